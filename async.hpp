@@ -0,0 +1,92 @@
+#pragma once
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace ModV6FileSystem
+{
+    // the value an asynchronous operation eventually produces, or the exception it failed with. Copies share the result.
+    // Continuations run on the thread that settles it, or right away on the caller's if it already is settled.
+    template<typename T>
+    struct Async
+    {
+    private:
+        struct State
+        {
+        public:
+            std::mutex lock;
+            std::condition_variable settled;
+            bool done = false;
+            T value{};
+            std::exception_ptr error;
+            std::vector<std::function<void(const Async<T>&)>> continuations;
+        };
+        std::shared_ptr<State> _state;
+
+        void settle(T value, std::exception_ptr error)
+        {
+            std::vector<std::function<void(const Async<T>&)>> continuations;
+            {
+                std::lock_guard<std::mutex> guard{this->_state->lock};
+                if(this->_state->done)
+                {
+                    throw std::logic_error("Asynchronous result settled twice");
+                }
+                this->_state->value = std::move(value);
+                this->_state->error = error;
+                this->_state->done = true;
+                continuations.swap(this->_state->continuations);
+            }
+            this->_state->settled.notify_all();
+            for(auto& continuation : continuations)
+            {
+                continuation(*this);
+            }
+        }
+    public:
+        Async() : _state(std::make_shared<State>())
+        {
+        }
+        void resolve(T value)
+        {
+            this->settle(std::move(value), nullptr);
+        }
+        void reject(std::exception_ptr error)
+        {
+            this->settle(T{}, error);
+        }
+        bool ready() const
+        {
+            std::lock_guard<std::mutex> guard{this->_state->lock};
+            return this->_state->done;
+        }
+        // waits until settled, then returns the value or rethrows the failure
+        T get() const
+        {
+            std::unique_lock<std::mutex> guard{this->_state->lock};
+            this->_state->settled.wait(guard, [this]() { return this->_state->done; });
+            if(this->_state->error)
+            {
+                std::rethrow_exception(this->_state->error);
+            }
+            return this->_state->value;
+        }
+        void then(std::function<void(const Async<T>&)> continuation) const
+        {
+            {
+                std::lock_guard<std::mutex> guard{this->_state->lock};
+                if(!this->_state->done)
+                {
+                    this->_state->continuations.push_back(std::move(continuation));
+                    return;
+                }
+            }
+            continuation(*this);
+        }
+    };
+}
@@ -2,15 +2,18 @@
 
 namespace ModV6FileSystem
 {
-    Block::Block(int32_t fd, uint32_t blockIdx) : _fd(fd), _blockIdx(blockIdx)
+    Block::Block(int32_t fd, uint32_t blockIdx) : _fd(fd), _blockIdx(blockIdx), _metadata(false)
     {
-        lseek(this->_fd, 1024 * this->_blockIdx, SEEK_SET);
-        read(this->_fd, this->_data.bytes.data(), 1024);
+        // positioned I/O, since threads share the image's file descriptor
+        pread(this->_fd, this->_data.bytes.data(), 1024, 1024ull * this->_blockIdx);
+        this->_saved = this->_data;
     }
     Block::~Block()
     {
-        lseek(this->_fd, 1024 * this->_blockIdx, SEEK_SET);
-        write(this->_fd, this->_data.bytes.data(), 1024);
+        if(this->modified())
+        {
+            pwrite(this->_fd, this->_data.bytes.data(), 1024, 1024ull * this->_blockIdx);
+        }
         // std::cout << "~Block[" << this->_blockIdx << "]" << std::endl;
     }
     std::array<uint8_t, 1024>& Block::asBytes() const
@@ -19,6 +22,7 @@ namespace ModV6FileSystem
     }
     std::array<uint32_t, 256>& Block::asIntegers() const
     {
+        this->markMetadata();
         const auto* data_byte_ptr = this->asBytes().data();
         const auto* data_integer_ptr = reinterpret_cast<const std::array<uint32_t, 256>*>(data_byte_ptr);
         return const_cast<std::array<uint32_t, 256>&>(*data_integer_ptr);
@@ -27,4 +31,28 @@ namespace ModV6FileSystem
     {
         return this->_blockIdx;
     }
+    bool Block::metadata() const
+    {
+        return this->_metadata.load(std::memory_order_relaxed);
+    }
+    void Block::markMetadata() const
+    {
+        if(!this->_metadata.load(std::memory_order_relaxed))
+        {
+            this->_metadata.store(true, std::memory_order_relaxed);
+        }
+    }
+    bool Block::modified() const
+    {
+        return this->_data.bytes != this->_saved.bytes;
+    }
+    void Block::saved()
+    {
+        this->_saved = this->_data;
+    }
+    void Block::load(const std::array<uint8_t, 1024>& bytes)
+    {
+        this->_data.bytes = bytes;
+        this->_saved.bytes = bytes;
+    }
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <iostream>
 #include <unistd.h>
@@ -24,8 +25,12 @@ namespace ModV6FileSystem
             std::array<uint8_t, 1024> bytes;
         };
         Data _data;
+        // the bytes as last read or written back, a block that still matches them is not written again
+        Data _saved;
         int32_t _fd;
         uint32_t _blockIdx;
+        // set once the block is read as a structure rather than file data, the journal keeps those
+        mutable std::atomic<bool> _metadata;
     public:
         Block(int32_t fd, uint32_t blockIdx);
         ~Block();
@@ -35,5 +40,12 @@ namespace ModV6FileSystem
         // in free data block linked list
         std::array<uint32_t, 256>& asIntegers() const;
         uint32_t index() const;
+        bool metadata() const;
+        void markMetadata() const;
+        bool modified() const;
+        // the current bytes are kept elsewhere now, so they are not written back
+        void saved();
+        // replaces what was read with a newer copy of the block
+        void load(const std::array<uint8_t, 1024>& bytes);
     };
 }
\ No newline at end of file
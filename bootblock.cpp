@@ -0,0 +1,91 @@
+#include "bootblock.hpp"
+
+namespace ModV6FileSystem
+{
+    const uint32_t BootBlock::MAGIC;
+
+    std::ostream &operator<<(std::ostream &ostream, const BootBlock& in)
+    {
+        return ostream << "BootBlock[valid=" << in.valid() << ", fragment=" << in.fragment() << ", dedup=" << in.dedup()
+            << ", refcounts=" << in.refcounts() << ", hashIndex=" << in.hashIndex()
+            << ", compress=" << in.compress() << ", journal=" << in.journal()
+            << ", snapshots=" << in.snapshots() << "]";
+    }
+    BootBlock::BootBlock(std::shared_ptr<Block> block) : 
+        _data(*reinterpret_cast<Data*>(block->asBytes().data())), _block(block)
+    {
+        block->markMetadata();
+    }
+    BootBlock::~BootBlock()
+    {
+        // std::cout << "~BootBlock" << std::endl;
+    }
+    bool BootBlock::valid() const
+    {
+        return this->_data.magic == MAGIC;
+    }
+    uint32_t BootBlock::magic() const
+    {
+        return this->_data.magic;
+    }
+    void BootBlock::magic(uint32_t magic)
+    {
+        this->_data.magic = magic;
+    }
+    uint32_t BootBlock::fragment() const
+    {
+        return this->valid() ? this->_data.fragment : 0;
+    }
+    void BootBlock::fragment(uint32_t fragment)
+    {
+        this->_data.fragment = fragment;
+    }
+    bool BootBlock::dedup() const
+    {
+        return this->valid() && this->_data.dedup != 0;
+    }
+    void BootBlock::dedup(bool dedup)
+    {
+        this->_data.dedup = dedup;
+    }
+    uint32_t BootBlock::refcounts() const
+    {
+        return this->valid() ? this->_data.refcounts : 0;
+    }
+    void BootBlock::refcounts(uint32_t refcounts)
+    {
+        this->_data.refcounts = refcounts;
+    }
+    uint32_t BootBlock::hashIndex() const
+    {
+        return this->valid() ? this->_data.hashIndex : 0;
+    }
+    void BootBlock::hashIndex(uint32_t hashIndex)
+    {
+        this->_data.hashIndex = hashIndex;
+    }
+    bool BootBlock::compress() const
+    {
+        return this->valid() && this->_data.compress != 0;
+    }
+    void BootBlock::compress(bool compress)
+    {
+        this->_data.compress = compress;
+    }
+    uint32_t BootBlock::journal() const
+    {
+        return this->valid() ? this->_data.journal : 0;
+    }
+    void BootBlock::journal(uint32_t journal)
+    {
+        this->_data.journal = journal;
+    }
+    uint32_t BootBlock::snapshots() const
+    {
+        return this->valid() ? this->_data.snapshots : 0;
+    }
+    void BootBlock::snapshots(uint32_t snapshots)
+    {
+        this->_data.snapshots = snapshots;
+    }
+}
\ No newline at end of file
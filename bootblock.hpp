@@ -0,0 +1,62 @@
+#pragma once
+#include <array>
+#include <memory>
+#include <string>
+#include "block.hpp"
+
+namespace ModV6FileSystem
+{
+    struct Block;
+
+    // block 0 carries no boot code, so it holds the bookkeeping that does not fit in the superblock
+    struct BootBlock
+    {
+    public:
+        // "mv6x", written by initfs; images without it have none of the extensions
+        static const uint32_t MAGIC = 0x7836766D;
+    private:
+        struct Data
+        {
+        public:
+            uint32_t magic;
+            // data block currently receiving packed file tails, 0 if none
+            uint32_t fragment;
+            // nonzero while cpin shares blocks with identical contents
+            uint32_t dedup;
+            // directory blocks of the per-block reference count table and the content hash index, 0 if none
+            uint32_t refcounts;
+            uint32_t hashIndex;
+            // nonzero while cpin stores new files compressed
+            uint32_t compress;
+            // size of the metadata journal in the last blocks of the image, 0 if there is none
+            uint32_t journal;
+            // data block listing the snapshots of the image, 0 if there are none
+            uint32_t snapshots;
+        };
+        Data& _data;
+        std::shared_ptr<Block> _block;
+
+    public:
+        friend std::ostream &operator<<(std::ostream &ostream, const BootBlock& in);
+        BootBlock(std::shared_ptr<Block> block);
+        ~BootBlock();
+
+        bool valid() const;
+        uint32_t magic() const;
+        void magic(uint32_t magic);
+        uint32_t fragment() const;
+        void fragment(uint32_t fragment);
+        bool dedup() const;
+        void dedup(bool dedup);
+        uint32_t refcounts() const;
+        void refcounts(uint32_t refcounts);
+        uint32_t hashIndex() const;
+        void hashIndex(uint32_t hashIndex);
+        bool compress() const;
+        void compress(bool compress);
+        uint32_t journal() const;
+        void journal(uint32_t journal);
+        uint32_t snapshots() const;
+        void snapshots(uint32_t snapshots);
+    };
+}
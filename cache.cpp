@@ -0,0 +1,361 @@
+#include "cache.hpp"
+
+namespace ModV6FileSystem
+{
+    namespace
+    {
+        std::atomic<uint32_t> nextStripe{0};
+    }
+
+    const uint32_t BlockCache::SHARDS;
+    const uint32_t BlockCache::STRIPES;
+    const uint32_t BlockCache::MIN_SLOTS;
+    // marks a removed entry, so probes for blocks placed after it keep going
+    BlockCache::Entry BlockCache::TOMBSTONE{};
+
+    BlockCache::Table::Table(uint32_t size) : mask(size - 1), slots(new std::atomic<Entry*>[size])
+    {
+        for(uint32_t i = 0; i < size; ++i)
+        {
+            this->slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    BlockCache::BlockCache() : _writeBacks(0)
+    {
+        for(auto& shard : this->_shards)
+        {
+            shard.table.store(new Table(MIN_SLOTS));
+            shard.used = 0;
+            shard.removed = 0;
+        }
+        for(auto& stripe : this->_readers)
+        {
+            stripe.count.store(0);
+        }
+    }
+    BlockCache::~BlockCache()
+    {
+        // std::cout << "~BlockCache" << std::endl;
+        // every block holds the cache, so nothing is looking anything up anymore
+        for(auto& shard : this->_shards)
+        {
+            Table* table = shard.table.load();
+            for(uint32_t i = 0; i <= table->mask; ++i)
+            {
+                Entry* entry = table->slots[i].load();
+                if(entry != nullptr && entry != &TOMBSTONE)
+                {
+                    delete entry;
+                }
+            }
+            delete table;
+            for(auto entry : shard.retiredEntries)
+            {
+                delete entry;
+            }
+            for(auto retired : shard.retiredTables)
+            {
+                delete retired;
+            }
+        }
+    }
+    std::shared_ptr<Block> BlockCache::find(uint32_t blockIdx)
+    {
+        // a hit only touches the reader count of this thread and the block's own reference count
+        Shard& shard = this->_shards[blockIdx % SHARDS];
+        Stripe& stripe = this->readerStripe();
+        stripe.count.fetch_add(1);
+        std::shared_ptr<Block> block_ptr;
+        Entry* entry = this->find(shard.table.load(), blockIdx);
+        if(entry != nullptr)
+        {
+            block_ptr = entry->block.lock();
+        }
+        stripe.count.fetch_sub(1);
+        return block_ptr;
+    }
+    std::shared_ptr<Block> BlockCache::get(int32_t fd, uint32_t blockIdx)
+    {
+        if(auto block_ptr = this->find(blockIdx))
+        {
+            return block_ptr;
+        }
+        Shard& shard = this->_shards[blockIdx % SHARDS];
+        while(true)
+        {
+            std::unique_lock<std::mutex> guard{shard.lock};
+            Entry* entry = this->find(shard.table.load(), blockIdx);
+            if(entry == nullptr)
+            {
+                // blocks keep the cache alive, so their write-back still finds it
+                auto self = this->shared_from_this();
+                Block* block = new Block(fd, blockIdx);
+                auto journal = std::atomic_load(&this->_journal);
+                std::array<uint8_t, 1024> bytes;
+                if(journal && journal->overlay(blockIdx, bytes))
+                {
+                    block->load(bytes);
+                    block->markMetadata();
+                }
+                std::shared_ptr<Block> block_ptr{block, [self](Block* block) { self->release(block); }};
+                this->insert(shard, new Entry{blockIdx, block, block_ptr});
+                return block_ptr;
+            }
+            if(auto block_ptr = entry->block.lock())
+            {
+                return block_ptr;
+            }
+            // its last owner is about to write it back, reading it now could miss that write
+            guard.unlock();
+            std::this_thread::yield();
+        }
+    }
+    void BlockCache::release(Block* block)
+    {
+        Shard& shard = this->_shards[block->index() % SHARDS];
+        std::lock_guard<std::mutex> guard{shard.lock};
+        this->remove(shard, block);
+        auto journal = std::atomic_load(&this->_journal);
+        if(journal && block->metadata() && block->modified() && journal->stage(block->index(), block->asBytes()))
+        {
+            block->saved();
+        }
+        if(block->modified())
+        {
+            ++this->_writeBacks;
+        }
+        delete block;
+        this->reclaim(shard);
+    }
+    BlockCache::Stripe& BlockCache::readerStripe()
+    {
+        static thread_local uint32_t stripe = nextStripe.fetch_add(1) % STRIPES;
+        return this->_readers[stripe];
+    }
+    /**
+     * True if no lookup is running without a lock. Whatever was unlinked before this returned true
+     * cannot be reached by lookups starting later, so it can be freed.
+     */
+    bool BlockCache::quiescent()
+    {
+        for(auto& stripe : this->_readers)
+        {
+            if(stripe.count.load() != 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    void BlockCache::reclaim(Shard& shard)
+    {
+        if((shard.retiredEntries.empty() && shard.retiredTables.empty()) || !this->quiescent())
+        {
+            return;
+        }
+        for(auto entry : shard.retiredEntries)
+        {
+            delete entry;
+        }
+        for(auto table : shard.retiredTables)
+        {
+            delete table;
+        }
+        shard.retiredEntries.clear();
+        shard.retiredTables.clear();
+    }
+    uint32_t BlockCache::home(const Table* table, uint32_t blockIdx) const
+    {
+        return ((blockIdx / SHARDS) * 2654435761u) & table->mask;
+    }
+    BlockCache::Entry* BlockCache::find(const Table* table, uint32_t blockIdx) const
+    {
+        // tables are never full, so every probe ends at an empty slot
+        for(uint32_t slot = this->home(table, blockIdx);; slot = (slot + 1) & table->mask)
+        {
+            Entry* entry = table->slots[slot].load();
+            if(entry == nullptr)
+            {
+                return nullptr;
+            }
+            if(entry != &TOMBSTONE && entry->blockIdx == blockIdx)
+            {
+                return entry;
+            }
+        }
+    }
+    // with the shard locked
+    void BlockCache::insert(Shard& shard, Entry* entry)
+    {
+        Table* table = shard.table.load();
+        if((shard.used + shard.removed + 1) * 4ull > (table->mask + 1) * 3ull)
+        {
+            // rebuilt at most half full, without tombstones; lookups still probing the old table finish there
+            uint32_t size = MIN_SLOTS;
+            while(size < (shard.used + 1) * 2)
+            {
+                size *= 2;
+            }
+            Table* rebuilt = new Table(size);
+            for(uint32_t i = 0; i <= table->mask; ++i)
+            {
+                Entry* moved = table->slots[i].load();
+                if(moved == nullptr || moved == &TOMBSTONE)
+                {
+                    continue;
+                }
+                uint32_t slot = this->home(rebuilt, moved->blockIdx);
+                while(rebuilt->slots[slot].load(std::memory_order_relaxed) != nullptr)
+                {
+                    slot = (slot + 1) & rebuilt->mask;
+                }
+                rebuilt->slots[slot].store(moved, std::memory_order_relaxed);
+            }
+            shard.table.store(rebuilt);
+            shard.retiredTables.push_back(table);
+            shard.removed = 0;
+            table = rebuilt;
+        }
+        uint32_t slot = this->home(table, entry->blockIdx);
+        while(true)
+        {
+            Entry* current = table->slots[slot].load();
+            if(current == nullptr || current == &TOMBSTONE)
+            {
+                shard.removed -= current == &TOMBSTONE;
+                break;
+            }
+            slot = (slot + 1) & table->mask;
+        }
+        table->slots[slot].store(entry);
+        ++shard.used;
+    }
+    // with the shard locked: unlinks the entry of a block that is being released, if it is still in the table
+    void BlockCache::remove(Shard& shard, Block* block)
+    {
+        Table* table = shard.table.load();
+        uint32_t slot = this->home(table, block->index());
+        while(true)
+        {
+            Entry* entry = table->slots[slot].load();
+            if(entry == nullptr)
+            {
+                // forgotten by clear
+                return;
+            }
+            if(entry != &TOMBSTONE && entry->block_ptr == block)
+            {
+                shard.retiredEntries.push_back(entry);
+                break;
+            }
+            slot = (slot + 1) & table->mask;
+        }
+        --shard.used;
+        if(table->slots[(slot + 1) & table->mask].load() != nullptr)
+        {
+            table->slots[slot].store(&TOMBSTONE);
+            ++shard.removed;
+            return;
+        }
+        // the end of a probe run: this slot and the tombstones right before it no longer lead anywhere
+        table->slots[slot].store(nullptr);
+        for(slot = (slot - 1) & table->mask; table->slots[slot].load() == &TOMBSTONE; slot = (slot - 1) & table->mask)
+        {
+            table->slots[slot].store(nullptr);
+            --shard.removed;
+        }
+    }
+    void BlockCache::clear()
+    {
+        for(auto& shard : this->_shards)
+        {
+            std::lock_guard<std::mutex> guard{shard.lock};
+            Table* table = shard.table.load();
+            for(uint32_t i = 0; i <= table->mask; ++i)
+            {
+                Entry* entry = table->slots[i].load();
+                if(entry != nullptr && entry != &TOMBSTONE)
+                {
+                    shard.retiredEntries.push_back(entry);
+                }
+            }
+            shard.table.store(new Table(MIN_SLOTS));
+            shard.retiredTables.push_back(table);
+            shard.used = 0;
+            shard.removed = 0;
+            this->reclaim(shard);
+        }
+    }
+    void BlockCache::prune()
+    {
+        for(auto& shard : this->_shards)
+        {
+            std::lock_guard<std::mutex> guard{shard.lock};
+            this->reclaim(shard);
+        }
+    }
+    uint64_t BlockCache::writeBacks() const
+    {
+        return this->_writeBacks.load();
+    }
+    void BlockCache::reload(int32_t fd)
+    {
+        auto journal = std::atomic_load(&this->_journal);
+        for(auto& shard : this->_shards)
+        {
+            auto live = this->live(shard);
+            for(auto& block_ptr : live)
+            {
+                std::array<uint8_t, 1024> bytes;
+                if(!journal || !journal->overlay(block_ptr->index(), bytes))
+                {
+                    pread(fd, bytes.data(), 1024, 1024ull * block_ptr->index());
+                }
+                block_ptr->load(bytes);
+            }
+        }
+    }
+    void BlockCache::attach(std::shared_ptr<Journal> journal)
+    {
+        std::atomic_store(&this->_journal, std::move(journal));
+    }
+    // releasing a block locks its shard, so the caller lets go of them after it is unlocked again
+    std::vector<std::shared_ptr<Block>> BlockCache::live(Shard& shard)
+    {
+        std::vector<std::shared_ptr<Block>> result;
+        std::lock_guard<std::mutex> guard{shard.lock};
+        Table* table = shard.table.load();
+        for(uint32_t i = 0; i <= table->mask; ++i)
+        {
+            Entry* entry = table->slots[i].load();
+            if(entry == nullptr || entry == &TOMBSTONE)
+            {
+                continue;
+            }
+            if(auto block_ptr = entry->block.lock())
+            {
+                result.push_back(std::move(block_ptr));
+            }
+        }
+        return result;
+    }
+    void BlockCache::stageLive()
+    {
+        auto journal = std::atomic_load(&this->_journal);
+        if(!journal)
+        {
+            return;
+        }
+        for(auto& shard : this->_shards)
+        {
+            auto live = this->live(shard);
+            for(auto& block_ptr : live)
+            {
+                if(block_ptr->metadata() && block_ptr->modified() && journal->stage(block_ptr->index(), block_ptr->asBytes()))
+                {
+                    block_ptr->saved();
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "block.hpp"
+#include "journal.hpp"
+
+namespace ModV6FileSystem
+{
+    struct Block;
+
+    // the blocks of an image that are in use, shared by every thread working on it:
+    // at most one Block per block number is alive, so everybody sees the same bytes.
+    // A hit takes no lock: it probes an open-addressing table of its shard and pins the block through the entry's
+    // weak pointer. Misses and releases lock the shard. The last owner of a block writes it back with its shard locked,
+    // so a block is never read from the image while its write-back is still in progress.
+    // Entries and tables taken out of use are only freed once no lock-free lookup is running.
+    struct BlockCache : public std::enable_shared_from_this<BlockCache>
+    {
+    public:
+        static const uint32_t SHARDS = 64;
+        static const uint32_t STRIPES = 64;
+        static const uint32_t MIN_SLOTS = 16;
+    private:
+        // never changes once it is in a table
+        struct Entry
+        {
+        public:
+            uint32_t blockIdx;
+            Block* block_ptr;
+            std::weak_ptr<Block> block;
+        };
+        struct Table
+        {
+        public:
+            uint32_t mask;
+            std::unique_ptr<std::atomic<Entry*>[]> slots;
+
+            Table(uint32_t size);
+        };
+        struct Shard
+        {
+        public:
+            std::mutex lock;
+            std::atomic<Table*> table;
+            // counts of the current table, live entries and tombstones
+            uint32_t used;
+            uint32_t removed;
+            std::vector<Entry*> retiredEntries;
+            std::vector<Table*> retiredTables;
+        };
+        // lookups running without the shard lock, spread over padded counters so readers don't share a cache line
+        struct Stripe
+        {
+        public:
+            std::atomic<uint32_t> count;
+            char padding[64 - sizeof(std::atomic<uint32_t>)];
+        };
+        static Entry TOMBSTONE;
+        std::array<Shard, SHARDS> _shards;
+        std::array<Stripe, STRIPES> _readers;
+        // metadata blocks are staged there instead of being written back, if there is one
+        std::shared_ptr<Journal> _journal;
+        // blocks written back to the image so far
+        std::atomic<uint64_t> _writeBacks;
+
+        Stripe& readerStripe();
+        bool quiescent();
+        void reclaim(Shard& shard);
+        uint32_t home(const Table* table, uint32_t blockIdx) const;
+        Entry* find(const Table* table, uint32_t blockIdx) const;
+        void insert(Shard& shard, Entry* entry);
+        void remove(Shard& shard, Block* block);
+        void release(Block* block);
+        std::vector<std::shared_ptr<Block>> live(Shard& shard);
+    public:
+        BlockCache();
+        ~BlockCache();
+
+        // the block if it is in use, null otherwise; never reads the image or takes a lock
+        std::shared_ptr<Block> find(uint32_t blockIdx);
+        std::shared_ptr<Block> get(int32_t fd, uint32_t blockIdx);
+        // forgets every block; ones still held keep working but are no longer shared with new lookups
+        void clear();
+        // frees entries and tables that lock-free lookups can no longer be looking at
+        void prune();
+        // null to write metadata blocks back again
+        void attach(std::shared_ptr<Journal> journal);
+        // stages the changed metadata blocks that are still held
+        void stageLive();
+        uint64_t writeBacks() const;
+        // replaces the bytes of every block in use with its newest copy in the journal or else the image
+        void reload(int32_t fd);
+    };
+}
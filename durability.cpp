@@ -0,0 +1,137 @@
+#include "durability.hpp"
+
+namespace ModV6FileSystem
+{
+    const uint32_t Durability::DEFAULT_INTERVAL_MS;
+    const uint32_t Durability::DEFAULT_DIRTY_BLOCKS;
+
+    Durability::Durability() : mode(COMMAND), intervalMs(DEFAULT_INTERVAL_MS), dirtyBlocks(DEFAULT_DIRTY_BLOCKS)
+    {
+    }
+    bool Durability::parse(const std::string& option, Durability& result)
+    {
+        result = Durability{};
+        if(option == "none")
+        {
+            result.mode = NONE;
+            return true;
+        }
+        if(option == "command")
+        {
+            return true;
+        }
+        if(option.compare(0, 8, "periodic") != 0)
+        {
+            return false;
+        }
+        result.mode = PERIODIC;
+        auto rest = option.substr(8);
+        try
+        {
+            if(!rest.empty())
+            {
+                if(rest[0] != ':')
+                {
+                    return false;
+                }
+                std::size_t used;
+                auto separator = rest.find(':', 1);
+                result.intervalMs = std::stoul(rest.substr(1, separator - 1), &used);
+                if(used != rest.substr(1, separator - 1).size())
+                {
+                    return false;
+                }
+                if(separator != std::string::npos)
+                {
+                    result.dirtyBlocks = std::stoul(rest.substr(separator + 1), &used);
+                    if(used != rest.size() - separator - 1)
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+        catch(const std::exception&)
+        {
+            return false;
+        }
+        return result.intervalMs > 0 && result.dirtyBlocks > 0;
+    }
+    std::string Durability::describe() const
+    {
+        switch(this->mode)
+        {
+            case NONE:
+                return "none";
+            case COMMAND:
+                return "command";
+            default:
+                return "periodic, every " + std::to_string(this->intervalMs) + " ms or "
+                    + std::to_string(this->dirtyBlocks) + " blocks";
+        }
+    }
+    Syncer::Syncer(int32_t fd) : _fd(fd), _syncing(false), _requested(0), _completed(0), _syncs(0), _totalMs(0), _maxMs(0),
+        _last(std::chrono::steady_clock::now())
+    {
+    }
+    void Syncer::sync(const std::string& what)
+    {
+        std::unique_lock<std::mutex> guard{this->_lock};
+        auto ticket = ++this->_requested;
+        // a sync that started before this request might have missed its writes
+        this->_done.wait(guard, [this, ticket]() { return !this->_syncing || this->_completed >= ticket; });
+        if(this->_completed >= ticket)
+        {
+            return;
+        }
+        this->_syncing = true;
+        auto target = this->_requested;
+        auto covered = target - this->_completed;
+        guard.unlock();
+        auto begin = std::chrono::steady_clock::now();
+        auto result = fdatasync(this->_fd);
+        auto end = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - begin).count();
+        guard.lock();
+        this->_syncing = false;
+        if(result == 0)
+        {
+            this->_completed = target;
+            ++this->_syncs;
+            this->_totalMs += ms;
+            this->_maxMs = std::max(this->_maxMs, ms);
+            this->_last = end;
+        }
+        guard.unlock();
+        this->_done.notify_all();
+        if(result != 0)
+        {
+            throw std::runtime_error("Failed to sync " + what);
+        }
+        std::cout << "Synced " << what << " in " << ms << " ms";
+        if(covered > 1)
+        {
+            std::cout << " for " << covered << " requests";
+        }
+        std::cout << std::endl;
+    }
+    void Syncer::start()
+    {
+        sync_file_range(this->_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+    double Syncer::sinceLastMs()
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - this->_last).count();
+    }
+    void Syncer::report()
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        if(this->_syncs == 0)
+        {
+            return;
+        }
+        std::cout << "Sync latency: " << this->_syncs << " syncs, average " << this->_totalMs / this->_syncs
+            << " ms, max " << this->_maxMs << " ms" << std::endl;
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ModV6FileSystem
+{
+    // when what commands change is forced to disk, chosen with openfs.
+    // none leaves it to the kernel, so only a crash of the program is survived; command syncs before each command
+    // that changed the image returns; periodic syncs every intervalMs milliseconds or once dirtyBlocks blocks changed.
+    struct Durability
+    {
+    public:
+        enum Mode
+        {
+            NONE,
+            COMMAND,
+            PERIODIC
+        };
+        static const uint32_t DEFAULT_INTERVAL_MS = 1000;
+        static const uint32_t DEFAULT_DIRTY_BLOCKS = 256;
+        Mode mode;
+        uint32_t intervalMs;
+        uint32_t dirtyBlocks;
+
+        Durability();
+        // none, command, or periodic[:<milliseconds>[:<blocks>]]; false if option is none of those
+        static bool parse(const std::string& option, Durability& result);
+        std::string describe() const;
+    };
+
+    // fdatasync of one image. Threads asking while a sync runs share the next one, and its latency is reported.
+    struct Syncer
+    {
+    private:
+        int32_t _fd;
+        std::mutex _lock;
+        std::condition_variable _done;
+        bool _syncing;
+        // requests so far, and how many of them a finished sync covered
+        uint64_t _requested;
+        uint64_t _completed;
+        uint64_t _syncs;
+        double _totalMs;
+        double _maxMs;
+        std::chrono::steady_clock::time_point _last;
+    public:
+        Syncer(int32_t fd);
+
+        // returns once everything written before the call is durable
+        void sync(const std::string& what);
+        // starts writing back dirty pages of the image without waiting for them
+        void start();
+        // since the last sync finished, or since the image was opened
+        double sinceLastMs();
+        void report();
+    };
+}
@@ -24,6 +24,7 @@ namespace ModV6FileSystem
         ),
         _block(block_ptr)
     {
+        block_ptr->markMetadata();
     }
     File::~File()
     {
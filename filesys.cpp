@@ -2,42 +2,428 @@
 
 namespace ModV6FileSystem
 {
-    FileSystem::FileSystem() : _fd(-1)
+    namespace
+    {
+        std::atomic<uint64_t> nextFileSystemId{0};
+        // pread/pwrite until everything is transferred, end of file is hit or an error occurs
+        uint64_t preadFully(int32_t fd, void* buffer, uint64_t length, uint64_t offset)
+        {
+            uint64_t done = 0;
+            while(done < length)
+            {
+                auto result = pread(fd, static_cast<uint8_t*>(buffer) + done, length - done, offset + done);
+                if(result <= 0)
+                {
+                    break;
+                }
+                done += result;
+            }
+            return done;
+        }
+        uint64_t pwriteFully(int32_t fd, const void* buffer, uint64_t length, uint64_t offset)
+        {
+            uint64_t done = 0;
+            while(done < length)
+            {
+                auto result = pwrite(fd, static_cast<const uint8_t*>(buffer) + done, length - done, offset + done);
+                if(result <= 0)
+                {
+                    break;
+                }
+                done += result;
+            }
+            return done;
+        }
+        bool isZeroBlock(const uint8_t* bytes)
+        {
+            return bytes[0] == 0 && std::memcmp(bytes, bytes + 1, 1023) == 0;
+        }
+        // compressed i-nodes store data in clusters of this many logical blocks
+        const uint64_t CLUSTER_BLOCKS = 16;
+        const uint64_t CLUSTER_BYTES = CLUSTER_BLOCKS * 1024;
+        // cluster map entry following the blocks of a compressed cluster, which hold a 4-byte length and the LZ data
+        const uint32_t CLUSTER_TAG = 0xFFFFFFFE;
+        // slot 0 of a fragment block is its header: this magic number and the bitmap of used slots
+        const uint32_t FRAGMENT_MAGIC = 0x67617266;
+        // entries of one level of a host tree that import claims i-nodes for and links at a time
+        const uint64_t IMPORT_BATCH = 1024;
+        // fast non-cryptographic hash of a block's contents for the dedup index, matches are verified byte by byte
+        uint32_t hashBlock(const uint8_t* bytes)
+        {
+            uint64_t hash = 0x9E3779B97F4A7C15ull;
+            for(auto word = 0; word < 128; ++word)
+            {
+                uint64_t value;
+                std::memcpy(&value, bytes + word * 8, 8);
+                hash = (hash ^ value) * 0xFF51AFD7ED558CCDull;
+                hash ^= hash >> 29;
+            }
+            return static_cast<uint32_t>(hash ^ (hash >> 32));
+        }
+        // the magazine this thread holds for each file system, by file system id. The file system owns them, so one
+        // dropped with its image is never handed out; those still registered are retired when the thread exits.
+        struct ThreadMagazines
+        {
+        public:
+            std::unordered_map<uint64_t, std::weak_ptr<Magazine>> magazines;
+
+            ~ThreadMagazines()
+            {
+                for(auto& entry : this->magazines)
+                {
+                    if(auto magazine_ptr = entry.second.lock())
+                    {
+                        magazine_ptr->retire();
+                    }
+                }
+            }
+        };
+        thread_local ThreadMagazines threadMagazines;
+        // threads of the event loop running asynchronous operations, and of its I/O backend reading what they miss
+        const uint32_t LOOP_THREADS = 2;
+        const uint32_t IO_THREADS = 4;
+        // longest an I/O thread waits for a lock an attempt found held, before handing the attempt back to the loop
+        const std::chrono::milliseconds LOCK_WAIT{1};
+        // set while an attempt runs on the event loop, where getBlock must not read the image
+        thread_local bool nonBlocking = false;
+        struct NonBlocking
+        {
+        public:
+            bool previous;
+
+            NonBlocking(bool enabled) : previous(nonBlocking)
+            {
+                nonBlocking = enabled;
+            }
+            ~NonBlocking()
+            {
+                nonBlocking = this->previous;
+            }
+        };
+        // a shared lock on the mutex; on the event loop one that is held is not waited for, the attempt is handed
+        // to an I/O thread to wait there instead, as with a block miss
+        std::shared_lock<std::shared_timed_mutex> sharedLock(std::shared_timed_mutex& mutex)
+        {
+            if(!nonBlocking)
+            {
+                return std::shared_lock<std::shared_timed_mutex>{mutex};
+            }
+            std::shared_lock<std::shared_timed_mutex> guard{mutex, std::try_to_lock};
+            if(!guard.owns_lock())
+            {
+                throw LockBusy(mutex);
+            }
+            return guard;
+        }
+        // keeps new asynchronous operations out and waits for those in flight, while the image is swapped or formatted
+        struct AsyncPause
+        {
+        public:
+            FileSystem& fs;
+
+            AsyncPause(FileSystem& fs) : fs(fs)
+            {
+                fs.pauseAsync();
+            }
+            ~AsyncPause()
+            {
+                fs.resumeAsync();
+            }
+        };
+        // operations this thread is in, only the outermost one enters the journal
+        thread_local uint32_t journalDepth = 0;
+        // a command whose metadata changes are committed together with those of the commands overlapping it,
+        // or on an image without a journal, made as durable as openfs asked for
+        struct JournalOperation
+        {
+        public:
+            FileSystem& fs;
+            bool outermost;
+            std::shared_ptr<Journal> journal;
+
+            JournalOperation(FileSystem& fs) : fs(fs), outermost(journalDepth == 0),
+                journal(this->outermost ? fs._journal : nullptr)
+            {
+                if(this->journal && !this->journal->enter())
+                {
+                    // part of this thread's transaction
+                    this->journal.reset();
+                }
+                ++journalDepth;
+            }
+            ~JournalOperation()
+            {
+                --journalDepth;
+                if(this->outermost && std::uncaught_exception())
+                {
+                    fs.failTransaction();
+                }
+                try
+                {
+                    // what the threads of this command left in magazines is on the free list the batch commits;
+                    // a transaction does so when it begins and ends
+                    if(this->outermost && !fs.ownsTransaction())
+                    {
+                        fs.flushMagazines();
+                    }
+                    if(this->journal && this->journal->leave())
+                    {
+                        fs.commitJournal(this->journal);
+                    }
+                    else if(this->outermost && !this->journal)
+                    {
+                        fs.syncCommand();
+                    }
+                }
+                catch(const std::exception& exc)
+                {
+                    std::cout << "Failed to make the command durable: " << exc.what() << std::endl;
+                }
+            }
+        };
+    }
+    FileSystem::FileSystem() : _cache(std::make_shared<BlockCache>()), _fd(-1), _id(nextFileSystemId++), _refcounted(false),
+        _asyncOps(0), _asyncPauses(0), _syncedWriteBacks(0), _transaction(false), _transactionFailed(false)
     {
         reset();
     }
     FileSystem::~FileSystem()
     {
-        this->_blocks.clear();
+        this->pauseAsync();
+        this->_loop.reset();
+        if(this->_transaction)
+        {
+            std::cout << "Transaction was never committed, discarding it" << std::endl;
+            this->rollbackTransaction();
+        }
+        this->_handles.clear();
+        if(this->_fd != -1)
+        {
+            this->flushMagazines();
+            this->closeJournal();
+            this->closeSyncer();
+        }
+        this->_cache->clear();
         close(this->_fd);
         std::cout << "~FileSystem" << std::endl;
     }
     void FileSystem::reset()
     {
+        if(this->_transaction)
+        {
+            std::cout << "Transaction was never committed, discarding it" << std::endl;
+            this->rollbackTransaction();
+        }
+        // open handles keep i-node blocks alive, which must be written back before the image goes away
+        this->_handles.clear();
         if(this->_fd != -1)
         {
+            this->flushMagazines();
+            this->closeJournal();
+            this->closeSyncer();
             close(this->_fd);
         }
+        this->_magazines.clear();
+        this->_refcounted = false;
         this->_fd = -1;
         this->_working_directory = "/";
-        this->setDimensions(0, 0);
-        this->_blocks.clear();
+        this->_snapshot.clear();
+        this->_snapshotINodes.clear();
+        this->setDimensions(0, 0, 0);
+        this->_cache->clear();
         std::cout << "FileSystem::reset" << std::endl;
     }
-    void FileSystem::setDimensions(uint32_t totalBlocks, uint32_t inodeBlocks)
+    void FileSystem::setDimensions(uint32_t totalBlocks, uint32_t inodeBlocks, uint32_t journalBlocks)
     {
         std::cout << "Setting dimensions: [totalBlocks=" << totalBlocks << ", inodeBlocks="
-            << inodeBlocks << "]" << std::endl;
+            << inodeBlocks << ", journalBlocks=" << journalBlocks << "]" << std::endl;
         this->TOTAL_BLOCKS = totalBlocks;
         this->BOOT_INFO_BLOCKS = 1;
         this->SUPERBLOCK_BLOCKS = 1;
         this->INODE_BLOCKS = inodeBlocks;
-        this->DATA_BLOCKS = TOTAL_BLOCKS - BOOT_INFO_BLOCKS - SUPERBLOCK_BLOCKS - INODE_BLOCKS;
+        this->JOURNAL_BLOCKS = journalBlocks;
+        this->DATA_BLOCKS = TOTAL_BLOCKS - BOOT_INFO_BLOCKS - SUPERBLOCK_BLOCKS - INODE_BLOCKS - JOURNAL_BLOCKS;
         this->BOOT_INFO_BLOCK_IDX = 0;
         this->SUPERBLOCK_IDX = BOOT_INFO_BLOCK_IDX + BOOT_INFO_BLOCKS;
         this->INODE_BLOCK_IDX = SUPERBLOCK_IDX + SUPERBLOCK_BLOCKS;
         this->DATA_BLOCK_IDX = INODE_BLOCK_IDX + INODE_BLOCKS;
         this->OUT_OF_BOUNDS = DATA_BLOCK_IDX + DATA_BLOCKS;
+        this->JOURNAL_BLOCK_IDX = OUT_OF_BOUNDS;
+        this->_inodeLocks.reset(new std::shared_timed_mutex[std::max<uint64_t>(1, inodeBlocks * 16ull)]);
+    }
+    /**
+     * Replays the journal of the open image, if it has one, and starts journaling its metadata.
+     */
+    void FileSystem::openJournal()
+    {
+        if(this->JOURNAL_BLOCKS == 0)
+        {
+            return;
+        }
+        uint32_t sequence;
+        auto clean = Journal::replay(this->_fd, this->JOURNAL_BLOCK_IDX, this->JOURNAL_BLOCKS, sequence);
+        // anything read before the replay is out of date
+        this->_cache->clear();
+        if(!clean)
+        {
+            this->scrubFreeList();
+        }
+        this->_journal = std::make_shared<Journal>(this->_fd, this->JOURNAL_BLOCK_IDX, this->JOURNAL_BLOCKS, sequence,
+            this->_durability, this->_syncer, [this]() { this->_cache->stageLive(); });
+        this->_cache->attach(this->_journal);
+    }
+    void FileSystem::closeJournal()
+    {
+        if(!this->_journal)
+        {
+            return;
+        }
+        // the free list is changed outside of an operation below, a periodic commit must not catch it halfway
+        this->_journal->stop();
+        this->_journal->commit();
+        // blocks released by that commit belong on the free list before the image is closed
+        this->flushMagazines();
+        this->_journal->close();
+        this->_cache->attach(nullptr);
+        this->_journal.reset();
+    }
+    void FileSystem::openSyncer(int32_t fd, Durability durability)
+    {
+        this->_fd = fd;
+        this->_durability = durability;
+        this->_syncer = std::make_shared<Syncer>(fd);
+        this->_syncedWriteBacks = this->_cache->writeBacks();
+    }
+    /**
+     * Written back blocks still in the cache are released first, so the last sync covers them.
+     */
+    void FileSystem::closeSyncer()
+    {
+        if(!this->_syncer)
+        {
+            return;
+        }
+        this->_cache->clear();
+        if(this->_durability.mode != Durability::NONE)
+        {
+            this->_syncer->sync("image");
+        }
+        this->_syncer->report();
+        this->_syncer.reset();
+    }
+    void FileSystem::commitJournal(std::shared_ptr<Journal> journal)
+    {
+        journal->commit();
+        // blocks the batch freed can only be reused now, a second batch puts them on the free list on disk
+        if(journal->reusable())
+        {
+            JournalOperation operation{*this};
+        }
+    }
+    /**
+     * Makes a command that changed an image without a journal durable, as far as the durability chosen with openfs
+     * asks for. Periodic durability is only checked when a command finishes, there is no timer for these images.
+     */
+    void FileSystem::syncCommand()
+    {
+        auto syncer = this->_syncer;
+        if(!syncer || this->_durability.mode == Durability::NONE || this->ownsTransaction())
+        {
+            return;
+        }
+        if(this->_durability.mode == Durability::PERIODIC)
+        {
+            auto written = this->_cache->writeBacks();
+            auto synced = this->_syncedWriteBacks.load();
+            if(syncer->sinceLastMs() < this->_durability.intervalMs && written - synced < this->_durability.dirtyBlocks)
+            {
+                syncer->start();
+                return;
+            }
+            this->_syncedWriteBacks.compare_exchange_strong(synced, written);
+        }
+        syncer->sync("command");
+    }
+    /**
+     * After a crash, blocks that uncommitted commands took off the free list are back on it, with whatever
+     * was written to them. Free blocks are expected to be zero, so they are zeroed again.
+     */
+    void FileSystem::scrubFreeList()
+    {
+        std::cout << "Image was not closed cleanly, zeroing its free blocks" << std::endl;
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        auto freeArray = superblock_ptr->free();
+        uint32_t nfree = superblock_ptr->nfree();
+        superblock_ptr.reset();
+        uint64_t scrubbed = 0;
+        auto scrub = [this, &scrubbed](uint32_t blockIdx) {
+            if(blockIdx < this->DATA_BLOCK_IDX || blockIdx >= this->OUT_OF_BOUNDS)
+            {
+                return;
+            }
+            std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+            if(!isZeroBlock(block_ptr->asBytes().data()))
+            {
+                std::fill(block_ptr->asBytes().begin(), block_ptr->asBytes().end(), 0);
+                ++scrubbed;
+            }
+        };
+        // a damaged chain could loop, it cannot be longer than the data blocks
+        for(uint32_t chain = 0; chain <= this->DATA_BLOCKS; ++chain)
+        {
+            for(uint32_t i = 1; i <= std::min<uint32_t>(nfree, 250); ++i)
+            {
+                scrub(freeArray[i]);
+            }
+            auto nextDataBlockIdx = freeArray[0];
+            if(nextDataBlockIdx < this->DATA_BLOCK_IDX || nextDataBlockIdx >= this->OUT_OF_BOUNDS)
+            {
+                break;
+            }
+            std::shared_ptr<Block> block_ptr = this->getBlock(nextDataBlockIdx);
+            std::copy_n(block_ptr->asIntegers().begin(), 251, freeArray.begin());
+            nfree = 250;
+        }
+        std::cout << "Zeroed " << scrubbed << " free blocks" << std::endl;
+    }
+    /**
+     * Makes i-nodes come from the named snapshot's copy of the i-node blocks, false if the image has no such snapshot.
+     */
+    bool FileSystem::mountSnapshot(const std::string& name)
+    {
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        if(bootblock_ptr->snapshots() == 0)
+        {
+            return false;
+        }
+        SnapshotList list{this->getBlock(bootblock_ptr->snapshots())};
+        auto entry = list.find(name);
+        if(entry == -1)
+        {
+            return false;
+        }
+        std::shared_ptr<Block> block_ptr = this->getBlock(list.table(entry));
+        std::array<uint32_t, 256>& directory = block_ptr->asIntegers();
+        if(directory[0] != this->INODE_BLOCKS)
+        {
+            throw std::runtime_error("Snapshot " + name + " has " + std::to_string(directory[0]) 
+                + " i-node blocks, the image has " + std::to_string(this->INODE_BLOCKS) + "!");
+        }
+        this->_snapshot = name;
+        this->_snapshotINodes.assign(directory.begin() + 1, directory.begin() + 1 + directory[0]);
+        std::cout << "Mounted snapshot " << name << " read-only" << std::endl;
+        return true;
+    }
+    // true, after saying so, if a snapshot is mounted, which no command may change
+    bool FileSystem::readOnly(const std::string& command)
+    {
+        if(this->_snapshotINodes.empty())
+        {
+            return false;
+        }
+        std::cout << "Snapshot " << this->_snapshot << " is mounted read-only, aborting " << command << std::endl;
+        this->failTransaction();
+        return true;
     }
     std::shared_ptr<Block> FileSystem::getBlock(uint32_t blockIdx)
     {
@@ -51,36 +437,33 @@ namespace ModV6FileSystem
         {
             throw std::runtime_error("Failed to retrieve block " + std::to_string(blockIdx) + " which is out of bounds");
         }
-        // std::vector<std::weak_ptr<Block>> iterator
-        auto iter = this->_blocks.begin();
-        while(iter != this->_blocks.end())
+        if(nonBlocking)
         {
-            if(iter->expired())
-            {
-                iter = this->_blocks.erase(iter);
-            }
-            else
+            auto block_ptr = this->_cache->find(blockIdx);
+            if(!block_ptr)
             {
-                if(auto block_ptr = iter->lock())
-                {
-                    if(block_ptr->index() == blockIdx)
-                    {
-                        return block_ptr;
-                    }
-                }
-                else
-                {
-                    std::cout << "Found expired weak pointer in block tracker!" << std::endl;
-                }
-                // move iterator
-                ++iter;
+                throw BlockMiss({blockIdx});
             }
+            return block_ptr;
+        }
+        auto block_ptr = this->_cache->get(this->_fd, blockIdx);
+        if(this->_transaction.load(std::memory_order_relaxed))
+        {
+            // written back or staged once, when the transaction ends
+            std::lock_guard<std::mutex> guard{this->_transactionLock};
+            this->_transactionPins.emplace(blockIdx, block_ptr);
         }
-        std::shared_ptr<Block> block_ptr{new Block(this->_fd, blockIdx)};
-        std::weak_ptr<Block> weak_block_ptr = block_ptr;
-        this->_blocks.push_back(weak_block_ptr);
         return block_ptr;
     }
+    /**
+     * Forgets blocks nobody holds anymore; those have already been written back.
+     * Blocks still held (e.g. i-nodes of open file handles) stay tracked, 
+     * so later lookups keep sharing the same copy instead of reading a stale one.
+     */
+    void FileSystem::pruneBlocks()
+    {
+        this->_cache->prune();
+    }
     std::shared_ptr<INode> FileSystem::getINode(uint32_t inodeIdx)
     {
         const auto INODES_PER_BLOCK = 1024 / 64;
@@ -89,7 +472,8 @@ namespace ModV6FileSystem
             throw std::invalid_argument("Failed to retrieve i-node " + std::to_string(inodeIdx)
                 + " which is out of bounds");
         }
-        auto blockIdx = this->INODE_BLOCK_IDX + (inodeIdx / INODES_PER_BLOCK);
+        auto blockIdx = this->_snapshotINodes.empty() ? this->INODE_BLOCK_IDX + (inodeIdx / INODES_PER_BLOCK)
+            : this->_snapshotINodes[inodeIdx / INODES_PER_BLOCK];
         auto offset = inodeIdx % INODES_PER_BLOCK;
         // std::cout << "Fetching i-node " << inodeIdx << " from spot " << offset 
         //     << " of block " << blockIdx << std::endl;
@@ -116,117 +500,408 @@ namespace ModV6FileSystem
         std::shared_ptr<SuperBlock> superblock_ptr{new SuperBlock(block_ptr)};
         return superblock_ptr;
     }
-    void FileSystem::freeDataBlock(std::shared_ptr<SuperBlock> superblock_ptr, uint32_t blockIdx)
+    std::shared_ptr<BootBlock> FileSystem::getBootBlock()
     {
-        if(blockIdx < this->DATA_BLOCK_IDX || blockIdx >= this->DATA_BLOCK_IDX + this->DATA_BLOCKS)
-        {
-            throw std::invalid_argument("Cannot free block " + std::to_string(blockIdx)
-                + " as it is not a data block");
-        }
-        std::cout << "Free block " << blockIdx << std::endl;
-        std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
-        std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
-        std::fill(intArray.begin(), intArray.end(), 0);
-        auto freeArray = superblock_ptr->free();
-        auto nfree = superblock_ptr->nfree();
-        superblock_ptr->nfree(++nfree);
-        if(nfree < 251)
+        auto block_ptr = this->getBlock(0);
+        std::shared_ptr<BootBlock> bootblock_ptr{new BootBlock(block_ptr)};
+        return bootblock_ptr;
+    }
+    /**
+     * The calling thread's magazine, registered with the file system the first time the thread allocates or frees.
+     */
+    std::shared_ptr<Magazine> FileSystem::magazine()
+    {
+        auto& magazines = threadMagazines.magazines;
+        auto magazine_ptr = magazines[this->_id].lock();
+        if(!magazine_ptr)
         {
-            freeArray[nfree] = blockIdx;
+            magazine_ptr = std::make_shared<Magazine>();
+            magazines[this->_id] = magazine_ptr;
+            std::lock_guard<std::mutex> guard{this->_magazineLock};
+            this->_magazines.push_back(magazine_ptr);
         }
-        else
+        return magazine_ptr;
+    }
+    /**
+     * Returns the contents of every magazine, and the blocks the journal has released, to the superblock free list,
+     * so the image on disk accounts for them. Magazines of threads that have exited are dropped once drained.
+     */
+    void FileSystem::flushMagazines()
+    {
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        std::lock_guard<std::mutex> magazines_guard{this->_magazineLock};
+        std::vector<uint32_t> blockIdxs;
+        for(auto& magazine_ptr : this->_magazines)
         {
-            for(auto i = 0; i < 251; i++)
+            // retired before it is drained, so nothing can be put in it after
+            auto retired = magazine_ptr->retired();
+            auto drained = magazine_ptr->drain();
+            blockIdxs.insert(blockIdxs.end(), drained.begin(), drained.end());
+            if(retired)
             {
-                intArray[i] = freeArray[i];
+                magazine_ptr.reset();
             }
-            std::fill(freeArray.begin(), freeArray.end(), 0);
-            freeArray[0] = blockIdx;
-            superblock_ptr->nfree(0);
         }
-        superblock_ptr->free(freeArray);
+        this->_magazines.erase(std::remove(this->_magazines.begin(), this->_magazines.end(), nullptr), this->_magazines.end());
+        if(this->_journal)
+        {
+            auto reusable = this->_journal->drain();
+            blockIdxs.insert(blockIdxs.end(), reusable.begin(), reusable.end());
+        }
+        if(!blockIdxs.empty())
+        {
+            std::cout << "Returning " << blockIdxs.size() << " blocks from magazines" << std::endl;
+            this->returnFreeBlocks(this->getSuperBlock(), blockIdxs);
+        }
+    }
+    // puts freed blocks in this thread's magazine, spilling whole chunks to the free list when it is full
+    void FileSystem::stockMagazine(std::shared_ptr<SuperBlock> superblock_ptr, const std::vector<uint32_t>& blockIdxs)
+    {
+        auto spill = this->magazine()->put(blockIdxs);
+        if(!spill.empty())
+        {
+            std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+            this->returnFreeBlocks(superblock_ptr, spill);
+        }
     }
     /**
-     * Updates the superblock with the allocated data block.
-     * It will be necessary to call FileSystem::getBlock(uint32_t blockIdx) to get the actual block.
+     * Pops up to count blocks off the superblock free list, fewer if it runs out. The allocator lock is held.
      */
-    uint32_t FileSystem::allocateDataBlock(std::shared_ptr<SuperBlock> superblock_ptr)
+    std::vector<uint32_t> FileSystem::takeFreeBlocks(std::shared_ptr<SuperBlock> superblock_ptr, uint64_t count)
     {
+        std::vector<uint32_t> result;
+        result.reserve(count);
         auto freeArray = superblock_ptr->free();
         auto nfree = superblock_ptr->nfree();
-        if(nfree != 0)
-        {
-            auto blockIdx = freeArray[nfree];
-            freeArray[nfree] = 0;
-            superblock_ptr->free(freeArray);
-            superblock_ptr->nfree(--nfree);
-            return blockIdx;
-        }
-        else
+        while(result.size() < count)
         {
-            auto nextDataBlockIdx = freeArray[nfree];
+            if(nfree != 0)
+            {
+                result.push_back(freeArray[nfree]);
+                freeArray[nfree] = 0;
+                --nfree;
+                continue;
+            }
+            auto nextDataBlockIdx = freeArray[0];
             if(nextDataBlockIdx == 0)
             {
-                throw std::runtime_error("Out of memory: cannot allocate any more data blocks!");
+                break;
             }
-            else
+            std::shared_ptr<Block> block_ptr = this->getBlock(nextDataBlockIdx);
+            std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+            std::copy_n(intArray.begin(), 251, freeArray.begin());
+            std::fill(intArray.begin(), intArray.end(), 0);
+            nfree = 251 - 1;
+            if(this->_journal)
             {
-                std::shared_ptr<Block> block_ptr = this->getBlock(nextDataBlockIdx);
-                std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
-                for(auto i = 0; i < 251; i++)
-                {
-                    freeArray[i] = intArray[i];
-                }
-                std::fill(intArray.begin(), intArray.end(), 0);
-                superblock_ptr->nfree(251 - 1);
-                superblock_ptr->free(freeArray);
-                return nextDataBlockIdx;
+                // the image on disk keeps the old chain until this commits
+                this->_journal->free(nextDataBlockIdx);
+                continue;
             }
+            result.push_back(nextDataBlockIdx);
         }
+        superblock_ptr->free(freeArray);
+        superblock_ptr->nfree(nfree);
+        return result;
     }
-    uint32_t FileSystem::allocateINode()
+    /**
+     * Pushes zeroed blocks onto the superblock free list. The allocator lock is held.
+     */
+    void FileSystem::returnFreeBlocks(std::shared_ptr<SuperBlock> superblock_ptr, const std::vector<uint32_t>& blockIdxs)
     {
-        const auto INODES_PER_BLOCK = 1024 / 64;
-        const auto ALLOCATED_FLAG = 0b1000000000000000;
-        const auto TOTAL_INODES = this->INODE_BLOCKS * INODES_PER_BLOCK;
-        for(uint32_t idx = 0; idx < TOTAL_INODES; idx++)
+        auto freeArray = superblock_ptr->free();
+        auto nfree = superblock_ptr->nfree();
+        for(auto blockIdx : blockIdxs)
         {
-            std::shared_ptr<INode> inode_ptr = this->getINode(idx);
-            auto flags = inode_ptr->flags();
-            if((flags & ALLOCATED_FLAG) == 0)
+            if(++nfree < 251)
             {
-                inode_ptr->flags(flags | ALLOCATED_FLAG);
-                return idx;
+                freeArray[nfree] = blockIdx;
+            }
+            else
+            {
+                std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+                std::copy_n(freeArray.begin(), 251, block_ptr->asIntegers().begin());
+                std::fill(freeArray.begin(), freeArray.end(), 0);
+                freeArray[0] = blockIdx;
+                nfree = 0;
             }
         }
-        throw std::runtime_error("Out of memory: cannot allocate any more i-nodes!");
-    }
-    void FileSystem::freeINode(std::shared_ptr<INode> inode_ptr)
-    {
-        inode_ptr->flags(0);
-        inode_ptr->nlinks(0);
-        inode_ptr->uid(0);
-        inode_ptr->gid(0);
-        inode_ptr->size(0);
-        std::array<uint32_t, 9> addr = inode_ptr->addr();
-        std::fill(addr.begin(), addr.end(), 0);
-        inode_ptr->addr(addr);
-        inode_ptr->actime(0);
-        inode_ptr->modtime(0);
+        superblock_ptr->free(freeArray);
+        superblock_ptr->nfree(nfree);
     }
-    void FileSystem::initializeFreeList(std::shared_ptr<SuperBlock> superblock_ptr)
+    void FileSystem::freeDataBlock(std::shared_ptr<SuperBlock> superblock_ptr, uint32_t blockIdx)
     {
-        std::cout << "Number of data blocks: " << this->DATA_BLOCKS << std::endl;
-        std::cout << "Data blocks start at: " << this->DATA_BLOCK_IDX << std::endl;
-        for(int32_t i = DATA_BLOCKS - 1; i >= 0; i--)
+        if(blockIdx < this->DATA_BLOCK_IDX || blockIdx >= this->DATA_BLOCK_IDX + this->DATA_BLOCKS)
         {
-            this->freeDataBlock(superblock_ptr, DATA_BLOCK_IDX + i);
+            throw std::invalid_argument("Cannot free block " + std::to_string(blockIdx)
+                + " as it is not a data block");
         }
-    }
-    void FileSystem::initializeINodes()
-    {
-        const auto INODES_PER_BLOCK = 1024 / 64;
-        for(uint32_t idx = 0; idx < this->INODE_BLOCKS * INODES_PER_BLOCK; idx++)
+        std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+        if(this->_refcounted)
+        {
+            std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+            std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+            BlockTable refcounts{this, bootblock_ptr->refcounts()};
+            if(refcounts.counter(blockIdx) != 0)
+            {
+                // other files still point here, only their reference goes away
+                --refcounts.counter(blockIdx);
+                std::cout << "Dropped a reference to shared block " << blockIdx << std::endl;
+                return;
+            }
+            BlockTable index{this, bootblock_ptr->hashIndex()};
+            if(index.exists())
+            {
+                this->unindexBlock(index, hashBlock(block_ptr->asBytes().data()), blockIdx);
+            }
+        }
+        std::cout << "Free block " << blockIdx << std::endl;
+        if(this->_journal)
+        {
+            this->_journal->free(blockIdx);
+            return;
+        }
+        std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+        std::fill(intArray.begin(), intArray.end(), 0);
+        this->noteFreed(superblock_ptr, std::vector<uint32_t>{blockIdx});
+    }
+    /**
+     * Hands out a block from this thread's magazine, refilling it from the superblock if it is empty.
+     * It will be necessary to call FileSystem::getBlock(uint32_t blockIdx) to get the actual block.
+     */
+    uint32_t FileSystem::allocateDataBlock(std::shared_ptr<SuperBlock> superblock_ptr)
+    {
+        uint32_t blockIdx;
+        if(this->magazine()->take(blockIdx))
+        {
+            this->noteAllocated(std::vector<uint32_t>{blockIdx});
+            return blockIdx;
+        }
+        return this->allocateDataBlocks(superblock_ptr, 1)[0];
+    }
+    /**
+     * Batched version of FileSystem::allocateDataBlock(std::shared_ptr<SuperBlock> superblock_ptr).
+     * What the magazine cannot cover is taken from the free list in whole chunks under one lock,
+     * the part of the last chunk that is not needed stays in the magazine.
+     */
+    std::vector<uint32_t> FileSystem::allocateDataBlocks(std::shared_ptr<SuperBlock> superblock_ptr, uint64_t count)
+    {
+        std::vector<uint32_t> result;
+        result.reserve(count);
+        auto magazine_ptr = this->magazine();
+        magazine_ptr->take(count, result);
+        if(this->_journal && result.size() < count)
+        {
+            this->_journal->take(count - result.size(), result);
+        }
+        if(result.size() == count)
+        {
+            this->noteAllocated(result);
+            return result;
+        }
+        auto missing = count - result.size();
+        auto wanted = (missing + Magazine::CHUNK - 1) / Magazine::CHUNK * Magazine::CHUNK;
+        std::vector<uint32_t> taken;
+        {
+            std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+            taken = this->takeFreeBlocks(superblock_ptr, wanted);
+            if(taken.size() < missing)
+            {
+                // the rest of the free blocks may be sitting in other threads' magazines
+                this->flushMagazines();
+                auto more = this->takeFreeBlocks(superblock_ptr, wanted - taken.size());
+                taken.insert(taken.end(), more.begin(), more.end());
+            }
+            if(taken.size() < missing)
+            {
+                // hand back what was taken so the free list stays consistent
+                taken.insert(taken.end(), result.begin(), result.end());
+                this->returnFreeBlocks(superblock_ptr, taken);
+                throw std::runtime_error("Out of memory: cannot allocate " + std::to_string(count)
+                    + " more data blocks!");
+            }
+        }
+        result.insert(result.end(), taken.begin(), taken.begin() + missing);
+        // reversed, as the magazine hands out its last block first; a sorted free list then gives ascending runs
+        this->stockMagazine(superblock_ptr, std::vector<uint32_t>{taken.rbegin(), taken.rend() - missing});
+        this->noteAllocated(result);
+        return result;
+    }
+    /**
+     * Batched version of FileSystem::freeDataBlock(std::shared_ptr<SuperBlock> superblock_ptr, uint32_t blockIdx).
+     */
+    void FileSystem::freeDataBlocks(std::shared_ptr<SuperBlock> superblock_ptr, const std::vector<uint32_t>& blockIdxs)
+    {
+        if(blockIdxs.empty())
+        {
+            return;
+        }
+        for(auto blockIdx : blockIdxs)
+        {
+            if(blockIdx < this->DATA_BLOCK_IDX || blockIdx >= this->DATA_BLOCK_IDX + this->DATA_BLOCKS)
+            {
+                throw std::invalid_argument("Cannot free block " + std::to_string(blockIdx)
+                    + " as it is not a data block");
+            }
+        }
+        std::vector<uint32_t> released;
+        if(this->_refcounted)
+        {
+            // reference counts and the hash index are shared, the rest is not
+            std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+            std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+            BlockTable refcounts{this, bootblock_ptr->refcounts()};
+            BlockTable index{this, bootblock_ptr->hashIndex()};
+            for(auto blockIdx : blockIdxs)
+            {
+                if(refcounts.counter(blockIdx) != 0)
+                {
+                    --refcounts.counter(blockIdx);
+                    continue;
+                }
+                if(index.exists())
+                {
+                    this->unindexBlock(index, hashBlock(this->getBlock(blockIdx)->asBytes().data()), blockIdx);
+                }
+                released.push_back(blockIdx);
+            }
+        }
+        else
+        {
+            released = blockIdxs;
+        }
+        for(auto blockIdx : released)
+        {
+            if(this->_journal)
+            {
+                this->_journal->free(blockIdx);
+                continue;
+            }
+            std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+            std::fill(block_ptr->asIntegers().begin(), block_ptr->asIntegers().end(), 0);
+        }
+        std::cout << "Freed " << released.size() << " blocks" << std::endl;
+        if(released.size() != blockIdxs.size())
+        {
+            std::cout << "Dropped references to " << blockIdxs.size() - released.size() << " shared blocks" << std::endl;
+        }
+        if(!this->_journal)
+        {
+            this->noteFreed(superblock_ptr, released);
+        }
+    }
+    // blocks handed out during a transaction, which are free again if it is rolled back
+    void FileSystem::noteAllocated(const std::vector<uint32_t>& blockIdxs)
+    {
+        if(this->_transaction.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> guard{this->_transactionLock};
+            this->_transactionBlocks.insert(this->_transactionBlocks.end(), blockIdxs.begin(), blockIdxs.end());
+        }
+    }
+    // zeroed blocks freed without a journal, held back until the transaction ends if one is open
+    void FileSystem::noteFreed(std::shared_ptr<SuperBlock> superblock_ptr, const std::vector<uint32_t>& blockIdxs)
+    {
+        if(this->_transaction.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> guard{this->_transactionLock};
+            if(this->_transaction)
+            {
+                this->_transactionFreed.insert(this->_transactionFreed.end(), blockIdxs.begin(), blockIdxs.end());
+                return;
+            }
+        }
+        this->stockMagazine(superblock_ptr, blockIdxs);
+    }
+    uint32_t FileSystem::allocateINode()
+    {
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        const auto INODES_PER_BLOCK = 1024 / 64;
+        const auto ALLOCATED_FLAG = 0b1000000000000000;
+        const auto TOTAL_INODES = this->INODE_BLOCKS * INODES_PER_BLOCK;
+        for(uint32_t idx = 0; idx < TOTAL_INODES; idx++)
+        {
+            std::shared_ptr<INode> inode_ptr = this->getINode(idx);
+            auto flags = inode_ptr->flags();
+            if((flags & ALLOCATED_FLAG) == 0)
+            {
+                // claimed before the lock is released, the caller fills in the rest
+                inode_ptr->flags(ALLOCATED_FLAG);
+                return idx;
+            }
+        }
+        throw std::runtime_error("Out of memory: cannot allocate any more i-nodes!");
+    }
+    // FileSystem::allocateINode for many i-nodes in one scan of the i-node blocks; claims none if there are too few
+    std::vector<uint32_t> FileSystem::allocateINodes(uint64_t count)
+    {
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        const auto INODES_PER_BLOCK = 1024 / 64;
+        const auto ALLOCATED_FLAG = 0b1000000000000000;
+        const auto TOTAL_INODES = this->INODE_BLOCKS * INODES_PER_BLOCK;
+        std::vector<std::shared_ptr<INode>> inode_ptrs;
+        std::vector<uint32_t> result;
+        for(uint32_t idx = 0; idx < TOTAL_INODES && result.size() < count; idx++)
+        {
+            std::shared_ptr<INode> inode_ptr = this->getINode(idx);
+            if((inode_ptr->flags() & ALLOCATED_FLAG) == 0)
+            {
+                inode_ptrs.push_back(inode_ptr);
+                result.push_back(idx);
+            }
+        }
+        if(result.size() < count)
+        {
+            throw std::runtime_error("Out of memory: cannot allocate " + std::to_string(count) + " more i-nodes!");
+        }
+        for(auto inode_ptr : inode_ptrs)
+        {
+            inode_ptr->flags(ALLOCATED_FLAG);
+        }
+        return result;
+    }
+    void FileSystem::freeINode(std::shared_ptr<INode> inode_ptr)
+    {
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        inode_ptr->flags(0);
+        inode_ptr->nlinks(0);
+        inode_ptr->uid(0);
+        inode_ptr->gid(0);
+        inode_ptr->xflags(0);
+        inode_ptr->size(0);
+        std::array<uint32_t, 9> addr = inode_ptr->addr();
+        std::fill(addr.begin(), addr.end(), 0);
+        inode_ptr->addr(addr);
+        inode_ptr->actime(0);
+        inode_ptr->modtime(0);
+    }
+    // FileSystem::freeINode for many i-nodes under one hold of _allocatorLock
+    void FileSystem::freeINodes(const std::vector<uint32_t>& inodeIdxs)
+    {
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        for(auto inodeIdx : inodeIdxs)
+        {
+            this->freeINode(this->getINode(inodeIdx));
+        }
+    }
+    void FileSystem::initializeFreeList(std::shared_ptr<SuperBlock> superblock_ptr)
+    {
+        std::cout << "Number of data blocks: " << this->DATA_BLOCKS << std::endl;
+        std::cout << "Data blocks start at: " << this->DATA_BLOCK_IDX << std::endl;
+        std::vector<uint32_t> blockIdxs;
+        for(int32_t i = DATA_BLOCKS - 1; i >= 0; i--)
+        {
+            std::shared_ptr<Block> block_ptr = this->getBlock(DATA_BLOCK_IDX + i);
+            std::fill(block_ptr->asIntegers().begin(), block_ptr->asIntegers().end(), 0);
+            blockIdxs.push_back(DATA_BLOCK_IDX + i);
+        }
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        this->returnFreeBlocks(superblock_ptr, blockIdxs);
+    }
+    void FileSystem::initializeINodes()
+    {
+        const auto INODES_PER_BLOCK = 1024 / 64;
+        for(uint32_t idx = 0; idx < this->INODE_BLOCKS * INODES_PER_BLOCK; idx++)
         {
             std::shared_ptr<INode> inode_ptr = this->getINode(idx);
             inode_ptr->flags(0);
@@ -259,6 +934,7 @@ namespace ModV6FileSystem
         inode_ptr->nlinks(3);
         inode_ptr->uid(0);
         inode_ptr->gid(0);
+        inode_ptr->xflags(0);
         // 2 * file size
         // We have 1 for . and 1 for ..
         inode_ptr->size(2 * 32);
@@ -284,6 +960,38 @@ namespace ModV6FileSystem
         parent->name("..");
         std::cout << "Allocated data block: " << blockIdx << std::endl;
     }
+    std::shared_timed_mutex& FileSystem::inodeLock(uint32_t inodeIdx)
+    {
+        if(inodeIdx >= this->INODE_BLOCKS * 16ull)
+        {
+            throw std::out_of_range("No lock for i-node " + std::to_string(inodeIdx));
+        }
+        return this->_inodeLocks[inodeIdx];
+    }
+    std::string FileSystem::workingDirectory()
+    {
+        std::lock_guard<std::mutex> guard{this->_cwdLock};
+        return this->_working_directory;
+    }
+    /**
+     * I-node of the entry called name in a directory, -1 if there is none. The caller holds the directory's lock,
+     * which is how commands check that what an unlocked path lookup found is still there.
+     */
+    int64_t FileSystem::findEntry(std::shared_ptr<INode> inode_ptr, const std::string& name)
+    {
+        if(!inode_ptr->allocated() || inode_ptr->filetype() != FileType::DIRECTORY)
+        {
+            return -1;
+        }
+        for(auto file_ptr : this->getFilesForINode(inode_ptr))
+        {
+            if(file_ptr->name() == name)
+            {
+                return file_ptr->inode();
+            }
+        }
+        return -1;
+    }
     std::string FileSystem::getExtendedFilename(std::string workingDirectory, std::string filename)
     {
         std::string slash{"/"};
@@ -294,7 +1002,7 @@ namespace ModV6FileSystem
         }
         if(target[0] != slash[0])
         {
-            target = this->_working_directory + target;
+            target = workingDirectory + target;
         }
         return target;
     }
@@ -334,6 +1042,8 @@ namespace ModV6FileSystem
         {
             if(element.size() > 0)
             {
+                // one directory at a time: the result may be stale by the time it is used, commands recheck it
+                auto guard = sharedLock(this->inodeLock(currentIdx));
                 inode_ptr = this->getINode(currentIdx);
                 if(inode_ptr->filetype() == FileType::REGULAR)
                 {
@@ -371,20 +1081,13 @@ namespace ModV6FileSystem
     std::vector<uint32_t> FileSystem::getBlocksForINode(std::shared_ptr<INode> inode_ptr)
     {
         std::vector<uint32_t> result;
-        if(inode_ptr->filesize() == FileSize::SMALL)
+        for(uint32_t block_address : this->getBlockMap(inode_ptr))
         {
-            for(uint32_t block_address : inode_ptr->addr())
+            if(block_address != 0)
             {
-                if(block_address != 0)
-                {
-                    result.push_back(block_address);
-                }
+                result.push_back(block_address);
             }
         }
-        else
-        {
-            throw std::runtime_error("Medium/Large/Massive files in i-nodes not supported yet!");
-        }
         return result;
     }
     std::vector<std::shared_ptr<File>> FileSystem::getFilesForINode(std::shared_ptr<INode> inode_ptr)
@@ -419,53 +1122,70 @@ namespace ModV6FileSystem
     std::string FileSystem::getWorkingDirectory(uint32_t inodeIdx)
     {
         std::string pwd = "/";
-        auto inode_ptr = this->getINode(inodeIdx);
-        std::vector<std::shared_ptr<File>> parent_ptrs = this->getFilesForINode(inode_ptr);
         while(inodeIdx != 0)
         {
-            inode_ptr = this->getINode(inodeIdx);
-            std::vector<std::shared_ptr<File>> file_ptrs = parent_ptrs;
-            bool found = false;
-            for(auto file_ptr : file_ptrs)
+            // the child is let go before its parent is locked, directories are only ever locked top down
+            int64_t parentIdx;
+            {
+                std::shared_lock<std::shared_timed_mutex> guard{this->inodeLock(inodeIdx)};
+                parentIdx = this->findEntry(this->getINode(inodeIdx), "..");
+            }
+            if(parentIdx == -1)
+            {
+                throw std::runtime_error("I-node " + std::to_string(inodeIdx) + " has no parent!");
+            }
+            std::shared_lock<std::shared_timed_mutex> guard{this->inodeLock(parentIdx)};
+            std::vector<std::shared_ptr<File>> parent_ptrs = this->getFilesForINode(this->getINode(parentIdx));
+            bool found_child = false;
+            for(auto parent_file_ptr : parent_ptrs)
             {
-                if(file_ptr->name() == "..")
+                auto inode = parent_file_ptr->inode();
+                auto name = parent_file_ptr->name();
+                if(name != "." && name != ".." && inode == inodeIdx)
                 {
-                    found = true;
-                    auto parentIdx = file_ptr->inode();
-                    auto parent_inode_ptr = this->getINode(parentIdx);
-                    parent_ptrs = this->getFilesForINode(parent_inode_ptr);
-                    bool found_child = false;
-                    for(auto parent_file_ptr : parent_ptrs)
-                    {
-                        auto inode = parent_file_ptr->inode();
-                        auto name = parent_file_ptr->name();
-                        if(name != "." && name != ".." && inode == inodeIdx)
-                        {
-                            pwd = "/" + name + pwd;
-                            found_child = true;
-                            break;
-                        }
-                    }
-                    if(!found_child)
-                    {
-                        throw std::runtime_error("I-node " + std::to_string(inodeIdx) + " is not a child of its parent!");
-                    }
-                    inodeIdx = parentIdx;
+                    pwd = "/" + name + pwd;
+                    found_child = true;
                     break;
                 }
             }
-            if(!found)
+            if(!found_child)
             {
-                throw std::runtime_error("I-node " + std::to_string(inodeIdx) + " has no parent!");
+                throw std::runtime_error("I-node " + std::to_string(inodeIdx) + " is not a child of its parent!");
             }
+            inodeIdx = parentIdx;
         }
         return pwd;
     }
+    // the directory itself, then each directory above it up to the root, found through their .. entries
+    std::vector<uint32_t> FileSystem::getAncestors(uint32_t inodeIdx)
+    {
+        std::vector<uint32_t> result{inodeIdx};
+        while(inodeIdx != 0 && result.size() <= this->INODE_BLOCKS * 16ull)
+        {
+            std::shared_lock<std::shared_timed_mutex> guard{this->inodeLock(inodeIdx)};
+            auto parentIdx = this->findEntry(this->getINode(inodeIdx), "..");
+            if(parentIdx == -1)
+            {
+                throw std::runtime_error("I-node " + std::to_string(inodeIdx) + " has no parent!");
+            }
+            inodeIdx = parentIdx;
+            result.push_back(inodeIdx);
+        }
+        return result;
+    }
     uint32_t FileSystem::createDirectory(std::string name, uint32_t parentIdx)
     {
         auto inodeIdx = this->allocateINode();
-        std::shared_ptr<INode> inode_ptr = this->getINode(inodeIdx);
         std::cout << "Allocated i-node " << inodeIdx << std::endl;
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        this->initializeDirectory(inodeIdx, parentIdx, this->allocateDataBlock(superblock_ptr));
+        this->linkFile(name, parentIdx, inodeIdx);
+        return inodeIdx;
+    }
+    // an empty directory in the given data block that no directory points to yet
+    void FileSystem::initializeDirectory(uint32_t inodeIdx, uint32_t parentIdx, uint32_t blockIdx)
+    {
+        std::shared_ptr<INode> inode_ptr = this->getINode(inodeIdx);
         inode_ptr->allocated(true);
         inode_ptr->filetype(FileType::DIRECTORY);
         inode_ptr->filesize(FileSize::SMALL);
@@ -486,6 +1206,7 @@ namespace ModV6FileSystem
         inode_ptr->nlinks(3);
         inode_ptr->uid(0);
         inode_ptr->gid(0);
+        inode_ptr->xflags(0);
         // 2 * file size
         // We have 1 for . and 1 for ..
         inode_ptr->size(2 * 32);
@@ -493,8 +1214,6 @@ namespace ModV6FileSystem
         inode_ptr->actime(0);
         inode_ptr->modtime(0);
         
-        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
-        auto blockIdx = this->allocateDataBlock(superblock_ptr);
         // update allocated block for file
         auto blocks = inode_ptr->addr();
         blocks[0] = blockIdx;
@@ -510,32 +1229,98 @@ namespace ModV6FileSystem
         parent->inode(parentIdx);
         parent->name("..");
         std::cout << "Allocated data block: " << blockIdx << std::endl;
-        auto parent_ptr = this->getINode(parentIdx);
-        std::shared_ptr<File> file_ptr = this->addFileToINode(parent_ptr);
-        file_ptr->inode(inodeIdx);
-        file_ptr->name(name);
-        return inodeIdx;
     }
     uint32_t FileSystem::createFile(std::string name, uint32_t parentIdx)
     {
         auto inodeIdx = this->allocateINode();
+        this->initializeFile(inodeIdx);
+        this->linkFile(name, parentIdx, inodeIdx);
+        return inodeIdx;
+    }
+    // an empty regular file that no directory points to yet
+    void FileSystem::initializeFile(uint32_t inodeIdx)
+    {
         auto inode_ptr = this->getINode(inodeIdx);
-        inode_ptr->flags(0);
         inode_ptr->allocated(true);
         inode_ptr->nlinks(1);
         inode_ptr->uid(0);
         inode_ptr->gid(0);
+        inode_ptr->xflags(0);
         inode_ptr->size(0);
         inode_ptr->actime(0);
         inode_ptr->modtime(0);
         inode_ptr->ownerR(true);
         inode_ptr->ownerW(true);
-
+    }
+    void FileSystem::linkFile(std::string name, uint32_t parentIdx, uint32_t inodeIdx)
+    {
         auto parent_ptr = this->getINode(parentIdx);
         std::shared_ptr<File> file_ptr = this->addFileToINode(parent_ptr);
         file_ptr->inode(inodeIdx);
         file_ptr->name(name);
-        return inodeIdx;
+    }
+    /**
+     * FileSystem::linkFile for many entries of one directory: it grows once, the blocks for the new entries are
+     * mapped in one batch and each of them is filled in one go.
+     */
+    void FileSystem::linkFiles(uint32_t parentIdx, const std::vector<std::pair<std::string, uint32_t>>& entries)
+    {
+        if(entries.empty())
+        {
+            return;
+        }
+        auto parent_ptr = this->getINode(parentIdx);
+        uint64_t size = parent_ptr->size();
+        uint64_t grown = size + 32 * entries.size();
+        if(grown < size)
+        {
+            throw std::overflow_error("I-node size " + std::to_string(size) + " overflows if extended!");
+        }
+        this->resizeINode(parent_ptr, grown);
+        std::vector<uint64_t> logicals;
+        for(auto logical = size / 1024; logical <= (grown - 1) / 1024; ++logical)
+        {
+            logicals.push_back(logical);
+        }
+        std::vector<uint32_t> blockIdxs = this->mapBlocks(parent_ptr, logicals);
+        uint64_t entry = 0;
+        for(uint64_t i = 0; i < blockIdxs.size(); ++i)
+        {
+            std::array<std::shared_ptr<File>, 32> files = this->getFiles(blockIdxs[i]);
+            for(; entry < entries.size() && (size + 32 * entry) / 1024 == logicals[i]; ++entry)
+            {
+                auto file_ptr = files[(size + 32 * entry) % 1024 / 32];
+                file_ptr->inode(entries[entry].second);
+                file_ptr->name(entries[entry].first);
+            }
+        }
+    }
+    /**
+     * Removes the directory's entry for the i-node: the last entry takes its place and the directory shrinks by one.
+     * Returns false if there is no such entry.
+     */
+    bool FileSystem::unlinkFile(std::shared_ptr<INode> parent_ptr, uint32_t inodeIdx)
+    {
+        std::vector<std::shared_ptr<File>> files = this->getFilesForINode(parent_ptr);
+        auto last_ptr = files.back();
+        for(auto file_ptr : files)
+        {
+            if(file_ptr->inode() == inodeIdx && file_ptr->name() != "." && file_ptr->name() != "..")
+            {
+                if(file_ptr != last_ptr)
+                {
+                    file_ptr->inode(last_ptr->inode());
+                    file_ptr->filename(last_ptr->filename());
+                }
+                last_ptr->inode(0);
+                std::array<char, 28> filename = last_ptr->filename();
+                std::fill(filename.begin(), filename.end(), '\0');
+                last_ptr->filename(filename);
+                this->resizeINode(parent_ptr, parent_ptr->size() - 32);
+                return true;
+            }
+        }
+        return false;
     }
     std::shared_ptr<File> FileSystem::addFileToINode(std::shared_ptr<INode> inode_ptr)
     {
@@ -546,12 +1331,51 @@ namespace ModV6FileSystem
         }
         auto FILES_PER_BLOCK = 1024 / 32;
         this->resizeINode(inode_ptr, size + 32);
-        std::vector<uint32_t> blocks = this->getBlocksForINode(inode_ptr);
-        std::array<std::shared_ptr<File>, 32> files = this->getFiles(blocks.back());
-        auto offset = (inode_ptr->size() % 1024) / FILES_PER_BLOCK;
+        // the new entry occupies the 32 bytes that used to be just past the end of the directory
+        auto blockIdx = this->mapBlocks(inode_ptr, {size / 1024}).front();
+        std::array<std::shared_ptr<File>, 32> files = this->getFiles(blockIdx);
+        auto offset = (size % 1024) / FILES_PER_BLOCK;
         std::cout << "Offset of file in block is: " << std::to_string(offset) << std::endl;
         return files[offset];
     }
+    uint64_t FileSystem::blocksForSize(uint64_t size)
+    {
+        return size / 1024 + (size % 1024 != 0);
+    }
+    uint64_t FileSystem::blockSpan(uint16_t depth)
+    {
+        uint64_t span = 1024;
+        for(uint16_t level = 0; level < depth; ++level)
+        {
+            span *= 256;
+        }
+        return span;
+    }
+    FileSize FileSystem::fileSizeForBlocks(uint64_t blocks)
+    {
+        if(blocks <= 9)
+        {
+            return FileSize::SMALL;
+        }
+        else if(blocks <= 2304)
+        {
+            return FileSize::MEDIUM;
+        }
+        else if(blocks <= 589824)
+        {
+            return FileSize::LARGE;
+        }
+        else if(blocks <= 150994944)
+        {
+            return FileSize::MASSIVE;
+        }
+        throw std::runtime_error("Excessive size=" + std::to_string(blocks) +": this should never happen!");
+    }
+    /**
+     * Changes the size of the i-node without allocating any data blocks: growing leaves a hole,
+     * which reads as zeros until something is written there through FileSystem::mapBlocks.
+     * Shrinking frees every block past the new end and zeroes the rest of the new final block.
+     */
     void FileSystem::resizeINode(std::shared_ptr<INode> inode_ptr, uint64_t size)
     {
         if(size > 154618822656ull)
@@ -559,618 +1383,5474 @@ namespace ModV6FileSystem
             throw std::runtime_error("I-node data not accessible if extended to "+ std::to_string(size) + " bytes!");
         }
         std::cout << "Setting size of i-node to " << size << std::endl;
-        auto old_size = inode_ptr->size();
-        inode_ptr->size(size);
-        auto old_blocks = old_size / 1024 + (old_size != 0);
-        auto blocks = size / 1024 + (size != 0);
-        std::cout << "old_blocks=" << old_blocks << ", blocks=" << blocks << std::endl;
-        std::vector<std::vector<uint32_t>> levels = this->getBlocks(inode_ptr);
-        auto level = 0;
-        for(auto vec : levels)
+        if(inode_ptr->inlined())
         {
-            std::cout << "Level" << ++level << ": size " << vec.size() << std::endl;
-            for(auto member : vec)
+            if(size <= 36)
             {
-                std::cout << member << ", ";
+                auto data = inode_ptr->inlineData();
+                std::fill(data.begin() + size, data.end(), 0);
+                inode_ptr->inlineData(data);
+                inode_ptr->inlined(size != 0);
+                inode_ptr->size(size);
+                return;
             }
-            std::cout << std::endl;
-        }
-        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
-        if(blocks == old_blocks)
-        {
-            std::cout << "I-node contains the same number of blocks before and after!" << std::endl;
+            this->unpackINode(inode_ptr);
         }
-        else if(blocks == 0)
+        if(inode_ptr->tailPacked() && size != inode_ptr->size())
         {
-            std::vector<std::vector<uint32_t>> blocks = this->getBlocks(inode_ptr);
-            for(auto vec : blocks)
+            if(size <= inode_ptr->size() / 1024 * 1024)
             {
-                for(auto block : vec)
-                {
-                    this->freeDataBlock(superblock_ptr, block);
-                }
+                this->releaseTail(inode_ptr);
+            }
+            else
+            {
+                this->unpackINode(inode_ptr);
             }
         }
-        else if(blocks > old_blocks)
+        if(inode_ptr->compressed() && size < inode_ptr->size() && size % CLUSTER_BYTES != 0)
+        {
+            // the cluster left partly past the new end is cut block by block, which needs it raw
+            this->expandCluster(inode_ptr, size / CLUSTER_BYTES);
+        }
+        auto old_size = inode_ptr->size();
+        auto filesize = this->fileSizeForBlocks(this->blocksForSize(size));
+        auto old_depth = static_cast<uint16_t>(inode_ptr->filesize());
+        auto depth = static_cast<uint16_t>(filesize);
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        std::vector<uint32_t> freed;
+        auto addr = inode_ptr->addr();
+        auto empty = std::all_of(addr.begin(), addr.end(), [](uint32_t blockIdx) { return blockIdx == 0; });
+        // growing past the current level: the old top level becomes the first children of a new indirect block
+        for(; old_depth < depth; ++old_depth)
         {
-            auto added = blocks - old_blocks;
-            if(blocks < 9)
+            if(empty)
             {
-                auto addr = inode_ptr->addr();
-                for(auto i = old_blocks; i < old_blocks + added; i++)
-                {
-                    std::cout << "adding i-node in spot " << i << std::endl;
-                    addr[i] = this->allocateDataBlock(superblock_ptr);
-                }
-                inode_ptr->addr(addr);
-                levels = this->getBlocks(inode_ptr);
-                level = 0;
-                for(auto vec : levels)
-                {
-                    std::cout << "Level" << ++level << ": size " << vec.size() << std::endl;
-                    for(auto member : vec)
-                    {
-                        std::cout << member << ", ";
-                    }
-                    std::cout << std::endl;
-                }
+                continue;
             }
-            else if(blocks < 2304)
+            auto blockIdx = this->allocateDataBlock(superblock_ptr);
+            std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+            std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+            std::fill(intArray.begin(), intArray.end(), 0);
+            std::copy(addr.begin(), addr.end(), intArray.begin());
+            std::fill(addr.begin(), addr.end(), 0);
+            addr[0] = blockIdx;
+        }
+        if(size < old_size)
+        {
+            auto blockSize = this->blockSpan(old_depth);
+            for(auto i = 0; i < 9; ++i)
             {
-                throw std::runtime_error("Medium blocks not yet supported");
+                addr[i] = this->resizeBlock(addr[i], blockSize * i, blockSize, size, freed);
             }
-            else if(blocks < 589824)
+            inode_ptr->addr(addr);
+            inode_ptr->filesize(static_cast<FileSize>(old_depth));
+            // a later grow must not bring the old bytes past the new end back
+            if(size % 1024 != 0)
             {
-                throw std::runtime_error("Large blocks not yet supported");
+                auto blockIdx = this->lookupBlocks(inode_ptr, {size / 1024}).front();
+                blockIdx = this->ownBlock(inode_ptr, size / 1024, blockIdx);
+                if(blockIdx != 0)
+                {
+                    std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+                    std::array<uint8_t, 1024>& bytes = block_ptr->asBytes();
+                    std::fill(bytes.begin() + size % 1024, bytes.end(), 0);
+                }
+                addr = inode_ptr->addr();
             }
-            else if(blocks < 150994944)
+        }
+        // shrinking below the current level: the children of the only remaining top-level block move up
+        for(; old_depth > depth; --old_depth)
+        {
+            auto top = addr[0];
+            std::fill(addr.begin(), addr.end(), 0);
+            if(top != 0)
             {
-                throw std::runtime_error("Massive blocks not yet supported");
+                std::shared_ptr<Block> block_ptr = this->getBlock(top);
+                std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+                std::copy_n(intArray.begin(), 9, addr.begin());
+                freed.push_back(top);
             }
-            else
+        }
+        inode_ptr->addr(addr);
+        inode_ptr->filesize(filesize);
+        inode_ptr->size(size);
+        this->freeDataBlocks(superblock_ptr, freed);
+    }
+    /**
+     * Moves inlined contents out of the addr area, or a packed tail out of its fragment block,
+     * into a regular data block. Returns whether anything moved.
+     */
+    bool FileSystem::unpackINode(std::shared_ptr<INode> inode_ptr)
+    {
+        if(inode_ptr->inlined())
+        {
+            std::cout << "Moving inline data of i-node into a data block" << std::endl;
+            auto data = inode_ptr->inlineData();
+            std::array<uint32_t, 9> addr;
+            std::fill(addr.begin(), addr.end(), 0);
+            inode_ptr->addr(addr);
+            inode_ptr->inlined(false);
+            inode_ptr->filesize(FileSize::SMALL);
+            if(std::any_of(data.begin(), data.end(), [](uint8_t byte) { return byte != 0; }))
             {
-                throw std::runtime_error("Excessive size=" + std::to_string(blocks) +": this should never happen!");
+                auto blockIdx = this->mapBlocks(inode_ptr, {0}).front();
+                std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+                std::copy(data.begin(), data.end(), block_ptr->asBytes().begin());
             }
+            return true;
         }
-        else if(blocks < old_blocks)
+        if(inode_ptr->tailPacked())
         {
-            auto subtracted = old_blocks - blocks;
-            std::cout << "subtracted=" << subtracted << ", old_blocks=" << old_blocks << ", blocks=" << blocks
-                << std::endl;
-            if(blocks < 9)
+            std::cout << "Moving packed tail of i-node into a data block" << std::endl;
+            std::vector<uint8_t> tail = this->readTail(inode_ptr);
+            this->releaseTail(inode_ptr);
+            if(std::any_of(tail.begin(), tail.end(), [](uint8_t byte) { return byte != 0; }))
             {
-                auto addr = inode_ptr->addr();
-                for(auto i = old_blocks - subtracted; i < old_blocks; i++)
-                {
-                    std::cout << "removing i-node in spot " << i << std::endl;
-                    this->freeDataBlock(superblock_ptr, addr[i]);
-                    addr[i] = 0;
-                }
-                inode_ptr->addr(addr);
+                auto blockIdx = this->mapBlocks(inode_ptr, {(inode_ptr->size() - 1) / 1024}).front();
+                std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+                std::copy(tail.begin(), tail.end(), block_ptr->asBytes().begin());
             }
-            else if(blocks < 2304)
+            return true;
+        }
+        return false;
+    }
+    /**
+     * Stores the final partial block of the i-node, whose logical block must still be a hole,
+     * in 32-byte slots of the current fragment block, starting a new fragment block if it is full.
+     * Returns false if the tail is too long to share a block.
+     */
+    bool FileSystem::packTail(std::shared_ptr<INode> inode_ptr, const uint8_t* data, uint64_t length)
+    {
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        auto needed = (length + 31) / 32;
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        if(length == 0 || needed > 31 || !bootblock_ptr->valid())
+        {
+            return false;
+        }
+        auto fits = [needed](uint32_t bitmap) -> uint16_t
+        {
+            for(uint16_t slot = 1; slot + needed <= 32; ++slot)
             {
-                throw std::runtime_error("Medium blocks not yet supported");
+                uint32_t mask = (needed == 32 ? 0xFFFFFFFF : ((1u << needed) - 1)) << slot;
+                if((bitmap & mask) == 0)
+                {
+                    return slot;
+                }
             }
-            else if(blocks < 589824)
+            return 0;
+        };
+        auto fragmentIdx = bootblock_ptr->fragment();
+        std::shared_ptr<Block> block_ptr;
+        uint16_t slot = 0;
+        if(fragmentIdx != 0)
+        {
+            block_ptr = this->getBlock(fragmentIdx);
+            slot = fits(block_ptr->asIntegers()[1]);
+        }
+        if(slot == 0)
+        {
+            std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+            fragmentIdx = this->allocateDataBlock(superblock_ptr);
+            block_ptr = this->getBlock(fragmentIdx);
+            block_ptr->asIntegers()[0] = FRAGMENT_MAGIC;
+            block_ptr->asIntegers()[1] = 1;
+            bootblock_ptr->fragment(fragmentIdx);
+            slot = 1;
+            std::cout << "Started fragment block " << fragmentIdx << std::endl;
+        }
+        std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+        intArray[1] |= ((1u << needed) - 1) << slot;
+        std::copy(data, data + length, block_ptr->asBytes().begin() + slot * 32);
+        this->replaceBlock(inode_ptr, (inode_ptr->size() - 1) / 1024, fragmentIdx);
+        inode_ptr->tailPacked(true);
+        inode_ptr->tailSlot(slot);
+        std::cout << "Packed " << length << " byte tail into slot " << slot << " of fragment block "
+            << fragmentIdx << std::endl;
+        return true;
+    }
+    // the final partial block of a tail-packed i-node
+    std::vector<uint8_t> FileSystem::readTail(std::shared_ptr<INode> inode_ptr)
+    {
+        auto size = inode_ptr->size();
+        auto fragmentIdx = this->lookupBlocks(inode_ptr, {(size - 1) / 1024}).front();
+        std::shared_ptr<Block> block_ptr = this->getBlock(fragmentIdx);
+        auto begin = block_ptr->asBytes().begin() + inode_ptr->tailSlot() * 32;
+        return std::vector<uint8_t>{begin, begin + size % 1024};
+    }
+    /**
+     * Gives the slots of a packed tail back to its fragment block, freeing the fragment block once it is empty,
+     * and leaves a hole in place of the tail.
+     */
+    void FileSystem::releaseTail(std::shared_ptr<INode> inode_ptr)
+    {
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        if(!inode_ptr->tailPacked())
+        {
+            return;
+        }
+        auto size = inode_ptr->size();
+        auto needed = (size % 1024 + 31) / 32;
+        auto fragmentIdx = this->replaceBlock(inode_ptr, (size - 1) / 1024, 0);
+        std::shared_ptr<Block> block_ptr = this->getBlock(fragmentIdx);
+        std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+        intArray[1] &= ~(((1u << needed) - 1) << inode_ptr->tailSlot());
+        inode_ptr->tailPacked(false);
+        inode_ptr->tailSlot(0);
+        if(intArray[1] == 1)
+        {
+            block_ptr.reset();
+            std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+            if(bootblock_ptr->fragment() == fragmentIdx)
             {
-                throw std::runtime_error("Large blocks not yet supported");
+                bootblock_ptr->fragment(0);
             }
-            else if(blocks < 150994944)
+            std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+            this->freeDataBlock(superblock_ptr, fragmentIdx);
+        }
+    }
+    /**
+     * Points a logical block of the i-node at blockIdx, allocating missing indirect blocks on the way,
+     * and returns the block it pointed at before (0 for a hole).
+     * Indirect blocks on the way are appended to pinned, if given, to keep them cached for the next call.
+     */
+    uint32_t FileSystem::replaceBlock(std::shared_ptr<INode> inode_ptr, uint64_t logical, uint32_t blockIdx,
+        std::vector<std::shared_ptr<Block>>* pinned)
+    {
+        auto depth = static_cast<uint16_t>(inode_ptr->filesize());
+        auto span = this->blockSpan(depth) / 1024;
+        if(logical / span >= 9)
+        {
+            throw std::runtime_error("Block " + std::to_string(logical) + " is not reachable from i-node!");
+        }
+        auto addr = inode_ptr->addr();
+        uint32_t* slot = &addr[logical / span];
+        logical %= span;
+        // indirect blocks on the path stay alive until their entry has been updated
+        std::vector<std::shared_ptr<Block>> path;
+        for(; depth > 0; --depth)
+        {
+            if(*slot == 0)
             {
-                throw std::runtime_error("Massive blocks not yet supported");
+                if(blockIdx == 0)
+                {
+                    return 0;
+                }
+                std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+                *slot = this->allocateDataBlock(superblock_ptr);
             }
-            else
+            path.push_back(this->getBlock(*slot));
+            span /= 256;
+            slot = &path.back()->asIntegers()[logical / span];
+            logical %= span;
+        }
+        auto old = *slot;
+        *slot = blockIdx;
+        inode_ptr->addr(addr);
+        if(pinned)
+        {
+            // the caller replaces more blocks under the same indirect blocks, so keep them cached
+            pinned->insert(pinned->end(), path.begin(), path.end());
+        }
+        return old;
+    }
+    /**
+     * Gives the i-node sole ownership of its data block at logical before the block is modified in place:
+     * a shared block is copied and the copy takes its place, an unshared one leaves the dedup index
+     * since its contents are about to change. Returns the block to modify (0 for a hole).
+     */
+    uint32_t FileSystem::ownBlock(std::shared_ptr<INode> inode_ptr, uint64_t logical, uint32_t blockIdx)
+    {
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        BlockTable refcounts{this, bootblock_ptr->refcounts()};
+        if(blockIdx == 0 || !refcounts.exists())
+        {
+            return blockIdx;
+        }
+        if(refcounts.counter(blockIdx) == 0)
+        {
+            BlockTable index{this, bootblock_ptr->hashIndex()};
+            if(index.exists())
             {
-                throw std::runtime_error("Excessive size=" + std::to_string(blocks) +": this should never happen!");
+                std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+                this->unindexBlock(index, hashBlock(block_ptr->asBytes().data()), blockIdx);
             }
+            return blockIdx;
         }
+        --refcounts.counter(blockIdx);
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        auto copyIdx = this->allocateDataBlock(superblock_ptr);
+        std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+        std::shared_ptr<Block> copy_ptr = this->getBlock(copyIdx);
+        copy_ptr->asBytes() = block_ptr->asBytes();
+        this->replaceBlock(inode_ptr, logical, copyIdx);
+        std::cout << "Copied shared block " << blockIdx << " to " << copyIdx << " before modifying it" << std::endl;
+        return copyIdx;
     }
-    std::vector<std::vector<uint32_t>> FileSystem::getBlocks(std::shared_ptr<INode> inode_ptr)
+    /**
+     * Creates an on-disk table of the given number of zeroed blocks, returning its directory block.
+     */
+    uint32_t FileSystem::createTable(std::shared_ptr<SuperBlock> superblock_ptr, uint32_t blocks)
     {
-        std::array<uint32_t,9> addr = inode_ptr->addr();
-        std::vector<uint32_t> blocks{addr.begin(), addr.end()};
-        uint16_t depth = static_cast<uint16_t>(inode_ptr->filesize());
-        return this->getBlocks(blocks, depth);
+        if(blocks == 0 || blocks > 255)
+        {
+            throw std::invalid_argument("A table needs between 1 and 255 blocks, not " + std::to_string(blocks));
+        }
+        std::vector<uint32_t> blockIdxs = this->allocateDataBlocks(superblock_ptr, blocks + 1);
+        std::shared_ptr<Block> block_ptr = this->getBlock(blockIdxs[0]);
+        std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+        intArray[0] = blocks;
+        std::copy(blockIdxs.begin() + 1, blockIdxs.end(), intArray.begin() + 1);
+        return blockIdxs[0];
     }
-    std::vector<std::vector<uint32_t>> FileSystem::getBlocks(std::vector<uint32_t> blocks, uint16_t depth)
+    /**
+     * Creates the reference count table and the hash index of the image if it has none yet;
+     * frees check reference counts from then on.
+     */
+    void FileSystem::createRefcounts(std::shared_ptr<BootBlock> bootblock_ptr)
     {
-        std::vector<std::vector<uint32_t>> result;
-        std::vector<uint32_t> top;
-        for(auto block : blocks)
+        if(bootblock_ptr->refcounts() != 0)
         {
-            if(block != 0)
+            return;
+        }
+        // one 16-bit count per block of the file system, one index slot per 8 bytes
+        auto countBlocks = (this->TOTAL_BLOCKS + 511) / 512;
+        auto indexBlocks = std::min<uint32_t>(255, (this->DATA_BLOCKS + 63) / 64);
+        if(countBlocks > 255)
+        {
+            throw std::runtime_error("File system of " + std::to_string(this->TOTAL_BLOCKS) 
+                + " blocks is too large for a reference count table!");
+        }
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        bootblock_ptr->refcounts(this->createTable(superblock_ptr, countBlocks));
+        bootblock_ptr->hashIndex(this->createTable(superblock_ptr, indexBlocks));
+        this->_refcounted = true;
+        std::cout << "Created reference count table of " << countBlocks << " blocks and hash index of " 
+            << indexBlocks << " blocks" << std::endl;
+    }
+    /**
+     * What a snapshot points at instead of blockIdx, the root of a tree with depth levels of indirect blocks.
+     * Data blocks are shared, taking one more reference, since commands copy shared blocks before modifying them.
+     * Everything else is modified in place, so it is copied: indirect blocks, data blocks when copy is set,
+     * and the fragment block tail, whose free slots other files fill. copies maps blocks to their copies.
+     */
+    uint32_t FileSystem::freezeBlock(BlockTable& refcounts, uint32_t blockIdx, uint16_t depth, bool copy, uint32_t tail,
+        std::unordered_map<uint32_t, uint32_t>& copies)
+    {
+        if(blockIdx == 0 || blockIdx == CLUSTER_TAG)
+        {
+            return blockIdx;
+        }
+        if(depth == 0 && !copy && blockIdx != tail && refcounts.counter(blockIdx) < 0xFFFF)
+        {
+            ++refcounts.counter(blockIdx);
+            return blockIdx;
+        }
+        auto found = copies.find(blockIdx);
+        if(found != copies.end())
+        {
+            return found->second;
+        }
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        auto copyIdx = this->allocateDataBlock(superblock_ptr);
+        superblock_ptr.reset();
+        std::shared_ptr<Block> copy_ptr = this->getBlock(copyIdx);
+        copy_ptr->asBytes() = this->getBlock(blockIdx)->asBytes();
+        if(depth > 0)
+        {
+            for(auto& child : copy_ptr->asIntegers())
             {
-                top.push_back(block);
+                child = this->freezeBlock(refcounts, child, depth - 1, copy, tail, copies);
             }
         }
-        result.push_back(top);
-        if(depth < 0)
+        else if(copy || blockIdx == tail)
         {
-            throw std::runtime_error("Depth of " + std::to_string(depth) + " is invalid!");
+            copy_ptr->markMetadata();
         }
-        if(depth != 0)
+        copies[blockIdx] = copyIdx;
+        return copyIdx;
+    }
+    /**
+     * Appends blockIdx and the blocks of the tree below it, with depth levels of indirect blocks, to result,
+     * leaving out the fragment block tail.
+     */
+    void FileSystem::appendTreeBlocks(uint32_t blockIdx, uint16_t depth, uint32_t tail, std::vector<uint32_t>& result)
+    {
+        if(blockIdx == 0 || blockIdx == CLUSTER_TAG || blockIdx == tail)
         {
-            std::vector<std::vector<uint32_t>> levels;
-            for(uint32_t level = 0; level < depth; level++)
+            return;
+        }
+        if(depth > 0)
+        {
+            std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+            for(auto child : block_ptr->asIntegers())
             {
-                std::vector<uint32_t> blockIdxs;
-                levels.push_back(blockIdxs);
+                this->appendTreeBlocks(child, depth - 1, tail, result);
             }
-            for(auto blockIdx : blocks)
+        }
+        result.push_back(blockIdx);
+    }
+    // pre-order blocks of a tree with their depths, for defrag; holes, cluster tags and the packed tail are left out
+    void FileSystem::appendTreeLayout(uint32_t blockIdx, uint16_t depth, uint64_t first, uint64_t tail,
+        std::vector<std::pair<uint32_t, uint16_t>>& result)
+    {
+        if(blockIdx < this->DATA_BLOCK_IDX || blockIdx >= this->OUT_OF_BOUNDS || (depth == 0 && first == tail))
+        {
+            return;
+        }
+        result.emplace_back(blockIdx, depth);
+        if(depth == 0)
+        {
+            return;
+        }
+        std::array<uint32_t, 256> children = this->getBlock(blockIdx)->asIntegers();
+        auto span = this->blockSpan(depth - 1) / 1024;
+        for(uint64_t child = 0; child < 256; ++child)
+        {
+            this->appendTreeLayout(children[child], depth - 1, first + child * span, tail, result);
+        }
+    }
+    /**
+     * Copies the blocks of an i-node's tree that defrag moves to their new places, and points the i-node and the
+     * moved indirect blocks at them. An indirect block that stays has nothing moved below it. The old blocks are
+     * left as they were.
+     */
+    void FileSystem::moveBlocks(std::shared_ptr<INode> inode_ptr, const std::vector<std::pair<uint32_t, uint16_t>>& layout,
+        const std::unordered_map<uint32_t, uint32_t>& moves)
+    {
+        auto moved = [&moves](uint32_t blockIdx) {
+            auto found = moves.find(blockIdx);
+            return found == moves.end() ? blockIdx : found->second;
+        };
+        for(auto& entry : layout)
+        {
+            auto found = moves.find(entry.first);
+            if(found == moves.end())
             {
-                if(blockIdx == 0)
+                continue;
+            }
+            if(entry.second == 0)
+            {
+                // file data is written home directly, as cpin writes it, never through the journal
+                std::array<uint8_t, 1024> bytes;
+                if(preadFully(this->_fd, bytes.data(), 1024, 1024ull * entry.first) != 1024
+                    || pwriteFully(this->_fd, bytes.data(), 1024, 1024ull * found->second) != 1024)
                 {
-                    continue;
+                    throw std::runtime_error("Failed to move block " + std::to_string(entry.first));
                 }
-                auto block_ptr = this->getBlock(blockIdx);
-                std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
-                std::vector<uint32_t> intermediate{intArray.begin(), intArray.end()};
-                // std::copy_n(intArray.begin(), 256, intermediate.begin());
-                std::vector<std::vector<uint32_t>> nextBlocks = this->getBlocks(intermediate, depth - 1);
-                for(uint32_t level = 0; level < depth; level++)
+                continue;
+            }
+            std::shared_ptr<Block> block_ptr = this->getBlock(entry.first);
+            std::shared_ptr<Block> copy_ptr = this->getBlock(found->second);
+            std::array<uint32_t, 256> children = block_ptr->asIntegers();
+            std::transform(children.begin(), children.end(), children.begin(), moved);
+            copy_ptr->asIntegers() = children;
+        }
+        auto addr = inode_ptr->addr();
+        std::transform(addr.begin(), addr.end(), addr.begin(), moved);
+        inode_ptr->addr(addr);
+    }
+    /**
+     * Collects the blocks on the free list, and apart from them those holding the rest of it, along the walk of
+     * FileSystem::takeFreeBlocks. False if the list is damaged. The allocator lock is held.
+     */
+    bool FileSystem::readFreeList(std::shared_ptr<SuperBlock> superblock_ptr, std::vector<uint32_t>& blockIdxs,
+        std::vector<uint32_t>& chain)
+    {
+        std::vector<bool> seen(this->TOTAL_BLOCKS, false);
+        auto take = [this, &seen](uint32_t blockIdx) {
+            if(blockIdx < this->DATA_BLOCK_IDX || blockIdx >= this->OUT_OF_BOUNDS || seen[blockIdx])
+            {
+                return false;
+            }
+            seen[blockIdx] = true;
+            return true;
+        };
+        auto freeArray = superblock_ptr->free();
+        uint32_t nfree = superblock_ptr->nfree();
+        if(nfree > 250)
+        {
+            return false;
+        }
+        // a block is never taken twice, so a chain that loops ends here too
+        while(true)
+        {
+            for(uint32_t i = 1; i <= nfree; ++i)
+            {
+                if(!take(freeArray[i]))
                 {
-                    for(auto nextBlockIdx : nextBlocks[level])
-                    {
-                        levels[level].push_back(nextBlockIdx);
-                    }
+                    return false;
                 }
+                blockIdxs.push_back(freeArray[i]);
             }
-            for(auto vec : levels)
+            auto nextDataBlockIdx = freeArray[0];
+            if(nextDataBlockIdx == 0)
             {
-                result.push_back(vec);
+                return true;
+            }
+            if(!take(nextDataBlockIdx))
+            {
+                return false;
             }
+            chain.push_back(nextDataBlockIdx);
+            std::shared_ptr<Block> block_ptr = this->getBlock(nextDataBlockIdx);
+            std::copy_n(block_ptr->asIntegers().begin(), 251, freeArray.begin());
+            nfree = 250;
         }
-        return result;
     }
-    std::shared_ptr<Block> FileSystem::getBlockForAddress(std::shared_ptr<INode> inode_ptr, uint64_t address)
+    /**
+     * Replaces the free list with blockIdxs, which are handed out lowest first from then on, so blocks allocated
+     * together are adjacent; chain lists those of them that held the old list. Without a journal those are zeroed
+     * and the list is filled in from the top down. With one, a block that held the list has its images in the
+     * journal, so it either holds the new list, which takeFreeBlocks never hands out, or is released through the
+     * journal; blocks that hold it are then the highest. The allocator lock is held.
+     */
+    void FileSystem::sortFreeList(std::shared_ptr<SuperBlock> superblock_ptr, std::vector<uint32_t> blockIdxs,
+        const std::vector<uint32_t>& chain)
     {
-        if(inode_ptr->filesize() == FileSize::SMALL)
+        // the last block returned is the first taken
+        std::sort(blockIdxs.begin(), blockIdxs.end(), std::greater<uint32_t>());
+        if(!this->_journal)
         {
-            auto addr = inode_ptr->addr();
-            auto blockIdx = addr[address/1024];
-            std::cout << "Fetching block " << blockIdx << std::endl;
-            std::cout << std::to_string(this->getBlock(blockIdx)->asBytes()[0]) << std::endl;
-            return this->getBlock(blockIdx);
+            for(auto blockIdx : chain)
+            {
+                std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+                std::fill(block_ptr->asIntegers().begin(), block_ptr->asIntegers().end(), 0);
+            }
         }
         else
         {
-            throw std::runtime_error("Medium/Large/Massive files in i-nodes not supported yet!");
+            // returnFreeBlocks puts every 251st block it is given in charge of the 250 before it
+            std::vector<uint32_t> holders{chain};
+            std::sort(holders.begin(), holders.end(), std::greater<uint32_t>());
+            auto total = blockIdxs.size();
+            while(holders.size() > total / 251)
+            {
+                this->_journal->free(holders.back());
+                holders.pop_back();
+                --total;
+            }
+            std::unordered_set<uint32_t> old{chain.begin(), chain.end()};
+            std::vector<uint32_t> entries;
+            entries.reserve(total);
+            for(auto blockIdx : blockIdxs)
+            {
+                if(old.count(blockIdx) == 0)
+                {
+                    entries.push_back(blockIdx);
+                }
+            }
+            uint64_t next = 0;
+            for(; holders.size() < total / 251; ++next)
+            {
+                holders.push_back(entries[next]);
+            }
+            blockIdxs.clear();
+            for(uint64_t holder = 0; next < entries.size(); ++next)
+            {
+                blockIdxs.push_back(entries[next]);
+                if((blockIdxs.size() + 1) % 251 == 0 && holder < holders.size())
+                {
+                    blockIdxs.push_back(holders[holder++]);
+                }
+            }
         }
+        auto freeArray = superblock_ptr->free();
+        std::fill(freeArray.begin(), freeArray.end(), 0);
+        superblock_ptr->free(freeArray);
+        superblock_ptr->nfree(0);
+        this->returnFreeBlocks(superblock_ptr, blockIdxs);
     }
-    void FileSystem::quit()
+    /**
+     * Commits the journal and puts magazines and the blocks the journal released back on the free list,
+     * so the free list accounts for every free block. _fsLock is held exclusively.
+     */
+    void FileSystem::settle()
     {
-        std::cout << "mod-v6 file system shutting down gracefully" << std::endl;
+        if(this->_journal)
+        {
+            this->_journal->commit();
+        }
+        JournalOperation operation{*this};
+        this->flushMagazines();
     }
-    void FileSystem::openfs(const std::string& filename)
+    /**
+     * The directory block of a table followed by the blocks it lists, empty if they are not all data blocks.
+     */
+    std::vector<uint32_t> FileSystem::tableBlocks(uint32_t directoryIdx, const std::string& name, Scan& scan)
     {
-        std::cout << "Executing openfs " << filename << std::endl;
-        auto existed_before = access(filename.c_str(), F_OK) != -1;
-        auto fd = open(filename.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-        auto accessible = fd != -1;
-        auto exists = access(filename.c_str(), F_OK) != -1;
-        if(!exists)
+        if(directoryIdx < this->DATA_BLOCK_IDX || directoryIdx >= this->OUT_OF_BOUNDS)
         {
-            std::cout << "Did not open FileSystem at " << filename 
-                << " since file could not be created" << std::endl;
+            scan.problems.push_back("The " + name + " is at block " + std::to_string(directoryIdx)
+                + ", which is not a data block");
+            return {};
         }
-        else if(!accessible)
+        std::shared_ptr<Block> block_ptr = this->getBlock(directoryIdx);
+        std::array<uint32_t, 256>& directory = block_ptr->asIntegers();
+        if(directory[0] == 0 || directory[0] > 255)
         {
-            std::cout << "Did not open FileSystem at " << filename 
-                << " since file could not be accessed" << std::endl;
+            scan.problems.push_back("The " + name + " claims to have " + std::to_string(directory[0]) + " blocks");
+            return {};
         }
-        else if(!existed_before)
+        std::vector<uint32_t> result{directoryIdx};
+        for(uint32_t n = 1; n <= directory[0]; ++n)
         {
-            reset();
-            this->_fd = fd;
+            if(directory[n] < this->DATA_BLOCK_IDX || directory[n] >= this->OUT_OF_BOUNDS)
+            {
+                scan.problems.push_back("The " + name + " lists block " + std::to_string(directory[n])
+                    + ", which is not a data block");
+                return {};
+            }
+            result.push_back(directory[n]);
         }
-        else if(existed_before)
+        return result;
+    }
+    /**
+     * Claims blockIdx, a data block, and the tree below it with depth levels of indirect blocks for fsck; first is
+     * the logical block it starts at. The packed tail is noted instead, as its fragment block is shared. Pointers
+     * outside the data blocks are a problem, which repairing turns into holes.
+     */
+    void FileSystem::checkTree(BlockUsage& usage, uint32_t blockIdx, uint16_t depth, uint64_t first, Scan& scan)
+    {
+        if(depth == 0 && first == scan.tail)
         {
-            reset();
-            this->_fd = fd;
-            std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
-            this->setDimensions(superblock_ptr->fsize(), superblock_ptr->isize());
+            scan.fragment = blockIdx;
+            return;
         }
-        else
+        usage.claim(blockIdx);
+        if(depth == 0)
         {
-            std::cout << "This should be impossible!" << std::endl;
+            if(first < scan.leaves.size())
+            {
+                scan.leaves[first] = blockIdx;
+            }
+            return;
         }
-        // this will overwrite the first filename.size() characters in the file
-        // write(fd, filename.c_str(), filename.size());
-        
-        std::cout << "Obtained file descriptor: " << fd << std::endl;
+        std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+        std::array<uint32_t, 256>& children = block_ptr->asIntegers();
+        auto span = this->blockSpan(depth - 1) / 1024;
+        uint32_t outside = 0;
+        for(uint64_t child = 0; child < 256; ++child)
+        {
+            if(children[child] == 0 || (depth == 1 && children[child] == CLUSTER_TAG))
+            {
+                continue;
+            }
+            if(children[child] < this->DATA_BLOCK_IDX || children[child] >= this->OUT_OF_BOUNDS)
+            {
+                ++outside;
+                if(scan.repair)
+                {
+                    children[child] = 0;
+                }
+                continue;
+            }
+            this->checkTree(usage, children[child], depth - 1, first + child * span, scan);
+        }
+        if(outside != 0)
+        {
+            scan.problems.push_back(scan.owner + " has " + std::to_string(outside) + " pointers in indirect block "
+                + std::to_string(blockIdx) + " that are not data blocks");
+            scan.repaired += scan.repair;
+        }
+    }
+    /**
+     * Walks the blocks of an i-node for fsck, and for a directory of the image (owner 0) collects its entries.
+     * A snapshot's i-nodes have the snapshot's list entry + 1 as owner.
+     */
+    void FileSystem::checkINode(BlockUsage& usage, std::shared_ptr<INode> inode_ptr, uint32_t inodeIdx, uint32_t owner,
+        Scan& scan)
+    {
+        if(!inode_ptr->allocated())
+        {
+            return;
+        }
+        ++scan.inodes;
+        if(inode_ptr->inlined())
+        {
+            return;
+        }
+        auto size = inode_ptr->size();
+        auto depth = static_cast<uint16_t>(inode_ptr->filesize());
+        auto span = this->blockSpan(depth) / 1024;
+        auto directory = owner == 0 && inode_ptr->filetype() == FileType::DIRECTORY;
+        scan.tail = inode_ptr->tailPacked() && size != 0 ? (size - 1) / 1024 : UINT64_MAX;
+        scan.fragment = 0;
+        scan.leaves.assign(directory ? this->blocksForSize(size) : 0, 0);
+        auto addr = inode_ptr->addr();
+        for(uint64_t n = 0; n < addr.size(); ++n)
+        {
+            if(addr[n] == 0 || (depth == 0 && addr[n] == CLUSTER_TAG))
+            {
+                continue;
+            }
+            if(addr[n] < this->DATA_BLOCK_IDX || addr[n] >= this->OUT_OF_BOUNDS)
+            {
+                scan.problems.push_back(scan.owner + " points at block " + std::to_string(addr[n]) + " for logical block "
+                    + std::to_string(n * span) + ", which is not a data block");
+                if(scan.repair)
+                {
+                    addr[n] = 0;
+                    inode_ptr->addr(addr);
+                    ++scan.repaired;
+                }
+                continue;
+            }
+            this->checkTree(usage, addr[n], depth, n * span, scan);
+        }
+        if(inode_ptr->tailPacked() && scan.fragment == 0)
+        {
+            scan.problems.push_back(scan.owner + " has a packed tail but no fragment block");
+            if(scan.repair)
+            {
+                inode_ptr->tailPacked(false);
+                inode_ptr->tailSlot(0);
+                ++scan.repaired;
+            }
+        }
+        else if(inode_ptr->tailPacked())
+        {
+            auto slots = static_cast<uint16_t>((size % 1024 + 31) / 32);
+            scan.tails.push_back(Scan::Tail{owner, scan.fragment, inode_ptr->tailSlot(), slots, inodeIdx});
+        }
+        for(uint64_t n = 0; n < scan.leaves.size(); ++n)
+        {
+            if(scan.leaves[n] == 0)
+            {
+                continue;
+            }
+            std::array<std::shared_ptr<File>, 32> file_ptrs = this->getFiles(scan.leaves[n]);
+            auto count = std::min<uint64_t>(32, size / 32 - n * 32);
+            for(uint64_t i = 0; i < count; ++i)
+            {
+                auto name = file_ptrs[i]->name();
+                auto childIdx = file_ptrs[i]->inode();
+                if(name.empty() && childIdx != 0)
+                {
+                    scan.problems.push_back(scan.owner + " has an entry without a name for i-node " 
+                        + std::to_string(childIdx));
+                }
+                else if(!name.empty() && name != "." && name != "..")
+                {
+                    scan.entries.push_back(Scan::Entry{inodeIdx, name, childIdx});
+                }
+            }
+        }
+    }
+    /**
+     * Claims for fsck the blocks of the boot block tables, then on a thread pool those under every i-node of the image
+     * and of its snapshots, in shards of a few i-node blocks. A snapshot whose table is damaged is dropped
+     * when repairing; its blocks are then reclaimed like any other unclaimed block.
+     */
+    FileSystem::Scan FileSystem::scanImage(BlockUsage& usage, bool repair)
+    {
+        struct Table
+        {
+        public:
+            uint32_t owner;
+            std::string label;
+            std::vector<uint32_t> blocks;
+        };
+        Scan result{};
+        result.repair = repair;
+        result.types.assign(this->INODE_BLOCKS * 16ull, 0);
+        result.nlinks.assign(this->INODE_BLOCKS * 16ull, 0);
+        std::vector<Table> tables{Table{0, "", {}}};
+        for(uint32_t n = 0; n < this->INODE_BLOCKS; ++n)
+        {
+            tables[0].blocks.push_back(this->INODE_BLOCK_IDX + n);
+        }
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        if(bootblock_ptr->valid())
+        {
+            std::vector<uint32_t> claimed;
+            if(bootblock_ptr->refcounts() != 0)
+            {
+                auto blocks = this->tableBlocks(bootblock_ptr->refcounts(), "reference count table", result);
+                result.refcounts = blocks.empty() ? 0 : blocks[0];
+                claimed.insert(claimed.end(), blocks.begin(), blocks.end());
+            }
+            if(bootblock_ptr->hashIndex() != 0)
+            {
+                auto blocks = this->tableBlocks(bootblock_ptr->hashIndex(), "hash index", result);
+                result.hashIndex = blocks.empty() ? 0 : blocks[0];
+                claimed.insert(claimed.end(), blocks.begin(), blocks.end());
+            }
+            auto listIdx = bootblock_ptr->snapshots();
+            if(listIdx != 0 && (listIdx < this->DATA_BLOCK_IDX || listIdx >= this->OUT_OF_BOUNDS))
+            {
+                result.problems.push_back("The snapshot list is at block " + std::to_string(listIdx)
+                    + ", which is not a data block");
+                if(repair)
+                {
+                    bootblock_ptr->snapshots(0);
+                    ++result.repaired;
+                }
+            }
+            else if(listIdx != 0)
+            {
+                claimed.push_back(listIdx);
+                SnapshotList list{this->getBlock(listIdx)};
+                for(uint32_t entry = 0; entry < SnapshotList::ENTRIES; ++entry)
+                {
+                    if(!list.used(entry))
+                    {
+                        continue;
+                    }
+                    auto name = "i-node table of snapshot " + list.name(entry);
+                    auto blocks = this->tableBlocks(list.table(entry), name, result);
+                    if(!blocks.empty() && blocks.size() - 1 != this->INODE_BLOCKS)
+                    {
+                        result.problems.push_back("The " + name + " has " + std::to_string(blocks.size() - 1)
+                            + " blocks, the image has " + std::to_string(this->INODE_BLOCKS) + " i-node blocks");
+                        blocks.clear();
+                    }
+                    if(blocks.empty())
+                    {
+                        if(repair)
+                        {
+                            std::cout << "Dropping snapshot " << list.name(entry) << std::endl;
+                            list.clear(entry);
+                            ++result.repaired;
+                        }
+                        continue;
+                    }
+                    claimed.insert(claimed.end(), blocks.begin(), blocks.end());
+                    tables.push_back(Table{entry + 1, " of snapshot " + list.name(entry), {blocks.begin() + 1, blocks.end()}});
+                }
+            }
+            for(auto blockIdx : claimed)
+            {
+                usage.claim(blockIdx);
+            }
+        }
+        bootblock_ptr.reset();
+        ThreadPool pool{std::thread::hardware_concurrency()};
+        // several shards per thread, so one full of large files does not hold up the rest
+        std::vector<std::tuple<const Table*, uint32_t, uint32_t>> ranges;
+        for(auto& table : tables)
+        {
+            auto blocks = static_cast<uint32_t>(table.blocks.size());
+            auto shard = std::max<uint32_t>(1, blocks / (4 * std::max<uint32_t>(1, pool.size())));
+            for(uint32_t begin = 0; begin < blocks; begin += shard)
+            {
+                ranges.emplace_back(&table, begin, std::min(blocks, begin + shard));
+            }
+        }
+        std::vector<Scan> shards(ranges.size());
+        std::cout << "Scanning " << ranges.size() << " shards of i-node blocks on " << pool.size() << " threads" << std::endl;
+        for(uint64_t i = 0; i < ranges.size(); ++i)
+        {
+            pool.submit([this, &usage, &result, &ranges, &shards, i]() {
+                const Table& table = *std::get<0>(ranges[i]);
+                Scan& shard = shards[i];
+                shard.repair = result.repair;
+                try
+                {
+                    for(auto n = std::get<1>(ranges[i]); n < std::get<2>(ranges[i]); ++n)
+                    {
+                        std::shared_ptr<Block> block_ptr = this->getBlock(table.blocks[n]);
+                        for(uint32_t offset = 0; offset < 16; ++offset)
+                        {
+                            auto inodeIdx = n * 16 + offset;
+                            std::shared_ptr<INode> inode_ptr{new INode(block_ptr, offset)};
+                            if(table.owner == 0 && inode_ptr->allocated())
+                            {
+                                // every shard has i-nodes of its own
+                                result.types[inodeIdx] = 1 + static_cast<uint8_t>(inode_ptr->filetype());
+                                result.nlinks[inodeIdx] = inode_ptr->nlinks();
+                            }
+                            shard.owner = "I-node " + std::to_string(inodeIdx) + table.label;
+                            this->checkINode(usage, inode_ptr, inodeIdx, table.owner, shard);
+                        }
+                    }
+                }
+                catch(...)
+                {
+                    shard.error = std::current_exception();
+                }
+            });
+        }
+        pool.wait();
+        for(auto& shard : shards)
+        {
+            if(shard.error)
+            {
+                std::rethrow_exception(shard.error);
+            }
+            result.entries.insert(result.entries.end(), shard.entries.begin(), shard.entries.end());
+            result.tails.insert(result.tails.end(), shard.tails.begin(), shard.tails.end());
+            result.problems.insert(result.problems.end(), shard.problems.begin(), shard.problems.end());
+            result.inodes += shard.inodes;
+            result.repaired += shard.repaired;
+        }
+        return result;
+    }
+    /**
+     * Checks for fsck that the directory tree reaches every allocated i-node of the image, that its entries point at
+     * allocated i-nodes and that link counts match them. Repairing removes bad entries and notes what the tree does
+     * not reach for linkLost. Returns how many entries were removed, after which blocks have to be claimed again.
+     */
+    uint64_t FileSystem::checkDirectories(Scan& scan)
+    {
+        const auto DIRECTORY = 1 + static_cast<uint8_t>(FileType::DIRECTORY);
+        auto total = scan.types.size();
+        if(total == 0 || scan.types[0] != DIRECTORY)
+        {
+            scan.problems.push_back("The root i-node is not a directory, the directory tree cannot be checked");
+            return 0;
+        }
+        std::vector<std::vector<uint64_t>> byDirectory(total);
+        for(uint64_t e = 0; e < scan.entries.size(); ++e)
+        {
+            byDirectory[scan.entries[e].directory].push_back(e);
+        }
+        std::vector<uint32_t> named(total, 0);
+        std::vector<std::string> paths(total);
+        std::vector<uint64_t> orphans;
+        paths[0] = "/";
+        std::vector<uint32_t> reached{0};
+        for(uint64_t next = 0; next < reached.size(); ++next)
+        {
+            auto directoryIdx = reached[next];
+            for(auto e : byDirectory[directoryIdx])
+            {
+                auto& entry = scan.entries[e];
+                auto path = paths[directoryIdx] + entry.name;
+                if(entry.inodeIdx >= total || scan.types[entry.inodeIdx] == 0)
+                {
+                    scan.problems.push_back("Entry " + path + " points at i-node " + std::to_string(entry.inodeIdx)
+                        + ", which is not allocated");
+                    orphans.push_back(e);
+                    continue;
+                }
+                ++named[entry.inodeIdx];
+                if(entry.inodeIdx == 0 || !paths[entry.inodeIdx].empty())
+                {
+                    continue;
+                }
+                paths[entry.inodeIdx] = path;
+                if(scan.types[entry.inodeIdx] == DIRECTORY)
+                {
+                    paths[entry.inodeIdx] += "/";
+                    reached.push_back(entry.inodeIdx);
+                }
+            }
+        }
+        std::vector<uint32_t> unreached;
+        for(uint32_t inodeIdx = 0; inodeIdx < total; ++inodeIdx)
+        {
+            if(scan.types[inodeIdx] == 0)
+            {
+                continue;
+            }
+            if(paths[inodeIdx].empty())
+            {
+                unreached.push_back(inodeIdx);
+                continue;
+            }
+            // a directory also has its . entry and the .. entry of its parent's, the root counts / instead
+            auto expected = named[inodeIdx] + (scan.types[inodeIdx] == DIRECTORY ? 2 : 0) + (inodeIdx == 0);
+            if(scan.nlinks[inodeIdx] != expected)
+            {
+                scan.problems.push_back("I-node " + std::to_string(inodeIdx) + " (" + paths[inodeIdx] + ") has "
+                    + std::to_string(scan.nlinks[inodeIdx]) + " links, its entries make " + std::to_string(expected));
+                if(scan.repair)
+                {
+                    this->getINode(inodeIdx)->nlinks(expected);
+                    ++scan.repaired;
+                }
+            }
+        }
+        // what is unreached is reported on the next pass, once the bad entries are gone
+        if(scan.repair && !orphans.empty())
+        {
+            unreached.clear();
+        }
+        // only the tops of what went missing are relinked, the rest is reached through them again
+        std::vector<bool> below(total, false);
+        for(auto inodeIdx : unreached)
+        {
+            for(auto e : byDirectory[inodeIdx])
+            {
+                if(scan.entries[e].inodeIdx < total)
+                {
+                    below[scan.entries[e].inodeIdx] = true;
+                }
+            }
+        }
+        for(auto inodeIdx : unreached)
+        {
+            scan.problems.push_back("I-node " + std::to_string(inodeIdx) + " is allocated, but no directory reaches it");
+            if(!below[inodeIdx])
+            {
+                scan.lost.push_back(inodeIdx);
+            }
+        }
+        if(!scan.repair)
+        {
+            return 0;
+        }
+        uint64_t changed = 0;
+        for(auto e : orphans)
+        {
+            auto& entry = scan.entries[e];
+            if(this->unlinkFile(this->getINode(entry.directory), entry.inodeIdx))
+            {
+                ++changed;
+                ++scan.repaired;
+            }
+        }
+        return changed;
+    }
+    /**
+     * Links the tops of what the directory tree does not reach into /lost+found for fsck, named by their i-nodes.
+     * This allocates, so it only runs once the free list has been checked. Returns how many were linked.
+     */
+    uint64_t FileSystem::linkLost(Scan& scan)
+    {
+        if(!scan.repair || scan.lost.empty())
+        {
+            return 0;
+        }
+        int64_t lostIdx = this->findEntry(this->getINode(0), "lost+found");
+        if(lostIdx == -1)
+        {
+            lostIdx = this->createDirectory("lost+found", 0);
+        }
+        else if(this->getINode(lostIdx)->filetype() != FileType::DIRECTORY)
+        {
+            std::cout << "/lost+found is not a directory, leaving " << scan.lost.size() << " unreachable i-nodes alone"
+                << std::endl;
+            return 0;
+        }
+        uint64_t changed = 0;
+        for(auto inodeIdx : scan.lost)
+        {
+            auto name = "#" + std::to_string(inodeIdx);
+            if(this->findEntry(this->getINode(lostIdx), name) != -1)
+            {
+                continue;
+            }
+            this->linkFile(name, lostIdx, inodeIdx);
+            auto inode_ptr = this->getINode(inodeIdx);
+            if(inode_ptr->filetype() == FileType::DIRECTORY)
+            {
+                for(auto file_ptr : this->getFilesForINode(inode_ptr))
+                {
+                    if(file_ptr->name() == "..")
+                    {
+                        file_ptr->inode(lostIdx);
+                    }
+                }
+            }
+            std::cout << "Linked i-node " << inodeIdx << " as /lost+found/" << name << std::endl;
+            ++changed;
+            ++scan.repaired;
+        }
+        return changed;
+    }
+    /**
+     * Claims each fragment block once for fsck, however many packed tails are in it, and checks that the header of each
+     * of the image's marks exactly the slots of its tails. A snapshot's copy keeps the header it had when it was taken.
+     */
+    void FileSystem::checkFragments(BlockUsage& usage, Scan& scan)
+    {
+        auto hex = [](uint32_t value) {
+            std::ostringstream out;
+            out << "0x" << std::hex << value;
+            return out.str();
+        };
+        std::map<std::pair<uint32_t, uint32_t>, std::vector<const Scan::Tail*>> fragments;
+        for(auto& tail : scan.tails)
+        {
+            fragments[{tail.owner, tail.fragment}].push_back(&tail);
+        }
+        for(auto& fragment : fragments)
+        {
+            auto fragmentIdx = fragment.first.second;
+            usage.claim(fragmentIdx);
+            if(fragment.first.first != 0)
+            {
+                continue;
+            }
+            uint32_t used = 1;
+            for(auto tail_ptr : fragment.second)
+            {
+                auto where = "The packed tail of i-node " + std::to_string(tail_ptr->inodeIdx) + " in fragment block "
+                    + std::to_string(fragmentIdx);
+                if(tail_ptr->slot == 0 || tail_ptr->slots == 0 || tail_ptr->slot + tail_ptr->slots > 32)
+                {
+                    scan.problems.push_back(where + " starts at slot " + std::to_string(tail_ptr->slot)
+                        + ", so its " + std::to_string(tail_ptr->slots) + " slots do not fit");
+                    continue;
+                }
+                uint32_t mask = ((1u << tail_ptr->slots) - 1) << tail_ptr->slot;
+                if((used & mask) != 0)
+                {
+                    scan.problems.push_back(where + " overlaps another tail");
+                }
+                used |= mask;
+            }
+            std::shared_ptr<Block> block_ptr = this->getBlock(fragmentIdx);
+            std::array<uint32_t, 256>& header = block_ptr->asIntegers();
+            if(header[0] != FRAGMENT_MAGIC || header[1] != used)
+            {
+                scan.problems.push_back("Fragment block " + std::to_string(fragmentIdx) + " marks slots " + hex(header[1])
+                    + " as used, its tails use " + hex(used));
+                if(scan.repair)
+                {
+                    header[0] = FRAGMENT_MAGIC;
+                    header[1] = used;
+                    ++scan.repaired;
+                }
+            }
+        }
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        auto fragmentIdx = bootblock_ptr->fragment();
+        if(bootblock_ptr->valid() && fragmentIdx != 0 && fragments.find({0, fragmentIdx}) == fragments.end())
+        {
+            scan.problems.push_back("The boot block has tails packed into block " + std::to_string(fragmentIdx)
+                + ", which holds none");
+            if(scan.repair)
+            {
+                bootblock_ptr->fragment(0);
+                ++scan.repaired;
+            }
+        }
+    }
+    /**
+     * Compares for fsck the claims on every data block with the free list and the reference counts. Repairing rebuilds
+     * the free list from the blocks nobody claims, zeroing those that were not on it, and sets reference counts to the
+     * claims; a block claimed more than once gets a count where there was none, so the next write copies it.
+     */
+    void FileSystem::checkBlocks(BlockUsage& usage, Scan& scan)
+    {
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        auto data = [this](uint32_t blockIdx) {
+            return blockIdx >= this->DATA_BLOCK_IDX && blockIdx < this->OUT_OF_BOUNDS;
+        };
+        // found on the free list, fixed by rebuilding it, and found in the reference counts or the hash index
+        std::vector<std::string> listed;
+        std::vector<std::string> counted;
+        std::vector<uint32_t> chain;
+        auto freeArray = superblock_ptr->free();
+        uint32_t nfree = superblock_ptr->nfree();
+        if(nfree > 250)
+        {
+            listed.push_back("The superblock claims to list " + std::to_string(nfree) + " free blocks");
+            nfree = 250;
+        }
+        // the walk of FileSystem::takeFreeBlocks; a damaged chain could loop, it cannot be longer than the data blocks
+        for(uint32_t length = 0; length <= this->DATA_BLOCKS; ++length)
+        {
+            for(uint32_t i = 1; i <= nfree; ++i)
+            {
+                if(!data(freeArray[i]))
+                {
+                    listed.push_back("The free list has block " + std::to_string(freeArray[i])
+                        + ", which is not a data block");
+                }
+                else if(!usage.list(freeArray[i]))
+                {
+                    listed.push_back("The free list has block " + std::to_string(freeArray[i]) + " twice");
+                }
+            }
+            auto nextDataBlockIdx = freeArray[0];
+            if(nextDataBlockIdx == 0)
+            {
+                break;
+            }
+            if(!data(nextDataBlockIdx) || !usage.list(nextDataBlockIdx))
+            {
+                listed.push_back("The free list goes on at block " + std::to_string(nextDataBlockIdx)
+                    + ", which is not a data block or was listed already");
+                break;
+            }
+            chain.push_back(nextDataBlockIdx);
+            std::shared_ptr<Block> block_ptr = this->getBlock(nextDataBlockIdx);
+            std::copy_n(block_ptr->asIntegers().begin(), 251, freeArray.begin());
+            nfree = 250;
+        }
+        BlockTable refcounts{this, scan.refcounts};
+        std::vector<uint32_t> leaked;
+        std::vector<uint32_t> recount;
+        uint64_t free = 0;
+        for(auto blockIdx = this->DATA_BLOCK_IDX; blockIdx < this->OUT_OF_BOUNDS; ++blockIdx)
+        {
+            auto references = usage.references(blockIdx);
+            uint32_t count = refcounts.exists() ? refcounts.counter(blockIdx) : 0;
+            auto block = "Block " + std::to_string(blockIdx);
+            free += references == 0;
+            if(references == 0 && !usage.listed(blockIdx))
+            {
+                leaked.push_back(blockIdx);
+            }
+            if(references != 0 && usage.listed(blockIdx))
+            {
+                listed.push_back(block + " is in use and on the free list");
+            }
+            if(references > count + 1)
+            {
+                counted.push_back(block + " has " + std::to_string(references) + " owners, but "
+                    + (refcounts.exists() ? "a reference count of " + std::to_string(count) : "no reference counts"));
+            }
+            else if(references != 0 && references < count + 1)
+            {
+                counted.push_back(block + " has a reference count of " + std::to_string(count) + ", but "
+                    + std::to_string(references) + " owners");
+            }
+            else if(references == 0 && count != 0)
+            {
+                counted.push_back("Free block " + std::to_string(blockIdx) + " has a reference count of "
+                    + std::to_string(count));
+            }
+            if(std::min<uint32_t>(references == 0 ? 0 : references - 1, 0xFFFF) != count)
+            {
+                recount.push_back(blockIdx);
+            }
+        }
+        if(!leaked.empty())
+        {
+            std::string first;
+            for(uint64_t i = 0; i < std::min<uint64_t>(leaked.size(), 8); ++i)
+            {
+                first += " " + std::to_string(leaked[i]);
+            }
+            listed.push_back(std::to_string(leaked.size()) + " blocks are neither in use nor free:" + first
+                + (leaked.size() > 8 ? " ..." : ""));
+        }
+        uint64_t stale = 0;
+        BlockTable index{this, scan.hashIndex};
+        for(uint64_t slot = 0; slot < index.entries(); ++slot)
+        {
+            uint32_t* entry = index.entry(slot);
+            if(entry[1] != 0 && entry[1] != BlockTable::REMOVED && (!data(entry[1]) || usage.references(entry[1]) == 0))
+            {
+                ++stale;
+                if(scan.repair)
+                {
+                    entry[1] = BlockTable::REMOVED;
+                }
+            }
+        }
+        if(stale != 0)
+        {
+            counted.push_back("The hash index has " + std::to_string(stale) + " entries for blocks that are not in use");
+        }
+        scan.problems.insert(scan.problems.end(), listed.begin(), listed.end());
+        scan.problems.insert(scan.problems.end(), counted.begin(), counted.end());
+        if(!scan.repair)
+        {
+            return;
+        }
+        scan.repaired += stale != 0;
+        if(!listed.empty())
+        {
+            // blocks on the old list are zero already, apart from the ones that held the rest of it
+            leaked.insert(leaked.end(), chain.begin(), chain.end());
+            uint64_t zeroed = 0;
+            for(auto blockIdx : leaked)
+            {
+                if(usage.references(blockIdx) == 0)
+                {
+                    std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+                    std::fill(block_ptr->asBytes().begin(), block_ptr->asBytes().end(), 0);
+                    ++zeroed;
+                }
+            }
+            std::vector<uint32_t> blockIdxs;
+            blockIdxs.reserve(free);
+            for(auto blockIdx = this->OUT_OF_BOUNDS; blockIdx-- > this->DATA_BLOCK_IDX;)
+            {
+                if(usage.references(blockIdx) == 0)
+                {
+                    blockIdxs.push_back(blockIdx);
+                }
+            }
+            std::fill(freeArray.begin(), freeArray.end(), 0);
+            superblock_ptr->free(freeArray);
+            superblock_ptr->nfree(0);
+            this->returnFreeBlocks(superblock_ptr, blockIdxs);
+            std::cout << "Rebuilt the free list of " << blockIdxs.size() << " blocks, zeroing " << zeroed << std::endl;
+            scan.repaired += listed.size();
+        }
+        if(recount.empty())
+        {
+            return;
+        }
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        if(scan.refcounts == 0 && bootblock_ptr->refcounts() != 0)
+        {
+            std::cout << "The reference count table is damaged, leaving the counts alone" << std::endl;
+            return;
+        }
+        if(!bootblock_ptr->valid())
+        {
+            std::cout << "File system was initialized without extension support, cannot count references" << std::endl;
+            return;
+        }
+        this->createRefcounts(bootblock_ptr);
+        BlockTable table{this, bootblock_ptr->refcounts()};
+        for(auto blockIdx : recount)
+        {
+            auto references = usage.references(blockIdx);
+            table.counter(blockIdx) = std::min<uint32_t>(references == 0 ? 0 : references - 1, 0xFFFF);
+        }
+        std::cout << "Set the reference counts of " << recount.size() << " blocks" << std::endl;
+        scan.repaired += counted.size() - (stale != 0);
+    }
+    /**
+     * Looks for a block with exactly these contents in the dedup index, probing linearly from the hash's slot.
+     * Returns 0 if there is none, or if the match cannot take another reference.
+     */
+    uint32_t FileSystem::findDuplicate(BlockTable& index, BlockTable& refcounts, uint32_t hash, const uint8_t* bytes)
+    {
+        auto slots = index.entries();
+        for(uint64_t probe = 0, slot = hash % slots; probe < slots; ++probe, slot = (slot + 1) % slots)
+        {
+            uint32_t* entry = index.entry(slot);
+            if(entry[1] == 0)
+            {
+                return 0;
+            }
+            if(entry[1] != BlockTable::REMOVED && entry[0] == hash)
+            {
+                std::shared_ptr<Block> block_ptr = this->getBlock(entry[1]);
+                if(std::memcmp(block_ptr->asBytes().data(), bytes, 1024) == 0 && refcounts.counter(entry[1]) < 0xFFFF)
+                {
+                    return entry[1];
+                }
+            }
+        }
+        return 0;
+    }
+    // a full index simply stops learning new blocks
+    void FileSystem::indexBlock(BlockTable& index, uint32_t hash, uint32_t blockIdx)
+    {
+        auto slots = index.entries();
+        for(uint64_t probe = 0, slot = hash % slots; probe < slots; ++probe, slot = (slot + 1) % slots)
+        {
+            uint32_t* entry = index.entry(slot);
+            if(entry[1] == 0 || entry[1] == BlockTable::REMOVED)
+            {
+                entry[0] = hash;
+                entry[1] = blockIdx;
+                return;
+            }
+        }
+    }
+    void FileSystem::unindexBlock(BlockTable& index, uint32_t hash, uint32_t blockIdx)
+    {
+        auto slots = index.entries();
+        for(uint64_t probe = 0, slot = hash % slots; probe < slots; ++probe, slot = (slot + 1) % slots)
+        {
+            uint32_t* entry = index.entry(slot);
+            if(entry[1] == 0)
+            {
+                return;
+            }
+            if(entry[1] == blockIdx)
+            {
+                entry[1] = BlockTable::REMOVED;
+                return;
+            }
+        }
+    }
+    /**
+     * Recursive resize from the README, for shrinking: 
+     * blocks starting at or past newSize are collected into freed, holes are skipped.
+     */
+    uint32_t FileSystem::resizeBlock(uint32_t blockIdx, uint64_t beginAddress, uint64_t blockSize, uint64_t newSize,
+        std::vector<uint32_t>& freed)
+    {
+        if(blockSize < 1024)
+        {
+            throw std::runtime_error("Invalid block size: " + std::to_string(blockSize) + " in resize block!");
+        }
+        if(blockIdx == 0 || beginAddress + blockSize <= newSize)
+        {
+            return blockIdx;
+        }
+        if(blockIdx == CLUSTER_TAG)
+        {
+            // only marks a compressed cluster, there is no block behind it
+            return beginAddress >= newSize ? 0 : blockIdx;
+        }
+        if(blockSize > 1024)
+        {
+            std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+            std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+            auto childBlockSize = blockSize / 256;
+            for(auto child = 0; child < 256; ++child)
+            {
+                intArray[child] = this->resizeBlock(intArray[child], beginAddress + childBlockSize * child,
+                    childBlockSize, newSize, freed);
+            }
+        }
+        if(beginAddress >= newSize)
+        {
+            freed.push_back(blockIdx);
+            blockIdx = 0;
+        }
+        return blockIdx;
+    }
+    /**
+     * Physical blocks backing the given logical blocks, which must be sorted and lie within the i-node's size.
+     * Missing blocks, and any indirect blocks above them, are allocated in a single batch.
+     */
+    std::vector<uint32_t> FileSystem::mapBlocks(std::shared_ptr<INode> inode_ptr, const std::vector<uint64_t>& logicals)
+    {
+        if(inode_ptr->inlined())
+        {
+            throw std::runtime_error("Inlined i-node has no blocks to map!");
+        }
+        if(inode_ptr->tailPacked())
+        {
+            throw std::runtime_error("Tail-packed i-node must be unpacked before mapping blocks!");
+        }
+        std::vector<uint32_t> result(logicals.size(), 0);
+        if(logicals.empty())
+        {
+            return result;
+        }
+        auto depth = static_cast<uint16_t>(inode_ptr->filesize());
+        if(logicals.back() >= 9 * (this->blockSpan(depth) / 1024))
+        {
+            throw std::runtime_error("Block " + std::to_string(logicals.back()) + " is not reachable from i-node!");
+        }
+        auto addr = inode_ptr->addr();
+        auto begin = logicals.data();
+        auto end = begin + logicals.size();
+        // the first pass only counts, so the allocation is one batch
+        auto missing = this->mapChildren(addr.data(), depth, 0, begin, end, nullptr, nullptr);
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        std::vector<uint32_t> pool = this->allocateDataBlocks(superblock_ptr, missing);
+        std::reverse(pool.begin(), pool.end());
+        this->mapChildren(addr.data(), depth, 0, begin, end, &pool, result.data());
+        inode_ptr->addr(addr);
+        return result;
+    }
+    /**
+     * Physical blocks backing the given logical blocks, which must be sorted and lie within the i-node's size.
+     * Holes come back as 0 and nothing is allocated.
+     */
+    std::vector<uint32_t> FileSystem::lookupBlocks(std::shared_ptr<INode> inode_ptr, const std::vector<uint64_t>& logicals)
+    {
+        if(inode_ptr->inlined())
+        {
+            throw std::runtime_error("Inlined i-node has no blocks to map!");
+        }
+        std::vector<uint32_t> result(logicals.size(), 0);
+        if(logicals.empty())
+        {
+            return result;
+        }
+        auto depth = static_cast<uint16_t>(inode_ptr->filesize());
+        auto addr = inode_ptr->addr();
+        this->mapChildren(addr.data(), depth, 0, logicals.data(), logicals.data() + logicals.size(), nullptr, result.data());
+        return result;
+    }
+    /**
+     * Walks the child pointers of one level of the block tree for the logical blocks in [begin, end).
+     * Without a pool it returns how many blocks are missing; with one it fills in the missing blocks.
+     * Either way the data block for every logical block is written to out, if given.
+     */
+    uint64_t FileSystem::mapChildren(uint32_t* children, uint16_t depth, uint64_t firstLogical,
+        const uint64_t* begin, const uint64_t* end, std::vector<uint32_t>* pool, uint32_t* out)
+    {
+        uint64_t missing = 0;
+        auto span = this->blockSpan(depth) / 1024;
+        while(begin != end)
+        {
+            auto child = (*begin - firstLogical) / span;
+            auto childFirst = firstLogical + child * span;
+            auto childEnd = std::lower_bound(begin, end, childFirst + span);
+            auto& blockIdx = children[child];
+            if(blockIdx == 0)
+            {
+                ++missing;
+                if(pool != nullptr)
+                {
+                    blockIdx = pool->back();
+                    pool->pop_back();
+                }
+            }
+            if(depth == 0)
+            {
+                if(out != nullptr)
+                {
+                    *out = blockIdx;
+                }
+            }
+            else if(blockIdx == 0)
+            {
+                // nothing below a missing block exists yet, no need to read anything
+                std::array<uint32_t, 256> none{};
+                missing += this->mapChildren(none.data(), depth - 1, childFirst, begin, childEnd, pool, out);
+            }
+            else
+            {
+                std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+                std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+                missing += this->mapChildren(intArray.data(), depth - 1, childFirst, begin, childEnd, pool, out);
+            }
+            if(out != nullptr)
+            {
+                out += childEnd - begin;
+            }
+            begin = childEnd;
+        }
+        return missing;
+    }
+    std::vector<std::vector<uint32_t>> FileSystem::getBlocks(std::shared_ptr<INode> inode_ptr)
+    {
+        std::array<uint32_t,9> addr = inode_ptr->addr();
+        std::vector<uint32_t> blocks{addr.begin(), addr.end()};
+        uint16_t depth = static_cast<uint16_t>(inode_ptr->filesize());
+        return this->getBlocks(blocks, depth);
+    }
+    std::vector<std::vector<uint32_t>> FileSystem::getBlocks(std::vector<uint32_t> blocks, uint16_t depth)
+    {
+        std::vector<std::vector<uint32_t>> result;
+        std::vector<uint32_t> top;
+        for(auto block : blocks)
+        {
+            if(block != 0)
+            {
+                top.push_back(block);
+            }
+        }
+        result.push_back(top);
+        if(depth < 0)
+        {
+            throw std::runtime_error("Depth of " + std::to_string(depth) + " is invalid!");
+        }
+        if(depth != 0)
+        {
+            std::vector<std::vector<uint32_t>> levels;
+            for(uint32_t level = 0; level < depth; level++)
+            {
+                std::vector<uint32_t> blockIdxs;
+                levels.push_back(blockIdxs);
+            }
+            for(auto blockIdx : blocks)
+            {
+                if(blockIdx == 0)
+                {
+                    continue;
+                }
+                auto block_ptr = this->getBlock(blockIdx);
+                std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+                std::vector<uint32_t> intermediate{intArray.begin(), intArray.end()};
+                // std::copy_n(intArray.begin(), 256, intermediate.begin());
+                std::vector<std::vector<uint32_t>> nextBlocks = this->getBlocks(intermediate, depth - 1);
+                for(uint32_t level = 0; level < depth; level++)
+                {
+                    for(auto nextBlockIdx : nextBlocks[level])
+                    {
+                        levels[level].push_back(nextBlockIdx);
+                    }
+                }
+            }
+            for(auto vec : levels)
+            {
+                result.push_back(vec);
+            }
+        }
+        return result;
+    }
+    std::shared_ptr<Block> FileSystem::getBlockForAddress(std::shared_ptr<INode> inode_ptr, uint64_t address)
+    {
+        auto depth = static_cast<uint16_t>(inode_ptr->filesize());
+        auto blockSize = this->blockSpan(depth);
+        if(address / blockSize >= 9)
+        {
+            throw std::runtime_error("Address " + std::to_string(address) + " is not reachable from i-node!");
+        }
+        auto blockIdx = inode_ptr->addr()[address / blockSize];
+        address %= blockSize;
+        for(; depth > 0 && blockIdx != 0; --depth)
+        {
+            std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+            blockSize /= 256;
+            blockIdx = block_ptr->asIntegers()[address / blockSize];
+            address %= blockSize;
+        }
+        if(blockIdx == 0)
+        {
+            // holes have no block, they read as zeros
+            return std::shared_ptr<Block>{nullptr};
+        }
+        std::cout << "Fetching block " << blockIdx << std::endl;
+        return this->getBlock(blockIdx);
+    }
+    /**
+     * Physical block for every logical block of the i-node, in file order, walking the block tree once.
+     */
+    std::vector<uint32_t> FileSystem::getBlockMap(std::shared_ptr<INode> inode_ptr)
+    {
+        if(inode_ptr->inlined())
+        {
+            throw std::runtime_error("Inlined i-node has no blocks to map!");
+        }
+        auto count = this->blocksForSize(inode_ptr->size());
+        auto depth = static_cast<uint16_t>(inode_ptr->filesize());
+        std::vector<uint32_t> result;
+        result.reserve(count);
+        for(auto blockIdx : inode_ptr->addr())
+        {
+            if(result.size() >= count)
+            {
+                break;
+            }
+            this->appendBlockMap(blockIdx, depth, count, result);
+        }
+        return result;
+    }
+    void FileSystem::appendBlockMap(uint32_t blockIdx, uint16_t depth, uint64_t count, std::vector<uint32_t>& result)
+    {
+        if(depth == 0)
+        {
+            result.push_back(blockIdx);
+            return;
+        }
+        if(blockIdx == 0)
+        {
+            auto span = this->blockSpan(depth) / 1024;
+            result.resize(std::min<uint64_t>(count, result.size() + span), 0);
+            return;
+        }
+        std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+        std::array<uint32_t, 256>& intArray = block_ptr->asIntegers();
+        for(auto child = 0; child < 256 && result.size() < count; ++child)
+        {
+            this->appendBlockMap(intArray[child], depth - 1, count, result);
+        }
+    }
+    /**
+     * Moves length bytes from in_fd to out_fd without passing them through user space.
+     * Tries copy_file_range first and sendfile second; returns how many bytes were moved,
+     * so the caller can finish the rest with an ordinary buffered copy.
+     */
+    uint64_t FileSystem::transferRange(int32_t in_fd, uint64_t in_offset, int32_t out_fd, uint64_t out_offset, uint64_t length)
+    {
+        uint64_t done = 0;
+        while(done < length)
+        {
+            loff_t in = in_offset + done;
+            loff_t out = out_offset + done;
+            auto result = copy_file_range(in_fd, &in, out_fd, &out, length - done, 0);
+            if(result <= 0)
+            {
+                break;
+            }
+            done += result;
+        }
+        if(done < length && lseek(out_fd, out_offset + done, SEEK_SET) != -1)
+        {
+            // sendfile writes at the current offset of out_fd
+            while(done < length)
+            {
+                off_t in = in_offset + done;
+                auto result = sendfile(out_fd, in_fd, &in, length - done);
+                if(result <= 0)
+                {
+                    break;
+                }
+                done += result;
+            }
+        }
+        return done;
+    }
+    /**
+     * Copies length bytes through a user space buffer, for whatever FileSystem::transferRange could not move.
+     */
+    void FileSystem::bufferRange(int32_t in_fd, uint64_t in_offset, int32_t out_fd, uint64_t out_offset, uint64_t length)
+    {
+        std::vector<uint8_t> buffer(std::min<uint64_t>(length, 256 * 1024));
+        for(uint64_t done = 0; done < length;)
+        {
+            auto wanted = std::min<uint64_t>(buffer.size(), length - done);
+            if(preadFully(in_fd, buffer.data(), wanted, in_offset + done) != wanted)
+            {
+                throw std::runtime_error("Failed to read " + std::to_string(wanted) + " bytes at "
+                    + std::to_string(in_offset + done));
+            }
+            if(pwriteFully(out_fd, buffer.data(), wanted, out_offset + done) != wanted)
+            {
+                throw std::runtime_error("Failed to write " + std::to_string(wanted) + " bytes at "
+                    + std::to_string(out_offset + done));
+            }
+            done += wanted;
+        }
+    }
+    /**
+     * Copies size bytes of the host file fd into the i-node, which must already have that size.
+     * Holes in the host file are skipped without reading them and all-zero blocks are never allocated,
+     * so both stay holes in the image.
+     * Runs as a pipeline over chunks of the file: a reader thread fills buffers from the host, this thread maps
+     * each chunk with one batched allocation and a writer thread stores it with one image write per run of
+     * consecutive blocks. With dedup on, this thread writes and indexes each chunk itself, since later chunks
+     * are compared against what is already in the image.
+     */
+    void FileSystem::copyIn(int32_t fd, std::shared_ptr<INode> inode_ptr, uint64_t size)
+    {
+        const uint64_t CHUNK_BLOCKS = 1024;
+        const uint32_t DEPTH = 4;
+        struct Chunk
+        {
+        public:
+            uint32_t buffer;
+            uint64_t offset;
+            uint64_t count;
+            std::vector<uint32_t> blocks;
+            std::vector<uint64_t> positions;
+        };
+        if(size == 0)
+        {
+            return;
+        }
+        std::vector<AlignedBuffer> buffers;
+        BoundedQueue<uint32_t> idle{DEPTH};
+        for(uint32_t i = 0; i < DEPTH; ++i)
+        {
+            buffers.emplace_back(CHUNK_BLOCKS * 1024);
+            idle.push(i);
+        }
+        BoundedQueue<Chunk> filled{DEPTH};
+        BoundedQueue<Chunk> mapped{DEPTH};
+        uint64_t written = 0;
+        uint64_t shared = 0;
+        std::unique_lock<std::recursive_mutex> allocator_guard{this->_allocatorLock};
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        BlockTable refcounts{this, bootblock_ptr->refcounts()};
+        BlockTable index{this, bootblock_ptr->dedup() ? bootblock_ptr->hashIndex() : 0};
+        bootblock_ptr.reset();
+        allocator_guard.unlock();
+        auto writeChunk = [this, &buffers](const Chunk& chunk) {
+            const uint8_t* buffer = buffers[chunk.buffer].data();
+            for(uint64_t run = 0; run < chunk.blocks.size();)
+            {
+                auto end = run + 1;
+                while(end < chunk.blocks.size() && chunk.blocks[end] == chunk.blocks[end - 1] + 1
+                    && chunk.positions[end] == chunk.positions[end - 1] + 1)
+                {
+                    ++end;
+                }
+                std::cout << "[cpin]Writing to blocks " << chunk.blocks[run] << " to " << chunk.blocks[end - 1] << std::endl;
+                auto length = (end - run) * 1024;
+                if(pwriteFully(this->_fd, buffer + chunk.positions[run] * 1024, length, 1024ull * chunk.blocks[run]) != length)
+                {
+                    throw std::runtime_error("Failed to write block " + std::to_string(chunk.blocks[run]));
+                }
+                run = end;
+            }
+        };
+        Stage reader{[&]() {
+            uint64_t offset = 0;
+            uint32_t buffer;
+            while(offset < size && idle.pop(buffer))
+            {
+                auto data = lseek(fd, offset, SEEK_DATA);
+                if(data == -1 && errno == ENXIO)
+                {
+                    break;
+                }
+                if(data != -1)
+                {
+                    offset = std::max<uint64_t>(offset, data / 1024 * 1024);
+                }
+                if(offset >= size)
+                {
+                    break;
+                }
+                uint8_t* bytes = buffers[buffer].data();
+                auto wanted = std::min<uint64_t>(buffers[buffer].size(), size - offset);
+                if(preadFully(fd, bytes, wanted, offset) != wanted)
+                {
+                    throw std::runtime_error("Host file shrank while copying in at " + std::to_string(offset));
+                }
+                auto count = this->blocksForSize(wanted);
+                std::fill(bytes + wanted, bytes + count * 1024, 0);
+                if(!filled.push(Chunk{buffer, offset, count, {}, {}}))
+                {
+                    break;
+                }
+                offset += count * 1024;
+            }
+        }, [&]() { filled.close(); }};
+        Stage writer{[&]() {
+            Chunk chunk;
+            while(mapped.pop(chunk))
+            {
+                writeChunk(chunk);
+                idle.push(chunk.buffer);
+            }
+        }, [&]() { idle.close(); mapped.close(); }};
+        try
+        {
+            Chunk chunk;
+            while(filled.pop(chunk))
+            {
+                const uint8_t* buffer = buffers[chunk.buffer].data();
+                std::vector<uint64_t> logicals;
+                for(uint64_t block = 0; block < chunk.count; ++block)
+                {
+                    if(!isZeroBlock(buffer + block * 1024))
+                    {
+                        logicals.push_back(chunk.offset / 1024 + block);
+                        chunk.positions.push_back(block);
+                    }
+                }
+                // with dedup on, blocks already in the image (or earlier in this chunk) are referenced instead of written
+                std::vector<uint64_t> sharedLogicals;
+                std::vector<uint32_t> sharedBlocks;
+                std::vector<uint64_t> repeatLogicals;
+                std::vector<uint64_t> repeatOf;
+                std::vector<uint32_t> hashes;
+                if(index.exists())
+                {
+                    std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+                    std::unordered_multimap<uint32_t, uint64_t> seen;
+                    std::vector<uint64_t> freshLogicals;
+                    std::vector<uint64_t> freshPositions;
+                    for(uint64_t i = 0; i < logicals.size(); ++i)
+                    {
+                        const uint8_t* bytes = buffer + chunk.positions[i] * 1024;
+                        auto hash = hashBlock(bytes);
+                        auto duplicate = this->findDuplicate(index, refcounts, hash, bytes);
+                        if(duplicate != 0)
+                        {
+                            ++refcounts.counter(duplicate);
+                            sharedLogicals.push_back(logicals[i]);
+                            sharedBlocks.push_back(duplicate);
+                            continue;
+                        }
+                        auto range = seen.equal_range(hash);
+                        auto match = std::find_if(range.first, range.second, [&](const std::pair<const uint32_t, uint64_t>& earlier)
+                        {
+                            return std::memcmp(buffer + freshPositions[earlier.second] * 1024, bytes, 1024) == 0;
+                        });
+                        if(match != range.second)
+                        {
+                            repeatLogicals.push_back(logicals[i]);
+                            repeatOf.push_back(match->second);
+                            continue;
+                        }
+                        seen.emplace(hash, freshLogicals.size());
+                        freshLogicals.push_back(logicals[i]);
+                        freshPositions.push_back(chunk.positions[i]);
+                        hashes.push_back(hash);
+                    }
+                    logicals.swap(freshLogicals);
+                    chunk.positions.swap(freshPositions);
+                }
+                try
+                {
+                    chunk.blocks = this->mapBlocks(inode_ptr, logicals);
+                }
+                catch(const std::runtime_error& error)
+                {
+                    std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+                    for(auto blockIdx : sharedBlocks)
+                    {
+                        --refcounts.counter(blockIdx);
+                    }
+                    throw;
+                }
+                written += chunk.blocks.size();
+                if(!index.exists())
+                {
+                    if(!mapped.push(std::move(chunk)))
+                    {
+                        break;
+                    }
+                    continue;
+                }
+                writeChunk(chunk);
+                idle.push(chunk.buffer);
+                std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+                for(uint64_t i = 0; i < chunk.blocks.size(); ++i)
+                {
+                    this->indexBlock(index, hashes[i], chunk.blocks[i]);
+                }
+                for(uint64_t i = 0; i < repeatLogicals.size(); ++i)
+                {
+                    ++refcounts.counter(chunk.blocks[repeatOf[i]]);
+                    sharedLogicals.push_back(repeatLogicals[i]);
+                    sharedBlocks.push_back(chunk.blocks[repeatOf[i]]);
+                }
+                std::vector<std::shared_ptr<Block>> pinned;
+                for(uint64_t i = 0; i < sharedLogicals.size(); ++i)
+                {
+                    this->replaceBlock(inode_ptr, sharedLogicals[i], sharedBlocks[i], &pinned);
+                }
+                shared += sharedLogicals.size();
+            }
+        }
+        catch(...)
+        {
+            // unblocks both threads, which the stages then wait for
+            idle.close();
+            filled.close();
+            mapped.close();
+            throw;
+        }
+        mapped.close();
+        reader.join();
+        writer.join();
+        std::cout << "[cpin]Stored " << written << " blocks, shared " << shared << ", left " 
+            << this->blocksForSize(size) - written - shared << " as holes" << std::endl;
+    }
+    /**
+     * cpin for compressed i-nodes: every cluster read from fd is LZ compressed into its first blocks,
+     * followed by CLUSTER_TAG in the cluster map, if that takes fewer blocks than its non-zero blocks stored raw;
+     * otherwise it is stored like FileSystem::copyIn would. All-zero blocks stay holes either way.
+     */
+    void FileSystem::copyInCompressed(int32_t fd, std::shared_ptr<INode> inode_ptr, uint64_t size)
+    {
+        const uint64_t CHUNK_CLUSTERS = 64;
+        std::vector<uint8_t> buffer(CHUNK_CLUSTERS * CLUSTER_BYTES);
+        std::vector<uint8_t> packed(CHUNK_CLUSTERS * CLUSTER_BYTES);
+        uint64_t written = 0;
+        uint64_t clusters = 0;
+        uint64_t compressed = 0;
+        for(uint64_t offset = 0; offset < size; offset += buffer.size())
+        {
+            auto wanted = std::min<uint64_t>(buffer.size(), size - offset);
+            if(preadFully(fd, buffer.data(), wanted, offset) != wanted)
+            {
+                throw std::runtime_error("Host file shrank while copying in at " + std::to_string(offset));
+            }
+            std::fill(buffer.begin() + wanted, buffer.end(), 0);
+            std::vector<uint64_t> logicals;
+            std::vector<const uint8_t*> sources;
+            std::vector<uint64_t> tags;
+            for(uint64_t clusterOffset = 0; clusterOffset < wanted; clusterOffset += CLUSTER_BYTES)
+            {
+                const uint8_t* source = buffer.data() + clusterOffset;
+                auto bytes = std::min(CLUSTER_BYTES, wanted - clusterOffset);
+                auto first = (offset + clusterOffset) / 1024;
+                std::vector<uint64_t> nonzero;
+                for(uint64_t block = 0; block < this->blocksForSize(bytes); ++block)
+                {
+                    if(!isZeroBlock(source + block * 1024))
+                    {
+                        nonzero.push_back(block);
+                    }
+                }
+                if(nonzero.empty())
+                {
+                    continue;
+                }
+                ++clusters;
+                // worth it only if at least one block is saved
+                uint8_t* target = packed.data() + clusterOffset;
+                auto capacity = (nonzero.size() - 1) * 1024;
+                auto length = capacity > 4 ? LZ::compress(source, bytes, target + 4, capacity - 4) : 0;
+                if(length == 0)
+                {
+                    for(auto block : nonzero)
+                    {
+                        logicals.push_back(first + block);
+                        sources.push_back(source + block * 1024);
+                    }
+                    continue;
+                }
+                ++compressed;
+                auto header = static_cast<uint32_t>(length);
+                std::memcpy(target, &header, 4);
+                auto blocks = this->blocksForSize(length + 4);
+                std::fill(target + length + 4, target + blocks * 1024, 0);
+                for(uint64_t block = 0; block < blocks; ++block)
+                {
+                    logicals.push_back(first + block);
+                    sources.push_back(target + block * 1024);
+                }
+                tags.push_back(first + blocks);
+            }
+            std::vector<uint32_t> blocks = this->mapBlocks(inode_ptr, logicals);
+            for(uint64_t run = 0; run < blocks.size();)
+            {
+                auto end = run + 1;
+                while(end < blocks.size() && blocks[end] == blocks[end - 1] + 1 && sources[end] == sources[end - 1] + 1024)
+                {
+                    ++end;
+                }
+                auto length = (end - run) * 1024;
+                if(pwriteFully(this->_fd, sources[run], length, 1024ull * blocks[run]) != length)
+                {
+                    throw std::runtime_error("Failed to write block " + std::to_string(blocks[run]));
+                }
+                run = end;
+            }
+            std::vector<std::shared_ptr<Block>> pinned;
+            for(auto tag : tags)
+            {
+                this->replaceBlock(inode_ptr, tag, CLUSTER_TAG, &pinned);
+            }
+            written += blocks.size();
+        }
+        std::cout << "[cpin]Stored " << written << " blocks for " << this->blocksForSize(size) << " blocks of data, "
+            << compressed << " of " << clusters << " clusters compressed" << std::endl;
+    }
+    /**
+     * Fills out, which holds a whole cluster, with the contents of cluster of a compressed i-node,
+     * reading only the blocks a compressed cluster takes up. Holes and anything past the end read as zeros.
+     */
+    void FileSystem::readCluster(std::shared_ptr<INode> inode_ptr, uint64_t cluster, uint8_t* out)
+    {
+        std::fill(out, out + CLUSTER_BYTES, 0);
+        auto first = cluster * CLUSTER_BLOCKS;
+        auto total = this->blocksForSize(inode_ptr->size());
+        std::vector<uint64_t> logicals;
+        for(auto logical = first; logical < std::min(first + CLUSTER_BLOCKS, total); ++logical)
+        {
+            logicals.push_back(logical);
+        }
+        std::vector<uint32_t> blocks = this->lookupBlocks(inode_ptr, logicals);
+        auto tag = std::find(blocks.begin(), blocks.end(), CLUSTER_TAG);
+        if(tag == blocks.end())
+        {
+            for(uint64_t i = 0; i < blocks.size(); ++i)
+            {
+                if(blocks[i] != 0)
+                {
+                    std::shared_ptr<Block> block_ptr = this->getBlock(blocks[i]);
+                    std::copy(block_ptr->asBytes().begin(), block_ptr->asBytes().end(), out + i * 1024);
+                }
+            }
+            return;
+        }
+        std::vector<uint8_t> packed((tag - blocks.begin()) * 1024);
+        for(uint64_t i = 0; i * 1024 < packed.size(); ++i)
+        {
+            std::shared_ptr<Block> block_ptr = this->getBlock(blocks[i]);
+            std::copy(block_ptr->asBytes().begin(), block_ptr->asBytes().end(), packed.begin() + i * 1024);
+        }
+        uint32_t length;
+        std::memcpy(&length, packed.data(), 4);
+        if(length + 4ull > packed.size())
+        {
+            throw std::runtime_error("Compressed cluster " + std::to_string(cluster) + " claims " 
+                + std::to_string(length) + " bytes, more than its blocks hold!");
+        }
+        LZ::decompress(packed.data() + 4, length, out, CLUSTER_BYTES);
+    }
+    /**
+     * Stores a compressed cluster raw again, so its blocks can be modified in place.
+     * Returns false if the cluster was not compressed.
+     */
+    bool FileSystem::expandCluster(std::shared_ptr<INode> inode_ptr, uint64_t cluster)
+    {
+        auto first = cluster * CLUSTER_BLOCKS;
+        auto total = this->blocksForSize(inode_ptr->size());
+        std::vector<uint64_t> logicals;
+        for(auto logical = first; logical < std::min(first + CLUSTER_BLOCKS, total); ++logical)
+        {
+            logicals.push_back(logical);
+        }
+        std::vector<uint32_t> blocks = this->lookupBlocks(inode_ptr, logicals);
+        auto tag = std::find(blocks.begin(), blocks.end(), CLUSTER_TAG);
+        if(tag == blocks.end())
+        {
+            return false;
+        }
+        std::vector<uint8_t> data(CLUSTER_BYTES);
+        this->readCluster(inode_ptr, cluster, data.data());
+        std::vector<std::shared_ptr<Block>> pinned;
+        std::vector<uint32_t> freed{blocks.begin(), tag};
+        for(auto logical = first; logical <= first + (tag - blocks.begin()); ++logical)
+        {
+            this->replaceBlock(inode_ptr, logical, 0, &pinned);
+        }
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        this->freeDataBlocks(superblock_ptr, freed);
+        std::vector<uint64_t> nonzero;
+        for(auto logical : logicals)
+        {
+            if(!isZeroBlock(data.data() + (logical - first) * 1024))
+            {
+                nonzero.push_back(logical);
+            }
+        }
+        std::vector<uint32_t> mapped = this->mapBlocks(inode_ptr, nonzero);
+        for(uint64_t i = 0; i < nonzero.size(); ++i)
+        {
+            std::shared_ptr<Block> block_ptr = this->getBlock(mapped[i]);
+            auto source = data.begin() + (nonzero[i] - first) * 1024;
+            std::copy(source, source + 1024, block_ptr->asBytes().begin());
+        }
+        std::cout << "Expanded compressed cluster " << cluster << " into " << nonzero.size() << " blocks" << std::endl;
+        return true;
+    }
+    /**
+     * cpout for compressed i-nodes, decompressing cluster by cluster into fd, which must be empty.
+     * All-zero blocks are skipped so they stay holes once the host file is extended to its full size.
+     */
+    void FileSystem::copyOutCompressed(int32_t fd, std::shared_ptr<INode> inode_ptr, uint64_t size)
+    {
+        std::vector<uint8_t> cluster(CLUSTER_BYTES);
+        for(uint64_t offset = 0; offset < size; offset += CLUSTER_BYTES)
+        {
+            this->readCluster(inode_ptr, offset / CLUSTER_BYTES, cluster.data());
+            auto blocks = this->blocksForSize(std::min(CLUSTER_BYTES, size - offset));
+            for(uint64_t run = 0; run < blocks;)
+            {
+                if(isZeroBlock(cluster.data() + run * 1024))
+                {
+                    ++run;
+                    continue;
+                }
+                auto end = run + 1;
+                while(end < blocks && !isZeroBlock(cluster.data() + end * 1024))
+                {
+                    ++end;
+                }
+                auto length = std::min(end * 1024, size - offset) - run * 1024;
+                if(pwriteFully(fd, cluster.data() + run * 1024, length, offset + run * 1024) != length)
+                {
+                    throw std::runtime_error("Failed to write " + std::to_string(length) + " bytes to host file");
+                }
+                run = end;
+            }
+        }
+    }
+    /**
+     * Copies size bytes from the given blocks, in order, into the host file fd, which must be empty.
+     * Holes are skipped, so they stay holes once the host file is extended to its full size.
+     * A file of one chunk copies each run of consecutive blocks with a single kernel-side copy; anything larger
+     * goes through a pipeline, with a reader thread filling buffers from the image while this thread writes
+     * the previous chunks to the host.
+     */
+    void FileSystem::copyOut(int32_t fd, const std::vector<uint32_t>& blocks, uint64_t size)
+    {
+        const uint64_t CHUNK_BLOCKS = 1024;
+        const uint32_t DEPTH = 4;
+        if(blocks.size() <= CHUNK_BLOCKS)
+        {
+            for(uint64_t run = 0; run < blocks.size();)
+            {
+                auto end = run + 1;
+                if(blocks[run] == 0)
+                {
+                    run = end;
+                    continue;
+                }
+                while(end < blocks.size() && blocks[end] == blocks[end - 1] + 1)
+                {
+                    ++end;
+                }
+                std::cout << "[cpout]Reading from blocks " << blocks[run] << " to " << blocks[end - 1] << std::endl;
+                auto length = std::min<uint64_t>((end - run) * 1024, size - run * 1024);
+                auto done = this->transferRange(this->_fd, 1024ull * blocks[run], fd, run * 1024, length);
+                this->bufferRange(this->_fd, 1024ull * blocks[run] + done, fd, run * 1024 + done, length - done);
+                run = end;
+            }
+            this->copyPinned(fd, blocks, size);
+            return;
+        }
+        struct Chunk
+        {
+        public:
+            uint32_t buffer;
+            uint64_t first;
+            // [begin, end) of each run of consecutive blocks, relative to first
+            std::vector<std::pair<uint64_t, uint64_t>> runs;
+        };
+        std::vector<AlignedBuffer> buffers;
+        BoundedQueue<uint32_t> idle{DEPTH};
+        for(uint32_t i = 0; i < DEPTH; ++i)
+        {
+            buffers.emplace_back(CHUNK_BLOCKS * 1024);
+            idle.push(i);
+        }
+        BoundedQueue<Chunk> filled{DEPTH};
+        Stage reader{[&]() {
+            uint32_t buffer;
+            for(uint64_t first = 0; first < blocks.size() && idle.pop(buffer); first += CHUNK_BLOCKS)
+            {
+                Chunk chunk{buffer, first, {}};
+                auto last = std::min<uint64_t>(blocks.size(), first + CHUNK_BLOCKS);
+                for(uint64_t run = first; run < last;)
+                {
+                    auto end = run + 1;
+                    if(blocks[run] == 0)
+                    {
+                        run = end;
+                        continue;
+                    }
+                    while(end < last && blocks[end] == blocks[end - 1] + 1)
+                    {
+                        ++end;
+                    }
+                    std::cout << "[cpout]Reading from blocks " << blocks[run] << " to " << blocks[end - 1] << std::endl;
+                    auto length = (end - run) * 1024;
+                    if(preadFully(this->_fd, buffers[buffer].data() + (run - first) * 1024, length, 1024ull * blocks[run]) != length)
+                    {
+                        throw std::runtime_error("Failed to read block " + std::to_string(blocks[run]));
+                    }
+                    chunk.runs.emplace_back(run - first, end - first);
+                    run = end;
+                }
+                if(!filled.push(std::move(chunk)))
+                {
+                    break;
+                }
+            }
+        }, [&]() { filled.close(); }};
+        try
+        {
+            Chunk chunk;
+            while(filled.pop(chunk))
+            {
+                for(auto& run : chunk.runs)
+                {
+                    auto offset = (chunk.first + run.first) * 1024;
+                    auto length = std::min<uint64_t>((run.second - run.first) * 1024, size - offset);
+                    if(pwriteFully(fd, buffers[chunk.buffer].data() + run.first * 1024, length, offset) != length)
+                    {
+                        throw std::runtime_error("Failed to write " + std::to_string(length) + " bytes to host file");
+                    }
+                }
+                idle.push(chunk.buffer);
+            }
+        }
+        catch(...)
+        {
+            idle.close();
+            filled.close();
+            throw;
+        }
+        reader.join();
+        this->copyPinned(fd, blocks, size);
+    }
+    /**
+     * Blocks changed inside a transaction stay pinned in the cache until it ends, so the image still has their old
+     * contents: copyOut writes those blocks from the cache over what it read.
+     */
+    void FileSystem::copyPinned(int32_t fd, const std::vector<uint32_t>& blocks, uint64_t size)
+    {
+        if(!this->_transaction.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        for(uint64_t i = 0; i < blocks.size(); ++i)
+        {
+            std::shared_ptr<Block> block_ptr;
+            if(blocks[i] != 0)
+            {
+                std::lock_guard<std::mutex> guard{this->_transactionLock};
+                auto pin = this->_transactionPins.find(blocks[i]);
+                if(pin != this->_transactionPins.end())
+                {
+                    block_ptr = pin->second;
+                }
+            }
+            if(!block_ptr || !block_ptr->modified())
+            {
+                continue;
+            }
+            auto length = std::min<uint64_t>(1024, size - i * 1024);
+            if(pwriteFully(fd, block_ptr->asBytes().data(), length, i * 1024) != length)
+            {
+                throw std::runtime_error("Failed to write " + std::to_string(length) + " bytes to host file");
+            }
+        }
+    }
+    void FileSystem::quit()
+    {
+        std::cout << "mod-v6 file system shutting down gracefully" << std::endl;
+        std::unique_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd != -1)
+        {
+            JournalOperation operation{*this};
+            this->flushMagazines();
+        }
+    }
+    void FileSystem::openfs(const std::string& filename, Durability durability, const std::string& snapshot)
+    {
+        std::cout << "Executing openfs " << filename << (snapshot.empty() ? "" : "@" + snapshot)
+            << " with durability " << durability.describe() << std::endl;
+        AsyncPause pause{*this};
+        std::unique_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        auto existed_before = access(filename.c_str(), F_OK) != -1;
+        auto fd = open(filename.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+        auto accessible = fd != -1;
+        auto exists = access(filename.c_str(), F_OK) != -1;
+        if(!exists)
+        {
+            std::cout << "Did not open FileSystem at " << filename 
+                << " since file could not be created" << std::endl;
+        }
+        else if(!accessible)
+        {
+            std::cout << "Did not open FileSystem at " << filename 
+                << " since file could not be accessed" << std::endl;
+        }
+        else if(!existed_before)
+        {
+            reset();
+            this->openSyncer(fd, durability);
+        }
+        else if(existed_before)
+        {
+            reset();
+            this->openSyncer(fd, durability);
+            std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+            this->setDimensions(superblock_ptr->fsize(), superblock_ptr->isize(), this->getBootBlock()->journal());
+            superblock_ptr.reset();
+            this->openJournal();
+            this->_refcounted = this->getBootBlock()->refcounts() != 0;
+        }
+        else
+        {
+            std::cout << "This should be impossible!" << std::endl;
+        }
+        if(!snapshot.empty() && this->_fd != -1 && !this->mountSnapshot(snapshot))
+        {
+            std::cout << "Did not open FileSystem at " << filename << " since it has no snapshot " << snapshot << std::endl;
+            reset();
+            return;
+        }
+        // this will overwrite the first filename.size() characters in the file
+        // write(fd, filename.c_str(), filename.size());
+        
+        std::cout << "Obtained file descriptor: " << fd << std::endl;
+    }
+    void FileSystem::initfs(uint32_t totalBlocks, uint32_t inodeBlocks)
+    {
+        std::cout << "Executing initfs " << totalBlocks << " " << inodeBlocks << std::endl;
+        AsyncPause pause{*this};
+        std::unique_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->readOnly("initfs"))
+        {
+            return;
+        }
+        // flush blocks, magazines hold blocks of the old layout; the old journal is about to be overwritten
+        if(this->_transaction)
+        {
+            std::cout << "Image is formatted, dropping the open transaction" << std::endl;
+            this->endTransaction();
+        }
+        if(this->_journal)
+        {
+            this->_journal->discard();
+            this->_journal.reset();
+            this->_cache->attach(nullptr);
+        }
+        this->_handles.clear();
+        this->_cache->clear();
+        this->_magazines.clear();
+        this->_refcounted = false;
+        // total size = totalBlocks * block size = totalBlocks * 1024 bytes
+        // i-nodes = 16 i-nodes per block
+        // total i-nodes = 16 * inodeBlocks
+        // block structure:
+        // ______________________________________________________________________________________
+        // | boot info | superblock | ... i-node blocks ... |        ... data blocks ...        |
+        // |     0     |     1      | 2 to inodeBlocks + 1  | inodeBlocks + 2 to totalBlocks - 1|
+        // ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄
+        // 1024 bytes per block
+        // images big enough for it end with the metadata journal, which is not counted as data blocks
+        TOTAL_BLOCKS = totalBlocks;
+        BOOT_INFO_BLOCKS = 1;
+        SUPERBLOCK_BLOCKS = 1;
+        INODE_BLOCKS = inodeBlocks;
+        DATA_BLOCKS = TOTAL_BLOCKS - BOOT_INFO_BLOCKS - SUPERBLOCK_BLOCKS - INODE_BLOCKS;
+        BOOT_INFO_BLOCK_IDX = 0;
+        SUPERBLOCK_IDX = BOOT_INFO_BLOCK_IDX + BOOT_INFO_BLOCKS;
+        INODE_BLOCK_IDX = SUPERBLOCK_IDX + SUPERBLOCK_BLOCKS;
+        DATA_BLOCK_IDX = INODE_BLOCK_IDX + INODE_BLOCKS;
+        OUT_OF_BOUNDS = DATA_BLOCK_IDX + DATA_BLOCKS;
+        std::cout << "Total blocks: " << TOTAL_BLOCKS << std::endl;
+        std::cout << "End of blocks: " << OUT_OF_BOUNDS << std::endl;
+        std::cout << "Data blocks: " << DATA_BLOCKS << std::endl;
+        if(BOOT_INFO_BLOCKS + SUPERBLOCK_BLOCKS + INODE_BLOCKS >= TOTAL_BLOCKS ||
+            TOTAL_BLOCKS != OUT_OF_BOUNDS)
+        {
+            throw std::invalid_argument("Invalid overflow given " + std::to_string(TOTAL_BLOCKS)
+                + " blocks total and " + std::to_string(INODE_BLOCKS) + " i-node blocks");
+        }
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting initfs" << std::endl;
+            return;
+        }
+        ftruncate(this->_fd, 0);
+        ftruncate(this->_fd, TOTAL_BLOCKS * 1024);
+        auto journalBlocks = Journal::sizeFor(DATA_BLOCKS);
+        this->setDimensions(totalBlocks, inodeBlocks, journalBlocks);
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        superblock_ptr->isize(INODE_BLOCKS);
+        superblock_ptr->fsize(TOTAL_BLOCKS);
+        superblock_ptr->nfree(0);
+        superblock_ptr->flock('\0');
+        superblock_ptr->ilock('\0');
+        superblock_ptr->fmod('\0');
+        superblock_ptr->time(0);
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        bootblock_ptr->magic(BootBlock::MAGIC);
+        bootblock_ptr->fragment(0);
+        bootblock_ptr->dedup(false);
+        bootblock_ptr->refcounts(0);
+        bootblock_ptr->hashIndex(0);
+        bootblock_ptr->compress(false);
+        bootblock_ptr->journal(journalBlocks);
+        bootblock_ptr->snapshots(0);
+        bootblock_ptr.reset();
+        this->initializeFreeList(superblock_ptr);
+        superblock_ptr.reset();
+        this->initializeINodes();
+        this->initializeRoot();
+        this->_cache->clear();
+        // the new image is written in place, the journal only takes over once it is durable
+        if(this->_durability.mode != Durability::NONE)
+        {
+            this->_syncer->sync("initfs");
+        }
+        this->openJournal();
+    }
+    /**
+     * Adds blocks to the end of the open image. The journal, which ends the image, is checkpointed and closed, and
+     * a new one sized for the larger image is put at the new end; the old one becomes data blocks along with the
+     * added space. Those are chained onto the free list without being read, blocks already in use are never
+     * touched, and the reference count table gains the blocks it needs to count the new ones.
+     */
+    void FileSystem::growfs(uint32_t totalBlocks)
+    {
+        std::cout << "Executing growfs " << totalBlocks << std::endl;
+        AsyncPause pause{*this};
+        std::unique_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting growfs" << std::endl;
+            return;
+        }
+        if(this->readOnly("growfs"))
+        {
+            return;
+        }
+        if(this->_transaction)
+        {
+            std::cout << "A transaction is open, aborting growfs" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        // they keep i-node blocks of the old journal alive
+        if(std::any_of(this->_handles.begin(), this->_handles.end(), [](std::shared_ptr<FileHandle> handle) { return !!handle; }))
+        {
+            std::cout << "Files are open, aborting growfs" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        auto journalBlocks = Journal::sizeFor(totalBlocks - std::min(totalBlocks, this->DATA_BLOCK_IDX));
+        auto outOfBounds = totalBlocks - journalBlocks;
+        if(totalBlocks <= this->TOTAL_BLOCKS || outOfBounds <= this->OUT_OF_BOUNDS)
+        {
+            std::cout << "An image of " << totalBlocks << " blocks has no more data blocks than this one of "
+                << this->TOTAL_BLOCKS << ", aborting growfs" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        // one 16-bit count per block of the file system, as in FileSystem::createRefcounts
+        auto countBlocks = (totalBlocks + 511) / 512;
+        {
+            std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+            if(bootblock_ptr->refcounts() != 0 && countBlocks > 255)
+            {
+                std::cout << "An image of " << totalBlocks << " blocks is too large for a reference count table, "
+                    << "aborting growfs" << std::endl;
+                this->failTransaction();
+                return;
+            }
+            BlockTable refcounts{this, bootblock_ptr->refcounts()};
+            if(refcounts.exists() && outOfBounds - this->OUT_OF_BOUNDS <= countBlocks - refcounts.blocks())
+            {
+                std::cout << "An image of " << totalBlocks << " blocks adds too few data blocks to count them, "
+                    << "aborting growfs" << std::endl;
+                this->failTransaction();
+                return;
+            }
+        }
+        auto oldTotalBlocks = this->TOTAL_BLOCKS;
+        auto oldOutOfBounds = this->OUT_OF_BOUNDS;
+        // everything the journal holds goes home, and blocks it kept from reuse go back on the free list
+        this->settle();
+        this->closeJournal();
+        this->_cache->clear();
+        if(ftruncate(this->_fd, 1024ull * totalBlocks) != 0)
+        {
+            this->openJournal();
+            throw std::runtime_error("Failed to extend the image to " + std::to_string(totalBlocks) + " blocks");
+        }
+        // free blocks are zero; the added space already is, the old journal is not
+        std::array<uint8_t, 1024> zeros{};
+        for(auto blockIdx = oldOutOfBounds; blockIdx < oldTotalBlocks; ++blockIdx)
+        {
+            pwriteFully(this->_fd, zeros.data(), 1024, 1024ull * blockIdx);
+        }
+        this->setDimensions(totalBlocks, this->INODE_BLOCKS, journalBlocks);
+        auto blockIdx = oldOutOfBounds;
+        {
+            std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+            std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+            std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+            if(bootblock_ptr->refcounts() != 0)
+            {
+                // the table's new blocks come zeroed out of the added ones, as no block there is shared yet
+                std::shared_ptr<Block> directory_ptr = this->getBlock(bootblock_ptr->refcounts());
+                std::array<uint32_t, 256>& intArray = directory_ptr->asIntegers();
+                for(; intArray[0] < countBlocks; ++blockIdx)
+                {
+                    intArray[++intArray[0]] = blockIdx;
+                }
+            }
+            // highest first, so the lowest of them is handed out first
+            std::vector<uint32_t> blockIdxs;
+            blockIdxs.reserve(this->OUT_OF_BOUNDS - blockIdx);
+            for(auto added = this->OUT_OF_BOUNDS; added > blockIdx; --added)
+            {
+                blockIdxs.push_back(added - 1);
+            }
+            this->returnFreeBlocks(superblock_ptr, blockIdxs);
+            superblock_ptr->fsize(totalBlocks);
+            bootblock_ptr->journal(journalBlocks);
+        }
+        this->_cache->clear();
+        if(this->_durability.mode != Durability::NONE)
+        {
+            this->_syncer->sync("growfs");
+        }
+        this->openJournal();
+        std::cout << "Grew the image from " << oldTotalBlocks << " to " << totalBlocks << " blocks, "
+            << this->OUT_OF_BOUNDS - oldOutOfBounds << " more of them data blocks, with a journal of "
+            << journalBlocks << " blocks" << std::endl;
+    }
+    /**
+     * Starts a transaction on the calling thread. With a journal, commands of other threads that change the image
+     * wait until it ends, and asynchronous operations that do as well, so this thread must not wait for those.
+     * Without one, commands only share one sync at commit, and a failed transaction cannot be undone.
+     */
+    void FileSystem::begin()
+    {
+        std::cout << "Executing begin" << std::endl;
+        std::unique_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting begin" << std::endl;
+            return;
+        }
+        if(this->readOnly("begin"))
+        {
+            return;
+        }
+        if(this->_transaction)
+        {
+            std::cout << "A transaction is already open, aborting begin" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        if(this->_journal)
+        {
+            // magazines and staged changes of earlier commands are settled first, so a rollback only undoes this
+            {
+                JournalOperation operation{*this};
+                this->flushMagazines();
+            }
+            this->_journal->commit();
+            this->_journal->begin();
+        }
+        else
+        {
+            std::cout << "Image has no journal, a failed transaction cannot be undone" << std::endl;
+        }
+        this->_transactionOwner = std::this_thread::get_id();
+        this->_transactionFailed = false;
+        this->_transaction = true;
+        // shared by every command of the transaction, instead of being read and written back by each
+        this->getSuperBlock();
+        this->getBootBlock();
+    }
+    void FileSystem::commit()
+    {
+        std::cout << "Executing commit" << std::endl;
+        std::unique_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(!this->ownsTransaction())
+        {
+            std::cout << "No transaction is open on this thread, aborting commit" << std::endl;
+            return;
+        }
+        if(this->_transactionFailed)
+        {
+            this->rollbackTransaction();
+            std::cout << "A command of the transaction failed, its changes were discarded" << std::endl;
+            return;
+        }
+        auto pinned = this->_transactionPins.size();
+        this->endTransaction();
+        if(this->_journal)
+        {
+            this->_journal->commit();
+        }
+        else if(this->_durability.mode != Durability::NONE)
+        {
+            this->_syncer->sync("transaction");
+        }
+        std::cout << "Committed transaction of " << pinned << " blocks" << std::endl;
+    }
+    void FileSystem::abort()
+    {
+        std::cout << "Executing abort" << std::endl;
+        AsyncPause pause{*this};
+        std::unique_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(!this->ownsTransaction())
+        {
+            std::cout << "No transaction is open on this thread, aborting abort" << std::endl;
+            return;
+        }
+        this->rollbackTransaction();
+    }
+    bool FileSystem::inTransaction()
+    {
+        return this->ownsTransaction();
+    }
+    bool FileSystem::ownsTransaction()
+    {
+        return this->_transaction.load() && this->_transactionOwner == std::this_thread::get_id();
+    }
+    void FileSystem::failTransaction()
+    {
+        if(this->ownsTransaction())
+        {
+            this->_transactionFailed = true;
+        }
+    }
+    // unpins what the transaction used, so metadata is staged and data written back
+    void FileSystem::endTransaction()
+    {
+        std::unordered_map<uint32_t, std::shared_ptr<Block>> pins;
+        std::vector<uint32_t> freed;
+        {
+            std::lock_guard<std::mutex> guard{this->_transactionLock};
+            this->_transaction = false;
+            pins.swap(this->_transactionPins);
+            freed.swap(this->_transactionFreed);
+            this->_transactionBlocks.clear();
+        }
+        pins.clear();
+        // the zeroed blocks are on disk now, so nothing can write over them once they are handed out again
+        if(!freed.empty())
+        {
+            this->stockMagazine(this->getSuperBlock(), freed);
+        }
+        if(this->_journal)
+        {
+            this->_journal->end();
+        }
+    }
+    /**
+     * Puts the image back the way it was when the transaction began, with _fsLock held exclusively.
+     * Pinned data blocks were never written back, so everything the transaction changed is still in memory,
+     * apart from file data copied straight into newly allocated blocks, which are zeroed.
+     */
+    void FileSystem::rollbackTransaction()
+    {
+        if(!this->_journal)
+        {
+            std::cout << "Image has no journal, the changes of the transaction stay" << std::endl;
+            this->endTransaction();
+            return;
+        }
+        this->_journal->rollback();
+        // every block in use goes back to its newest copy from before the transaction
+        this->_cache->reload(this->_fd);
+        std::vector<uint32_t> allocated;
+        {
+            std::lock_guard<std::recursive_mutex> allocator_guard{this->_allocatorLock};
+            std::lock_guard<std::mutex> magazines_guard{this->_magazineLock};
+            // magazines were empty when it began, whatever is in them came off the free list that was just restored
+            for(auto magazine_ptr : this->_magazines)
+            {
+                magazine_ptr->drain();
+            }
+            std::lock_guard<std::mutex> guard{this->_transactionLock};
+            allocated.swap(this->_transactionBlocks);
+        }
+        this->endTransaction();
+        std::array<uint8_t, 1024> zeros{};
+        for(auto blockIdx : allocated)
+        {
+            pwriteFully(this->_fd, zeros.data(), 1024, 1024ull * blockIdx);
+        }
+        this->_refcounted = this->getBootBlock()->refcounts() != 0;
+        std::vector<std::string> path = this->parseFilename(this->getExtendedFilename(this->workingDirectory(), ""));
+        if(this->getINodesForPath(path).size() != path.size())
+        {
+            std::lock_guard<std::mutex> guard{this->_cwdLock};
+            this->_working_directory = "/";
+            std::cout << "Working directory no longer exists, moving to /" << std::endl;
+        }
+        // handles keep working on what is left of their files, those created by the transaction are closed
+        std::lock_guard<std::mutex> handle_guard{this->_handleLock};
+        for(auto& handle_ptr : this->_handles)
+        {
+            if(!handle_ptr)
+            {
+                continue;
+            }
+            if(!handle_ptr->inode()->allocated())
+            {
+                std::cout << "Closing a handle on i-node " << handle_ptr->inodeIdx() << ", which no longer exists" << std::endl;
+                handle_ptr.reset();
+                continue;
+            }
+            auto blocks = handle_ptr->blocks();
+            blocks->assign(this->blocksForSize(handle_ptr->inode()->size()), FileHandle::UNMAPPED);
+        }
+        std::cout << "Discarded the transaction, zeroed " << allocated.size() << " blocks it allocated" << std::endl;
+    }
+    /**
+     * Fills an empty regular file with size bytes of the host file, laid out the way cpin does:
+     * inline, compressed, tail packed or in plain blocks. Leaves fd open, also when it throws.
+     */
+    void FileSystem::importData(int32_t fd, std::shared_ptr<INode> inode_ptr, uint64_t size)
+    {
+        bool compress;
+        {
+            std::lock_guard<std::recursive_mutex> allocator_guard{this->_allocatorLock};
+            compress = this->getBootBlock()->compress();
+        }
+        if(size > 0 && size <= 36)
+        {
+            // tiny files live in the i-node itself and never get a data block
+            std::array<uint8_t, 36> data;
+            std::fill(data.begin(), data.end(), 0);
+            if(preadFully(fd, data.data(), size, 0) != size)
+            {
+                throw std::runtime_error("Host file shrank while copying in " + std::to_string(size) + " bytes!");
+            }
+            inode_ptr->inlineData(data);
+            inode_ptr->inlined(true);
+            inode_ptr->size(size);
+        }
+        else if(compress)
+        {
+            this->resizeINode(inode_ptr, size);
+            inode_ptr->compressed(true);
+            this->copyInCompressed(fd, inode_ptr, size);
+        }
+        else
+        {
+            this->resizeINode(inode_ptr, size);
+            // a short final block shares a fragment block with other tails instead of taking a whole block
+            uint64_t tail = size % 1024;
+            std::vector<uint8_t> data(tail);
+            if(tail != 0 && tail <= 31 * 32 && preadFully(fd, data.data(), tail, size - tail) == tail
+                && std::any_of(data.begin(), data.end(), [](uint8_t byte) { return byte != 0; }))
+            {
+                this->copyIn(fd, inode_ptr, size - tail);
+                if(!this->packTail(inode_ptr, data.data(), tail))
+                {
+                    auto blockIdx = this->mapBlocks(inode_ptr, {(size - 1) / 1024}).front();
+                    std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+                    std::copy(data.begin(), data.end(), block_ptr->asBytes().begin());
+                }
+            }
+            else
+            {
+                this->copyIn(fd, inode_ptr, size);
+            }
+        }
+    }
+    void FileSystem::cpin(const std::string& outerFilename, const std::string& innerFilename)
+    {
+        std::cout << "Executing cpin " << outerFilename << " " << innerFilename << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting cpin" << std::endl;
+            return;
+        }
+        if(this->readOnly("cpin"))
+        {
+            return;
+        }
+        auto fd = open(outerFilename.c_str(), O_RDONLY);
+        auto accessible = fd != -1;
+        auto exists = access(outerFilename.c_str(), F_OK) != -1;
+        if(!exists)
+        {
+            throw std::runtime_error("File " + outerFilename + " does not exist!");
+        }
+        else if(!accessible)
+        {
+            throw std::runtime_error("Could not access file " + outerFilename + "!");
+        }
+
+        auto target = this->getExtendedFilename(this->workingDirectory(), innerFilename);
+        std::vector<std::string> path = this->parseFilename(target);
+        for(auto component : path)
+        {
+            std::cout << "Path component: " << component << std::endl;
+        }
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        for(auto inode : inodes)
+        {
+            std::cout << "I-nodes for path: " << std::to_string(inode) << std::endl;
+        }
+        if(path.size() == inodes.size())
+        {
+            std::cout << "Failed to copy in: something exists there already!" << std::endl;
+            this->failTransaction();
+        }
+        else if(path.size() < inodes.size() - 1)
+        {
+            std::cout << "Failed to copy in: parent is not a directory or does not exist!" << std::endl;
+            this->failTransaction();
+        }
+        else
+        {
+            std::cout << "Creating file " << innerFilename << std::endl;
+            if(path.back() != "")
+            {
+                close(fd);
+                throw std::runtime_error("Path " + innerFilename + " was not parsed properly!");
+            }
+            path.pop_back();
+            struct stat source_stat;
+            if(fstat(fd, &source_stat) == -1)
+            {
+                close(fd);
+                throw std::runtime_error("Could not stat file " + outerFilename + "!");
+            }
+            uint64_t size = source_stat.st_size;
+            std::unique_lock<std::shared_timed_mutex> parent_guard{this->inodeLock(inodes.back())};
+            if(this->findEntry(this->getINode(inodes.back()), path.back()) != -1)
+            {
+                close(fd);
+                std::cout << "Failed to copy in: something exists there already!" << std::endl;
+                this->failTransaction();
+                return;
+            }
+            auto inodeIdx = this->createFile(path.back(), inodes.back());
+            std::cout << "i-node for new file: " << std::to_string(inodeIdx) << std::endl;
+            // the new file is locked before it becomes reachable to others through the unlocked parent
+            std::unique_lock<std::shared_timed_mutex> guard{this->inodeLock(inodeIdx)};
+            parent_guard.unlock();
+            auto inode_ptr = this->getINode(inodeIdx);
+            try
+            {
+                this->importData(fd, inode_ptr, size);
+            }
+            catch(const std::runtime_error& error)
+            {
+                close(fd);
+                throw;
+            }
+        }
+        close(fd);
+        this->pruneBlocks();
+    }
+    /**
+     * Copies the regular file of an i-node out to the host, returning its size or -1 if it is not one.
+     * The caller holds the i-node's lock.
+     */
+    int64_t FileSystem::exportINode(std::shared_ptr<INode> inode_ptr, const std::string& innerFilename,
+        const std::string& outerFilename)
+    {
+        if(!inode_ptr->allocated())
+        {
+            throw std::runtime_error("Tried to access deallocated i-node for file " + innerFilename + "!");
+        }
+        if(inode_ptr->filetype() != FileType::REGULAR)
+        {
+            std::cout << "Failed to copy out: source is not a regular file!" << std::endl;
+            this->failTransaction();
+        }
+        else
+        {
+            auto fd = open(outerFilename.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+            auto accessible = fd != -1;
+            auto exists = access(outerFilename.c_str(), F_OK) != -1;
+            if(!exists)
+            {
+                throw std::runtime_error("File " + outerFilename + " does not exist!");
+            }
+            else if(!accessible)
+            {
+                throw std::runtime_error("Could not access file " + outerFilename + "!");
+            }
+            auto size = inode_ptr->size();
+            std::cout << "file size is: " << size << " bytes" << std::endl;
+            ftruncate(fd, 0);
+            if(inode_ptr->inlined())
+            {
+                auto data = inode_ptr->inlineData();
+                if(pwriteFully(fd, data.data(), size, 0) != size)
+                {
+                    close(fd);
+                    throw std::runtime_error("Failed to write " + std::to_string(size) + " bytes to host file");
+                }
+            }
+            else if(inode_ptr->compressed())
+            {
+                this->copyOutCompressed(fd, inode_ptr, size);
+            }
+            else if(inode_ptr->tailPacked())
+            {
+                std::vector<uint32_t> blocks = this->getBlockMap(inode_ptr);
+                blocks.pop_back();
+                std::vector<uint8_t> tail = this->readTail(inode_ptr);
+                this->copyOut(fd, blocks, size - tail.size());
+                if(pwriteFully(fd, tail.data(), tail.size(), size - tail.size()) != tail.size())
+                {
+                    close(fd);
+                    throw std::runtime_error("Failed to write " + std::to_string(tail.size()) + " bytes to host file");
+                }
+            }
+            else
+            {
+                this->copyOut(fd, this->getBlockMap(inode_ptr), size);
+            }
+            ftruncate(fd, size);
+            close(fd);
+            return size;
+        }
+        return -1;
+    }
+    /**
+     * Copies a file of the image out to the host, returning its size or -1 if there was nothing to copy.
+     * Looks the file up and locks it.
+     */
+    int64_t FileSystem::exportFile(const std::string& innerFilename, const std::string& outerFilename)
+    {
+        auto target = this->getExtendedFilename(this->workingDirectory(), innerFilename);
+        std::vector<std::string> path = this->parseFilename(target);
+        for(auto component : path)
+        {
+            std::cout << "Path component: " << component << std::endl;
+        }
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        for(auto inode : inodes)
+        {
+            std::cout << "I-nodes for path: " << std::to_string(inode) << std::endl;
+        }
+        std::shared_lock<std::shared_timed_mutex> guard;
+        if(path.size() == inodes.size() && inodes.size() > 1)
+        {
+            std::shared_lock<std::shared_timed_mutex> parent_guard{this->inodeLock(inodes[inodes.size() - 2])};
+            if(this->findEntry(this->getINode(inodes[inodes.size() - 2]), path[path.size() - 2]) != inodes.back())
+            {
+                inodes.pop_back();
+            }
+            else
+            {
+                guard = std::shared_lock<std::shared_timed_mutex>{this->inodeLock(inodes.back())};
+            }
+        }
+        if(path.size() == inodes.size())
+        {
+            return this->exportINode(this->getINode(inodes.back()), innerFilename, outerFilename);
+        }
+        else
+        {
+            std::cout << "Failed to copy out: source not found!" << std::endl;
+            this->failTransaction();
+        }
+        return -1;
+    }
+    void FileSystem::cpout(const std::string& innerFilename, const std::string& outerFilename)
+    {
+        std::cout << "Executing cpout " << innerFilename << " " << outerFilename << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting cpout" << std::endl;
+            return;
+        }
+        this->exportFile(innerFilename, outerFilename);
+        this->pruneBlocks();
+    }
+    /**
+     * Copies a regular file within the image without copying its data: the copy shares the data blocks of the source,
+     * which gain a reference each, and gets its own indirect blocks. Whichever file modifies a shared block first
+     * copies it then. A packed tail is packed again, since a fragment block cannot be shared by reference.
+     */
+    void FileSystem::cp(const std::string& sourceFilename, const std::string& targetFilename)
+    {
+        std::cout << "Executing cp " << sourceFilename << " " << targetFilename << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting cp" << std::endl;
+            return;
+        }
+        if(this->readOnly("cp"))
+        {
+            return;
+        }
+        std::vector<std::string> path = this->parseFilename(this->getExtendedFilename(this->workingDirectory(), targetFilename));
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        if(path.size() == inodes.size())
+        {
+            std::cout << "Failed to copy: something exists there already!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        if(inodes.size() != path.size() - 1 || path.back() != "")
+        {
+            std::cout << "Failed to copy: parent is not a directory or does not exist!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        path.pop_back();
+        std::vector<std::string> sourcePath = this->parseFilename(
+            this->getExtendedFilename(this->workingDirectory(), sourceFilename));
+        std::vector<uint32_t> sourceINodes = this->getINodesForPath(sourcePath);
+        if(sourcePath.size() != sourceINodes.size() || sourceINodes.size() < 2)
+        {
+            std::cout << "Failed to copy: source is not a regular file!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        // the source is frozen into addr first and unlocked again, so the target's parent is never locked after it
+        std::array<uint32_t, 9> addr;
+        uint16_t flags;
+        uint16_t xflags;
+        uint64_t size;
+        uint32_t modtime;
+        bool inlined;
+        uint16_t depth;
+        std::vector<uint8_t> tail;
+        uint64_t copied;
+        {
+            std::shared_lock<std::shared_timed_mutex> parent_guard{this->inodeLock(sourceINodes[sourceINodes.size() - 2])};
+            if(this->findEntry(this->getINode(sourceINodes[sourceINodes.size() - 2]), 
+                sourcePath[sourcePath.size() - 2]) != sourceINodes.back())
+            {
+                std::cout << "Failed to copy: source is not a regular file!" << std::endl;
+                this->failTransaction();
+                return;
+            }
+            std::shared_lock<std::shared_timed_mutex> guard{this->inodeLock(sourceINodes.back())};
+            parent_guard.unlock();
+            auto source_ptr = this->getINode(sourceINodes.back());
+            if(!source_ptr->allocated() || source_ptr->filetype() != FileType::REGULAR)
+            {
+                std::cout << "Failed to copy: source is not a regular file!" << std::endl;
+                this->failTransaction();
+                return;
+            }
+            flags = source_ptr->flags();
+            xflags = source_ptr->xflags();
+            size = source_ptr->size();
+            modtime = source_ptr->modtime();
+            addr = source_ptr->addr();
+            inlined = source_ptr->inlined();
+            depth = static_cast<uint16_t>(source_ptr->filesize());
+            std::lock_guard<std::recursive_mutex> allocator_guard{this->_allocatorLock};
+            std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+            if(!bootblock_ptr->valid())
+            {
+                throw std::runtime_error("File system was initialized without extension support, cannot cp!");
+            }
+            this->createRefcounts(bootblock_ptr);
+            if(source_ptr->tailPacked())
+            {
+                tail = this->readTail(source_ptr);
+            }
+            std::unordered_map<uint32_t, uint32_t> copies;
+            if(!inlined)
+            {
+                BlockTable refcounts{this, bootblock_ptr->refcounts()};
+                for(auto& blockIdx : addr)
+                {
+                    blockIdx = this->freezeBlock(refcounts, blockIdx, depth, false, 0, copies);
+                }
+            }
+            copied = copies.size();
+        }
+        std::unique_lock<std::shared_timed_mutex> parent_guard{this->inodeLock(inodes.back())};
+        auto parent_ptr = this->getINode(inodes.back());
+        if(!parent_ptr->allocated() || parent_ptr->filetype() != FileType::DIRECTORY 
+            || this->findEntry(parent_ptr, path.back()) != -1)
+        {
+            std::cout << "Failed to copy: something exists there already!" << std::endl;
+            this->failTransaction();
+            if(!inlined)
+            {
+                // drop what was frozen for the copy
+                std::vector<uint32_t> freed;
+                for(auto blockIdx : addr)
+                {
+                    this->appendTreeBlocks(blockIdx, depth, 0, freed);
+                }
+                this->freeDataBlocks(this->getSuperBlock(), freed);
+            }
+            return;
+        }
+        auto inodeIdx = this->createFile(path.back(), inodes.back());
+        std::unique_lock<std::shared_timed_mutex> guard{this->inodeLock(inodeIdx)};
+        parent_guard.unlock();
+        auto inode_ptr = this->getINode(inodeIdx);
+        inode_ptr->flags(flags);
+        inode_ptr->xflags(xflags);
+        inode_ptr->size(size);
+        inode_ptr->modtime(modtime);
+        inode_ptr->addr(addr);
+        if(inode_ptr->tailPacked())
+        {
+            // the copy holds a reference to the source's fragment block, which is dropped for slots of its own
+            auto logical = (size - 1) / 1024;
+            auto fragmentIdx = this->replaceBlock(inode_ptr, logical, 0);
+            this->freeDataBlock(this->getSuperBlock(), fragmentIdx);
+            inode_ptr->tailPacked(false);
+            inode_ptr->tailSlot(0);
+            if(!this->packTail(inode_ptr, tail.data(), tail.size()))
+            {
+                auto blockIdx = this->mapBlocks(inode_ptr, {logical}).front();
+                std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+                std::copy(tail.begin(), tail.end(), block_ptr->asBytes().begin());
+            }
+        }
+        std::cout << "Copied " << size << " bytes to i-node " << inodeIdx << " sharing its data blocks, " 
+            << copied << " indirect blocks copied" << std::endl;
+        this->pruneBlocks();
+    }
+    std::vector<std::pair<std::string, std::string>> FileSystem::readManifest(const std::string& manifest)
+    {
+        std::ifstream stream{manifest};
+        if(!stream)
+        {
+            throw std::runtime_error("Could not open manifest " + manifest + "!");
+        }
+        std::vector<std::pair<std::string, std::string>> result;
+        std::string line;
+        while(std::getline(stream, line))
+        {
+            std::istringstream words{line};
+            std::string first;
+            std::string second;
+            std::string extra;
+            if(!(words >> first))
+            {
+                continue;
+            }
+            if(!(words >> second) || (words >> extra))
+            {
+                std::cout << "Skipping malformed manifest line: " << line << std::endl;
+                continue;
+            }
+            result.emplace_back(first, second);
+        }
+        return result;
+    }
+    void FileSystem::reportBatch(const std::string& command, uint64_t total, const std::vector<double>& latencies,
+        uint64_t bytes, std::chrono::steady_clock::time_point start)
+    {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        auto seconds = std::max(elapsed.count(), 1e-9);
+        std::cout << command << ": copied " << latencies.size() << " of " << total << " files, " << bytes << " bytes in "
+            << seconds << " s (" << bytes / seconds / (1024 * 1024) << " MiB/s, " << latencies.size() / seconds
+            << " files/s)" << std::endl;
+        // some of the files were not copied, which fails the batch as a whole
+        if(latencies.size() < total)
+        {
+            this->failTransaction();
+        }
+        if(!latencies.empty())
+        {
+            std::vector<double> sorted{latencies};
+            std::sort(sorted.begin(), sorted.end());
+            std::cout << command << ": per-file latency median " << sorted[sorted.size() / 2] << " ms, max "
+                << sorted.back() << " ms" << std::endl;
+        }
+    }
+    /**
+     * cpin for every "<host file> <file>" line of the manifest, on a thread pool. The files are filled while
+     * nothing points to them yet and then linked into their directories, one lock of each parent per batch.
+     */
+    void FileSystem::cpinMany(const std::string& manifest)
+    {
+        std::cout << "Executing cpin-many " << manifest << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting cpin-many" << std::endl;
+            return;
+        }
+        if(this->readOnly("cpin-many"))
+        {
+            return;
+        }
+        struct Import
+        {
+        public:
+            std::string name;
+            uint32_t parentIdx;
+            int64_t inodeIdx;
+            uint64_t size;
+            double millis;
+        };
+        auto copies = this->readManifest(manifest);
+        auto start = std::chrono::steady_clock::now();
+        // every task only touches its own slot
+        std::vector<Import> imports(copies.size(), Import{"", 0, -1, 0, 0});
+        ThreadPool pool{std::thread::hardware_concurrency()};
+        std::cout << "Copying in " << copies.size() << " files on " << pool.size() << " threads" << std::endl;
+        for(uint64_t i = 0; i < copies.size(); ++i)
+        {
+            pool.submit([this, &copies, &imports, i]() {
+                auto begin = std::chrono::steady_clock::now();
+                auto& outerFilename = copies[i].first;
+                auto& innerFilename = copies[i].second;
+                std::vector<std::string> path = this->parseFilename(
+                    this->getExtendedFilename(this->workingDirectory(), innerFilename));
+                std::vector<uint32_t> inodes = this->getINodesForPath(path);
+                if(path.size() == inodes.size())
+                {
+                    std::cout << "Failed to copy in " << innerFilename << ": something exists there already!" << std::endl;
+                    return;
+                }
+                if(inodes.size() != path.size() - 1 || path.back() != "")
+                {
+                    std::cout << "Failed to copy in " << innerFilename << ": parent is not a directory or does not exist!"
+                        << std::endl;
+                    return;
+                }
+                path.pop_back();
+                auto fd = open(outerFilename.c_str(), O_RDONLY);
+                struct stat source_stat;
+                if(fd == -1 || fstat(fd, &source_stat) == -1)
+                {
+                    std::cout << "Failed to copy in " << innerFilename << ": could not access file " << outerFilename
+                        << std::endl;
+                    if(fd != -1)
+                    {
+                        close(fd);
+                    }
+                    return;
+                }
+                uint64_t size = source_stat.st_size;
+                auto inodeIdx = this->allocateINode();
+                this->initializeFile(inodeIdx);
+                auto inode_ptr = this->getINode(inodeIdx);
+                // whatever goes wrong, the i-node is not linked anywhere yet and has to be given back
+                bool imported = false;
+                std::string failure{"unknown error"};
+                try
+                {
+                    this->importData(fd, inode_ptr, size);
+                    imported = true;
+                }
+                catch(const std::exception& error)
+                {
+                    failure = error.what();
+                }
+                catch(...)
+                {
+                }
+                if(!imported)
+                {
+                    close(fd);
+                    this->resizeINode(inode_ptr, 0);
+                    this->freeINode(inode_ptr);
+                    std::cout << "Failed to copy in " << innerFilename << ": " << failure << std::endl;
+                    return;
+                }
+                close(fd);
+                std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - begin;
+                imports[i] = Import{path.back(), inodes.back(), inodeIdx, size, took.count()};
+            });
+        }
+        pool.wait();
+        std::map<uint32_t, std::vector<uint64_t>> parents;
+        for(uint64_t i = 0; i < imports.size(); ++i)
+        {
+            if(imports[i].inodeIdx != -1)
+            {
+                parents[imports[i].parentIdx].push_back(i);
+            }
+        }
+        for(auto& parent : parents)
+        {
+            pool.submit([this, &copies, &imports, &parent]() {
+                std::unique_lock<std::shared_timed_mutex> guard{this->inodeLock(parent.first)};
+                auto parent_ptr = this->getINode(parent.first);
+                auto directory = parent_ptr->allocated() && parent_ptr->filetype() == FileType::DIRECTORY;
+                // read once rather than searched for every entry, which also catches names repeated in the manifest
+                std::unordered_set<std::string> names;
+                if(directory)
+                {
+                    for(auto file_ptr : this->getFilesForINode(parent_ptr))
+                    {
+                        names.insert(file_ptr->name());
+                    }
+                }
+                std::vector<std::pair<std::string, uint32_t>> entries;
+                for(auto i : parent.second)
+                {
+                    auto& import = imports[i];
+                    if(directory && names.insert(import.name).second)
+                    {
+                        entries.emplace_back(import.name, import.inodeIdx);
+                        continue;
+                    }
+                    std::cout << "Failed to copy in " << copies[i].second << ": something exists there already!" << std::endl;
+                    auto inode_ptr = this->getINode(import.inodeIdx);
+                    this->resizeINode(inode_ptr, 0);
+                    this->freeINode(inode_ptr);
+                    import.inodeIdx = -1;
+                }
+                this->linkFiles(parent.first, entries);
+            });
+        }
+        pool.wait();
+        std::vector<double> latencies;
+        uint64_t bytes = 0;
+        for(auto& import : imports)
+        {
+            if(import.inodeIdx != -1)
+            {
+                latencies.push_back(import.millis);
+                bytes += import.size;
+            }
+        }
+        this->reportBatch("cpin-many", copies.size(), latencies, bytes, start);
+        this->pruneBlocks();
+    }
+    /**
+     * cpout for every "<file> <host file>" line of the manifest, on a thread pool.
+     */
+    void FileSystem::cpoutMany(const std::string& manifest)
+    {
+        std::cout << "Executing cpout-many " << manifest << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting cpout-many" << std::endl;
+            return;
+        }
+        auto copies = this->readManifest(manifest);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<int64_t> sizes(copies.size(), -1);
+        std::vector<double> millis(copies.size(), 0);
+        {
+            ThreadPool pool{std::thread::hardware_concurrency()};
+            std::cout << "Copying out " << copies.size() << " files on " << pool.size() << " threads" << std::endl;
+            for(uint64_t i = 0; i < copies.size(); ++i)
+            {
+                pool.submit([this, &copies, &sizes, &millis, i]() {
+                    auto begin = std::chrono::steady_clock::now();
+                    try
+                    {
+                        sizes[i] = this->exportFile(copies[i].first, copies[i].second);
+                    }
+                    catch(const std::runtime_error& error)
+                    {
+                        std::cout << "Failed to copy out " << copies[i].first << ": " << error.what() << std::endl;
+                    }
+                    std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - begin;
+                    millis[i] = took.count();
+                });
+            }
+        }
+        std::vector<double> latencies;
+        uint64_t bytes = 0;
+        for(uint64_t i = 0; i < copies.size(); ++i)
+        {
+            if(sizes[i] != -1)
+            {
+                latencies.push_back(millis[i]);
+                bytes += sizes[i];
+            }
+        }
+        this->reportBatch("cpout-many", copies.size(), latencies, bytes, start);
+        this->pruneBlocks();
+    }
+    /**
+     * Copies a host directory tree into the image, creating innerDirectory if it does not exist yet. The tree is
+     * walked one level at a time, in batches: i-nodes for a batch are claimed in one scan and blocks for its
+     * directories in one allocation, files are filled on a thread pool while nothing points to them yet, and
+     * then every directory gets all of its new entries at once.
+     */
+    void FileSystem::importTree(const std::string& outerDirectory, const std::string& innerDirectory)
+    {
+        std::cout << "Executing import " << outerDirectory << " " << innerDirectory << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting import" << std::endl;
+            return;
+        }
+        if(this->readOnly("import"))
+        {
+            return;
+        }
+        struct stat outer_stat;
+        if(stat(outerDirectory.c_str(), &outer_stat) == -1 || !S_ISDIR(outer_stat.st_mode))
+        {
+            std::cout << "Failed to import: " << outerDirectory << " is not a directory!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        std::vector<std::string> path = this->parseFilename(this->getExtendedFilename(this->workingDirectory(), innerDirectory));
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        uint32_t rootIdx;
+        if(path.size() == inodes.size())
+        {
+            rootIdx = inodes.back();
+            std::shared_lock<std::shared_timed_mutex> guard{this->inodeLock(rootIdx)};
+            if(this->getINode(rootIdx)->filetype() != FileType::DIRECTORY)
+            {
+                std::cout << "Failed to import: " << innerDirectory << " is not a directory!" << std::endl;
+                this->failTransaction();
+                return;
+            }
+        }
+        else if(inodes.size() == path.size() - 1 && path.back() == "")
+        {
+            path.pop_back();
+            std::unique_lock<std::shared_timed_mutex> parent_guard{this->inodeLock(inodes.back())};
+            if(this->findEntry(this->getINode(inodes.back()), path.back()) != -1)
+            {
+                std::cout << "Failed to import: something exists at " << innerDirectory << " already!" << std::endl;
+                this->failTransaction();
+                return;
+            }
+            rootIdx = this->createDirectory(path.back(), inodes.back());
+        }
+        else
+        {
+            std::cout << "Failed to import: parent of " << innerDirectory << " is not a directory or does not exist!"
+                << std::endl;
+            this->failTransaction();
+            return;
+        }
+        struct Import
+        {
+        public:
+            std::string outer;
+            std::string name;
+            uint32_t parentIdx;
+            bool directory;
+            int64_t inodeIdx;
+            uint64_t size;
+            double millis;
+        };
+        auto start = std::chrono::steady_clock::now();
+        uint64_t total = 0;
+        uint64_t directories = 0;
+        std::vector<double> latencies;
+        uint64_t bytes = 0;
+        ThreadPool pool{std::thread::hardware_concurrency()};
+        // host directories whose entries go into the image directory paired with them next
+        std::vector<std::pair<std::string, uint32_t>> level{{outerDirectory, rootIdx}};
+        while(!level.empty())
+        {
+            std::vector<Import> imports;
+            for(auto& directory : level)
+            {
+                auto dir = opendir(directory.first.c_str());
+                if(dir == nullptr)
+                {
+                    std::cout << "Failed to import " << directory.first << ": could not open directory" << std::endl;
+                    this->failTransaction();
+                    continue;
+                }
+                std::vector<std::string> names;
+                while(auto entry = readdir(dir))
+                {
+                    std::string name{entry->d_name};
+                    if(name != "." && name != "..")
+                    {
+                        names.push_back(name);
+                    }
+                }
+                closedir(dir);
+                std::sort(names.begin(), names.end());
+                for(auto& name : names)
+                {
+                    auto outer = directory.first + "/" + name;
+                    struct stat entry_stat;
+                    if(lstat(outer.c_str(), &entry_stat) == -1 || (!S_ISDIR(entry_stat.st_mode) && !S_ISREG(entry_stat.st_mode)))
+                    {
+                        std::cout << "Skipping " << outer << ": not a regular file or directory" << std::endl;
+                        continue;
+                    }
+                    if(name.size() > 28)
+                    {
+                        std::cout << "Skipping " << outer << ": name is longer than 28 characters" << std::endl;
+                        continue;
+                    }
+                    imports.push_back(Import{outer, name, directory.second, S_ISDIR(entry_stat.st_mode), -1, 0, 0});
+                    total += !S_ISDIR(entry_stat.st_mode);
+                }
+            }
+            level.clear();
+            for(uint64_t first = 0; first < imports.size(); first += IMPORT_BATCH)
+            {
+                auto last = std::min<uint64_t>(imports.size(), first + IMPORT_BATCH);
+                std::vector<uint32_t> inodeIdxs;
+                try
+                {
+                    inodeIdxs = this->allocateINodes(last - first);
+                }
+                catch(const std::runtime_error& error)
+                {
+                    // what was linked so far stays, nothing below it is imported
+                    std::cout << "Failed to import the remaining " << imports.size() - first << " entries at this depth: "
+                        << error.what() << std::endl;
+                    this->failTransaction();
+                    level.clear();
+                    break;
+                }
+                std::vector<uint64_t> made;
+                for(auto i = first; i < last; ++i)
+                {
+                    imports[i].inodeIdx = inodeIdxs[i - first];
+                    if(imports[i].directory)
+                    {
+                        made.push_back(i);
+                    }
+                }
+                if(!made.empty())
+                {
+                    std::vector<uint32_t> blockIdxs = this->allocateDataBlocks(this->getSuperBlock(), made.size());
+                    for(uint64_t j = 0; j < made.size(); ++j)
+                    {
+                        auto& import = imports[made[j]];
+                        this->initializeDirectory(import.inodeIdx, import.parentIdx, blockIdxs[j]);
+                    }
+                }
+                for(auto i = first; i < last; ++i)
+                {
+                    if(imports[i].directory)
+                    {
+                        continue;
+                    }
+                    // every task only touches its own slot
+                    pool.submit([this, &imports, i]() {
+                        auto begin = std::chrono::steady_clock::now();
+                        auto& import = imports[i];
+                        this->initializeFile(import.inodeIdx);
+                        auto inode_ptr = this->getINode(import.inodeIdx);
+                        auto fd = open(import.outer.c_str(), O_RDONLY);
+                        struct stat source_stat;
+                        bool imported = false;
+                        std::string failure{"unknown error"};
+                        try
+                        {
+                            if(fd == -1 || fstat(fd, &source_stat) == -1)
+                            {
+                                throw std::runtime_error("could not access file");
+                            }
+                            import.size = source_stat.st_size;
+                            this->importData(fd, inode_ptr, import.size);
+                            imported = true;
+                        }
+                        catch(const std::exception& error)
+                        {
+                            failure = error.what();
+                        }
+                        catch(...)
+                        {
+                        }
+                        if(!imported)
+                        {
+                            std::cout << "Failed to import " << import.outer << ": " << failure << std::endl;
+                            this->resizeINode(inode_ptr, 0);
+                            this->freeINode(inode_ptr);
+                            import.inodeIdx = -1;
+                        }
+                        if(fd != -1)
+                        {
+                            close(fd);
+                        }
+                        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - begin;
+                        import.millis = took.count();
+                    });
+                }
+                pool.wait();
+                std::map<uint32_t, std::vector<uint64_t>> parents;
+                for(auto i = first; i < last; ++i)
+                {
+                    if(imports[i].inodeIdx != -1)
+                    {
+                        parents[imports[i].parentIdx].push_back(i);
+                    }
+                }
+                for(auto& parent : parents)
+                {
+                    pool.submit([this, &imports, &parent]() {
+                        std::unique_lock<std::shared_timed_mutex> guard{this->inodeLock(parent.first)};
+                        auto parent_ptr = this->getINode(parent.first);
+                        // read once rather than searched for every entry
+                        std::unordered_set<std::string> names;
+                        for(auto file_ptr : this->getFilesForINode(parent_ptr))
+                        {
+                            names.insert(file_ptr->name());
+                        }
+                        std::vector<std::pair<std::string, uint32_t>> entries;
+                        for(auto i : parent.second)
+                        {
+                            auto& import = imports[i];
+                            if(names.count(import.name) == 0)
+                            {
+                                entries.emplace_back(import.name, import.inodeIdx);
+                                continue;
+                            }
+                            std::cout << "Failed to import " << import.outer << ": something exists there already!"
+                                << std::endl;
+                            auto inode_ptr = this->getINode(import.inodeIdx);
+                            this->resizeINode(inode_ptr, 0);
+                            this->freeINode(inode_ptr);
+                            import.inodeIdx = -1;
+                        }
+                        this->linkFiles(parent.first, entries);
+                    });
+                }
+                pool.wait();
+                for(auto i = first; i < last; ++i)
+                {
+                    auto& import = imports[i];
+                    if(import.inodeIdx == -1)
+                    {
+                        continue;
+                    }
+                    if(import.directory)
+                    {
+                        ++directories;
+                        level.emplace_back(import.outer, import.inodeIdx);
+                        continue;
+                    }
+                    latencies.push_back(import.millis);
+                    bytes += import.size;
+                }
+                this->pruneBlocks();
+            }
+        }
+        std::cout << "import: created " << directories << " directories" << std::endl;
+        this->reportBatch("import", total, latencies, bytes, start);
+    }
+    /**
+     * Copies a directory tree of the image out to outerDirectory, which is created along with the directories
+     * below it; the regular files are then copied out on a thread pool.
+     */
+    void FileSystem::exportTree(const std::string& innerDirectory, const std::string& outerDirectory)
+    {
+        std::cout << "Executing export " << innerDirectory << " " << outerDirectory << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting export" << std::endl;
+            return;
+        }
+        auto target = this->getExtendedFilename(this->workingDirectory(), innerDirectory);
+        std::vector<std::string> path = this->parseFilename(target);
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        if(path.size() != inodes.size() || this->getINode(inodes.back())->filetype() != FileType::DIRECTORY)
+        {
+            std::cout << "Failed to export: " << innerDirectory << " is not a directory!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        // each regular file by i-node, with its name in the image and on the host
+        std::vector<std::tuple<uint32_t, std::string, std::string>> copies;
+        uint64_t directories = 0;
+        std::vector<std::tuple<std::string, std::string, uint32_t>> level{std::make_tuple(target, outerDirectory, inodes.back())};
+        while(!level.empty())
+        {
+            std::vector<std::tuple<std::string, std::string, uint32_t>> next;
+            for(auto& directory : level)
+            {
+                auto& outer = std::get<1>(directory);
+                if(::mkdir(outer.c_str(), S_IRWXU) == -1 && errno != EEXIST)
+                {
+                    std::cout << "Failed to export to " << outer << ": could not create directory" << std::endl;
+                    this->failTransaction();
+                    continue;
+                }
+                ++directories;
+                std::shared_lock<std::shared_timed_mutex> guard{this->inodeLock(std::get<2>(directory))};
+                auto inode_ptr = this->getINode(std::get<2>(directory));
+                if(!inode_ptr->allocated() || inode_ptr->filetype() != FileType::DIRECTORY)
+                {
+                    continue;
+                }
+                for(auto file_ptr : this->getFilesForINode(inode_ptr))
+                {
+                    auto name = file_ptr->name();
+                    if(name == "." || name == "..")
+                    {
+                        continue;
+                    }
+                    auto inner = std::get<0>(directory) + name;
+                    if(this->getINode(file_ptr->inode())->filetype() == FileType::DIRECTORY)
+                    {
+                        next.emplace_back(inner + "/", outer + "/" + name, file_ptr->inode());
+                    }
+                    else
+                    {
+                        copies.emplace_back(file_ptr->inode(), inner, outer + "/" + name);
+                    }
+                }
+            }
+            level.swap(next);
+        }
+        std::vector<int64_t> sizes(copies.size(), -1);
+        std::vector<double> millis(copies.size(), 0);
+        {
+            ThreadPool pool{std::thread::hardware_concurrency()};
+            std::cout << "Copying out " << copies.size() << " files into " << directories << " directories on "
+                << pool.size() << " threads" << std::endl;
+            for(uint64_t i = 0; i < copies.size(); ++i)
+            {
+                pool.submit([this, &copies, &sizes, &millis, i]() {
+                    auto begin = std::chrono::steady_clock::now();
+                    auto& copy = copies[i];
+                    try
+                    {
+                        // the file is not looked up again, which would search its directory once for every file in it
+                        std::shared_lock<std::shared_timed_mutex> guard{this->inodeLock(std::get<0>(copy))};
+                        sizes[i] = this->exportINode(this->getINode(std::get<0>(copy)), std::get<1>(copy), std::get<2>(copy));
+                    }
+                    catch(const std::runtime_error& error)
+                    {
+                        std::cout << "Failed to export " << std::get<1>(copy) << ": " << error.what() << std::endl;
+                    }
+                    std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - begin;
+                    millis[i] = took.count();
+                });
+            }
+        }
+        std::vector<double> latencies;
+        uint64_t bytes = 0;
+        for(uint64_t i = 0; i < copies.size(); ++i)
+        {
+            if(sizes[i] != -1)
+            {
+                latencies.push_back(millis[i]);
+                bytes += sizes[i];
+            }
+        }
+        this->reportBatch("export", copies.size(), latencies, bytes, start);
+        this->pruneBlocks();
+    }
+    void FileSystem::rm(const std::string& innerFilename)
+    {
+        std::cout << "Executing rm " << innerFilename << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting rm" << std::endl;
+            return;
+        }
+        if(this->readOnly("rm"))
+        {
+            return;
+        }
+        auto target = this->getExtendedFilename(this->workingDirectory(), innerFilename);
+        std::vector<std::string> path = this->parseFilename(target);
+        for(auto component : path)
+        {
+            std::cout << "Path component: " << component << std::endl;
+        }
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        for(auto inode : inodes)
+        {
+            std::cout << "I-nodes for path: " << std::to_string(inode) << std::endl;
+        }
+        std::unique_lock<std::shared_timed_mutex> parent_guard;
+        std::unique_lock<std::shared_timed_mutex> guard;
+        if(path.size() == inodes.size() && inodes.size() > 1)
+        {
+            parent_guard = std::unique_lock<std::shared_timed_mutex>{this->inodeLock(inodes[inodes.size() - 2])};
+            if(this->findEntry(this->getINode(inodes[inodes.size() - 2]), path[path.size() - 2]) != inodes.back())
+            {
+                inodes.pop_back();
+            }
+            else
+            {
+                guard = std::unique_lock<std::shared_timed_mutex>{this->inodeLock(inodes.back())};
+            }
+        }
+        if(path.size() == inodes.size())
+        {
+            auto inodeIdx = inodes.back();
+            auto inode_ptr = this->getINode(inodeIdx);
+            if(inode_ptr->filetype() != FileType::REGULAR)
+            {
+                std::cout << "Failed to delete: target is not a regular file!" << std::endl;
+                this->failTransaction();
+            }
+            else if(this->isOpen(inodeIdx))
+            {
+                std::cout << "Failed to delete: target is open, close it first!" << std::endl;
+                this->failTransaction();
+            }
+            else
+            {
+                inodes.pop_back();
+                auto parent_ptr = this->getINode(inodes.back());
+                this->resizeINode(inode_ptr, 0);
+                this->freeINode(inode_ptr);
+                if(!this->unlinkFile(parent_ptr, inodeIdx))
+                {
+                    throw std::runtime_error("Could not find child in parent of file " + innerFilename + "!");
+                }
+            }
+        }
+        else
+        {
+            std::cout << "Failed to remove " << innerFilename << " because target could not be located!" << std::endl;
+            this->failTransaction();
+        }
+        this->pruneBlocks();
+    }
+    /**
+     * rm -r: deletes a file or a whole directory tree. Every i-node below it is locked, top down, and its blocks
+     * collected, then all blocks are freed in one batch, the i-nodes are released together and the entry
+     * in the parent is dropped once. Packed tails give their fragment slots back first, as their blocks are shared.
+     */
+    void FileSystem::rmTree(const std::string& innerFilename)
+    {
+        std::cout << "Executing rm -r " << innerFilename << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting rm -r" << std::endl;
+            return;
+        }
+        if(this->readOnly("rm -r"))
+        {
+            return;
+        }
+        // nothing is moved into or out of the tree while it is collected
+        std::lock_guard<std::mutex> rename_guard{this->_renameLock};
+        std::vector<std::string> path = this->parseFilename(this->getExtendedFilename(this->workingDirectory(), innerFilename));
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        if(path.size() != inodes.size() || inodes.size() < 2)
+        {
+            std::cout << "Failed to remove " << innerFilename << " because target could not be located!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        auto name = path[path.size() - 2];
+        if(name == "." || name == "..")
+        {
+            std::cout << "Failed to delete: . and .. cannot be deleted!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        auto rootIdx = inodes.back();
+        auto parentIdx = inodes[inodes.size() - 2];
+        auto removed = this->getWorkingDirectory(parentIdx) + name + "/";
+        if(this->workingDirectory().compare(0, removed.size(), removed) == 0)
+        {
+            std::cout << "Failed to delete: the working directory is inside " << innerFilename << "!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        std::unique_lock<std::shared_timed_mutex> parent_guard{this->inodeLock(parentIdx)};
+        auto parent_ptr = this->getINode(parentIdx);
+        if(this->findEntry(parent_ptr, name) != rootIdx)
+        {
+            std::cout << "Failed to remove " << innerFilename << " because target could not be located!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        std::vector<std::unique_lock<std::shared_timed_mutex>> guards;
+        std::vector<uint32_t> tree{rootIdx};
+        guards.emplace_back(this->inodeLock(rootIdx));
+        for(uint64_t next = 0; next < tree.size(); ++next)
+        {
+            auto inode_ptr = this->getINode(tree[next]);
+            if(inode_ptr->filetype() != FileType::DIRECTORY)
+            {
+                continue;
+            }
+            std::vector<uint32_t> children;
+            for(auto file_ptr : this->getFilesForINode(inode_ptr))
+            {
+                if(file_ptr->name() != "." && file_ptr->name() != "..")
+                {
+                    children.push_back(file_ptr->inode());
+                }
+            }
+            std::sort(children.begin(), children.end());
+            for(auto childIdx : children)
+            {
+                guards.emplace_back(this->inodeLock(childIdx));
+                tree.push_back(childIdx);
+            }
+        }
+        for(auto inodeIdx : tree)
+        {
+            if(this->isOpen(inodeIdx))
+            {
+                std::cout << "Failed to delete: i-node " << inodeIdx << " is open, close it first!" << std::endl;
+                this->failTransaction();
+                return;
+            }
+        }
+        std::vector<uint32_t> blockIdxs;
+        for(auto inodeIdx : tree)
+        {
+            auto inode_ptr = this->getINode(inodeIdx);
+            if(inode_ptr->inlined())
+            {
+                continue;
+            }
+            this->releaseTail(inode_ptr);
+            auto depth = static_cast<uint16_t>(inode_ptr->filesize());
+            for(auto blockIdx : inode_ptr->addr())
+            {
+                this->appendTreeBlocks(blockIdx, depth, 0, blockIdxs);
+            }
+        }
+        this->freeDataBlocks(this->getSuperBlock(), blockIdxs);
+        this->freeINodes(tree);
+        this->unlinkFile(parent_ptr, rootIdx);
+        std::cout << "Removed " << tree.size() << " i-nodes and " << blockIdxs.size() << " blocks under " 
+            << innerFilename << std::endl;
+        this->pruneBlocks();
+    }
+    /**
+     * Moves or renames a file or directory by rewriting directory entries only; a directory also gets its .. entry
+     * pointed at the new parent. A target that is an existing directory receives the source under its own name.
+     */
+    void FileSystem::mv(const std::string& sourceFilename, const std::string& targetFilename)
+    {
+        std::cout << "Executing mv " << sourceFilename << " " << targetFilename << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting mv" << std::endl;
+            return;
+        }
+        if(this->readOnly("mv"))
+        {
+            return;
+        }
+        // only renames move directories, so while this one runs no other changes which directory is inside which
+        std::lock_guard<std::mutex> rename_guard{this->_renameLock};
+        std::vector<std::string> sourcePath = this->parseFilename(
+            this->getExtendedFilename(this->workingDirectory(), sourceFilename));
+        std::vector<uint32_t> sourceINodes = this->getINodesForPath(sourcePath);
+        if(sourcePath.size() != sourceINodes.size() || sourceINodes.size() < 2)
+        {
+            std::cout << "Failed to move: source not found!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        auto name = sourcePath[sourcePath.size() - 2];
+        auto sourceParentIdx = sourceINodes[sourceINodes.size() - 2];
+        auto inodeIdx = sourceINodes.back();
+        if(name == "." || name == "..")
+        {
+            std::cout << "Failed to move: . and .. cannot be moved!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        std::vector<std::string> path = this->parseFilename(this->getExtendedFilename(this->workingDirectory(), targetFilename));
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        uint32_t parentIdx;
+        auto targetName = name;
+        if(path.size() == inodes.size())
+        {
+            std::shared_lock<std::shared_timed_mutex> guard{this->inodeLock(inodes.back())};
+            if(this->getINode(inodes.back())->filetype() != FileType::DIRECTORY)
+            {
+                std::cout << "Failed to move: something exists there already!" << std::endl;
+                this->failTransaction();
+                return;
+            }
+            parentIdx = inodes.back();
+        }
+        else if(inodes.size() == path.size() - 1 && path.back() == "")
+        {
+            parentIdx = inodes.back();
+            targetName = path[path.size() - 2];
+        }
+        else
+        {
+            std::cout << "Failed to move: parent is not a directory or does not exist!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        bool directory;
+        {
+            std::shared_lock<std::shared_timed_mutex> guard{this->inodeLock(inodeIdx)};
+            directory = this->getINode(inodeIdx)->filetype() == FileType::DIRECTORY;
+        }
+        std::vector<uint32_t> ancestors = this->getAncestors(parentIdx);
+        if(directory && std::find(ancestors.begin(), ancestors.end(), inodeIdx) != ancestors.end())
+        {
+            std::cout << "Failed to move: a directory cannot be moved into itself!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        std::string oldPath;
+        std::string newPath;
+        if(directory)
+        {
+            oldPath = this->getWorkingDirectory(inodeIdx);
+            newPath = this->getWorkingDirectory(parentIdx) + targetName + "/";
+        }
+        // a directory is locked before the directories below it, unrelated ones by ascending i-node number
+        auto sourceAncestors = this->getAncestors(sourceParentIdx);
+        auto firstIdx = std::min(sourceParentIdx, parentIdx);
+        if(std::find(ancestors.begin(), ancestors.end(), sourceParentIdx) != ancestors.end())
+        {
+            firstIdx = sourceParentIdx;
+        }
+        else if(std::find(sourceAncestors.begin(), sourceAncestors.end(), parentIdx) != sourceAncestors.end())
+        {
+            firstIdx = parentIdx;
+        }
+        auto secondIdx = firstIdx == sourceParentIdx ? parentIdx : sourceParentIdx;
+        std::unique_lock<std::shared_timed_mutex> first_guard{this->inodeLock(firstIdx)};
+        std::unique_lock<std::shared_timed_mutex> second_guard;
+        if(secondIdx != firstIdx)
+        {
+            second_guard = std::unique_lock<std::shared_timed_mutex>{this->inodeLock(secondIdx)};
+        }
+        auto sourceParent_ptr = this->getINode(sourceParentIdx);
+        auto parent_ptr = this->getINode(parentIdx);
+        if(this->findEntry(sourceParent_ptr, name) != inodeIdx)
+        {
+            std::cout << "Failed to move: source not found!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        if(!parent_ptr->allocated() || parent_ptr->filetype() != FileType::DIRECTORY)
+        {
+            std::cout << "Failed to move: parent is not a directory or does not exist!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        if(this->findEntry(parent_ptr, targetName) != -1)
+        {
+            std::cout << "Failed to move: something exists there already!" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        std::unique_lock<std::shared_timed_mutex> guard{this->inodeLock(inodeIdx)};
+        if(sourceParentIdx == parentIdx)
+        {
+            for(auto file_ptr : this->getFilesForINode(parent_ptr))
+            {
+                if(file_ptr->name() == name)
+                {
+                    file_ptr->name(targetName);
+                    break;
+                }
+            }
+        }
+        else
+        {
+            this->linkFile(targetName, parentIdx, inodeIdx);
+            this->unlinkFile(sourceParent_ptr, inodeIdx);
+            if(directory)
+            {
+                for(auto file_ptr : this->getFilesForINode(this->getINode(inodeIdx)))
+                {
+                    if(file_ptr->name() == "..")
+                    {
+                        file_ptr->inode(parentIdx);
+                        break;
+                    }
+                }
+            }
+        }
+        if(directory)
+        {
+            // a working directory inside the moved one follows it
+            std::lock_guard<std::mutex> cwd_guard{this->_cwdLock};
+            if(this->_working_directory.compare(0, oldPath.size(), oldPath) == 0)
+            {
+                this->_working_directory = newPath + this->_working_directory.substr(oldPath.size());
+                std::cout << "Working directory is now " << this->_working_directory << std::endl;
+            }
+        }
+        std::cout << "Moved i-node " << inodeIdx << " from directory " << sourceParentIdx << " to " 
+            << parentIdx << " as " << targetName << std::endl;
+        this->pruneBlocks();
     }
-    void FileSystem::initfs(uint32_t totalBlocks, uint32_t inodeBlocks)
+    void FileSystem::mkdir(const std::string& innerFilename)
     {
-        std::cout << "Executing initfs " << totalBlocks << " " << inodeBlocks << std::endl;
-        // flush blocks
-        this->_blocks.clear();
-        // total size = totalBlocks * block size = totalBlocks * 1024 bytes
-        // i-nodes = 16 i-nodes per block
-        // total i-nodes = 16 * inodeBlocks
-        // block structure:
-        // ______________________________________________________________________________________
-        // | boot info | superblock | ... i-node blocks ... |        ... data blocks ...        |
-        // |     0     |     1      | 2 to inodeBlocks + 1  | inodeBlocks + 2 to totalBlocks - 1|
-        // ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄ ̄
-        // 1024 bytes per block
-        TOTAL_BLOCKS = totalBlocks;
-        BOOT_INFO_BLOCKS = 1;
-        SUPERBLOCK_BLOCKS = 1;
-        INODE_BLOCKS = inodeBlocks;
-        DATA_BLOCKS = TOTAL_BLOCKS - BOOT_INFO_BLOCKS - SUPERBLOCK_BLOCKS - INODE_BLOCKS;
-        BOOT_INFO_BLOCK_IDX = 0;
-        SUPERBLOCK_IDX = BOOT_INFO_BLOCK_IDX + BOOT_INFO_BLOCKS;
-        INODE_BLOCK_IDX = SUPERBLOCK_IDX + SUPERBLOCK_BLOCKS;
-        DATA_BLOCK_IDX = INODE_BLOCK_IDX + INODE_BLOCKS;
-        OUT_OF_BOUNDS = DATA_BLOCK_IDX + DATA_BLOCKS;
-        std::cout << "Total blocks: " << TOTAL_BLOCKS << std::endl;
-        std::cout << "End of blocks: " << OUT_OF_BOUNDS << std::endl;
-        std::cout << "Data blocks: " << DATA_BLOCKS << std::endl;
-        if(BOOT_INFO_BLOCKS + SUPERBLOCK_BLOCKS + INODE_BLOCKS >= TOTAL_BLOCKS ||
-            TOTAL_BLOCKS != OUT_OF_BOUNDS)
+        std::cout << "Executing mkdir " << innerFilename << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting mkdir" << std::endl;
+            return;
+        }
+        if(this->readOnly("mkdir"))
+        {
+            return;
+        }
+        auto target = this->getExtendedFilename(this->workingDirectory(), innerFilename);
+        std::vector<std::string> path = this->parseFilename(target);
+        for(auto component : path)
+        {
+            std::cout << "Path component: " << component << std::endl;
+        }
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        for(auto inode : inodes)
+        {
+            std::cout << "I-nodes for path: " << std::to_string(inode) << std::endl;
+        }
+        if(path.size() == inodes.size())
+        {
+            std::cout << "Failed to make directory: something exists there already!" << std::endl;
+            this->failTransaction();
+        }
+        else if(path.size() < inodes.size() - 1)
+        {
+            std::cout << "Failed to make directory: parent is not a directory or does not exist!" << std::endl;
+            this->failTransaction();
+        }
+        else
+        {
+            std::cout << "Creating directory " << innerFilename << std::endl;
+            if(path.back() != "")
+            {
+                throw std::runtime_error("Path " + innerFilename + " was not parsed properly!");
+            }
+            path.pop_back();
+            std::unique_lock<std::shared_timed_mutex> parent_guard{this->inodeLock(inodes.back())};
+            if(this->findEntry(this->getINode(inodes.back()), path.back()) != -1)
+            {
+                std::cout << "Failed to make directory: something exists there already!" << std::endl;
+                this->failTransaction();
+                return;
+            }
+            auto inode = this->createDirectory(path.back(), inodes.back());
+            std::cout << "i-node for new directory: " << std::to_string(inode) << std::endl;
+        }
+        this->pruneBlocks();
+    }
+    void FileSystem::cd(const std::string& innerFilename)
+    {
+        std::cout << "Executing cd " << innerFilename << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting cd" << std::endl;
+            return;
+        }
+        auto target = this->getExtendedFilename(this->workingDirectory(), innerFilename);
+        std::vector<std::string> path = this->parseFilename(target);
+        for(auto component : path)
+        {
+            std::cout << "Path component: " << component << std::endl;
+        }
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        for(auto inode : inodes)
+        {
+            std::cout << "I-nodes for path: " << std::to_string(inode) << std::endl;
+        }
+        if(path.size() == inodes.size())
+        {
+            auto inode_ptr = this->getINode(inodes.back());
+            if(inode_ptr->filetype() != FileType::DIRECTORY)
+            {
+                std::cout << "Failed to change directory: target is not a directory!" << std::endl;
+                this->failTransaction();
+            }
+            else
+            {
+                auto workingDirectory = this->getWorkingDirectory(inodes.back());
+                {
+                    std::lock_guard<std::mutex> guard{this->_cwdLock};
+                    this->_working_directory = workingDirectory;
+                }
+                std::cout << "Moving to directory: " << workingDirectory << std::endl;
+            }
+        }
+        else
+        {
+            std::cout << "Failed to change directory: target not found!" << std::endl;
+            this->failTransaction();
+        }
+        this->pruneBlocks();
+    }
+    void FileSystem::pwd()
+    {
+        std::cout << "Executing pwd" << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting pwd" << std::endl;
+            return;
+        }
+        std::cout << this->workingDirectory() << std::endl;
+    }
+    void FileSystem::ls()
+    {
+        std::cout << "Executing ls" << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting ls" << std::endl;
+            return;
+        }
+        std::vector<uint32_t> inodes = this->getINodesForPath(this->parseFilename(this->workingDirectory()));
+        auto inodeIdx = inodes.back();
+        std::shared_lock<std::shared_timed_mutex> guard{this->inodeLock(inodeIdx)};
+        std::vector<std::shared_ptr<File>> file_ptrs = this->getFilesForINode(this->getINode(inodeIdx));
+        for(auto file_ptr : file_ptrs)
+        {
+            std::cout << file_ptr->name();
+            if(this->getINode(file_ptr->inode())->filetype() == FileType::DIRECTORY)
+            {
+                std::cout << "/";
+            }
+            std::cout << std::endl;
+        }
+    }
+    /**
+     * Turns deduplication of cpin data on or off. The first time it is turned on, the reference count table
+     * and the hash index are created in data blocks; both stay around afterwards since shared blocks remain shared.
+     */
+    void FileSystem::dedup(bool enabled)
+    {
+        std::cout << "Executing dedup " << (enabled ? "on" : "off") << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting dedup" << std::endl;
+            return;
+        }
+        if(this->readOnly("dedup"))
+        {
+            return;
+        }
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        if(!bootblock_ptr->valid())
+        {
+            throw std::runtime_error("File system was initialized without extension support, cannot dedup!");
+        }
+        if(enabled)
+        {
+            this->createRefcounts(bootblock_ptr);
+        }
+        bootblock_ptr->dedup(enabled);
+        std::cout << *bootblock_ptr << std::endl;
+        bootblock_ptr.reset();
+        this->pruneBlocks();
+    }
+    /**
+     * Turns compression of files copied in with cpin on or off. Files keep the mode they were stored with.
+     */
+    void FileSystem::compress(bool enabled)
+    {
+        std::cout << "Executing compress " << (enabled ? "on" : "off") << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting compress" << std::endl;
+            return;
+        }
+        if(this->readOnly("compress"))
+        {
+            return;
+        }
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        if(!bootblock_ptr->valid())
+        {
+            throw std::runtime_error("File system was initialized without extension support, cannot compress!");
+        }
+        bootblock_ptr->compress(enabled);
+        std::cout << *bootblock_ptr << std::endl;
+        bootblock_ptr.reset();
+        this->pruneBlocks();
+    }
+    /**
+     * Takes a snapshot of the whole image. Only the i-node blocks are copied, and whatever under them commands change
+     * in place: directories, indirect blocks and fragment blocks. File data blocks gain a reference instead,
+     * so a later command that modifies one copies it first and the snapshot keeps the old contents.
+     */
+    void FileSystem::snapshot(const std::string& name)
+    {
+        std::cout << "Executing snapshot " << name << std::endl;
+        // nothing may change while the trees are frozen
+        std::unique_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting snapshot" << std::endl;
+            return;
+        }
+        if(this->readOnly("snapshot"))
+        {
+            return;
+        }
+        if(this->_transaction)
+        {
+            std::cout << "A transaction is open, aborting snapshot" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        if(name.empty() || name.size() > SnapshotList::MAX_NAME)
+        {
+            std::cout << "Snapshot names have 1 to " << SnapshotList::MAX_NAME << " characters, aborting snapshot" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        JournalOperation operation{*this};
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        if(!bootblock_ptr->valid())
+        {
+            throw std::runtime_error("File system was initialized without extension support, cannot snapshot!");
+        }
+        if(this->INODE_BLOCKS > 255)
+        {
+            throw std::runtime_error("File system of " + std::to_string(this->INODE_BLOCKS) 
+                + " i-node blocks has too many to snapshot!");
+        }
+        int32_t entry = 0;
+        if(bootblock_ptr->snapshots() != 0)
+        {
+            SnapshotList list{this->getBlock(bootblock_ptr->snapshots())};
+            if(list.find(name) != -1)
+            {
+                std::cout << "Snapshot " << name << " exists already, aborting snapshot" << std::endl;
+                this->failTransaction();
+                return;
+            }
+            entry = list.unused();
+            if(entry == -1)
+            {
+                std::cout << "Image has " << SnapshotList::ENTRIES << " snapshots already, aborting snapshot" << std::endl;
+                this->failTransaction();
+                return;
+            }
+        }
+        this->createRefcounts(bootblock_ptr);
+        std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+        if(bootblock_ptr->snapshots() == 0)
+        {
+            bootblock_ptr->snapshots(this->allocateDataBlock(superblock_ptr));
+        }
+        auto tableIdx = this->createTable(superblock_ptr, this->INODE_BLOCKS);
+        superblock_ptr.reset();
+        uint64_t files = 0;
+        std::unordered_map<uint32_t, uint32_t> copies;
+        {
+            BlockTable refcounts{this, bootblock_ptr->refcounts()};
+            BlockTable table{this, tableIdx};
+            for(uint32_t n = 0; n < this->INODE_BLOCKS; ++n)
+            {
+                table.block(n)->asBytes() = this->getBlock(this->INODE_BLOCK_IDX + n)->asBytes();
+                for(uint32_t offset = 0; offset < 16; ++offset)
+                {
+                    std::shared_ptr<INode> inode_ptr{new INode(table.block(n), offset)};
+                    if(!inode_ptr->allocated())
+                    {
+                        continue;
+                    }
+                    ++files;
+                    if(inode_ptr->inlined())
+                    {
+                        continue;
+                    }
+                    uint32_t tail = 0;
+                    if(inode_ptr->tailPacked())
+                    {
+                        tail = this->lookupBlocks(inode_ptr, {(inode_ptr->size() - 1) / 1024}).front();
+                    }
+                    auto directory = inode_ptr->filetype() == FileType::DIRECTORY;
+                    auto depth = static_cast<uint16_t>(inode_ptr->filesize());
+                    auto addr = inode_ptr->addr();
+                    for(auto& blockIdx : addr)
+                    {
+                        blockIdx = this->freezeBlock(refcounts, blockIdx, depth, directory, tail, copies);
+                    }
+                    inode_ptr->addr(addr);
+                }
+            }
+        }
+        SnapshotList list{this->getBlock(bootblock_ptr->snapshots())};
+        list.set(entry, name, tableIdx, static_cast<uint32_t>(std::time(nullptr)));
+        std::cout << "Took snapshot " << name << " of " << files << " files, copying " << this->INODE_BLOCKS 
+            << " i-node blocks and " << copies.size() << " other blocks" << std::endl;
+        std::cout << list << std::endl;
+        bootblock_ptr.reset();
+        this->pruneBlocks();
+    }
+    void FileSystem::snapshots()
+    {
+        std::cout << "Executing snapshots" << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
         {
-            throw std::invalid_argument("Invalid overflow given " + std::to_string(TOTAL_BLOCKS)
-                + " blocks total and " + std::to_string(INODE_BLOCKS) + " i-node blocks");
+            std::cout << "openfs has not been called successfully, aborting snapshots" << std::endl;
+            return;
+        }
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        if(bootblock_ptr->snapshots() == 0)
+        {
+            std::cout << "Image has no snapshots" << std::endl;
+            return;
+        }
+        SnapshotList list{this->getBlock(bootblock_ptr->snapshots())};
+        for(uint32_t entry = 0; entry < SnapshotList::ENTRIES; ++entry)
+        {
+            if(!list.used(entry))
+            {
+                continue;
+            }
+            std::time_t time = list.time(entry);
+            std::tm local;
+            localtime_r(&time, &local);
+            std::cout << list.name(entry) << " taken " << std::put_time(&local, "%Y-%m-%d %H:%M:%S")
+                << (list.name(entry) == this->_snapshot ? ", mounted" : "") << std::endl;
         }
+    }
+    /**
+     * Drops a snapshot: blocks only it points at are freed, blocks it shares with the image lose a reference.
+     */
+    void FileSystem::deleteSnapshot(const std::string& name)
+    {
+        std::cout << "Executing snapshot-rm " << name << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
         if(this->_fd == -1)
         {
-            std::cout << "openfs has not been called successfully, aborting initfs" << std::endl;
+            std::cout << "openfs has not been called successfully, aborting snapshot-rm" << std::endl;
             return;
         }
-        ftruncate(this->_fd, 0);
-        ftruncate(this->_fd, TOTAL_BLOCKS * 1024);
-        this->setDimensions(totalBlocks, inodeBlocks);
+        if(this->readOnly("snapshot-rm"))
+        {
+            return;
+        }
+        std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+        std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+        auto listIdx = bootblock_ptr->snapshots();
+        std::shared_ptr<SnapshotList> list_ptr;
+        if(listIdx != 0)
+        {
+            list_ptr = std::make_shared<SnapshotList>(this->getBlock(listIdx));
+        }
+        auto entry = list_ptr ? list_ptr->find(name) : -1;
+        if(entry == -1)
+        {
+            std::cout << "Image has no snapshot " << name << ", aborting snapshot-rm" << std::endl;
+            this->failTransaction();
+            return;
+        }
+        auto tableIdx = list_ptr->table(entry);
+        std::vector<uint32_t> freed;
+        // a fragment block holds the tails of several files
+        std::set<uint32_t> fragments;
+        {
+            BlockTable table{this, tableIdx};
+            for(uint32_t n = 0; n < table.blocks(); ++n)
+            {
+                for(uint32_t offset = 0; offset < 16; ++offset)
+                {
+                    std::shared_ptr<INode> inode_ptr{new INode(table.block(n), offset)};
+                    if(!inode_ptr->allocated() || inode_ptr->inlined())
+                    {
+                        continue;
+                    }
+                    uint32_t tail = 0;
+                    if(inode_ptr->tailPacked())
+                    {
+                        tail = this->lookupBlocks(inode_ptr, {(inode_ptr->size() - 1) / 1024}).front();
+                        fragments.insert(tail);
+                    }
+                    auto depth = static_cast<uint16_t>(inode_ptr->filesize());
+                    for(auto blockIdx : inode_ptr->addr())
+                    {
+                        this->appendTreeBlocks(blockIdx, depth, tail, freed);
+                    }
+                }
+            }
+            std::shared_ptr<Block> block_ptr = this->getBlock(tableIdx);
+            std::array<uint32_t, 256>& directory = block_ptr->asIntegers();
+            freed.insert(freed.end(), directory.begin() + 1, directory.begin() + 1 + table.blocks());
+            freed.push_back(tableIdx);
+        }
+        freed.insert(freed.end(), fragments.begin(), fragments.end());
+        list_ptr->clear(entry);
+        auto empty = list_ptr->empty();
+        list_ptr.reset();
         std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
-        superblock_ptr->isize(INODE_BLOCKS);
-        superblock_ptr->fsize(TOTAL_BLOCKS);
-        superblock_ptr->nfree(0);
-        superblock_ptr->flock('\0');
-        superblock_ptr->ilock('\0');
-        superblock_ptr->fmod('\0');
-        superblock_ptr->time(0);
-        this->initializeFreeList(superblock_ptr);
+        this->freeDataBlocks(superblock_ptr, freed);
+        if(empty)
+        {
+            bootblock_ptr->snapshots(0);
+            this->freeDataBlock(superblock_ptr, listIdx);
+        }
+        std::cout << "Deleted snapshot " << name << std::endl;
+        bootblock_ptr.reset();
         superblock_ptr.reset();
-        this->initializeINodes();
-        this->initializeRoot();
-        this->_blocks.clear();
+        this->pruneBlocks();
     }
-    void FileSystem::cpin(const std::string& outerFilename, const std::string& innerFilename)
+    /**
+     * Checks the image in up to three passes: while repairing the directory tree changes entries, blocks are claimed
+     * again before they are compared with the free list, and only a checked free list hands out blocks to /lost+found. Magazines and the blocks the journal released go back on the
+     * free list first, so only blocks that really went missing, e.g. in a crash, show up as leaked.
+     */
+    void FileSystem::fsck(bool repair)
+    {
+        const uint32_t PASSES = 3;
+        std::string command{repair ? "fsck -r" : "fsck"};
+        std::cout << "Executing " << command << std::endl;
+        // nothing may change while blocks are claimed
+        std::unique_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting " << command << std::endl;
+            return;
+        }
+        if(repair && this->readOnly(command))
+        {
+            return;
+        }
+        if(this->_transaction)
+        {
+            std::cout << "A transaction is open, aborting " << command << std::endl;
+            this->failTransaction();
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        uint64_t problems = 0;
+        uint64_t repaired = 0;
+        uint64_t inodes = 0;
+        for(uint32_t pass = 1; pass <= PASSES; ++pass)
+        {
+            this->settle();
+            JournalOperation operation{*this};
+            BlockUsage usage{this->TOTAL_BLOCKS};
+            Scan scan = this->scanImage(usage, repair);
+            auto changed = this->checkDirectories(scan);
+            if(changed == 0)
+            {
+                this->checkFragments(usage, scan);
+                this->checkBlocks(usage, scan);
+            }
+            for(auto& problem : scan.problems)
+            {
+                std::cout << problem << std::endl;
+            }
+            if(changed == 0)
+            {
+                changed = this->linkLost(scan);
+            }
+            problems += scan.problems.size();
+            repaired += scan.repaired;
+            inodes = scan.inodes;
+            if(changed == 0)
+            {
+                break;
+            }
+            std::cout << "Changed " << changed << " directory entries" << (pass < PASSES ? ", claiming blocks again" 
+                : ", run fsck -r again to check the blocks") << std::endl;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << command << ": checked " << inodes << " i-nodes and " << this->DATA_BLOCKS << " data blocks in "
+            << elapsed.count() << " s, found " << problems << " problems";
+        if(repair)
+        {
+            std::cout << " and repaired " << repaired;
+        }
+        std::cout << std::endl;
+        this->pruneBlocks();
+    }
+    /**
+     * Counts the extents, runs of adjacent blocks, that each regular file of the image is in and, unless measuring
+     * only, moves every file in more than one into a single run of free blocks, in tree order: each indirect block
+     * right before the blocks under it. Blocks with other owners by reference count, and everything under such an
+     * indirect block, stay where they are, as do packed tails and open files. With a journal the blocks moved away
+     * from are only released by the commit, so the free list is sorted once more after it.
+     */
+    void FileSystem::defrag(bool measure)
+    {
+        std::string command{measure ? "defrag -n" : "defrag"};
+        std::cout << "Executing " << command << std::endl;
+        // nothing else may allocate while blocks are picked off the free list by hand
+        std::unique_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting " << command << std::endl;
+            return;
+        }
+        if(!measure && this->readOnly(command))
+        {
+            return;
+        }
+        if(this->_transaction)
+        {
+            std::cout << "A transaction is open, aborting " << command << std::endl;
+            this->failTransaction();
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        // regular files in the order of the directory tree, so the files of a directory end up next to each other
+        std::vector<std::pair<uint32_t, std::string>> files;
+        std::vector<std::pair<uint32_t, std::string>> directories{{0, "/"}};
+        std::vector<bool> visited(this->INODE_BLOCKS * 16ull, false);
+        visited[0] = true;
+        for(uint64_t next = 0; next < directories.size(); ++next)
+        {
+            std::map<std::string, uint32_t> children;
+            for(auto file_ptr : this->getFilesForINode(this->getINode(directories[next].first)))
+            {
+                auto childIdx = file_ptr->inode();
+                if(file_ptr->name() != "." && file_ptr->name() != ".." && childIdx < visited.size() && !visited[childIdx])
+                {
+                    visited[childIdx] = true;
+                    children[file_ptr->name()] = childIdx;
+                }
+            }
+            for(auto& child : children)
+            {
+                auto filetype = this->getINode(child.second)->filetype();
+                if(filetype == FileType::DIRECTORY)
+                {
+                    directories.emplace_back(child.second, directories[next].second + child.first + "/");
+                }
+                else if(filetype == FileType::REGULAR)
+                {
+                    files.emplace_back(child.second, directories[next].second + child.first);
+                }
+            }
+        }
+        auto extentsOf = [](const std::vector<uint32_t>& blockIdxs) {
+            uint64_t extents = 0;
+            for(uint64_t i = 0; i < blockIdxs.size(); ++i)
+            {
+                extents += i == 0 || blockIdxs[i] != blockIdxs[i - 1] + 1;
+            }
+            return extents;
+        };
+        uint64_t blocks = 0;
+        uint64_t before = 0;
+        uint64_t after = 0;
+        uint64_t fragmented = 0;
+        uint64_t movedFiles = 0;
+        uint64_t movedBlocks = 0;
+        auto sortAll = [this]() {
+            JournalOperation operation{*this};
+            std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+            std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+            std::vector<uint32_t> blockIdxs;
+            std::vector<uint32_t> chain;
+            if(!this->readFreeList(superblock_ptr, blockIdxs, chain))
+            {
+                return false;
+            }
+            blockIdxs.insert(blockIdxs.end(), chain.begin(), chain.end());
+            this->sortFreeList(superblock_ptr, blockIdxs, chain);
+            return true;
+        };
+        if(!measure)
+        {
+            this->settle();
+            // the list is then held by the highest free blocks, which nothing is moved into: the image on disk keeps
+            // using them until the moves commit
+            if(this->_journal)
+            {
+                JournalOperation operation{*this};
+                std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+                std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+                std::vector<uint32_t> blockIdxs;
+                std::vector<uint32_t> chain;
+                if(!this->readFreeList(superblock_ptr, blockIdxs, chain))
+                {
+                    std::cout << "The free list is damaged, run fsck -r before " << command << std::endl;
+                    return;
+                }
+                for(auto blockIdx : chain)
+                {
+                    this->_journal->free(blockIdx);
+                }
+                this->sortFreeList(superblock_ptr, blockIdxs, {});
+            }
+            this->settle();
+            this->pruneBlocks();
+        }
+        {
+            JournalOperation operation{*this};
+            std::lock_guard<std::recursive_mutex> guard{this->_allocatorLock};
+            std::shared_ptr<SuperBlock> superblock_ptr = this->getSuperBlock();
+            std::vector<uint32_t> freeBlocks;
+            std::vector<uint32_t> chain;
+            if(!measure && !this->readFreeList(superblock_ptr, freeBlocks, chain))
+            {
+                std::cout << "The free list is damaged, run fsck -r before " << command << std::endl;
+                return;
+            }
+            std::vector<bool> free(this->TOTAL_BLOCKS, false);
+            if(!this->_journal)
+            {
+                freeBlocks.insert(freeBlocks.end(), chain.begin(), chain.end());
+            }
+            for(auto blockIdx : freeBlocks)
+            {
+                free[blockIdx] = true;
+            }
+            // first fit from where the last run was found, so files follow each other
+            uint32_t cursor = this->DATA_BLOCK_IDX;
+            auto findRun = [this, &free, &cursor](uint64_t length) -> uint32_t {
+                for(auto from : {cursor, this->DATA_BLOCK_IDX})
+                {
+                    uint64_t found = 0;
+                    for(auto blockIdx = from; blockIdx < this->OUT_OF_BOUNDS; ++blockIdx)
+                    {
+                        found = free[blockIdx] ? found + 1 : 0;
+                        if(found == length)
+                        {
+                            cursor = blockIdx + 1;
+                            return blockIdx + 1 - length;
+                        }
+                    }
+                }
+                return 0;
+            };
+            std::shared_ptr<BootBlock> bootblock_ptr = this->getBootBlock();
+            auto valid = bootblock_ptr->valid();
+            BlockTable refcounts{this, valid ? bootblock_ptr->refcounts() : 0};
+            BlockTable index{this, valid ? bootblock_ptr->hashIndex() : 0};
+            // slots of the blocks in the dedup index, which follow them when they move
+            std::unordered_map<uint32_t, uint64_t> indexed;
+            for(uint64_t slot = 0; !measure && slot < index.entries(); ++slot)
+            {
+                uint32_t* entry = index.entry(slot);
+                if(entry[1] != 0 && entry[1] != BlockTable::REMOVED)
+                {
+                    indexed[entry[1]] = slot;
+                }
+            }
+            for(auto& file : files)
+            {
+                auto inode_ptr = this->getINode(file.first);
+                if(inode_ptr->inlined())
+                {
+                    continue;
+                }
+                auto size = inode_ptr->size();
+                auto depth = static_cast<uint16_t>(inode_ptr->filesize());
+                auto span = this->blockSpan(depth) / 1024;
+                auto tail = inode_ptr->tailPacked() && size != 0 ? (size - 1) / 1024 : UINT64_MAX;
+                std::vector<std::pair<uint32_t, uint16_t>> layout;
+                auto addr = inode_ptr->addr();
+                for(uint64_t n = 0; n < addr.size(); ++n)
+                {
+                    this->appendTreeLayout(addr[n], depth, n * span, tail, layout);
+                }
+                std::vector<uint32_t> blockIdxs;
+                for(auto& entry : layout)
+                {
+                    blockIdxs.push_back(entry.first);
+                }
+                auto extents = extentsOf(blockIdxs);
+                blocks += blockIdxs.size();
+                before += extents;
+                if(extents <= 1)
+                {
+                    after += extents;
+                    continue;
+                }
+                ++fragmented;
+                std::string report{file.second + ": " + std::to_string(blockIdxs.size()) + " blocks in "
+                    + std::to_string(extents) + " extents"};
+                // a shared indirect block keeps what is below it in place, which ends at the next entry as deep
+                std::vector<uint32_t> movable;
+                int32_t shared = -1;
+                for(auto& entry : layout)
+                {
+                    if(shared > entry.second)
+                    {
+                        continue;
+                    }
+                    shared = -1;
+                    if(refcounts.exists() && refcounts.counter(entry.first) != 0)
+                    {
+                        shared = entry.second > 0 ? entry.second : -1;
+                        continue;
+                    }
+                    movable.push_back(entry.first);
+                }
+                std::unordered_map<uint32_t, uint32_t> moves;
+                for(uint64_t i = 0; i < movable.size(); ++i)
+                {
+                    // past the last block until a run is found, where they are adjacent to nothing that stays
+                    moves[movable[i]] = this->TOTAL_BLOCKS + i;
+                }
+                auto remap = [&moves](std::vector<uint32_t> blockIdxs) {
+                    for(auto& blockIdx : blockIdxs)
+                    {
+                        auto found = moves.find(blockIdx);
+                        blockIdx = found == moves.end() ? blockIdx : found->second;
+                    }
+                    return blockIdxs;
+                };
+                uint32_t run = 0;
+                if(!measure)
+                {
+                    if(extentsOf(remap(blockIdxs)) >= extents)
+                    {
+                        report += ", left in place as the blocks it shares keep it apart";
+                    }
+                    else if(this->isOpen(file.first))
+                    {
+                        report += ", left in place as it is open";
+                    }
+                    else if((run = findRun(movable.size())) == 0)
+                    {
+                        report += ", left in place as there is no run of " + std::to_string(movable.size()) + " free blocks";
+                    }
+                }
+                if(run == 0)
+                {
+                    std::cout << report << std::endl;
+                    after += extents;
+                    continue;
+                }
+                for(auto& move : moves)
+                {
+                    move.second = run + (move.second - this->TOTAL_BLOCKS);
+                    free[move.second] = false;
+                }
+                this->moveBlocks(inode_ptr, layout, moves);
+                for(auto& move : moves)
+                {
+                    auto found = indexed.find(move.first);
+                    if(found != indexed.end())
+                    {
+                        index.entry(found->second)[1] = move.second;
+                    }
+                    if(this->_journal)
+                    {
+                        this->_journal->free(move.first);
+                        continue;
+                    }
+                    std::shared_ptr<Block> block_ptr = this->getBlock(move.first);
+                    std::fill(block_ptr->asIntegers().begin(), block_ptr->asIntegers().end(), 0);
+                    free[move.first] = true;
+                }
+                auto now = extentsOf(remap(blockIdxs));
+                after += now;
+                ++movedFiles;
+                movedBlocks += moves.size();
+                std::cout << report << ", now " << now << " at block " << run << std::endl;
+                this->pruneBlocks();
+            }
+            if(!measure)
+            {
+                std::vector<uint32_t> blockIdxs;
+                for(auto blockIdx = this->DATA_BLOCK_IDX; blockIdx < this->OUT_OF_BOUNDS; ++blockIdx)
+                {
+                    if(free[blockIdx])
+                    {
+                        blockIdxs.push_back(blockIdx);
+                    }
+                }
+                if(this->_journal)
+                {
+                    blockIdxs.insert(blockIdxs.end(), chain.begin(), chain.end());
+                }
+                else
+                {
+                    // those that were moved into hold data now
+                    chain.erase(std::remove_if(chain.begin(), chain.end(), [&free](uint32_t blockIdx) {
+                        return !free[blockIdx];
+                    }), chain.end());
+                }
+                this->sortFreeList(superblock_ptr, blockIdxs, chain);
+            }
+        }
+        if(!measure && this->_journal && movedBlocks != 0)
+        {
+            this->settle();
+            sortAll();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << command << ": " << files.size() << " files have " << blocks << " blocks in ";
+        if(measure)
+        {
+            std::cout << before << " extents, " << fragmented << " files are in more than one";
+        }
+        else
+        {
+            std::cout << after << " extents, down from " << before << " by moving " << movedBlocks << " blocks of "
+                << movedFiles << " files";
+        }
+        std::cout << ", in " << elapsed.count() << " s" << std::endl;
+        this->pruneBlocks();
+    }
+    int32_t FileSystem::openFile(const std::string& innerFilename)
+    {
+        std::cout << "Executing open " << innerFilename << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        if(this->_fd == -1)
+        {
+            std::cout << "openfs has not been called successfully, aborting open" << std::endl;
+            return -1;
+        }
+        auto target = this->getExtendedFilename(this->workingDirectory(), innerFilename);
+        std::vector<std::string> path = this->parseFilename(target);
+        std::vector<uint32_t> inodes = this->getINodesForPath(path);
+        if(path.size() != inodes.size())
+        {
+            std::cout << "Failed to open: target not found!" << std::endl;
+            this->failTransaction();
+            this->pruneBlocks();
+            return -1;
+        }
+        auto inodeIdx = inodes.back();
+        std::shared_lock<std::shared_timed_mutex> guard;
+        if(inodes.size() > 1)
+        {
+            std::shared_lock<std::shared_timed_mutex> parent_guard{this->inodeLock(inodes[inodes.size() - 2])};
+            if(this->findEntry(this->getINode(inodes[inodes.size() - 2]), path[path.size() - 2]) != inodeIdx)
+            {
+                std::cout << "Failed to open: target not found!" << std::endl;
+                this->failTransaction();
+                this->pruneBlocks();
+                return -1;
+            }
+            guard = std::shared_lock<std::shared_timed_mutex>{this->inodeLock(inodeIdx)};
+        }
+        auto inode_ptr = this->getINode(inodeIdx);
+        if(inode_ptr->filetype() != FileType::REGULAR)
+        {
+            std::cout << "Failed to open: target is not a regular file!" << std::endl;
+            this->failTransaction();
+            this->pruneBlocks();
+            return -1;
+        }
+        // rm checks for open handles with the i-node locked, so registering under the same lock cannot race it
+        std::lock_guard<std::mutex> handle_guard{this->_handleLock};
+        // handles on the same i-node share one block map, so a write through one is seen by all
+        std::shared_ptr<std::vector<uint32_t>> blocks;
+        for(auto handle_ptr : this->_handles)
+        {
+            if(handle_ptr && handle_ptr->inodeIdx() == inodeIdx)
+            {
+                blocks = handle_ptr->blocks();
+                break;
+            }
+        }
+        if(!blocks)
+        {
+            blocks = std::make_shared<std::vector<uint32_t>>(this->blocksForSize(inode_ptr->size()), FileHandle::UNMAPPED);
+        }
+        std::shared_ptr<FileHandle> handle_ptr{new FileHandle(inodeIdx, inode_ptr, blocks)};
+        auto slot = std::find(this->_handles.begin(), this->_handles.end(), nullptr);
+        int32_t handle = slot - this->_handles.begin();
+        if(slot == this->_handles.end())
+        {
+            this->_handles.push_back(handle_ptr);
+        }
+        else
+        {
+            *slot = handle_ptr;
+        }
+        std::cout << "Opened " << innerFilename << " as handle " << handle << ": " << *handle_ptr << std::endl;
+        this->pruneBlocks();
+        return handle;
+    }
+    void FileSystem::closeFile(int32_t handle)
+    {
+        std::cout << "Executing close " << handle << std::endl;
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        this->getHandle(handle);
+        std::lock_guard<std::mutex> guard{this->_handleLock};
+        this->_handles[handle].reset();
+        while(!this->_handles.empty() && !this->_handles.back())
+        {
+            this->_handles.pop_back();
+        }
+        this->pruneBlocks();
+    }
+    /**
+     * Reads up to length bytes at offset, stopping at the end of the file.
+     * Only the blocks covering the range are looked up and read; holes come back as zeros.
+     */
+    std::vector<uint8_t> FileSystem::readFile(int32_t handle, uint64_t offset, uint64_t length)
+    {
+        auto fs_guard = sharedLock(this->_fsLock);
+        auto handle_ptr = this->getHandle(handle);
+        auto guard = sharedLock(this->inodeLock(handle_ptr->inodeIdx()));
+        auto size = handle_ptr->inode()->size();
+        if(offset >= size || length == 0)
+        {
+            return std::vector<uint8_t>{};
+        }
+        length = std::min(length, size - offset);
+        std::vector<uint8_t> result(length, 0);
+        if(handle_ptr->inode()->inlined())
+        {
+            auto data = handle_ptr->inode()->inlineData();
+            std::copy(data.begin() + offset, data.begin() + offset + length, result.begin());
+            return result;
+        }
+        if(handle_ptr->inode()->compressed())
+        {
+            std::vector<uint8_t> cluster(CLUSTER_BYTES);
+            for(auto clusterIdx = offset / CLUSTER_BYTES; clusterIdx * CLUSTER_BYTES < offset + length; ++clusterIdx)
+            {
+                this->readCluster(handle_ptr->inode(), clusterIdx, cluster.data());
+                auto begin = std::max(offset, clusterIdx * CLUSTER_BYTES);
+                auto end = std::min(offset + length, (clusterIdx + 1) * CLUSTER_BYTES);
+                std::copy(cluster.begin() + (begin - clusterIdx * CLUSTER_BYTES), cluster.begin() + (end - clusterIdx * CLUSTER_BYTES),
+                    result.begin() + (begin - offset));
+            }
+            this->pruneBlocks();
+            return result;
+        }
+        auto first = offset / 1024;
+        auto last = (offset + length - 1) / 1024;
+        std::vector<uint32_t> blocks = this->getHandleBlocks(handle_ptr, first, last - first + 1);
+        for(auto logical = first; logical <= last; ++logical)
+        {
+            auto blockIdx = blocks[logical - first];
+            if(blockIdx == 0)
+            {
+                continue;
+            }
+            auto begin = std::max(offset, logical * 1024);
+            auto end = std::min(offset + length, (logical + 1) * 1024);
+            // a packed tail starts at its slot in the fragment block
+            auto base = handle_ptr->inode()->tailPacked() && logical == (size - 1) / 1024 ? 
+                handle_ptr->inode()->tailSlot() * 32 : 0;
+            std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+            std::array<uint8_t, 1024>& bytes = block_ptr->asBytes();
+            std::copy(bytes.begin() + base + begin % 1024, bytes.begin() + base + (end - 1) % 1024 + 1, 
+                result.begin() + (begin - offset));
+        }
+        this->pruneBlocks();
+        return result;
+    }
+    /**
+     * Writes data at offset, growing the file if needed.
+     * Only the blocks covering the range are touched; holes get a block only if something other than zeros lands in them.
+     */
+    uint64_t FileSystem::writeFile(int32_t handle, uint64_t offset, const std::vector<uint8_t>& data)
     {
-        std::cout << "Executing cpin " << outerFilename << " " << innerFilename << std::endl;
-        if(this->_fd == -1)
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        auto handle_ptr = this->getHandle(handle);
+        if(!this->_snapshotINodes.empty())
         {
-            std::cout << "openfs has not been called successfully, aborting cpin" << std::endl;
-            return;
+            throw std::runtime_error("Snapshot " + this->_snapshot + " is mounted read-only, aborting write");
         }
-        auto fd = open(outerFilename.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-        auto accessible = fd != -1;
-        auto exists = access(outerFilename.c_str(), F_OK) != -1;
-        if(!exists)
+        std::unique_lock<std::shared_timed_mutex> guard{this->inodeLock(handle_ptr->inodeIdx())};
+        auto inode_ptr = handle_ptr->inode();
+        if(data.empty())
         {
-            throw std::runtime_error("File " + outerFilename + " does not exist!");
+            return 0;
         }
-        else if(!accessible)
+        auto length = static_cast<uint64_t>(data.size());
+        if(offset + length < offset)
         {
-            throw std::runtime_error("Could not access file " + outerFilename + "!");
+            throw std::overflow_error("Write of " + std::to_string(length) + " bytes at " 
+                + std::to_string(offset) + " overflows!");
         }
-
-        auto target = this->getExtendedFilename(this->_working_directory, innerFilename);
-        std::vector<std::string> path = this->parseFilename(target);
-        for(auto component : path)
+        if(offset + length > inode_ptr->size())
         {
-            std::cout << "Path component: " << component << std::endl;
+            this->truncateHandle(handle_ptr, offset + length);
         }
-        std::vector<uint32_t> inodes = this->getINodesForPath(path);
-        for(auto inode : inodes)
+        if(inode_ptr->inlined())
         {
-            std::cout << "I-nodes for path: " << std::to_string(inode) << std::endl;
+            auto inline_data = inode_ptr->inlineData();
+            std::copy(data.begin(), data.end(), inline_data.begin() + offset);
+            inode_ptr->inlineData(inline_data);
+            return length;
         }
-        if(path.size() == inodes.size())
+        auto changed = this->unpackINode(inode_ptr);
+        if(inode_ptr->compressed())
         {
-            std::cout << "Failed to copy in: something exists there already!" << std::endl;
+            // written clusters are stored raw from now on, only cpin compresses
+            for(auto cluster = offset / CLUSTER_BYTES; cluster * CLUSTER_BYTES < offset + length; ++cluster)
+            {
+                changed = this->expandCluster(inode_ptr, cluster) || changed;
+            }
         }
-        else if(path.size() < inodes.size() - 1)
+        if(changed)
         {
-            std::cout << "Failed to copy in: parent is not a directory or does not exist!" << std::endl;
+            auto& cached = *handle_ptr->blocks();
+            std::fill(cached.begin(), cached.end(), FileHandle::UNMAPPED);
         }
-        else
+        auto first = offset / 1024;
+        auto last = (offset + length - 1) / 1024;
+        std::vector<uint32_t> blocks = this->getHandleBlocks(handle_ptr, first, last - first + 1);
+        std::vector<uint64_t> logicals;
+        for(auto logical = first; logical <= last; ++logical)
         {
-            std::cout << "Creating directory " << innerFilename << std::endl;
-            if(path.back() != "")
+            auto begin = std::max(offset, logical * 1024) - offset;
+            auto end = std::min(offset + length, (logical + 1) * 1024) - offset;
+            auto nonzero = std::any_of(data.begin() + begin, data.begin() + end, [](uint8_t byte) { return byte != 0; });
+            if(blocks[logical - first] == 0 && nonzero)
             {
-                throw std::runtime_error("Path " + innerFilename + " was not parsed properly!");
+                logicals.push_back(logical);
             }
-            path.pop_back();
-            auto inodeIdx = this->createFile(path.back(), inodes.back());
-            std::cout << "i-node for new directory: " << std::to_string(inodeIdx) << std::endl;
-            auto bytes_read = 1024;
-            char data_buffer[1024] = {0};
-            auto address = 0;
-            auto inode_ptr = this->getINode(inodeIdx);
-            while(bytes_read == 1024)
+        }
+        std::vector<uint32_t> mapped = this->mapBlocks(inode_ptr, logicals);
+        auto& cached = *handle_ptr->blocks();
+        for(uint64_t i = 0; i < logicals.size(); ++i)
+        {
+            cached[logicals[i]] = mapped[i];
+            blocks[logicals[i] - first] = mapped[i];
+        }
+        for(auto logical = first; logical <= last; ++logical)
+        {
+            auto blockIdx = blocks[logical - first];
+            if(blockIdx == 0)
             {
-                bytes_read = read(fd, &data_buffer, 1024);
-                if(bytes_read == 0)
-                {
-                    break;
-                }
-                this->resizeINode(inode_ptr, inode_ptr->size() + bytes_read);
-                auto block_ptr = this->getBlockForAddress(inode_ptr, address);
-                std::cout << "[cpin]Writing to block " << block_ptr->index() << std::endl;
-                address += bytes_read;
-                std::array<uint8_t, 1024>& block_data = block_ptr->asBytes();
-                for(auto idx = 0; idx < address; ++idx)
-                {
-                    block_data[idx] = data_buffer[idx];
-                    std::cout << block_data[idx] << ", " << std::endl;
-                }
-                for(auto idx = address; idx < 1024; ++idx)
-                {
-                    block_data[idx] = 0;
-                }
+                continue;
             }
+            blockIdx = this->ownBlock(inode_ptr, logical, blockIdx);
+            cached[logical] = blockIdx;
+            auto begin = std::max(offset, logical * 1024);
+            auto end = std::min(offset + length, (logical + 1) * 1024);
+            std::shared_ptr<Block> block_ptr = this->getBlock(blockIdx);
+            std::array<uint8_t, 1024>& bytes = block_ptr->asBytes();
+            std::copy(data.begin() + (begin - offset), data.begin() + (end - offset), bytes.begin() + begin % 1024);
         }
-        std::cout << std::to_string(this->getBlock(18)->asBytes()[1023]) << std::endl;
-        this->_blocks.clear();
-        std::cout << std::to_string(this->getBlock(18)->asBytes()[0]) << std::endl;
+        this->pruneBlocks();
+        return length;
     }
-    void FileSystem::cpout(const std::string& innerFilename, const std::string& outerFilename)
+    // sequential read at the handle's offset, which moves past what was read
+    std::vector<uint8_t> FileSystem::readFile(int32_t handle, uint64_t length)
     {
-        std::cout << "Executing cpout " << innerFilename << " " << outerFilename << std::endl;
-        if(this->_fd == -1)
+        auto handle_ptr = this->getHandle(handle);
+        std::vector<uint8_t> result = this->readFile(handle, handle_ptr->offset(), length);
+        handle_ptr->offset(handle_ptr->offset() + result.size());
+        return result;
+    }
+    // sequential write at the handle's offset, which moves past what was written
+    uint64_t FileSystem::writeFile(int32_t handle, const std::vector<uint8_t>& data)
+    {
+        auto handle_ptr = this->getHandle(handle);
+        auto written = this->writeFile(handle, handle_ptr->offset(), data);
+        handle_ptr->offset(handle_ptr->offset() + written);
+        return written;
+    }
+    uint64_t FileSystem::seekFile(int32_t handle, uint64_t offset)
+    {
+        auto handle_ptr = this->getHandle(handle);
+        handle_ptr->offset(offset);
+        return offset;
+    }
+    /**
+     * Resizes the open file with the recursive resize, keeping the cached block map in step:
+     * blocks below the new end keep their place, anything added is a hole.
+     */
+    void FileSystem::truncateFile(int32_t handle, uint64_t size)
+    {
+        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+        JournalOperation operation{*this};
+        auto handle_ptr = this->getHandle(handle);
+        if(!this->_snapshotINodes.empty())
         {
-            std::cout << "openfs has not been called successfully, aborting cpout" << std::endl;
-            return;
+            throw std::runtime_error("Snapshot " + this->_snapshot + " is mounted read-only, aborting truncate");
         }
-        auto target = this->getExtendedFilename(this->_working_directory, innerFilename);
-        std::vector<std::string> path = this->parseFilename(target);
-        for(auto component : path)
+        std::unique_lock<std::shared_timed_mutex> guard{this->inodeLock(handle_ptr->inodeIdx())};
+        this->truncateHandle(handle_ptr, size);
+    }
+    // FileSystem::truncateFile with the i-node already locked
+    void FileSystem::truncateHandle(std::shared_ptr<FileHandle> handle_ptr, uint64_t size)
+    {
+        auto packed = handle_ptr->inode()->inlined() || handle_ptr->inode()->tailPacked() || handle_ptr->inode()->compressed();
+        this->resizeINode(handle_ptr->inode(), size);
+        handle_ptr->blocks()->resize(this->blocksForSize(size), 0);
+        if(packed)
         {
-            std::cout << "Path component: " << component << std::endl;
+            // moving packed data around changes which block backs the end of the file
+            std::fill(handle_ptr->blocks()->begin(), handle_ptr->blocks()->end(), FileHandle::UNMAPPED);
         }
-        std::vector<uint32_t> inodes = this->getINodesForPath(path);
-        for(auto inode : inodes)
+        this->pruneBlocks();
+    }
+    std::shared_ptr<FileHandle> FileSystem::getHandle(int32_t handle)
+    {
+        std::lock_guard<std::mutex> guard{this->_handleLock};
+        if(handle < 0 || handle >= static_cast<int32_t>(this->_handles.size()) || !this->_handles[handle])
         {
-            std::cout << "I-nodes for path: " << std::to_string(inode) << std::endl;
+            throw std::invalid_argument("File handle " + std::to_string(handle) + " is not open");
         }
-        if(path.size() == inodes.size())
+        return this->_handles[handle];
+    }
+    /**
+     * Block map entries [first, first + count) of an open file, looking up only the ones not cached yet.
+     */
+    std::vector<uint32_t> FileSystem::getHandleBlocks(std::shared_ptr<FileHandle> handle_ptr, uint64_t first, uint64_t count)
+    {
+        // readers of the same i-node fill the shared map concurrently, so it is only touched under _handleLock
+        auto& cached = *handle_ptr->blocks();
+        std::vector<uint64_t> logicals;
         {
-            auto inode_ptr = this->getINode(inodes.back());
-            if(!inode_ptr->allocated())
-            {
-                throw std::runtime_error("Tried to access deallocated i-node for file " + innerFilename + "!");
-            }
-            if(inode_ptr->filetype() != FileType::REGULAR)
-            {
-                std::cout << "Failed to copy out: source is not a regular file!" << std::endl;
-            }
-            else
+            std::lock_guard<std::mutex> guard{this->_handleLock};
+            for(auto logical = first; logical < first + count; ++logical)
             {
-                auto fd = open(outerFilename.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-                auto accessible = fd != -1;
-                auto exists = access(outerFilename.c_str(), F_OK) != -1;
-                if(!exists)
-                {
-                    throw std::runtime_error("File " + outerFilename + " does not exist!");
-                }
-                else if(!accessible)
-                {
-                    throw std::runtime_error("Could not access file " + outerFilename + "!");
-                }
-                auto size = inode_ptr->size();
-                std::cout << "file size is: " << size << " bytes" << std::endl;
-                char buffer[1024] = {0};
-                ftruncate(fd, 1024 * (1 + size / 1024));
-                for(uint64_t address = 0; address < size; address += 1024)
+                if(cached[logical] == FileHandle::UNMAPPED)
                 {
-                    std::shared_ptr<Block> block_ptr = this->getBlockForAddress(inode_ptr, address);
-                    std::array<uint8_t, 1024>& bytes = block_ptr->asBytes();
-                    for(auto i = 0; i < 1024; ++i)
-                    {
-                        if(bytes[i] != 0)
-                        {
-                            std::cout << "Writing byte: " << bytes[i] << std::endl;
-                        }
-                        buffer[i] = bytes[i];
-                    }
-                    lseek(fd, address, SEEK_SET);
-                    write(fd, &buffer, 1024);
+                    logicals.push_back(logical);
                 }
-                ftruncate(fd, inode_ptr->size());
             }
         }
-        else
+        std::vector<uint32_t> found = this->lookupBlocks(handle_ptr->inode(), logicals);
+        std::lock_guard<std::mutex> guard{this->_handleLock};
+        for(uint64_t i = 0; i < logicals.size(); ++i)
         {
-            std::cout << "Failed to copy out: source not found!" << std::endl;
+            cached[logicals[i]] = found[i];
         }
-        this->_blocks.clear();
+        return std::vector<uint32_t>{cached.begin() + first, cached.begin() + first + count};
     }
-    void FileSystem::rm(const std::string& innerFilename)
+    bool FileSystem::isOpen(uint32_t inodeIdx)
     {
-        std::cout << "Executing rm " << innerFilename << std::endl;
-        if(this->_fd == -1)
+        std::lock_guard<std::mutex> guard{this->_handleLock};
+        return std::any_of(this->_handles.begin(), this->_handles.end(), 
+            [inodeIdx](std::shared_ptr<FileHandle> handle_ptr) { return handle_ptr && handle_ptr->inodeIdx() == inodeIdx; });
+    }
+    EventLoop& FileSystem::loop()
+    {
+        std::lock_guard<std::mutex> guard{this->_asyncLock};
+        if(!this->_loop)
         {
-            std::cout << "openfs has not been called successfully, aborting rm" << std::endl;
-            return;
+            this->_loop.reset(new EventLoop(LOOP_THREADS, IO_THREADS));
         }
-        auto target = this->getExtendedFilename(this->_working_directory, innerFilename);
-        std::vector<std::string> path = this->parseFilename(target);
-        for(auto component : path)
+        return *this->_loop;
+    }
+    bool FileSystem::beginAsync()
+    {
+        std::lock_guard<std::mutex> guard{this->_asyncLock};
+        if(this->_asyncPauses != 0)
         {
-            std::cout << "Path component: " << component << std::endl;
+            return false;
         }
-        std::vector<uint32_t> inodes = this->getINodesForPath(path);
-        for(auto inode : inodes)
+        ++this->_asyncOps;
+        return true;
+    }
+    // notifies under the lock, as pauseAsync in ~FileSystem may return and tear the loop down right after
+    void FileSystem::endAsync()
+    {
+        std::lock_guard<std::mutex> guard{this->_asyncLock};
+        if(--this->_asyncOps == 0)
         {
-            std::cout << "I-nodes for path: " << std::to_string(inode) << std::endl;
+            this->_asyncIdle.notify_all();
         }
-        if(path.size() == inodes.size())
-        {
-            auto inodeIdx = inodes.back();
-            auto inode_ptr = this->getINode(inodeIdx);
-            if(inode_ptr->filetype() != FileType::REGULAR)
+    }
+    void FileSystem::runAttempt(std::shared_ptr<Attempt> attempt)
+    {
+        auto run = [this, attempt]() {
+            std::vector<uint32_t> missing;
+            std::shared_timed_mutex* busy = nullptr;
+            std::exception_ptr error;
+            try
             {
-                std::cout << "Failed to delete: target is not a regular file!" << std::endl;
+                NonBlocking nonBlocking{!attempt->blocking};
+                attempt->body();
             }
-            else
+            catch(const BlockMiss& miss)
             {
-                inodes.pop_back();
-                auto parent_ptr = this->getINode(inodes.back());
-                this->resizeINode(inode_ptr, 0);
-                this->freeINode(inode_ptr);
-                std::vector<std::shared_ptr<File>> files = this->getFilesForINode(parent_ptr);
-                auto last_ptr = files.back();
-                if(last_ptr->inode() == inodeIdx)
-                {
-                    last_ptr->inode(0);
-                    std::array<char, 28> filename = last_ptr->filename();
-                    std::fill(filename.begin(), filename.end(), '\0');
-                    last_ptr->filename(filename);
-                    this->resizeINode(parent_ptr, parent_ptr->size() - 32);
-                }
-                else
+                missing = miss.blocks();
+            }
+            catch(const LockBusy& held)
+            {
+                busy = &held.mutex();
+            }
+            catch(...)
+            {
+                error = std::current_exception();
+            }
+            if(missing.empty() && !busy)
+            {
+                this->finishAttempt(attempt, error);
+                return;
+            }
+            // openfs and initfs, which replace the i-node locks, wait for attempts in flight, so a busy lock outlives the wait
+            this->loop().io([this, attempt, missing, busy]() {
+                try
                 {
-                    auto backup = last_ptr;
-                    bool found = false;
-                    for(auto file_ptr : files)
+                    if(busy)
                     {
-                        if(file_ptr->inode() == inodeIdx)
+                        // waited for only briefly, so I/O threads stay free for reads of other attempts; if it is
+                        // still held, or held again by the time the attempt runs, the attempt comes back here
+                        if(busy->try_lock_shared_for(LOCK_WAIT))
                         {
-                            found = true;
-                            file_ptr->inode(last_ptr->inode());
-                            file_ptr->filename(last_ptr->filename());
-                            last_ptr->inode(0);
-                            std::array<char, 28> filename = last_ptr->filename();
-                            std::fill(filename.begin(), filename.end(), '\0');
-                            last_ptr->filename(filename);
-                            this->resizeINode(parent_ptr, parent_ptr->size() - 32);
-                            break;
+                            busy->unlock_shared();
                         }
                     }
-                    if(!found)
+                    else
                     {
-                        throw std::runtime_error("Could not find child in parent of file " + innerFilename + "!");
+                        std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+                        if(this->_fd == -1)
+                        {
+                            throw std::runtime_error("openfs has not been called successfully, aborting asynchronous operation");
+                        }
+                        for(auto blockIdx : missing)
+                        {
+                            attempt->pins.push_back(this->getBlock(blockIdx));
+                        }
                     }
                 }
-                std::vector<std::shared_ptr<File>> otherfiles;
-
-            }
+                catch(...)
+                {
+                    this->finishAttempt(attempt, std::current_exception());
+                    return;
+                }
+                // the run posted below may finish the attempt before this task is out of submit,
+                // so this task counts as in flight until then
+                {
+                    std::lock_guard<std::mutex> guard{this->_asyncLock};
+                    ++this->_asyncOps;
+                }
+                this->runAttempt(attempt);
+                this->endAsync();
+            });
+        };
+        if(attempt->blocking)
+        {
+            this->loop().io(run);
         }
         else
         {
-            std::cout << "Failed to remove " << innerFilename << " because target could not be located!" << std::endl;
+            this->loop().post(run);
         }
-        this->_blocks.clear();
     }
-    void FileSystem::mkdir(const std::string& innerFilename)
+    /**
+     * Drops the pins and counts the operation as done before settling it,
+     * so continuations may start new operations or wait for the image to be reopened.
+     */
+    void FileSystem::finishAttempt(std::shared_ptr<Attempt> attempt, std::exception_ptr error)
     {
-        std::cout << "Executing mkdir " << innerFilename << std::endl;
-        if(this->_fd == -1)
-        {
-            std::cout << "openfs has not been called successfully, aborting mkdir" << std::endl;
-            return;
-        }
-        auto target = this->getExtendedFilename(this->_working_directory, innerFilename);
-        std::vector<std::string> path = this->parseFilename(target);
-        for(auto component : path)
-        {
-            std::cout << "Path component: " << component << std::endl;
-        }
-        std::vector<uint32_t> inodes = this->getINodesForPath(path);
-        for(auto inode : inodes)
-        {
-            std::cout << "I-nodes for path: " << std::to_string(inode) << std::endl;
-        }
-        if(path.size() == inodes.size())
-        {
-            std::cout << "Failed to make directory: something exists there already!" << std::endl;
-        }
-        else if(path.size() < inodes.size() - 1)
+        attempt->pins.clear();
+        this->endAsync();
+        if(error)
         {
-            std::cout << "Failed to make directory: parent is not a directory or does not exist!" << std::endl;
+            attempt->fail(error);
         }
         else
         {
-            std::cout << "Creating directory " << innerFilename << std::endl;
-            if(path.back() != "")
+            attempt->succeed();
+        }
+    }
+    void FileSystem::pauseAsync()
+    {
+        std::unique_lock<std::mutex> guard{this->_asyncLock};
+        ++this->_asyncPauses;
+        this->_asyncIdle.wait(guard, [this]() { return this->_asyncOps == 0; });
+    }
+    void FileSystem::resumeAsync()
+    {
+        std::lock_guard<std::mutex> guard{this->_asyncLock};
+        --this->_asyncPauses;
+    }
+    Async<int64_t> FileSystem::lookup(const std::string& innerFilename)
+    {
+        return this->startAsync<int64_t>(false, [this, innerFilename]() -> int64_t {
+            auto fs_guard = sharedLock(this->_fsLock);
+            if(this->_fd == -1)
             {
-                throw std::runtime_error("Path " + innerFilename + " was not parsed properly!");
+                throw std::runtime_error("openfs has not been called successfully, aborting lookup");
             }
-            path.pop_back();
-            auto inode = this->createDirectory(path.back(), inodes.back());
-            std::cout << "i-node for new directory: " << std::to_string(inode) << std::endl;
-        }
-        this->_blocks.clear();
+            std::vector<std::string> path = this->parseFilename(
+                this->getExtendedFilename(this->workingDirectory(), innerFilename));
+            std::vector<uint32_t> inodes = this->getINodesForPath(path);
+            return path.size() == inodes.size() ? static_cast<int64_t>(inodes.back()) : -1;
+        });
     }
-    void FileSystem::cd(const std::string& innerFilename)
+    Async<int64_t> FileSystem::create(const std::string& innerFilename)
     {
-        std::cout << "Executing cd " << innerFilename << std::endl;
-        if(this->_fd == -1)
-        {
-            std::cout << "openfs has not been called successfully, aborting cd" << std::endl;
-            return;
-        }
-        auto target = this->getExtendedFilename(this->_working_directory, innerFilename);
-        std::vector<std::string> path = this->parseFilename(target);
-        for(auto component : path)
-        {
-            std::cout << "Path component: " << component << std::endl;
-        }
-        std::vector<uint32_t> inodes = this->getINodesForPath(path);
-        for(auto inode : inodes)
-        {
-            std::cout << "I-nodes for path: " << std::to_string(inode) << std::endl;
-        }
-        if(path.size() == inodes.size())
-        {
-            auto inode_ptr = this->getINode(inodes.back());
-            if(inode_ptr->filetype() != FileType::DIRECTORY)
+        // allocating and linking change the image halfway, so this one may not stop at a miss
+        return this->startAsync<int64_t>(true, [this, innerFilename]() -> int64_t {
+            std::shared_lock<std::shared_timed_mutex> fs_guard{this->_fsLock};
+            JournalOperation operation{*this};
+            if(this->_fd == -1)
             {
-                std::cout << "Failed to change directory: target is not a directory!" << std::endl;
+                throw std::runtime_error("openfs has not been called successfully, aborting create");
             }
-            else
+            if(!this->_snapshotINodes.empty())
             {
-                this->_working_directory = this->getWorkingDirectory(inodes.back());
-                std::cout << "Moving to directory: " << this->_working_directory << std::endl;
+                throw std::runtime_error("Snapshot " + this->_snapshot + " is mounted read-only, aborting create");
             }
-        }
-        else
-        {
-            std::cout << "Failed to change directory: target not found!" << std::endl;
-        }
-        this->_blocks.clear();
-    }
-    void FileSystem::pwd()
-    {
-        std::cout << "Executing pwd" << std::endl;
-        if(this->_fd == -1)
-        {
-            std::cout << "openfs has not been called successfully, aborting pwd" << std::endl;
-            return;
-        }
-        std::cout << this->_working_directory << std::endl;
+            std::vector<std::string> path = this->parseFilename(
+                this->getExtendedFilename(this->workingDirectory(), innerFilename));
+            std::vector<uint32_t> inodes = this->getINodesForPath(path);
+            if(path.size() == inodes.size())
+            {
+                throw std::runtime_error("Failed to create " + innerFilename + ": something exists there already!");
+            }
+            if(inodes.size() != path.size() - 1 || path.back() != "")
+            {
+                throw std::runtime_error("Failed to create " + innerFilename + ": parent is not a directory or does not exist!");
+            }
+            path.pop_back();
+            std::unique_lock<std::shared_timed_mutex> parent_guard{this->inodeLock(inodes.back())};
+            auto parent_ptr = this->getINode(inodes.back());
+            if(!parent_ptr->allocated() || parent_ptr->filetype() != FileType::DIRECTORY)
+            {
+                throw std::runtime_error("Failed to create " + innerFilename + ": parent is not a directory or does not exist!");
+            }
+            if(this->findEntry(parent_ptr, path.back()) != -1)
+            {
+                throw std::runtime_error("Failed to create " + innerFilename + ": something exists there already!");
+            }
+            auto inodeIdx = this->createFile(path.back(), inodes.back());
+            this->pruneBlocks();
+            return inodeIdx;
+        });
     }
-    void FileSystem::ls()
+    /**
+     * readFile without waiting for the image: the data blocks of the range that are not in use
+     * are asked for all at once, then the read runs again with them pinned.
+     */
+    Async<std::vector<uint8_t>> FileSystem::read(int32_t handle, uint64_t offset, uint64_t length)
     {
-        std::cout << "Executing ls" << std::endl;
-        if(this->_fd == -1)
-        {
-            std::cout << "openfs has not been called successfully, aborting ls" << std::endl;
-            return;
-        }
-        std::vector<uint32_t> inodes = this->getINodesForPath(this->parseFilename(this->_working_directory));
-        auto inodeIdx = inodes.back();
-        std::vector<std::shared_ptr<File>> file_ptrs = this->getFilesForINode(this->getINode(inodeIdx));
-        for(auto file_ptr : file_ptrs)
-        {
-            std::cout << file_ptr->name();
-            if(this->getINode(file_ptr->inode())->filetype() == FileType::DIRECTORY)
+        return this->startAsync<std::vector<uint8_t>>(false, [this, handle, offset, length]() {
             {
-                std::cout << "/";
+                auto fs_guard = sharedLock(this->_fsLock);
+                auto handle_ptr = this->getHandle(handle);
+                auto guard = sharedLock(this->inodeLock(handle_ptr->inodeIdx()));
+                auto inode_ptr = handle_ptr->inode();
+                auto size = inode_ptr->size();
+                if(offset < size && length != 0 && !inode_ptr->inlined() && !inode_ptr->compressed())
+                {
+                    auto first = offset / 1024;
+                    auto last = (offset + std::min(length, size - offset) - 1) / 1024;
+                    std::vector<uint32_t> missing;
+                    for(auto blockIdx : this->getHandleBlocks(handle_ptr, first, last - first + 1))
+                    {
+                        if(blockIdx != 0 && !this->_cache->find(blockIdx))
+                        {
+                            missing.push_back(blockIdx);
+                        }
+                    }
+                    if(!missing.empty())
+                    {
+                        throw BlockMiss(missing);
+                    }
+                }
             }
-            std::cout << std::endl;
-        }
+            return this->readFile(handle, offset, length);
+        });
     }
     void FileSystem::sl()
     {
@@ -1205,6 +6885,15 @@ namespace ModV6FileSystem
         this->ls();
         this->rm("abc123_v6");
         this->ls();
+        // a command that fails inside a transaction discards it, which takes an image large enough for a journal
+        this->initfs(1000, 15);
+        this->cd("/");
+        this->begin();
+        this->mkdir("tx");
+        this->rm("missing");
+        this->mkdir("tx/level1");
+        this->commit();
+        this->ls();
         this->quit();
     }
 }
\ No newline at end of file
@@ -1,26 +1,94 @@
 #pragma once
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
 #include <string>
+#include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <sstream>
+#include <thread>
 #include <vector>
+#include <dirent.h>
 #include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdexcept>
 #include <string>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include "inode.hpp"
 #include "block.hpp"
+#include "cache.hpp"
+#include "bootblock.hpp"
+#include "handle.hpp"
+#include "table.hpp"
+#include "lz.hpp"
+#include "magazine.hpp"
+#include "pool.hpp"
+#include "pipeline.hpp"
+#include "async.hpp"
+#include "loop.hpp"
+#include "journal.hpp"
+#include "durability.hpp"
+#include "snapshot.hpp"
+#include "usage.hpp"
 
 namespace ModV6FileSystem
 {
+    // Commands may run concurrently from several threads; a handle is used by one thread at a time.
+    // Locks are taken by the commands, never by the helpers they call, in this order:
+    // _fsLock (exclusive only for openfs, initfs and quit), then _renameLock, then i-node locks, a directory before
+    // anything in it or below it and otherwise by ascending i-node number, then _allocatorLock for the free list, free i-nodes,
+    // reference counts, the hash index and fragment blocks, then _magazineLock and the magazines.
+    // _handleLock and _cwdLock are innermost.
+    // Asynchronous operations run as attempts on an event loop, each taking and dropping its locks like a command.
+    // An attempt never reads the image: a block that is not in use makes it stop, and it is run again once the blocks
+    // it missed were read on an I/O thread and pinned. Neither does it wait for a lock that is held: it stops the same
+    // way and runs again once an I/O thread could take the lock. openfs and initfs wait for attempts in flight, as
+    // those pin blocks of the current image, so they must not be called from a continuation.
+    // Commands that change the image run as journal operations, see journal.hpp. A thread inside one must not wait for
+    // another thread that has yet to start its own, as a commit may be holding new operations back.
     struct FileSystem
     {
     public:
-        std::vector<std::weak_ptr<Block>> _blocks;
+        std::shared_ptr<BlockCache> _cache;
+        // indexed by handle number, closed handles are null
+        std::vector<std::shared_ptr<FileHandle>> _handles;
         int32_t _fd;
         std::string _working_directory;
+        std::shared_timed_mutex _fsLock;
+        // one per i-node: shared to read the file or directory, exclusive to change it
+        std::unique_ptr<std::shared_timed_mutex[]> _inodeLocks;
+        std::recursive_mutex _allocatorLock;
+        std::mutex _handleLock;
+        std::mutex _cwdLock;
+        // held by mv across its lookups and locks, see FileSystem::mv
+        std::mutex _renameLock;
+        // never reused, so a thread's magazine for one file system is not mistaken for another's
+        const uint64_t _id;
+        std::mutex _magazineLock;
+        std::vector<std::shared_ptr<Magazine>> _magazines;
+        // set once the image has reference counts, frees then have to check them under _allocatorLock
+        std::atomic<bool> _refcounted;
+        // asynchronous operations in flight, and openfs or initfs calls waiting for them to finish
+        std::mutex _asyncLock;
+        std::condition_variable _asyncIdle;
+        uint64_t _asyncOps;
+        uint32_t _asyncPauses;
+        std::unique_ptr<EventLoop> _loop;
         uint32_t TOTAL_BLOCKS;
         uint32_t BOOT_INFO_BLOCKS;
         uint32_t SUPERBLOCK_BLOCKS;
@@ -31,47 +99,287 @@ namespace ModV6FileSystem
         uint32_t INODE_BLOCK_IDX;
         uint32_t DATA_BLOCK_IDX;
         uint32_t OUT_OF_BOUNDS;
+        uint32_t JOURNAL_BLOCKS;
+        uint32_t JOURNAL_BLOCK_IDX;
+        // metadata journal of the open image, null if it has none; only replaced with _fsLock held exclusively
+        std::shared_ptr<Journal> _journal;
+        Durability _durability;
+        std::shared_ptr<Syncer> _syncer;
+        // write-backs of the cache covered by the last periodic sync, for images without a journal
+        std::atomic<uint64_t> _syncedWriteBacks;
+        // open transaction and the thread that began it. Every block used while it is open stays pinned until it ends,
+        // so metadata is staged and data written back once; blocks it allocated are zeroed if it is rolled back.
+        std::atomic<bool> _transaction;
+        std::thread::id _transactionOwner;
+        bool _transactionFailed;
+        std::mutex _transactionLock;
+        std::unordered_map<uint32_t, std::shared_ptr<Block>> _transactionPins;
+        std::vector<uint32_t> _transactionBlocks;
+        // blocks freed during a transaction on an image without a journal, kept off the free list until their
+        // zeroed copies are written back, as data copied straight into a reused block would be clobbered
+        std::vector<uint32_t> _transactionFreed;
+        // snapshot openfs mounted read-only and the blocks of its i-node table copy, empty for the image itself
+        std::string _snapshot;
+        std::vector<uint32_t> _snapshotINodes;
 
         void reset();
-        void setDimensions(uint32_t totalBlocks, uint32_t inodeBlocks);
+        void setDimensions(uint32_t totalBlocks, uint32_t inodeBlocks, uint32_t journalBlocks);
+        void openJournal();
+        void closeJournal();
+        void commitJournal(std::shared_ptr<Journal> journal);
+        void openSyncer(int32_t fd, Durability durability);
+        void closeSyncer();
+        void syncCommand();
+        bool ownsTransaction();
+        void failTransaction();
+        void endTransaction();
+        void rollbackTransaction();
+        void noteAllocated(const std::vector<uint32_t>& blockIdxs);
+        void noteFreed(std::shared_ptr<SuperBlock> superblock_ptr, const std::vector<uint32_t>& blockIdxs);
+        void scrubFreeList();
+        bool mountSnapshot(const std::string& name);
+        bool readOnly(const std::string& command);
         std::shared_ptr<Block> getBlock(uint32_t blockIdx);
+        void pruneBlocks();
         std::shared_ptr<INode> getINode(uint32_t inodeIdx);
         std::array<std::shared_ptr<File>, 32> getFiles(uint32_t blockIdx);
         std::shared_ptr<SuperBlock> getSuperBlock();
+        std::shared_ptr<BootBlock> getBootBlock();
+        std::shared_ptr<Magazine> magazine();
+        void flushMagazines();
+        void stockMagazine(std::shared_ptr<SuperBlock> superblock_ptr, const std::vector<uint32_t>& blockIdxs);
+        std::vector<uint32_t> takeFreeBlocks(std::shared_ptr<SuperBlock> superblock_ptr, uint64_t count);
+        void returnFreeBlocks(std::shared_ptr<SuperBlock> superblock_ptr, const std::vector<uint32_t>& blockIdxs);
         void freeDataBlock(std::shared_ptr<SuperBlock> superblock_ptr, uint32_t blockIdx);
         uint32_t allocateDataBlock(std::shared_ptr<SuperBlock> superblock_ptr);
+        std::vector<uint32_t> allocateDataBlocks(std::shared_ptr<SuperBlock> superblock_ptr, uint64_t count);
+        void freeDataBlocks(std::shared_ptr<SuperBlock> superblock_ptr, const std::vector<uint32_t>& blockIdxs);
         void freeINode(std::shared_ptr<INode> inode_ptr);
+        void freeINodes(const std::vector<uint32_t>& inodeIdxs);
         uint32_t allocateINode();
+        std::vector<uint32_t> allocateINodes(uint64_t count);
         void initializeFreeList(std::shared_ptr<SuperBlock> superblock_ptr);
         void initializeINodes();
         void initializeRoot();
+        std::shared_timed_mutex& inodeLock(uint32_t inodeIdx);
+        std::string workingDirectory();
+        int64_t findEntry(std::shared_ptr<INode> inode_ptr, const std::string& name);
         std::string getExtendedFilename(std::string workingDirectory, std::string filename);
         std::vector<std::string> parseFilename(std::string filename);
         std::vector<uint32_t> getINodesForPath(std::vector<std::string> path);
         std::vector<uint32_t> getBlocksForINode(std::shared_ptr<INode> inode_ptr);
         std::vector<std::shared_ptr<File>> getFilesForINode(std::shared_ptr<INode> inode_ptr);
         std::string getWorkingDirectory(uint32_t inodeIdx);
+        std::vector<uint32_t> getAncestors(uint32_t inodeIdx);
         uint32_t createDirectory(std::string name, uint32_t parentIdx);
+        void initializeDirectory(uint32_t inodeIdx, uint32_t parentIdx, uint32_t blockIdx);
         uint32_t createFile(std::string name, uint32_t parentIdx);
+        void initializeFile(uint32_t inodeIdx);
+        void linkFile(std::string name, uint32_t parentIdx, uint32_t inodeIdx);
+        void linkFiles(uint32_t parentIdx, const std::vector<std::pair<std::string, uint32_t>>& entries);
+        bool unlinkFile(std::shared_ptr<INode> parent_ptr, uint32_t inodeIdx);
         std::shared_ptr<File> addFileToINode(std::shared_ptr<INode> inode_ptr);
+        uint64_t blocksForSize(uint64_t size);
+        uint64_t blockSpan(uint16_t depth);
+        FileSize fileSizeForBlocks(uint64_t blocks);
         void resizeINode(std::shared_ptr<INode> inode_ptr, uint64_t size);
+        bool unpackINode(std::shared_ptr<INode> inode_ptr);
+        bool packTail(std::shared_ptr<INode> inode_ptr, const uint8_t* data, uint64_t length);
+        std::vector<uint8_t> readTail(std::shared_ptr<INode> inode_ptr);
+        void releaseTail(std::shared_ptr<INode> inode_ptr);
+        uint32_t replaceBlock(std::shared_ptr<INode> inode_ptr, uint64_t logical, uint32_t blockIdx,
+            std::vector<std::shared_ptr<Block>>* pinned = nullptr);
+        uint32_t ownBlock(std::shared_ptr<INode> inode_ptr, uint64_t logical, uint32_t blockIdx);
+        uint32_t createTable(std::shared_ptr<SuperBlock> superblock_ptr, uint32_t blocks);
+        void createRefcounts(std::shared_ptr<BootBlock> bootblock_ptr);
+        uint32_t freezeBlock(BlockTable& refcounts, uint32_t blockIdx, uint16_t depth, bool copy, uint32_t tail,
+            std::unordered_map<uint32_t, uint32_t>& copies);
+        void appendTreeBlocks(uint32_t blockIdx, uint16_t depth, uint32_t tail, std::vector<uint32_t>& result);
+        void appendTreeLayout(uint32_t blockIdx, uint16_t depth, uint64_t first, uint64_t tail,
+            std::vector<std::pair<uint32_t, uint16_t>>& result);
+        void moveBlocks(std::shared_ptr<INode> inode_ptr, const std::vector<std::pair<uint32_t, uint16_t>>& layout,
+            const std::unordered_map<uint32_t, uint32_t>& moves);
+        bool readFreeList(std::shared_ptr<SuperBlock> superblock_ptr, std::vector<uint32_t>& blockIdxs,
+            std::vector<uint32_t>& chain);
+        void sortFreeList(std::shared_ptr<SuperBlock> superblock_ptr, std::vector<uint32_t> blockIdxs,
+            const std::vector<uint32_t>& chain);
+        // what fsck found in i-node tables, one per shard of i-node blocks while they are scanned
+        struct Scan
+        {
+        public:
+            struct Entry
+            {
+            public:
+                uint32_t directory;
+                std::string name;
+                uint32_t inodeIdx;
+            };
+            struct Tail
+            {
+            public:
+                // 0 for the image, 1 + the list entry for a snapshot
+                uint32_t owner;
+                uint32_t fragment;
+                uint16_t slot;
+                uint16_t slots;
+                uint32_t inodeIdx;
+            };
+            bool repair;
+            // of the i-node being walked: what problems call it, the logical block of its packed tail and the block
+            // found there, and the blocks of a directory
+            std::string owner;
+            uint64_t tail;
+            uint32_t fragment;
+            std::vector<uint32_t> leaves;
+            // of the image's i-nodes, by number: 0 if free, 1 + the file type otherwise, and the link counts
+            std::vector<uint8_t> types;
+            std::vector<uint16_t> nlinks;
+            // named entries of the image's directories
+            std::vector<Entry> entries;
+            std::vector<Tail> tails;
+            // the topmost of the image's i-nodes that the directory tree does not reach
+            std::vector<uint32_t> lost;
+            // directory blocks of the boot block tables, 0 if there are none or they are damaged
+            uint32_t refcounts;
+            uint32_t hashIndex;
+            uint64_t inodes;
+            std::vector<std::string> problems;
+            uint64_t repaired;
+            std::exception_ptr error;
+        };
+        void settle();
+        std::vector<uint32_t> tableBlocks(uint32_t directoryIdx, const std::string& name, Scan& scan);
+        void checkTree(BlockUsage& usage, uint32_t blockIdx, uint16_t depth, uint64_t first, Scan& scan);
+        void checkINode(BlockUsage& usage, std::shared_ptr<INode> inode_ptr, uint32_t inodeIdx, uint32_t owner, Scan& scan);
+        Scan scanImage(BlockUsage& usage, bool repair);
+        uint64_t checkDirectories(Scan& scan);
+        uint64_t linkLost(Scan& scan);
+        void checkFragments(BlockUsage& usage, Scan& scan);
+        void checkBlocks(BlockUsage& usage, Scan& scan);
+        uint32_t findDuplicate(BlockTable& index, BlockTable& refcounts, uint32_t hash, const uint8_t* bytes);
+        void indexBlock(BlockTable& index, uint32_t hash, uint32_t blockIdx);
+        void unindexBlock(BlockTable& index, uint32_t hash, uint32_t blockIdx);
+        void copyInCompressed(int32_t fd, std::shared_ptr<INode> inode_ptr, uint64_t size);
+        void readCluster(std::shared_ptr<INode> inode_ptr, uint64_t cluster, uint8_t* out);
+        bool expandCluster(std::shared_ptr<INode> inode_ptr, uint64_t cluster);
+        void copyOutCompressed(int32_t fd, std::shared_ptr<INode> inode_ptr, uint64_t size);
+        uint32_t resizeBlock(uint32_t blockIdx, uint64_t beginAddress, uint64_t blockSize, uint64_t newSize,
+            std::vector<uint32_t>& freed);
+        std::vector<uint32_t> mapBlocks(std::shared_ptr<INode> inode_ptr, const std::vector<uint64_t>& logicals);
+        std::vector<uint32_t> lookupBlocks(std::shared_ptr<INode> inode_ptr, const std::vector<uint64_t>& logicals);
+        uint64_t mapChildren(uint32_t* children, uint16_t depth, uint64_t firstLogical,
+            const uint64_t* begin, const uint64_t* end, std::vector<uint32_t>* pool, uint32_t* out);
         std::vector<std::vector<uint32_t>> getBlocks(std::shared_ptr<INode> inode_ptr);
         std::vector<std::vector<uint32_t>> getBlocks(std::vector<uint32_t> blocks, uint16_t depth);
         std::shared_ptr<Block> getBlockForAddress(std::shared_ptr<INode> inode_ptr, uint64_t address);
+        std::vector<uint32_t> getBlockMap(std::shared_ptr<INode> inode_ptr);
+        void appendBlockMap(uint32_t blockIdx, uint16_t depth, uint64_t count, std::vector<uint32_t>& result);
+        uint64_t transferRange(int32_t in_fd, uint64_t in_offset, int32_t out_fd, uint64_t out_offset, uint64_t length);
+        void bufferRange(int32_t in_fd, uint64_t in_offset, int32_t out_fd, uint64_t out_offset, uint64_t length);
+        void copyIn(int32_t fd, std::shared_ptr<INode> inode_ptr, uint64_t size);
+        void copyOut(int32_t fd, const std::vector<uint32_t>& blocks, uint64_t size);
+        void copyPinned(int32_t fd, const std::vector<uint32_t>& blocks, uint64_t size);
+        void importData(int32_t fd, std::shared_ptr<INode> inode_ptr, uint64_t size);
+        int64_t exportINode(std::shared_ptr<INode> inode_ptr, const std::string& innerFilename, const std::string& outerFilename);
+        int64_t exportFile(const std::string& innerFilename, const std::string& outerFilename);
+        std::vector<std::pair<std::string, std::string>> readManifest(const std::string& manifest);
+        void reportBatch(const std::string& command, uint64_t total, const std::vector<double>& latencies,
+            uint64_t bytes, std::chrono::steady_clock::time_point start);
+        std::shared_ptr<FileHandle> getHandle(int32_t handle);
+        std::vector<uint32_t> getHandleBlocks(std::shared_ptr<FileHandle> handle_ptr, uint64_t first, uint64_t count);
+        bool isOpen(uint32_t inodeIdx);
+        void truncateHandle(std::shared_ptr<FileHandle> handle_ptr, uint64_t size);
+        struct Attempt
+        {
+        public:
+            // blocking attempts run on the I/O threads and may read the image, for operations that change it
+            bool blocking;
+            std::function<void()> body;
+            std::function<void()> succeed;
+            std::function<void(std::exception_ptr)> fail;
+            // blocks missed by earlier runs, held so the next run finds them
+            std::vector<std::shared_ptr<Block>> pins;
+        };
+        EventLoop& loop();
+        bool beginAsync();
+        void endAsync();
+        void runAttempt(std::shared_ptr<Attempt> attempt);
+        void finishAttempt(std::shared_ptr<Attempt> attempt, std::exception_ptr error);
+        void pauseAsync();
+        void resumeAsync();
+        template<typename T>
+        Async<T> startAsync(bool blocking, std::function<T()> body)
+        {
+            Async<T> result;
+            auto value = std::make_shared<T>();
+            auto attempt = std::make_shared<Attempt>();
+            attempt->blocking = blocking;
+            attempt->body = [body, value]() { *value = body(); };
+            attempt->succeed = [result, value]() mutable { result.resolve(std::move(*value)); };
+            attempt->fail = [result](std::exception_ptr error) mutable { result.reject(error); };
+            if(!this->beginAsync())
+            {
+                result.reject(std::make_exception_ptr(std::runtime_error("File system is being reopened, try again")));
+                return result;
+            }
+            this->runAttempt(attempt);
+            return result;
+        }
     public:
         FileSystem();
         ~FileSystem();
         
         void quit();
-        void openfs(const std::string& filename);
+        // with a snapshot name, mounts that snapshot read-only instead of the image itself
+        void openfs(const std::string& filename, Durability durability = Durability{}, const std::string& snapshot = "");
         void initfs(uint32_t totalBlocks, uint32_t inodeBlocks);
+        // extends the open image to totalBlocks, the added data blocks going on the free list
+        void growfs(uint32_t totalBlocks);
+        // commands of this thread up to commit or abort are applied as one, a failed one discards them all
+        void begin();
+        void commit();
+        void abort();
+        bool inTransaction();
         void cpin(const std::string& outerFilename, const std::string& innerFilename);
         void cpout(const std::string& innerFilename, const std::string& outerFilename);
+        // a copy within the image that shares the source's data blocks until either file modifies them
+        void cp(const std::string& sourceFilename, const std::string& targetFilename);
+        void cpinMany(const std::string& manifest);
+        void cpoutMany(const std::string& manifest);
+        // cpin and cpout for whole directory trees, creating the directories on the way
+        void importTree(const std::string& outerDirectory, const std::string& innerDirectory);
+        void exportTree(const std::string& innerDirectory, const std::string& outerDirectory);
         void rm(const std::string& innerFilename);
+        void rmTree(const std::string& innerFilename);
+        void mv(const std::string& sourceFilename, const std::string& targetFilename);
         void mkdir(const std::string& innerFilename);
         void cd(const std::string& innerFilename);
         void pwd();
         void ls();
+        void dedup(bool enabled);
+        void compress(bool enabled);
+        void snapshot(const std::string& name);
+        void snapshots();
+        void deleteSnapshot(const std::string& name);
+        // checks that every block is either in use or free, and each only once unless its reference count says so,
+        // and that the directory tree reaches every i-node with a matching link count; repair fixes what it finds
+        void fsck(bool repair);
+        // moves the blocks of each regular file that is in several runs of adjacent blocks into one run,
+        // then sorts the free list so later allocations are adjacent too; measuring only reports the runs
+        void defrag(bool measure);
+        int32_t openFile(const std::string& innerFilename);
+        void closeFile(int32_t handle);
+        std::vector<uint8_t> readFile(int32_t handle, uint64_t offset, uint64_t length);
+        std::vector<uint8_t> readFile(int32_t handle, uint64_t length);
+        uint64_t writeFile(int32_t handle, uint64_t offset, const std::vector<uint8_t>& data);
+        uint64_t writeFile(int32_t handle, const std::vector<uint8_t>& data);
+        uint64_t seekFile(int32_t handle, uint64_t offset);
+        void truncateFile(int32_t handle, uint64_t size);
+        // i-node of a path, -1 if nothing is there
+        Async<int64_t> lookup(const std::string& innerFilename);
+        // i-node of a new empty regular file
+        Async<int64_t> create(const std::string& innerFilename);
+        Async<std::vector<uint8_t>> read(int32_t handle, uint64_t offset, uint64_t length);
         void sl();
         void test();
     };
@@ -0,0 +1,43 @@
+#include "handle.hpp"
+
+namespace ModV6FileSystem
+{
+    const uint32_t FileHandle::UNMAPPED;
+
+    std::ostream &operator<<(std::ostream &ostream, const FileHandle& in)
+    {
+        auto mapped = std::count_if(in.blocks()->begin(), in.blocks()->end(), 
+            [](uint32_t blockIdx) { return blockIdx != FileHandle::UNMAPPED; });
+        return ostream << "FileHandle[inode=" << in.inodeIdx() << ", offset=" << in.offset()
+            << ", mapped=" << mapped << "/" << in.blocks()->size() << "]";
+    }
+    FileHandle::FileHandle(uint32_t inodeIdx, std::shared_ptr<INode> inode_ptr, 
+        std::shared_ptr<std::vector<uint32_t>> blocks) :
+        _inodeIdx(inodeIdx), _inode(inode_ptr), _blocks(blocks), _offset(0)
+    {
+    }
+    FileHandle::~FileHandle()
+    {
+        // std::cout << "~FileHandle" << std::endl;
+    }
+    uint32_t FileHandle::inodeIdx() const
+    {
+        return this->_inodeIdx;
+    }
+    std::shared_ptr<INode> FileHandle::inode() const
+    {
+        return this->_inode;
+    }
+    std::shared_ptr<std::vector<uint32_t>> FileHandle::blocks() const
+    {
+        return this->_blocks;
+    }
+    uint64_t FileHandle::offset() const
+    {
+        return this->_offset;
+    }
+    void FileHandle::offset(uint64_t offset)
+    {
+        this->_offset = offset;
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "inode.hpp"
+
+namespace ModV6FileSystem
+{
+    struct INode;
+
+    // an open file: the resolved i-node plus a cache of its logical to physical block map,
+    // shared by every handle open on the same i-node
+    struct FileHandle
+    {
+    public:
+        // block map entry that has not been looked up yet
+        static const uint32_t UNMAPPED = 0xFFFFFFFF;
+    private:
+        uint32_t _inodeIdx;
+        std::shared_ptr<INode> _inode;
+        std::shared_ptr<std::vector<uint32_t>> _blocks;
+        uint64_t _offset;
+
+    public:
+        friend std::ostream &operator<<(std::ostream &ostream, const FileHandle& in);
+        FileHandle(uint32_t inodeIdx, std::shared_ptr<INode> inode_ptr, std::shared_ptr<std::vector<uint32_t>> blocks);
+        ~FileHandle();
+
+        uint32_t inodeIdx() const;
+        std::shared_ptr<INode> inode() const;
+        std::shared_ptr<std::vector<uint32_t>> blocks() const;
+        uint64_t offset() const;
+        void offset(uint64_t offset);
+    };
+}
@@ -44,7 +44,13 @@ namespace ModV6FileSystem
             prefix = ", ";
         }
         addresses += "]";
+        if(in.inlined())
+        {
+            auto data = in.inlineData();
+            addresses = "\"" + std::string{data.begin(), data.begin() + std::min<uint64_t>(in.size(), 36)} + "\"";
+        }
         return ostream << "INode[flags=" << std::bitset<16>(in.flags())
+        << ", xflags=" << std::bitset<16>(in.xflags())
         << ", allocated=" << in.allocated()
         << ", filetype=" << filetype
         << ", filesize=" << filesize
@@ -61,6 +67,7 @@ namespace ModV6FileSystem
         ),
         _block(block_ptr)
     {
+        block_ptr->markMetadata();
     }
     INode::~INode()
     {
@@ -96,7 +103,7 @@ namespace ModV6FileSystem
     }
     void INode::gid(uint32_t gid)
     {
-        this->_data.gid = gid;
+        this->_data.gid = static_cast<uint16_t>(gid);
     }
     uint64_t INode::size() const
     {
@@ -107,6 +114,14 @@ namespace ModV6FileSystem
         this->_data.size1 = (uint32_t)((size & 0xFFFFFFFF00000000ull) >> 32);
         this->_data.size2 = (uint32_t)(size & 0x00000000FFFFFFFFull);
     }
+    uint16_t INode::xflags() const
+    {
+        return this->_data.xflags;
+    }
+    void INode::xflags(uint16_t xflags)
+    {
+        this->_data.xflags = xflags;
+    }
     std::array<uint32_t, 9> INode::addr() const
     {
         return this->_data.addr;
@@ -115,6 +130,16 @@ namespace ModV6FileSystem
     {
         std::copy(addr.begin(), addr.end(), this->_data.addr.begin());
     }
+    std::array<uint8_t, 36> INode::inlineData() const
+    {
+        const auto* data_ptr = reinterpret_cast<const std::array<uint8_t, 36>*>(this->_data.addr.data());
+        return *data_ptr;
+    }
+    void INode::inlineData(std::array<uint8_t, 36> data)
+    {
+        auto* data_ptr = reinterpret_cast<std::array<uint8_t, 36>*>(this->_data.addr.data());
+        std::copy(data.begin(), data.end(), data_ptr->begin());
+    }
     uint32_t INode::actime() const
     {
         return this->_data.actime;
@@ -409,4 +434,75 @@ namespace ModV6FileSystem
             this->flags(flags & ~WORLD_X_FLAG);
         }
     }
+    bool INode::inlined() const
+    {
+        auto xflags = this->xflags();
+        const auto INLINE_FLAG = 0b1000000000000000;
+        return (xflags & INLINE_FLAG) == INLINE_FLAG;
+    }
+    void INode::inlined(bool set)
+    {
+        auto xflags = this->xflags();
+        const auto INLINE_FLAG = 0b1000000000000000;
+        if(set)
+        {
+            this->xflags(xflags | INLINE_FLAG);
+        }
+        else
+        {
+            this->xflags(xflags & ~INLINE_FLAG);
+        }
+    }
+    bool INode::tailPacked() const
+    {
+        auto xflags = this->xflags();
+        const auto TAIL_FLAG = 0b0100000000000000;
+        return (xflags & TAIL_FLAG) == TAIL_FLAG;
+    }
+    void INode::tailPacked(bool set)
+    {
+        auto xflags = this->xflags();
+        const auto TAIL_FLAG = 0b0100000000000000;
+        if(set)
+        {
+            this->xflags(xflags | TAIL_FLAG);
+        }
+        else
+        {
+            this->xflags(xflags & ~TAIL_FLAG);
+        }
+    }
+    uint16_t INode::tailSlot() const
+    {
+        auto xflags = this->xflags();
+        const auto TAIL_SLOT_FLAG = 0b0000000000011111;
+        return xflags & TAIL_SLOT_FLAG;
+    }
+    void INode::tailSlot(uint16_t slot)
+    {
+        auto xflags = this->xflags();
+        const auto TAIL_SLOT_FLAG = 0b0000000000011111;
+        this->xflags(xflags & ~TAIL_SLOT_FLAG);
+        xflags = this->xflags();
+        this->xflags(xflags | (slot & TAIL_SLOT_FLAG));
+    }
+    bool INode::compressed() const
+    {
+        auto xflags = this->xflags();
+        const auto COMPRESS_FLAG = 0b0010000000000000;
+        return (xflags & COMPRESS_FLAG) == COMPRESS_FLAG;
+    }
+    void INode::compressed(bool set)
+    {
+        auto xflags = this->xflags();
+        const auto COMPRESS_FLAG = 0b0010000000000000;
+        if(set)
+        {
+            this->xflags(xflags | COMPRESS_FLAG);
+        }
+        else
+        {
+            this->xflags(xflags & ~COMPRESS_FLAG);
+        }
+    }
 }
\ No newline at end of file
@@ -24,7 +24,9 @@ namespace ModV6FileSystem
             uint16_t flags;
             uint16_t nlinks;
             uint32_t uid;
-            uint32_t gid;
+            uint16_t gid;
+            // extended flags, see INode::inlined()
+            uint16_t xflags;
             // assuming this is earlier bytes
             uint32_t size1;
             // assuming this is later bytes
@@ -51,8 +53,13 @@ namespace ModV6FileSystem
         void gid(uint32_t gid);
         uint64_t size() const;
         void size(uint64_t size);
+        uint16_t xflags() const;
+        void xflags(uint16_t xflags);
         std::array<uint32_t, 9> addr() const;
         void addr(std::array<uint32_t, 9> addr);
+        // the addr area reinterpreted as file contents, for inlined i-nodes
+        std::array<uint8_t, 36> inlineData() const;
+        void inlineData(std::array<uint8_t, 36> data);
         uint32_t actime() const;
         void actime(uint32_t actime);
         uint32_t modtime() const;
@@ -87,5 +94,17 @@ namespace ModV6FileSystem
         void worldW(bool set);
         bool worldX() const;
         void worldX(bool set);
+        // methods for extended flags
+        // files of at most 36 bytes keep their contents in the addr area instead of a data block
+        bool inlined() const;
+        void inlined(bool set);
+        // the partial final block is stored in a shared fragment block, starting at 32-byte slot tailSlot()
+        bool tailPacked() const;
+        void tailPacked(bool set);
+        uint16_t tailSlot() const;
+        void tailSlot(uint16_t slot);
+        // data is stored in 16-block clusters, each of which may be LZ compressed into fewer blocks
+        bool compressed() const;
+        void compressed(bool set);
     };
 }
\ No newline at end of file
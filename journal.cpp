@@ -0,0 +1,630 @@
+#include "journal.hpp"
+
+namespace ModV6FileSystem
+{
+    namespace
+    {
+        // descriptor block: magic, sequence, images, revocations, last, checksum (2 words), unused, block numbers
+        const uint32_t HEADER_WORDS = 8;
+
+        uint64_t checksum(const uint8_t* bytes, uint64_t length, uint64_t hash)
+        {
+            for(uint64_t word = 0; word + 8 <= length; word += 8)
+            {
+                uint64_t value;
+                std::memcpy(&value, bytes + word, 8);
+                hash = (hash ^ value) * 0xFF51AFD7ED558CCDull;
+                hash ^= hash >> 29;
+            }
+            return hash;
+        }
+        bool readAll(int32_t fd, void* buffer, uint64_t length, uint64_t offset)
+        {
+            uint64_t done = 0;
+            while(done < length)
+            {
+                auto result = pread(fd, static_cast<uint8_t*>(buffer) + done, length - done, offset + done);
+                if(result <= 0)
+                {
+                    return false;
+                }
+                done += result;
+            }
+            return true;
+        }
+        void writeAll(int32_t fd, const void* buffer, uint64_t length, uint64_t offset)
+        {
+            uint64_t done = 0;
+            while(done < length)
+            {
+                auto result = pwrite(fd, static_cast<const uint8_t*>(buffer) + done, length - done, offset + done);
+                if(result <= 0)
+                {
+                    throw std::runtime_error("Failed to write " + std::to_string(length) + " bytes of the journal");
+                }
+                done += result;
+            }
+        }
+        void sync(int32_t fd)
+        {
+            if(fdatasync(fd) != 0)
+            {
+                throw std::runtime_error("Failed to sync the replayed journal");
+            }
+        }
+        // checksum of a descriptor, with its checksum words zeroed, and the images following it
+        uint64_t batchChecksum(const uint8_t* descriptor, const uint8_t* images, uint64_t count)
+        {
+            std::array<uint32_t, 256> words;
+            std::memcpy(words.data(), descriptor, 1024);
+            words[5] = 0;
+            words[6] = 0;
+            auto hash = checksum(reinterpret_cast<const uint8_t*>(words.data()), 1024, 0x9E3779B97F4A7C15ull);
+            return checksum(images, count * 1024, hash);
+        }
+    }
+
+    const uint32_t Journal::MAGIC;
+    const uint32_t Journal::BATCH_MAGIC;
+    const uint32_t Journal::MIN_BLOCKS;
+    const uint32_t Journal::MAX_BLOCKS;
+    const uint32_t Journal::DESCRIPTOR_ENTRIES;
+
+    uint32_t Journal::sizeFor(uint32_t dataBlocks)
+    {
+        auto blocks = std::min(MAX_BLOCKS, dataBlocks / 16);
+        return blocks < MIN_BLOCKS ? 0 : blocks;
+    }
+    /**
+     * Batches are replayed in order, up to the first one that is incomplete or fails its checksum:
+     * that one was being written when the image went down, and was never acknowledged.
+     */
+    bool Journal::replay(int32_t fd, uint32_t start, uint32_t blocks, uint32_t& sequence)
+    {
+        struct Replayed
+        {
+        public:
+            uint32_t sequence;
+            std::vector<std::pair<uint32_t, Image>> images;
+            std::vector<uint32_t> revoked;
+        };
+        std::array<uint32_t, 256> header;
+        if(!readAll(fd, header.data(), 1024, 1024ull * start) || header[0] != MAGIC)
+        {
+            sequence = 1;
+            return true;
+        }
+        auto clean = header[2] != 0;
+        auto expected = header[1];
+        std::vector<Replayed> batches;
+        Replayed current{expected, {}, {}};
+        for(uint32_t position = 1; position < blocks;)
+        {
+            std::array<uint32_t, 256> descriptor;
+            if(!readAll(fd, descriptor.data(), 1024, 1024ull * (start + position)))
+            {
+                break;
+            }
+            auto images = descriptor[2];
+            auto revocations = descriptor[3];
+            if(descriptor[0] != BATCH_MAGIC || descriptor[1] != expected || images + revocations > DESCRIPTOR_ENTRIES
+                || position + 1 + images > blocks)
+            {
+                break;
+            }
+            std::vector<uint8_t> bytes(images * 1024ull);
+            if(!readAll(fd, bytes.data(), bytes.size(), 1024ull * (start + position + 1)))
+            {
+                break;
+            }
+            auto expectedChecksum = (static_cast<uint64_t>(descriptor[6]) << 32) | descriptor[5];
+            if(batchChecksum(reinterpret_cast<const uint8_t*>(descriptor.data()), bytes.data(), images) != expectedChecksum)
+            {
+                break;
+            }
+            for(uint32_t i = 0; i < images; ++i)
+            {
+                Image image;
+                std::memcpy(image.data(), bytes.data() + i * 1024ull, 1024);
+                current.images.emplace_back(descriptor[HEADER_WORDS + i], image);
+            }
+            for(uint32_t i = 0; i < revocations; ++i)
+            {
+                current.revoked.push_back(descriptor[HEADER_WORDS + images + i]);
+            }
+            position += 1 + images;
+            if(descriptor[4] != 0)
+            {
+                batches.push_back(std::move(current));
+                current = Replayed{++expected, {}, {}};
+            }
+        }
+        // a revoked block keeps what later batches wrote to it, not what earlier ones did
+        std::unordered_map<uint32_t, uint32_t> revokedAt;
+        for(auto& batch : batches)
+        {
+            for(auto blockIdx : batch.revoked)
+            {
+                revokedAt[blockIdx] = batch.sequence;
+            }
+        }
+        uint64_t written = 0;
+        for(auto& batch : batches)
+        {
+            for(auto& image : batch.images)
+            {
+                auto revoked = revokedAt.find(image.first);
+                if(revoked != revokedAt.end() && revoked->second > batch.sequence)
+                {
+                    continue;
+                }
+                writeAll(fd, image.second.data(), 1024, 1024ull * image.first);
+                ++written;
+            }
+        }
+        if(!batches.empty())
+        {
+            sync(fd);
+        }
+        std::cout << "Replayed " << batches.size() << " journal batches, " << written << " blocks" << std::endl;
+        sequence = expected;
+        return clean;
+    }
+    Journal::Journal(int32_t fd, uint32_t start, uint32_t blocks, uint32_t sequence, Durability durability,
+        std::shared_ptr<Syncer> syncer, std::function<void()> stageLive) :
+        _fd(fd), _start(start), _blocks(blocks), _active(0), _closing(false), _closed(false), _sequence(sequence), _head(1),
+        _durability(durability), _syncer(std::move(syncer)), _stageLive(std::move(stageLive)), _stopping(false),
+        _transaction(false)
+    {
+        // blocks may be written home before the first commit, so a crash from here on has to be noticed
+        this->writeHeader(false);
+        this->durable("journal header");
+        std::cout << "Journal of " << blocks << " blocks at block " << start << ", next batch " << sequence
+            << ", durability " << this->_durability.describe() << std::endl;
+        if(this->_durability.mode == Durability::PERIODIC)
+        {
+            this->_flusher = std::thread(&Journal::flush, this);
+        }
+    }
+    Journal::~Journal()
+    {
+        this->stop();
+        // std::cout << "~Journal" << std::endl;
+    }
+    void Journal::durable(const std::string& what)
+    {
+        if(this->_durability.mode != Durability::NONE)
+        {
+            this->_syncer->sync(what);
+        }
+    }
+    void Journal::flush()
+    {
+        std::unique_lock<std::mutex> guard{this->_lock};
+        while(true)
+        {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(this->_durability.intervalMs);
+            this->_changed.wait_until(guard, deadline, [this]() { return this->_stopping; });
+            if(this->_stopping)
+            {
+                return;
+            }
+            if(this->_running.empty() && this->_revoked.empty() && this->_freed.empty())
+            {
+                continue;
+            }
+            guard.unlock();
+            try
+            {
+                this->commit();
+            }
+            catch(const std::exception& exc)
+            {
+                std::cout << "Periodic commit failed: " << exc.what() << std::endl;
+            }
+            guard.lock();
+        }
+    }
+    void Journal::stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard{this->_lock};
+            this->_stopping = true;
+        }
+        this->_changed.notify_all();
+        if(this->_flusher.joinable())
+        {
+            this->_flusher.join();
+        }
+    }
+    void Journal::writeHeader(bool clean)
+    {
+        std::array<uint32_t, 256> header{};
+        header[0] = MAGIC;
+        header[1] = this->_sequence;
+        header[2] = clean;
+        writeAll(this->_fd, header.data(), 1024, 1024ull * this->_start);
+    }
+    bool Journal::enter()
+    {
+        std::unique_lock<std::mutex> guard{this->_lock};
+        if(this->_transaction && this->_owner == std::this_thread::get_id())
+        {
+            return false;
+        }
+        this->_changed.wait(guard, [this]() { return !this->_closing && !this->_transaction; });
+        ++this->_active;
+        return true;
+    }
+    bool Journal::leave()
+    {
+        bool commit;
+        {
+            std::lock_guard<std::mutex> guard{this->_lock};
+            --this->_active;
+            if(this->_closing)
+            {
+                // the commit that is waiting takes this operation along
+                if(this->_active == 0)
+                {
+                    this->_changed.notify_all();
+                }
+                return false;
+            }
+            // blocks that are freed count as well, as those cannot be handed out again before the batch commits
+            auto staged = this->_running.size() + this->_freed.size();
+            auto pending = staged != 0 || !this->_revoked.empty();
+            // no batch grows past a quarter of the log
+            auto full = staged * 4 >= this->_blocks;
+            switch(this->_durability.mode)
+            {
+                case Durability::COMMAND:
+                    // batches grow while operations overlap
+                    commit = pending && (this->_active == 0 || full);
+                    break;
+                case Durability::PERIODIC:
+                    commit = staged >= this->_durability.dirtyBlocks || full;
+                    break;
+                default:
+                    commit = full;
+                    break;
+            }
+            commit = commit && !this->_closed;
+        }
+        if(!commit && this->_durability.mode == Durability::PERIODIC)
+        {
+            // file data written by the operation starts going out now, so the next commit has less to wait for
+            this->_syncer->start();
+        }
+        return commit;
+    }
+    bool Journal::stage(uint32_t blockIdx, const Image& bytes)
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        if(this->_closed)
+        {
+            return false;
+        }
+        auto image = std::make_shared<const Image>(bytes);
+        if(this->_transaction && this->_undo.count(blockIdx) == 0)
+        {
+            auto newest = this->_newest.find(blockIdx);
+            this->_undo[blockIdx] = newest == this->_newest.end() ? nullptr : newest->second;
+        }
+        this->_running[blockIdx] = image;
+        this->_newest[blockIdx] = image;
+        return true;
+    }
+    bool Journal::overlay(uint32_t blockIdx, Image& bytes)
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        auto found = this->_newest.find(blockIdx);
+        if(found == this->_newest.end())
+        {
+            return false;
+        }
+        bytes = *found->second;
+        return true;
+    }
+    void Journal::free(uint32_t blockIdx)
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        this->_freed.push_back(blockIdx);
+    }
+    void Journal::take(uint64_t count, std::vector<uint32_t>& blockIdxs)
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        while(count-- > 0 && !this->_reusable.empty())
+        {
+            blockIdxs.push_back(this->_reusable.back());
+            if(this->_transaction)
+            {
+                this->_taken.push_back(this->_reusable.back());
+            }
+            this->_reusable.pop_back();
+        }
+    }
+    std::vector<uint32_t> Journal::drain()
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        std::vector<uint32_t> result;
+        result.swap(this->_reusable);
+        if(this->_transaction)
+        {
+            this->_taken.insert(this->_taken.end(), result.begin(), result.end());
+        }
+        return result;
+    }
+    bool Journal::reusable()
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        return !this->_reusable.empty();
+    }
+    void Journal::begin()
+    {
+        std::unique_lock<std::mutex> guard{this->_lock};
+        this->_changed.wait(guard, [this]() { return !this->_closing && !this->_transaction; });
+        this->_transaction = true;
+        this->_owner = std::this_thread::get_id();
+        ++this->_active;
+    }
+    void Journal::end()
+    {
+        {
+            std::lock_guard<std::mutex> guard{this->_lock};
+            this->_transaction = false;
+            this->_undo.clear();
+            this->_taken.clear();
+            --this->_active;
+        }
+        this->_changed.notify_all();
+    }
+    void Journal::rollback()
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        for(auto& undo : this->_undo)
+        {
+            if(undo.second)
+            {
+                this->_newest[undo.first] = undo.second;
+            }
+            else
+            {
+                this->_newest.erase(undo.first);
+            }
+        }
+        // nothing was staged or freed when the transaction began
+        this->_running.clear();
+        this->_freed.clear();
+        this->_reusable.insert(this->_reusable.end(), this->_taken.begin(), this->_taken.end());
+        std::cout << "Rolled back " << this->_undo.size() << " journaled blocks" << std::endl;
+        this->_undo.clear();
+        this->_taken.clear();
+    }
+    void Journal::commit()
+    {
+        std::lock_guard<std::mutex> commit_guard{this->_commitLock};
+        Batch batch;
+        {
+            std::unique_lock<std::mutex> guard{this->_lock};
+            if(this->_closed)
+            {
+                return;
+            }
+            this->_closing = true;
+            this->_changed.wait(guard, [this]() { return this->_active == 0; });
+        }
+        try
+        {
+            // no operation is halfway, so what is staged now belongs together
+            this->_stageLive();
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> guard{this->_lock};
+            this->_closing = false;
+            this->_changed.notify_all();
+            throw;
+        }
+        {
+            std::lock_guard<std::mutex> guard{this->_lock};
+            batch.sequence = this->_sequence;
+            batch.images.assign(this->_running.begin(), this->_running.end());
+            batch.revoked.swap(this->_revoked);
+            batch.freed.swap(this->_freed);
+            this->_running.clear();
+            this->_closing = false;
+        }
+        this->_changed.notify_all();
+        if(batch.images.empty() && batch.revoked.empty() && batch.freed.empty())
+        {
+            return;
+        }
+        try
+        {
+            this->writeBatch(batch);
+        }
+        catch(...)
+        {
+            // back into the running batch, unless an operation staged something newer meanwhile
+            std::lock_guard<std::mutex> guard{this->_lock};
+            for(auto& image : batch.images)
+            {
+                this->_running.insert(image);
+            }
+            this->_revoked.insert(this->_revoked.end(), batch.revoked.begin(), batch.revoked.end());
+            this->_freed.insert(this->_freed.end(), batch.freed.begin(), batch.freed.end());
+            throw;
+        }
+        this->finish(batch);
+    }
+    /**
+     * Appends a batch to the log and syncs once, which also makes the file data written before it durable.
+     * Batches that do not fit behind the last one wait for a checkpoint; ones bigger than the whole log
+     * are written home directly, without the protection of the journal.
+     */
+    void Journal::writeBatch(const Batch& batch)
+    {
+        uint64_t entries = batch.images.size() + batch.revoked.size();
+        uint64_t descriptors = std::max<uint64_t>(1, (entries + DESCRIPTOR_ENTRIES - 1) / DESCRIPTOR_ENTRIES);
+        uint64_t total = descriptors + batch.images.size();
+        if(1 + total > this->_blocks)
+        {
+            std::cout << "Batch " << batch.sequence << " of " << batch.images.size()
+                << " blocks does not fit in the journal, writing it in place" << std::endl;
+            this->checkpoint();
+            for(auto& image : batch.images)
+            {
+                writeAll(this->_fd, image.second->data(), 1024, 1024ull * image.first);
+            }
+            this->durable("batch " + std::to_string(batch.sequence) + " in place");
+            std::lock_guard<std::mutex> guard{this->_lock};
+            for(auto& image : batch.images)
+            {
+                auto newest = this->_newest.find(image.first);
+                if(newest != this->_newest.end() && newest->second == image.second)
+                {
+                    this->_newest.erase(newest);
+                }
+            }
+            ++this->_sequence;
+            return;
+        }
+        if(this->_head + total > this->_blocks)
+        {
+            this->checkpoint();
+        }
+        std::vector<uint8_t> buffer(total * 1024, 0);
+        uint64_t image = 0;
+        uint64_t revocation = 0;
+        uint64_t position = 0;
+        while(true)
+        {
+            auto* descriptor = reinterpret_cast<uint32_t*>(buffer.data() + position * 1024);
+            auto images = std::min<uint64_t>(DESCRIPTOR_ENTRIES, batch.images.size() - image);
+            auto revocations = std::min<uint64_t>(DESCRIPTOR_ENTRIES - images, batch.revoked.size() - revocation);
+            descriptor[0] = BATCH_MAGIC;
+            descriptor[1] = batch.sequence;
+            descriptor[2] = images;
+            descriptor[3] = revocations;
+            descriptor[4] = image + images == batch.images.size() && revocation + revocations == batch.revoked.size();
+            for(uint64_t i = 0; i < images; ++i)
+            {
+                descriptor[HEADER_WORDS + i] = batch.images[image + i].first;
+                std::memcpy(buffer.data() + (position + 1 + i) * 1024, batch.images[image + i].second->data(), 1024);
+            }
+            for(uint64_t i = 0; i < revocations; ++i)
+            {
+                descriptor[HEADER_WORDS + images + i] = batch.revoked[revocation + i];
+            }
+            auto sum = batchChecksum(reinterpret_cast<const uint8_t*>(descriptor),
+                buffer.data() + (position + 1) * 1024, images);
+            descriptor[5] = static_cast<uint32_t>(sum);
+            descriptor[6] = static_cast<uint32_t>(sum >> 32);
+            image += images;
+            revocation += revocations;
+            position += 1 + images;
+            if(descriptor[4] != 0)
+            {
+                break;
+            }
+        }
+        writeAll(this->_fd, buffer.data(), buffer.size(), 1024ull * (this->_start + this->_head));
+        this->durable("batch " + std::to_string(batch.sequence) + " of " + std::to_string(total) + " blocks");
+        this->_head += total;
+        ++this->_sequence;
+        std::lock_guard<std::mutex> guard{this->_lock};
+        for(auto& logged : batch.images)
+        {
+            this->_committed[logged.first] = logged.second;
+            this->_logged.insert(logged.first);
+        }
+    }
+    /**
+     * Once a batch is durable, the blocks it freed are no longer used by the image on disk:
+     * their older images are revoked, they are zeroed in place and may be handed out again.
+     */
+    void Journal::finish(const Batch& batch)
+    {
+        {
+            std::lock_guard<std::mutex> guard{this->_lock};
+            for(auto blockIdx : batch.freed)
+            {
+                if(this->_logged.count(blockIdx) != 0)
+                {
+                    this->_revoked.push_back(blockIdx);
+                }
+                this->_newest.erase(blockIdx);
+                this->_committed.erase(blockIdx);
+                this->_running.erase(blockIdx);
+            }
+        }
+        Image zeros{};
+        for(auto blockIdx : batch.freed)
+        {
+            writeAll(this->_fd, zeros.data(), 1024, 1024ull * blockIdx);
+        }
+        std::lock_guard<std::mutex> guard{this->_lock};
+        this->_reusable.insert(this->_reusable.end(), batch.freed.begin(), batch.freed.end());
+    }
+    // writes the committed images home so the log can start over, with _commitLock held
+    void Journal::checkpoint()
+    {
+        std::vector<std::pair<uint32_t, std::shared_ptr<const Image>>> images;
+        {
+            std::lock_guard<std::mutex> guard{this->_lock};
+            images.assign(this->_committed.begin(), this->_committed.end());
+        }
+        std::sort(images.begin(), images.end(),
+            [](const std::pair<uint32_t, std::shared_ptr<const Image>>& a, const std::pair<uint32_t, std::shared_ptr<const Image>>& b) {
+                return a.first < b.first;
+            });
+        for(auto& image : images)
+        {
+            writeAll(this->_fd, image.second->data(), 1024, 1024ull * image.first);
+        }
+        this->durable("checkpoint of " + std::to_string(images.size()) + " blocks");
+        {
+            std::lock_guard<std::mutex> guard{this->_lock};
+            for(auto& image : images)
+            {
+                auto newest = this->_newest.find(image.first);
+                if(newest != this->_newest.end() && newest->second == image.second)
+                {
+                    this->_newest.erase(newest);
+                }
+            }
+            this->_committed.clear();
+            this->_logged.clear();
+        }
+        // older batches now fail the sequence check; the next sync makes this durable along with the next batch
+        this->_head = 1;
+        this->writeHeader(false);
+        std::cout << "Checkpointed " << images.size() << " journaled blocks" << std::endl;
+    }
+    void Journal::close()
+    {
+        this->stop();
+        this->commit();
+        std::lock_guard<std::mutex> commit_guard{this->_commitLock};
+        this->checkpoint();
+        this->writeHeader(true);
+        this->durable("journal header");
+        std::lock_guard<std::mutex> guard{this->_lock};
+        this->_closed = true;
+        this->_newest.clear();
+    }
+    void Journal::discard()
+    {
+        this->stop();
+        std::lock_guard<std::mutex> guard{this->_lock};
+        this->_closed = true;
+        this->_running.clear();
+        this->_revoked.clear();
+        this->_freed.clear();
+        this->_newest.clear();
+        this->_committed.clear();
+        this->_logged.clear();
+        this->_reusable.clear();
+    }
+}
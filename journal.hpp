@@ -0,0 +1,131 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include "durability.hpp"
+
+namespace ModV6FileSystem
+{
+    // write-ahead log of metadata blocks, kept in the last blocks of the image.
+    // Commands run as operations. The metadata blocks they change are staged here instead of being written back,
+    // and committed as one batch: appended to the log and made durable with a single fdatasync. With command
+    // durability that happens once no operation is running, with periodic durability from a thread of its own. Committed blocks are written home lazily, when the log is full or the image is
+    // closed; until then lookups get the newest copy from here. openfs replays every batch whose checksums match,
+    // so after a crash the metadata is as of the last commit.
+    // The image on disk keeps using blocks freed by a batch until it commits, so they are only zeroed and reused after.
+    struct Journal
+    {
+    public:
+        static const uint32_t MAGIC = 0x6A36766D;
+        static const uint32_t BATCH_MAGIC = 0x7436766D;
+        static const uint32_t MIN_BLOCKS = 32;
+        static const uint32_t MAX_BLOCKS = 4096;
+        // block numbers one descriptor block has room for, images and revocations together
+        static const uint32_t DESCRIPTOR_ENTRIES = 248;
+    private:
+        using Image = std::array<uint8_t, 1024>;
+        struct Batch
+        {
+        public:
+            uint32_t sequence;
+            std::vector<std::pair<uint32_t, std::shared_ptr<const Image>>> images;
+            // blocks whose older images must not be replayed anymore, since they hold something else now
+            std::vector<uint32_t> revoked;
+            std::vector<uint32_t> freed;
+        };
+        int32_t _fd;
+        // header block, followed by the log
+        uint32_t _start;
+        uint32_t _blocks;
+        std::mutex _lock;
+        std::condition_variable _changed;
+        uint32_t _active;
+        // a commit is waiting for the running operations, new ones wait for it
+        bool _closing;
+        bool _closed;
+        std::map<uint32_t, std::shared_ptr<const Image>> _running;
+        std::vector<uint32_t> _revoked;
+        std::vector<uint32_t> _freed;
+        // newest copy of every block whose home is out of date, and the last committed copy of those
+        std::unordered_map<uint32_t, std::shared_ptr<const Image>> _newest;
+        std::unordered_map<uint32_t, std::shared_ptr<const Image>> _committed;
+        // blocks with an image in the log since the last checkpoint
+        std::unordered_set<uint32_t> _logged;
+        // freed by committed batches, zeroed and ready to be handed out again
+        std::vector<uint32_t> _reusable;
+        // one commit or checkpoint at a time, taken before _lock
+        std::mutex _commitLock;
+        // of the next batch, and where it goes in the log
+        uint32_t _sequence;
+        uint32_t _head;
+        Durability _durability;
+        std::shared_ptr<Syncer> _syncer;
+        // stages the metadata blocks that are still held, while no operation runs
+        std::function<void()> _stageLive;
+        // commits periodically, if the durability asks for it
+        std::thread _flusher;
+        bool _stopping;
+        // open transaction, which counts as one operation until it ends. The newest copies it replaced
+        // (null for blocks that had none) and the reusable blocks it took are what a rollback puts back.
+        bool _transaction;
+        std::thread::id _owner;
+        std::unordered_map<uint32_t, std::shared_ptr<const Image>> _undo;
+        std::vector<uint32_t> _taken;
+
+        void writeHeader(bool clean);
+        void durable(const std::string& what);
+        void flush();
+        void writeBatch(const Batch& batch);
+        void checkpoint();
+        void finish(const Batch& batch);
+    public:
+        // journal size for an image with that many data blocks, 0 if it is too small for one
+        static uint32_t sizeFor(uint32_t dataBlocks);
+        // writes the committed batches in the log home; false if the image was not closed cleanly
+        static bool replay(int32_t fd, uint32_t start, uint32_t blocks, uint32_t& sequence);
+        Journal(int32_t fd, uint32_t start, uint32_t blocks, uint32_t sequence, Durability durability,
+            std::shared_ptr<Syncer> syncer, std::function<void()> stageLive);
+        ~Journal();
+
+        // false on the thread of the open transaction, whose commands are all part of it
+        bool enter();
+        // true if the caller, which is no longer in an operation, should commit
+        bool leave();
+        // false once the journal is closed, the block has to be written home then
+        bool stage(uint32_t blockIdx, const Image& bytes);
+        // the newest copy of a block, if its home is out of date
+        bool overlay(uint32_t blockIdx, Image& bytes);
+        void free(uint32_t blockIdx);
+        void take(uint64_t count, std::vector<uint32_t>& blockIdxs);
+        std::vector<uint32_t> drain();
+        // true if committed batches freed blocks that drain has not handed out yet
+        bool reusable();
+        void commit();
+        // with nothing staged and no operation running; other threads' operations wait until it ends
+        void begin();
+        void end();
+        // forgets what the transaction staged and freed, before it ends
+        void rollback();
+        // no more periodic commits, for changes made outside of operations
+        void stop();
+        // commits, writes everything home and marks the journal clean; what is staged afterwards is written home
+        void close();
+        // forgets everything, for an image that is being formatted
+        void discard();
+    };
+}
@@ -0,0 +1,40 @@
+#include "loop.hpp"
+
+namespace ModV6FileSystem
+{
+    BlockMiss::BlockMiss(std::vector<uint32_t> blocks) : _blocks(std::move(blocks))
+    {
+        this->_message = "Missed " + std::to_string(this->_blocks.size()) + " blocks starting at block "
+            + (this->_blocks.empty() ? std::string{"none"} : std::to_string(this->_blocks.front()));
+    }
+    const std::vector<uint32_t>& BlockMiss::blocks() const
+    {
+        return this->_blocks;
+    }
+    const char* BlockMiss::what() const noexcept
+    {
+        return this->_message.c_str();
+    }
+    LockBusy::LockBusy(std::shared_timed_mutex& mutex) : _mutex(&mutex)
+    {
+    }
+    std::shared_timed_mutex& LockBusy::mutex() const
+    {
+        return *this->_mutex;
+    }
+    const char* LockBusy::what() const noexcept
+    {
+        return "Lock is held";
+    }
+    EventLoop::EventLoop(uint32_t threads, uint32_t ioThreads) : _loop(threads), _io(ioThreads)
+    {
+    }
+    void EventLoop::post(std::function<void()> task)
+    {
+        this->_loop.submit(std::move(task));
+    }
+    void EventLoop::io(std::function<void()> task)
+    {
+        this->_io.submit(std::move(task));
+    }
+}
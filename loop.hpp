@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include "pool.hpp"
+
+namespace ModV6FileSystem
+{
+    // thrown by a lookup that would have had to read the image; the operation is retried once the blocks are in
+    struct BlockMiss : public std::exception
+    {
+    private:
+        std::vector<uint32_t> _blocks;
+        std::string _message;
+    public:
+        BlockMiss(std::vector<uint32_t> blocks);
+
+        const std::vector<uint32_t>& blocks() const;
+        const char* what() const noexcept override;
+    };
+
+    // thrown by a lookup that would have had to wait for a lock; the operation is retried once the lock is free
+    struct LockBusy : public std::exception
+    {
+    private:
+        std::shared_timed_mutex* _mutex;
+    public:
+        LockBusy(std::shared_timed_mutex& mutex);
+
+        std::shared_timed_mutex& mutex() const;
+        const char* what() const noexcept override;
+    };
+
+    // runs asynchronous operations on a few loop threads that never wait for the image,
+    // and the reads they would have waited for on I/O threads, which hand the operation back when they are done
+    struct EventLoop
+    {
+    private:
+        ThreadPool _loop;
+        ThreadPool _io;
+    public:
+        EventLoop(uint32_t threads, uint32_t ioThreads);
+
+        void post(std::function<void()> task);
+        void io(std::function<void()> task);
+    };
+}
@@ -0,0 +1,161 @@
+#include "lz.hpp"
+
+namespace ModV6FileSystem
+{
+    namespace LZ
+    {
+        namespace
+        {
+            const uint64_t MIN_MATCH = 4;
+            const uint64_t MAX_OFFSET = 0xFFFF;
+            const uint32_t HASH_BITS = 12;
+            const uint32_t NONE = 0xFFFFFFFF;
+
+            uint32_t hash(const uint8_t* bytes)
+            {
+                uint32_t sequence;
+                std::memcpy(&sequence, bytes, 4);
+                return (sequence * 2654435761u) >> (32 - HASH_BITS);
+            }
+            // worst case size of a sequence, so a single check up front covers all of its writes
+            uint64_t sequenceBound(uint64_t literals, uint64_t match)
+            {
+                return 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1;
+            }
+            void writeCount(uint8_t* out, uint64_t& op, uint64_t count)
+            {
+                for(; count >= 255; count -= 255)
+                {
+                    out[op++] = 255;
+                }
+                out[op++] = static_cast<uint8_t>(count);
+            }
+            uint64_t readCount(const uint8_t* in, uint64_t length, uint64_t& ip)
+            {
+                uint64_t count = 0;
+                uint8_t byte;
+                do
+                {
+                    if(ip >= length)
+                    {
+                        throw std::runtime_error("Corrupt compressed data: length runs past the end");
+                    }
+                    byte = in[ip++];
+                    count += byte;
+                }
+                while(byte == 255);
+                return count;
+            }
+            // match is the full match length, 0 for the final literals-only sequence
+            bool writeSequence(const uint8_t* literals, uint64_t literalCount, uint64_t offset, uint64_t match,
+                uint8_t* out, uint64_t& op, uint64_t capacity)
+            {
+                if(op + sequenceBound(literalCount, match) > capacity)
+                {
+                    return false;
+                }
+                auto extra = match == 0 ? 0 : match - MIN_MATCH;
+                auto& token = out[op++];
+                token = static_cast<uint8_t>((std::min<uint64_t>(literalCount, 15) << 4) | std::min<uint64_t>(extra, 15));
+                if(literalCount >= 15)
+                {
+                    writeCount(out, op, literalCount - 15);
+                }
+                std::memcpy(out + op, literals, literalCount);
+                op += literalCount;
+                if(match != 0)
+                {
+                    out[op++] = static_cast<uint8_t>(offset);
+                    out[op++] = static_cast<uint8_t>(offset >> 8);
+                    if(extra >= 15)
+                    {
+                        writeCount(out, op, extra - 15);
+                    }
+                }
+                return true;
+            }
+        }
+        uint64_t compress(const uint8_t* in, uint64_t length, uint8_t* out, uint64_t capacity)
+        {
+            std::vector<uint32_t> table(1u << HASH_BITS, NONE);
+            uint64_t ip = 0;
+            uint64_t anchor = 0;
+            uint64_t op = 0;
+            while(ip + MIN_MATCH <= length)
+            {
+                auto slot = hash(in + ip);
+                auto candidate = table[slot];
+                table[slot] = static_cast<uint32_t>(ip);
+                if(candidate == NONE || ip - candidate > MAX_OFFSET || std::memcmp(in + candidate, in + ip, MIN_MATCH) != 0)
+                {
+                    ++ip;
+                    continue;
+                }
+                auto match = MIN_MATCH;
+                while(ip + match < length && in[candidate + match] == in[ip + match])
+                {
+                    ++match;
+                }
+                if(!writeSequence(in + anchor, ip - anchor, ip - candidate, match, out, op, capacity))
+                {
+                    return 0;
+                }
+                ip += match;
+                anchor = ip;
+            }
+            if(!writeSequence(in + anchor, length - anchor, 0, 0, out, op, capacity))
+            {
+                return 0;
+            }
+            return op;
+        }
+        uint64_t decompress(const uint8_t* in, uint64_t length, uint8_t* out, uint64_t capacity)
+        {
+            uint64_t ip = 0;
+            uint64_t op = 0;
+            while(ip < length)
+            {
+                auto token = in[ip++];
+                uint64_t literalCount = token >> 4;
+                if(literalCount == 15)
+                {
+                    literalCount += readCount(in, length, ip);
+                }
+                if(ip + literalCount > length || op + literalCount > capacity)
+                {
+                    throw std::runtime_error("Corrupt compressed data: literals run past the end");
+                }
+                std::memcpy(out + op, in + ip, literalCount);
+                ip += literalCount;
+                op += literalCount;
+                if(ip == length)
+                {
+                    break;
+                }
+                if(ip + 2 > length)
+                {
+                    throw std::runtime_error("Corrupt compressed data: offset runs past the end");
+                }
+                uint64_t offset = in[ip] | (in[ip + 1] << 8);
+                ip += 2;
+                uint64_t match = token & 15;
+                if(match == 15)
+                {
+                    match += readCount(in, length, ip);
+                }
+                match += MIN_MATCH;
+                if(offset == 0 || offset > op || op + match > capacity)
+                {
+                    throw std::runtime_error("Corrupt compressed data: match at offset " + std::to_string(offset) 
+                        + " out of range");
+                }
+                // byte by byte, since a match may overlap the bytes it produces
+                for(uint64_t i = 0; i < match; ++i, ++op)
+                {
+                    out[op] = out[op - offset];
+                }
+            }
+            return op;
+        }
+    }
+}
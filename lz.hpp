@@ -0,0 +1,21 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ModV6FileSystem
+{
+    // small LZ77 codec in the style of LZ4: a stream of sequences, each a token byte
+    // (literal count, match length - 4), the literals, then a 2-byte backwards offset and the match;
+    // counts of 15 or more continue in following bytes of 255 and a remainder, the last sequence has no match
+    namespace LZ
+    {
+        // returns the compressed length, or 0 if it would not fit in capacity bytes
+        uint64_t compress(const uint8_t* in, uint64_t length, uint8_t* out, uint64_t capacity);
+        // returns the decompressed length, throws on data that is corrupt or does not fit in capacity bytes
+        uint64_t decompress(const uint8_t* in, uint64_t length, uint8_t* out, uint64_t capacity);
+    }
+}
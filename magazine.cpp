@@ -0,0 +1,62 @@
+#include "magazine.hpp"
+
+namespace ModV6FileSystem
+{
+    const uint32_t Magazine::CHUNK;
+
+    Magazine::Magazine() : _retired(false)
+    {
+    }
+    Magazine::~Magazine()
+    {
+        // std::cout << "~Magazine" << std::endl;
+    }
+    bool Magazine::take(uint32_t& blockIdx)
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        if(this->_blocks.empty())
+        {
+            return false;
+        }
+        blockIdx = this->_blocks.back();
+        this->_blocks.pop_back();
+        return true;
+    }
+    void Magazine::take(uint64_t count, std::vector<uint32_t>& result)
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        auto taken = std::min<uint64_t>(count, this->_blocks.size());
+        // in the order that taking them one at a time would
+        result.insert(result.end(), this->_blocks.rbegin(), this->_blocks.rbegin() + taken);
+        this->_blocks.resize(this->_blocks.size() - taken);
+    }
+    std::vector<uint32_t> Magazine::put(const std::vector<uint32_t>& blockIdxs)
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        this->_blocks.insert(this->_blocks.end(), blockIdxs.begin(), blockIdxs.end());
+        std::vector<uint32_t> spill;
+        if(this->_blocks.size() > 2 * CHUNK)
+        {
+            // the oldest blocks go, one chunk is always kept for the next allocations
+            auto spilled = (this->_blocks.size() - CHUNK) / CHUNK * CHUNK;
+            spill.assign(this->_blocks.begin(), this->_blocks.begin() + spilled);
+            this->_blocks.erase(this->_blocks.begin(), this->_blocks.begin() + spilled);
+        }
+        return spill;
+    }
+    std::vector<uint32_t> Magazine::drain()
+    {
+        std::lock_guard<std::mutex> guard{this->_lock};
+        std::vector<uint32_t> result;
+        result.swap(this->_blocks);
+        return result;
+    }
+    void Magazine::retire()
+    {
+        this->_retired = true;
+    }
+    bool Magazine::retired() const
+    {
+        return this->_retired;
+    }
+}
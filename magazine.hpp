@@ -0,0 +1,37 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace ModV6FileSystem
+{
+    // free data blocks set aside for one thread, so it can allocate and free without the allocator lock.
+    // Filled from and spilled to the superblock free list in chunks the size of its free array.
+    // Only its thread uses it, except when the file system takes everything back; the lock is for that.
+    struct Magazine
+    {
+    public:
+        static const uint32_t CHUNK = 251;
+    private:
+        std::mutex _lock;
+        std::vector<uint32_t> _blocks;
+        // set when its thread exits, after which the file system drains it one last time and lets it go
+        std::atomic<bool> _retired;
+
+    public:
+        Magazine();
+        ~Magazine();
+
+        // false if it is empty
+        bool take(uint32_t& blockIdx);
+        // moves up to count blocks into result
+        void take(uint64_t count, std::vector<uint32_t>& result);
+        // keeps blocks, returning whole chunks to spill once it holds more than two
+        std::vector<uint32_t> put(const std::vector<uint32_t>& blockIdxs);
+        std::vector<uint32_t> drain();
+        void retire();
+        bool retired() const;
+    };
+}
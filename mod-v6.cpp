@@ -29,7 +29,13 @@
  * Be wary - bad things will happen if you openfs a file and don't initfs it
  * Make sure you have done initfs on the file system at least once before expecting anything else to work
  * File consistency is not guaranteed once an exception has been thrown due to any reason.
- * Only running initfs with valid parameters can guarantee that file consistency is restored.
+ * fsck checks an image and fsck -r repairs what it finds; only initfs is sure to restore consistency.
+ * growfs <newTotalBlocks> makes an image larger in place, keeping what is on it.
+ * defrag moves each file into one run of adjacent blocks, defrag -n only reports how scattered they are.
+ * Images of more than 512 data blocks journal their metadata: if the program dies, openfs brings the
+ * directories and i-nodes back to how they were after the last command that finished. File data is not journaled,
+ * and blocks that were free in memory at the time go missing until fsck -r reclaims them.
+ * snapshot <name> keeps the image as it is now, openfs <filename> @<name> opens that copy read-only.
  */
 namespace ModV6FileSystem
 {
@@ -83,68 +89,255 @@ int main_(int argc, char* argv[])
 		{
 			std::cout << "Argument: " << arg << std::endl;
 		}
-		// checks if any supported command is called,
-		// updating the set of supported commands along the way
-		if(expected(supported, command, "q", arguments, 0))
+		// a failed command inside a transaction discards it, otherwise the program stops
+		try
 		{
-			fs->quit();
-			break;
-		}
-		else if(expected(supported, command, "openfs", arguments, 1))
-		{
-			fs->openfs(arguments[0]);
-		}
-		else if(expected(supported, command, "initfs", arguments, 2))
-		{
-			auto totalBlocks = std::stoul(arguments[0]);
-			auto iNodeBlocks = std::stoul(arguments[1]);
-			fs->initfs(totalBlocks, iNodeBlocks);
-		}
-		else if(expected(supported, command, "cpin", arguments, 2))
-		{
-			fs->cpin(arguments[0], arguments[1]);
-		}
-		else if(expected(supported, command, "cpout", arguments, 2))
-		{
-			fs->cpout(arguments[0], arguments[1]);
-		}
-		else if(expected(supported, command, "rm", arguments, 1))
-		{
-			fs->rm(arguments[0]);
-		}
-		else if(expected(supported, command, "mkdir", arguments, 1))
-		{
-			fs->mkdir(arguments[0]);
-		}
-		else if(expected(supported, command, "cd", arguments, 1))
-		{
-			fs->cd(arguments[0]);
-		}
-		else if(expected(supported, command, "pwd", arguments, 0))
-		{
-			fs->pwd();
-		}
-		else if(expected(supported, command, "ls", arguments, 0))
-		{
-			fs->ls();
-		}
-		else if(expected(supported, command, "sl", arguments, 0))
-		{
-			fs->sl();
-		}
-		else if(expected(supported, command, "test", arguments, 0))
-		{
-			fs->test();
-		}
-		else if(expected(supported, command, "help", arguments, 0))
-		{
-			std::cout << "Supported commands:" << std::endl;
-			std::cout << "	openfs <filename>" << std::endl;
-			std::cout << "	initfs <totalBlocks> <iNodeBlocks>" << std::endl;
+			// checks if any supported command is called,
+			// updating the set of supported commands along the way
+			if(expected(supported, command, "q", arguments, 0))
+			{
+				fs->quit();
+				break;
+			}
+			else if(expected(supported, command, "openfs", arguments, 
+				arguments.size() == 2 || arguments.size() == 3 ? arguments.size() : 1))
+			{
+				// a last argument of @<name> mounts that snapshot read-only
+				std::string snapshot;
+				if(arguments.size() > 1 && arguments.back().size() > 1 && arguments.back()[0] == '@')
+				{
+					snapshot = arguments.back().substr(1);
+					arguments.pop_back();
+				}
+				Durability durability;
+				if(arguments.size() == 3 || (arguments.size() == 2 && !Durability::parse(arguments[1], durability)))
+				{
+					std::cout << "openfs expects none, command or periodic[:<milliseconds>[:<blocks>]], then @<snapshot>" << std::endl;
+					continue;
+				}
+				fs->openfs(arguments[0], durability, snapshot);
+			}
+			else if(expected(supported, command, "initfs", arguments, 2))
+			{
+				auto totalBlocks = std::stoul(arguments[0]);
+				auto iNodeBlocks = std::stoul(arguments[1]);
+				fs->initfs(totalBlocks, iNodeBlocks);
+			}
+			else if(expected(supported, command, "growfs", arguments, 1))
+			{
+				fs->growfs(std::stoul(arguments[0]));
+			}
+			else if(expected(supported, command, "begin", arguments, 0))
+			{
+				fs->begin();
+			}
+			else if(expected(supported, command, "commit", arguments, 0))
+			{
+				fs->commit();
+			}
+			else if(expected(supported, command, "abort", arguments, 0))
+			{
+				fs->abort();
+			}
+			else if(expected(supported, command, "cpin", arguments, 2))
+			{
+				fs->cpin(arguments[0], arguments[1]);
+			}
+			else if(expected(supported, command, "cpout", arguments, 2))
+			{
+				fs->cpout(arguments[0], arguments[1]);
+			}
+			else if(expected(supported, command, "cp", arguments, 2))
+			{
+				fs->cp(arguments[0], arguments[1]);
+			}
+			else if(expected(supported, command, "cpin-many", arguments, 1))
+			{
+				fs->cpinMany(arguments[0]);
+			}
+			else if(expected(supported, command, "cpout-many", arguments, 1))
+			{
+				fs->cpoutMany(arguments[0]);
+			}
+			else if(expected(supported, command, "import", arguments, 2))
+			{
+				fs->importTree(arguments[0], arguments[1]);
+			}
+			else if(expected(supported, command, "export", arguments, 2))
+			{
+				fs->exportTree(arguments[0], arguments[1]);
+			}
+			else if(expected(supported, command, "rm", arguments, arguments.size() == 2 ? 2 : 1))
+			{
+				if(arguments.size() == 2 && arguments[0] != "-r")
+				{
+					std::cout << "rm expects -r before the path of a directory tree" << std::endl;
+					continue;
+				}
+				if(arguments.size() == 2)
+				{
+					fs->rmTree(arguments[1]);
+				}
+				else
+				{
+					fs->rm(arguments[0]);
+				}
+			}
+			else if(expected(supported, command, "mv", arguments, 2))
+			{
+				fs->mv(arguments[0], arguments[1]);
+			}
+			else if(expected(supported, command, "mkdir", arguments, 1))
+			{
+				fs->mkdir(arguments[0]);
+			}
+			else if(expected(supported, command, "cd", arguments, 1))
+			{
+				fs->cd(arguments[0]);
+			}
+			else if(expected(supported, command, "pwd", arguments, 0))
+			{
+				fs->pwd();
+			}
+			else if(expected(supported, command, "ls", arguments, 0))
+			{
+				fs->ls();
+			}
+			else if(expected(supported, command, "dedup", arguments, 1))
+			{
+				if(arguments[0] != "on" && arguments[0] != "off")
+				{
+					std::cout << "dedup expects on or off" << std::endl;
+					continue;
+				}
+				fs->dedup(arguments[0] == "on");
+			}
+			else if(expected(supported, command, "compress", arguments, 1))
+			{
+				if(arguments[0] != "on" && arguments[0] != "off")
+				{
+					std::cout << "compress expects on or off" << std::endl;
+					continue;
+				}
+				fs->compress(arguments[0] == "on");
+			}
+			else if(expected(supported, command, "snapshot", arguments, 1))
+			{
+				fs->snapshot(arguments[0]);
+			}
+			else if(expected(supported, command, "snapshots", arguments, 0))
+			{
+				fs->snapshots();
+			}
+			else if(expected(supported, command, "snapshot-rm", arguments, 1))
+			{
+				fs->deleteSnapshot(arguments[0]);
+			}
+			else if(expected(supported, command, "fsck", arguments, arguments.size() == 1 ? 1 : 0))
+			{
+				if(arguments.size() == 1 && arguments[0] != "-r")
+				{
+					std::cout << "fsck expects -r to repair what it finds" << std::endl;
+					continue;
+				}
+				fs->fsck(arguments.size() == 1);
+			}
+			else if(expected(supported, command, "defrag", arguments, arguments.size() == 1 ? 1 : 0))
+			{
+				if(arguments.size() == 1 && arguments[0] != "-n")
+				{
+					std::cout << "defrag expects -n to only measure fragmentation" << std::endl;
+					continue;
+				}
+				fs->defrag(arguments.size() == 1);
+			}
+			else if(expected(supported, command, "open", arguments, 1))
+			{
+				auto handle = fs->openFile(arguments[0]);
+				std::cout << "Handle: " << handle << std::endl;
+			}
+			else if(expected(supported, command, "close", arguments, 1))
+			{
+				fs->closeFile(std::stoi(arguments[0]));
+			}
+			else if(expected(supported, command, "read", arguments, 2))
+			{
+				auto data = fs->readFile(std::stoi(arguments[0]), std::stoull(arguments[1]));
+				std::cout << "Read " << data.size() << " bytes: " << std::string{data.begin(), data.end()} << std::endl;
+			}
+			else if(expected(supported, command, "pread", arguments, 3))
+			{
+				auto data = fs->readFile(std::stoi(arguments[0]), std::stoull(arguments[1]), std::stoull(arguments[2]));
+				std::cout << "Read " << data.size() << " bytes: " << std::string{data.begin(), data.end()} << std::endl;
+			}
+			else if(expected(supported, command, "write", arguments, 2))
+			{
+				std::vector<uint8_t> data{arguments[1].begin(), arguments[1].end()};
+				std::cout << "Wrote " << fs->writeFile(std::stoi(arguments[0]), data) << " bytes" << std::endl;
+			}
+			else if(expected(supported, command, "pwrite", arguments, 3))
+			{
+				std::vector<uint8_t> data{arguments[2].begin(), arguments[2].end()};
+				std::cout << "Wrote " << fs->writeFile(std::stoi(arguments[0]), std::stoull(arguments[1]), data) 
+					<< " bytes" << std::endl;
+			}
+			else if(expected(supported, command, "seek", arguments, 2))
+			{
+				fs->seekFile(std::stoi(arguments[0]), std::stoull(arguments[1]));
+			}
+			else if(expected(supported, command, "truncate", arguments, 2))
+			{
+				fs->truncateFile(std::stoi(arguments[0]), std::stoull(arguments[1]));
+			}
+			else if(expected(supported, command, "sl", arguments, 0))
+			{
+				fs->sl();
+			}
+			else if(expected(supported, command, "test", arguments, 0))
+			{
+				fs->test();
+			}
+			else if(expected(supported, command, "help", arguments, 0))
+			{
+				std::cout << "Supported commands:" << std::endl;
+				std::cout << "	openfs <filename> [none|command|periodic[:<milliseconds>[:<blocks>]]] [@<snapshot>]" << std::endl;
+				std::cout << "	initfs <totalBlocks> <iNodeBlocks>" << std::endl;
+				std::cout << "	growfs <newTotalBlocks>" << std::endl;
+				std::cout << "	begin, then commit or abort" << std::endl;
+				std::cout << "	cp <file> <newFile>" << std::endl;
+				std::cout << "	mv <file> <newFile or directory>" << std::endl;
+				std::cout << "	rm [-r] <file or directory>" << std::endl;
+				std::cout << "	cpin-many <manifest of: hostFile file>" << std::endl;
+				std::cout << "	cpout-many <manifest of: file hostFile>" << std::endl;
+				std::cout << "	import <hostDirectory> <directory>" << std::endl;
+				std::cout << "	export <directory> <hostDirectory>" << std::endl;
+				std::cout << "	dedup <on|off>" << std::endl;
+				std::cout << "	compress <on|off>" << std::endl;
+				std::cout << "	snapshot <name>, snapshots, snapshot-rm <name>" << std::endl;
+				std::cout << "	fsck [-r]" << std::endl;
+				std::cout << "	defrag [-n]" << std::endl;
+				std::cout << "	open <filename>" << std::endl;
+				std::cout << "	close <handle>" << std::endl;
+				std::cout << "	read <handle> <length>" << std::endl;
+				std::cout << "	pread <handle> <offset> <length>" << std::endl;
+				std::cout << "	write <handle> <text>" << std::endl;
+				std::cout << "	pwrite <handle> <offset> <text>" << std::endl;
+				std::cout << "	seek <handle> <offset>" << std::endl;
+				std::cout << "	truncate <handle> <size>" << std::endl;
+			}
+			else if(supported.find(command) == supported.end())
+			{
+				std::cout << "Unrecognized command, please try again" << std::endl;
+			}
 		}
-		else if(supported.find(command) == supported.end())
+		catch(const std::exception& exc)
 		{
-			std::cout << "Unrecognized command, please try again" << std::endl;
+			if(!fs->inTransaction())
+			{
+				throw;
+			}
+			std::cout << "Command failed inside a transaction: " << exc.what() << std::endl;
+			fs->abort();
 		}
 	}
 	// fs->openfs("./fs");
@@ -0,0 +1,54 @@
+#include "pipeline.hpp"
+
+namespace ModV6FileSystem
+{
+    Stage::Stage(std::function<void()> body, std::function<void()> finished)
+    {
+        this->_thread = std::thread{[this, body, finished]() {
+            try
+            {
+                body();
+            }
+            catch(...)
+            {
+                this->_error = std::current_exception();
+            }
+            finished();
+        }};
+    }
+    Stage::~Stage()
+    {
+        if(this->_thread.joinable())
+        {
+            this->_thread.join();
+        }
+    }
+    void Stage::join()
+    {
+        if(this->_thread.joinable())
+        {
+            this->_thread.join();
+        }
+        if(this->_error)
+        {
+            std::rethrow_exception(this->_error);
+        }
+    }
+    AlignedBuffer::AlignedBuffer(uint64_t size) : _data(nullptr, &std::free), _size(size)
+    {
+        void* data = nullptr;
+        if(posix_memalign(&data, 4096, size) != 0)
+        {
+            throw std::runtime_error("Could not allocate a buffer of " + std::to_string(size) + " bytes!");
+        }
+        this->_data.reset(static_cast<uint8_t*>(data));
+    }
+    uint8_t* AlignedBuffer::data() const
+    {
+        return this->_data.get();
+    }
+    uint64_t AlignedBuffer::size() const
+    {
+        return this->_size;
+    }
+}
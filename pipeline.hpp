@@ -0,0 +1,92 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace ModV6FileSystem
+{
+    // hands values from one pipeline stage to the next. Producers wait while it is full, consumers while it is empty;
+    // once closed, push refuses and pop drains what is left, so either side can stop the other.
+    template<typename T>
+    struct BoundedQueue
+    {
+    private:
+        std::mutex _lock;
+        std::condition_variable _changed;
+        std::deque<T> _values;
+        uint64_t _capacity;
+        bool _closed;
+    public:
+        BoundedQueue(uint64_t capacity) : _capacity(capacity), _closed(false)
+        {
+        }
+        // false if the queue was closed, the value is dropped then
+        bool push(T value)
+        {
+            std::unique_lock<std::mutex> guard{this->_lock};
+            this->_changed.wait(guard, [this]() { return this->_closed || this->_values.size() < this->_capacity; });
+            if(this->_closed)
+            {
+                return false;
+            }
+            this->_values.push_back(std::move(value));
+            this->_changed.notify_all();
+            return true;
+        }
+        // false once the queue is closed and empty
+        bool pop(T& value)
+        {
+            std::unique_lock<std::mutex> guard{this->_lock};
+            this->_changed.wait(guard, [this]() { return this->_closed || !this->_values.empty(); });
+            if(this->_values.empty())
+            {
+                return false;
+            }
+            value = std::move(this->_values.front());
+            this->_values.pop_front();
+            this->_changed.notify_all();
+            return true;
+        }
+        void close()
+        {
+            std::lock_guard<std::mutex> guard{this->_lock};
+            this->_closed = true;
+            this->_changed.notify_all();
+        }
+    };
+
+    // one pipeline stage on its own thread. finished runs after the body, also when it throws,
+    // and is where the stage closes its queues; join hands back whatever the body threw.
+    struct Stage
+    {
+    private:
+        std::thread _thread;
+        std::exception_ptr _error;
+    public:
+        Stage(std::function<void()> body, std::function<void()> finished);
+        ~Stage();
+
+        void join();
+    };
+
+    // page aligned memory for whole blocks, so the kernel can move it without bouncing
+    struct AlignedBuffer
+    {
+    private:
+        std::unique_ptr<uint8_t, decltype(&std::free)> _data;
+        uint64_t _size;
+    public:
+        AlignedBuffer(uint64_t size);
+
+        uint8_t* data() const;
+        uint64_t size() const;
+    };
+}
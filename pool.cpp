@@ -0,0 +1,131 @@
+#include "pool.hpp"
+
+namespace ModV6FileSystem
+{
+    namespace
+    {
+        // the pool this thread works for and its place in it, so tasks it submits go on its own queue
+        thread_local const ThreadPool* currentPool = nullptr;
+        thread_local uint32_t currentWorker = 0;
+    }
+    ThreadPool::ThreadPool(uint32_t threads) : _queued(0), _pending(0), _submitted(0), _sleeping(0), _stopping(false)
+    {
+        threads = std::max<uint32_t>(1, threads);
+        for(uint32_t i = 0; i < threads; ++i)
+        {
+            this->_workers.emplace_back(new Worker());
+        }
+        for(uint32_t i = 0; i < threads; ++i)
+        {
+            this->_threads.emplace_back(&ThreadPool::run, this, i);
+        }
+    }
+    ThreadPool::~ThreadPool()
+    {
+        this->wait();
+        {
+            std::lock_guard<std::mutex> guard{this->_lock};
+            this->_stopping = true;
+        }
+        this->_wake.notify_all();
+        for(auto& thread : this->_threads)
+        {
+            thread.join();
+        }
+        // std::cout << "~ThreadPool" << std::endl;
+    }
+    uint32_t ThreadPool::size() const
+    {
+        return this->_workers.size();
+    }
+    void ThreadPool::submit(std::function<void()> task)
+    {
+        ++this->_pending;
+        auto self = currentPool == this ? currentWorker : this->_submitted++ % this->_workers.size();
+        Worker& worker = *this->_workers[self];
+        {
+            std::lock_guard<std::mutex> guard{worker.lock};
+            worker.tasks.push_back(std::move(task));
+        }
+        // counted before _sleeping is read, as a worker about to sleep counts itself before it reads _queued:
+        // either it sees the task, or this sees it and wakes it
+        ++this->_queued;
+        if(this->_sleeping != 0)
+        {
+            // under the lock, so a worker that has counted itself is already waiting by the time it is notified
+            std::lock_guard<std::mutex> guard{this->_lock};
+            this->_wake.notify_one();
+        }
+    }
+    void ThreadPool::wait()
+    {
+        std::unique_lock<std::mutex> guard{this->_lock};
+        this->_idle.wait(guard, [this]() { return this->_pending == 0; });
+    }
+    bool ThreadPool::pop(uint32_t self, std::function<void()>& task)
+    {
+        for(uint32_t i = 0; i < this->_workers.size(); ++i)
+        {
+            Worker& worker = *this->_workers[(self + i) % this->_workers.size()];
+            std::lock_guard<std::mutex> guard{worker.lock};
+            if(worker.tasks.empty())
+            {
+                continue;
+            }
+            if(i == 0)
+            {
+                task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+            }
+            --this->_queued;
+            return true;
+        }
+        return false;
+    }
+    void ThreadPool::run(uint32_t self)
+    {
+        currentPool = this;
+        currentWorker = self;
+        while(true)
+        {
+            std::function<void()> task;
+            if(!this->pop(self, task))
+            {
+                std::unique_lock<std::mutex> guard{this->_lock};
+                ++this->_sleeping;
+                this->_wake.wait(guard, [this]() { return this->_stopping || this->_queued > 0; });
+                --this->_sleeping;
+                if(this->_stopping && this->_queued <= 0)
+                {
+                    return;
+                }
+                continue;
+            }
+            try
+            {
+                task();
+            }
+            catch(const std::exception& exc)
+            {
+                std::cerr << "Task failed with exception:" << std::endl << exc.what() << std::endl;
+            }
+            catch(...)
+            {
+                std::cerr << "Task failed with an exception that is not a std::exception" << std::endl;
+            }
+            // what it captured goes before the pool may be waited out
+            task = nullptr;
+            if(--this->_pending == 0)
+            {
+                // under the lock, so wait() cannot check _pending and then miss this
+                std::lock_guard<std::mutex> guard{this->_lock};
+                this->_idle.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ModV6FileSystem
+{
+    // fixed set of threads running submitted tasks. Every worker has its own queue behind its own lock: it takes
+    // its newest task first and, once its queue is empty, steals the oldest task of another worker, so long tasks
+    // don't hold up the rest. Tasks submitted by a worker go on its own queue, others are dealt out in turn.
+    // The pool lock is only taken by workers going to sleep with nothing left to steal, and by whoever wakes them.
+    struct ThreadPool
+    {
+    private:
+        struct Worker
+        {
+        public:
+            std::mutex lock;
+            std::deque<std::function<void()>> tasks;
+        };
+        std::vector<std::unique_ptr<Worker>> _workers;
+        std::vector<std::thread> _threads;
+        std::mutex _lock;
+        std::condition_variable _wake;
+        std::condition_variable _idle;
+        // tasks sitting in some queue, briefly negative while a task is taken before its submit counts it
+        std::atomic<int64_t> _queued;
+        // tasks submitted and not finished
+        std::atomic<uint64_t> _pending;
+        std::atomic<uint64_t> _submitted;
+        // workers waiting on _wake, which a submit only has to take the lock for if there are any
+        std::atomic<uint32_t> _sleeping;
+        bool _stopping;
+
+        bool pop(uint32_t self, std::function<void()>& task);
+        void run(uint32_t self);
+    public:
+        ThreadPool(uint32_t threads);
+        ~ThreadPool();
+
+        uint32_t size() const;
+        void submit(std::function<void()> task);
+        // blocks until every submitted task has finished
+        void wait();
+    };
+}
@@ -0,0 +1,86 @@
+#include "snapshot.hpp"
+
+namespace ModV6FileSystem
+{
+    const uint32_t SnapshotList::ENTRIES;
+    const uint32_t SnapshotList::MAX_NAME;
+
+    std::ostream &operator<<(std::ostream &ostream, const SnapshotList& in)
+    {
+        ostream << "SnapshotList[";
+        auto first = true;
+        for(uint32_t entry = 0; entry < SnapshotList::ENTRIES; ++entry)
+        {
+            if(in.used(entry))
+            {
+                ostream << (first ? "" : ", ") << in.name(entry) << "=" << in.table(entry);
+                first = false;
+            }
+        }
+        return ostream << "]";
+    }
+    SnapshotList::SnapshotList(std::shared_ptr<Block> block) :
+        _entries(*reinterpret_cast<std::array<Entry, ENTRIES>*>(block->asBytes().data())), _block(block)
+    {
+        block->markMetadata();
+    }
+    SnapshotList::~SnapshotList()
+    {
+        // std::cout << "~SnapshotList" << std::endl;
+    }
+    int32_t SnapshotList::find(const std::string& name) const
+    {
+        for(uint32_t entry = 0; entry < ENTRIES; ++entry)
+        {
+            if(this->used(entry) && this->name(entry) == name)
+            {
+                return entry;
+            }
+        }
+        return -1;
+    }
+    int32_t SnapshotList::unused() const
+    {
+        for(uint32_t entry = 0; entry < ENTRIES; ++entry)
+        {
+            if(!this->used(entry))
+            {
+                return entry;
+            }
+        }
+        return -1;
+    }
+    bool SnapshotList::empty() const
+    {
+        return std::none_of(this->_entries.begin(), this->_entries.end(),
+            [](const Entry& entry) { return entry.name[0] != '\0'; });
+    }
+    bool SnapshotList::used(uint32_t entry) const
+    {
+        return this->_entries[entry].name[0] != '\0';
+    }
+    std::string SnapshotList::name(uint32_t entry) const
+    {
+        const char* name = this->_entries[entry].name;
+        return std::string{name, strnlen(name, MAX_NAME)};
+    }
+    uint32_t SnapshotList::table(uint32_t entry) const
+    {
+        return this->_entries[entry].table;
+    }
+    uint32_t SnapshotList::time(uint32_t entry) const
+    {
+        return this->_entries[entry].time;
+    }
+    void SnapshotList::set(uint32_t entry, const std::string& name, uint32_t table, uint32_t time)
+    {
+        std::memset(this->_entries[entry].name, 0, MAX_NAME + 1);
+        std::memcpy(this->_entries[entry].name, name.data(), std::min<std::size_t>(name.size(), MAX_NAME));
+        this->_entries[entry].table = table;
+        this->_entries[entry].time = time;
+    }
+    void SnapshotList::clear(uint32_t entry)
+    {
+        this->set(entry, "", 0, 0);
+    }
+}
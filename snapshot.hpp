@@ -0,0 +1,53 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include "block.hpp"
+
+namespace ModV6FileSystem
+{
+    struct Block;
+
+    // the snapshots of an image, in the data block named by the boot block. Each entry names the table holding
+    // the snapshot's copy of the i-node blocks, whose files share their data blocks with the image by reference count
+    struct SnapshotList
+    {
+    public:
+        static const uint32_t ENTRIES = 32;
+        static const uint32_t MAX_NAME = 23;
+    private:
+        struct Entry
+        {
+        public:
+            // nul-terminated, empty for an unused entry
+            char name[MAX_NAME + 1];
+            // directory block of the table of copied i-node blocks
+            uint32_t table;
+            // seconds since the epoch when it was taken
+            uint32_t time;
+        };
+        std::array<Entry, ENTRIES>& _entries;
+        std::shared_ptr<Block> _block;
+
+    public:
+        friend std::ostream &operator<<(std::ostream &ostream, const SnapshotList& in);
+        SnapshotList(std::shared_ptr<Block> block);
+        ~SnapshotList();
+
+        // entry of the named snapshot, -1 if there is none
+        int32_t find(const std::string& name) const;
+        // an unused entry, -1 if the list is full
+        int32_t unused() const;
+        bool empty() const;
+        bool used(uint32_t entry) const;
+        std::string name(uint32_t entry) const;
+        uint32_t table(uint32_t entry) const;
+        uint32_t time(uint32_t entry) const;
+        void set(uint32_t entry, const std::string& name, uint32_t table, uint32_t time);
+        void clear(uint32_t entry);
+    };
+}
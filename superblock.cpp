@@ -20,6 +20,7 @@ namespace ModV6FileSystem
     SuperBlock::SuperBlock(std::shared_ptr<Block> block) : 
         _data(*reinterpret_cast<Data*>(block->asBytes().data())), _block(block)
     {
+        block->markMetadata();
     }
     SuperBlock::~SuperBlock()
     {
@@ -0,0 +1,55 @@
+#include "table.hpp"
+#include "filesys.hpp"
+
+namespace ModV6FileSystem
+{
+    const uint32_t BlockTable::REMOVED;
+
+    BlockTable::BlockTable(FileSystem* fs, uint32_t directoryIdx) : _fs(fs)
+    {
+        if(directoryIdx != 0)
+        {
+            this->_directory = fs->getBlock(directoryIdx);
+            this->_blocks.resize(this->_directory->asIntegers()[0]);
+        }
+    }
+    BlockTable::~BlockTable()
+    {
+        // std::cout << "~BlockTable" << std::endl;
+    }
+    bool BlockTable::exists() const
+    {
+        return this->_directory != nullptr;
+    }
+    uint32_t BlockTable::blocks() const
+    {
+        return this->_blocks.size();
+    }
+    std::shared_ptr<Block> BlockTable::block(uint32_t n)
+    {
+        if(n >= this->_blocks.size())
+        {
+            throw std::out_of_range("Table has no block " + std::to_string(n));
+        }
+        if(!this->_blocks[n])
+        {
+            this->_blocks[n] = this->_fs->getBlock(this->_directory->asIntegers()[1 + n]);
+            this->_blocks[n]->markMetadata();
+        }
+        return this->_blocks[n];
+    }
+    uint16_t& BlockTable::counter(uint64_t idx)
+    {
+        auto block_ptr = this->block(idx / 512);
+        return reinterpret_cast<uint16_t*>(block_ptr->asBytes().data())[idx % 512];
+    }
+    uint32_t* BlockTable::entry(uint64_t idx)
+    {
+        auto block_ptr = this->block(idx / 128);
+        return block_ptr->asIntegers().data() + idx % 128 * 2;
+    }
+    uint64_t BlockTable::entries() const
+    {
+        return this->_blocks.size() * 128ull;
+    }
+}
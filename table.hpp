@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "block.hpp"
+
+namespace ModV6FileSystem
+{
+    struct Block;
+    struct FileSystem;
+
+    // an array kept in data blocks whose numbers are listed, after their count, in a directory block;
+    // blocks are read on first use and stay cached for as long as the table is alive
+    struct BlockTable
+    {
+    public:
+        // hash index entry whose block has been freed, probing continues past it
+        static const uint32_t REMOVED = 0xFFFFFFFF;
+    private:
+        FileSystem* _fs;
+        std::shared_ptr<Block> _directory;
+        std::vector<std::shared_ptr<Block>> _blocks;
+
+    public:
+        BlockTable(FileSystem* fs, uint32_t directoryIdx);
+        ~BlockTable();
+
+        bool exists() const;
+        uint32_t blocks() const;
+        std::shared_ptr<Block> block(uint32_t n);
+        // as 16-bit counters, 512 per block
+        uint16_t& counter(uint64_t idx);
+        // as (hash, block number) pairs, 128 per block
+        uint32_t* entry(uint64_t idx);
+        uint64_t entries() const;
+    };
+}
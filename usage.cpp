@@ -0,0 +1,38 @@
+#include "usage.hpp"
+
+namespace ModV6FileSystem
+{
+    BlockUsage::BlockUsage(uint32_t blocks) : _references(new std::atomic<uint32_t>[blocks]),
+        _listed(blocks, false)
+    {
+        for(uint32_t blockIdx = 0; blockIdx < blocks; ++blockIdx)
+        {
+            this->_references[blockIdx].store(0, std::memory_order_relaxed);
+        }
+    }
+    BlockUsage::~BlockUsage()
+    {
+        // std::cout << "~BlockUsage" << std::endl;
+    }
+    void BlockUsage::claim(uint32_t blockIdx)
+    {
+        this->_references[blockIdx].fetch_add(1, std::memory_order_relaxed);
+    }
+    uint32_t BlockUsage::references(uint32_t blockIdx) const
+    {
+        return this->_references[blockIdx].load(std::memory_order_relaxed);
+    }
+    bool BlockUsage::list(uint32_t blockIdx)
+    {
+        if(this->_listed[blockIdx])
+        {
+            return false;
+        }
+        this->_listed[blockIdx] = true;
+        return true;
+    }
+    bool BlockUsage::listed(uint32_t blockIdx) const
+    {
+        return this->_listed[blockIdx];
+    }
+}
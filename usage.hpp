@@ -0,0 +1,28 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ModV6FileSystem
+{
+    // what fsck found pointing at each block of an image: how many i-node trees, snapshot tables and boot block tables
+    // refer to it, and whether the free list has it. References are claimed from several threads at once,
+    // the free list is walked by one.
+    struct BlockUsage
+    {
+    private:
+        std::unique_ptr<std::atomic<uint32_t>[]> _references;
+        std::vector<bool> _listed;
+
+    public:
+        BlockUsage(uint32_t blocks);
+        ~BlockUsage();
+
+        void claim(uint32_t blockIdx);
+        uint32_t references(uint32_t blockIdx) const;
+        // false if the free list had it already
+        bool list(uint32_t blockIdx);
+        bool listed(uint32_t blockIdx) const;
+    };
+}